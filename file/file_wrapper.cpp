@@ -8,7 +8,7 @@
 
 int file_wrapper::open(const char* pathname, int flags)
 {
-	int fd = ::open(pathname, flags);
+	int fd = open_silently(pathname, flags);
 	if (fd < 0) {
 		logger::instance().log(logger::LOG_ERROR, "Couldn't open file (%s).", pathname);
 		return -1;
@@ -19,7 +19,12 @@ int file_wrapper::open(const char* pathname, int flags)
 
 int file_wrapper::open(const char* pathname, int flags, mode_t mode)
 {
-	int fd = ::open(pathname, flags, mode);
+	int fd;
+
+	do {
+		fd = ::open(pathname, flags, mode);
+	} while ((fd < 0) && (errno == EINTR));
+
 	if (fd < 0) {
 		logger::instance().log(logger::LOG_ERROR, "Couldn't open file (%s).", pathname);
 		return -1;
@@ -28,6 +33,17 @@ int file_wrapper::open(const char* pathname, int flags, mode_t mode)
 	return fd;
 }
 
+int file_wrapper::open_silently(const char* pathname, int flags)
+{
+	int fd;
+
+	do {
+		fd = ::open(pathname, flags);
+	} while ((fd < 0) && (errno == EINTR));
+
+	return fd;
+}
+
 bool file_wrapper::close(int fd)
 {
 	if (::close(fd) < 0) {
@@ -15,6 +15,9 @@ class file_wrapper {
 		static int open(const char* pathname, int flags);
 		static int open(const char* pathname, int flags, mode_t mode);
 
+		// Open without logging the errors (worker threads).
+		static int open_silently(const char* pathname, int flags);
+
 		// Close.
 		static bool close(int fd);
 
@@ -1,50 +1,116 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <new>
 #include <sys/stat.h>
+#if HAVE_MEMFD_CREATE
+	#include <sys/mman.h>
+#endif
 #include "tmpfiles_cache.h"
 #include "file/file_wrapper.h"
 #include "logger/logger.h"
 
 const size_t tmpfiles_cache::DEFAULT_MAX_SPARE_FILES = 32;
+const off_t tmpfiles_cache::DEFAULT_MAX_MEMORY = 64 * 1024 * 1024;
+const size_t tmpfiles_cache::DEFAULT_MAX_PENDING_WRITES = 16 * 1024 * 1024;
 const size_t tmpfiles_cache::TMPFILE_NAME_LEN = 6;
+const unsigned tmpfiles_cache::ANONYMOUS = UINT_MAX;
+
+struct tmpfiles_cache::write_job : public worker_pool::job {
+	tmpfiles_cache* cache;
+	unsigned fd;
+
+	const char* data;
+	size_t len;
+	off_t offset;
+
+	bool success;
+
+	// Run (called from a worker thread).
+	void run();
+
+	// Completed (called from the event loop).
+	void completed();
+};
+
+void tmpfiles_cache::write_job::run()
+{
+	// The logger is not thread-safe, errors are reported by written().
+	size_t written = 0;
+
+	do {
+		ssize_t ret = pwrite(fd, data + written, len - written, offset + written);
+		if (ret < 0) {
+			if (errno != EINTR) {
+				success = false;
+				return;
+			}
+		} else {
+			written += ret;
+		}
+	} while (written < len);
+
+	success = true;
+}
+
+void tmpfiles_cache::write_job::completed()
+{
+	cache->written(this);
+}
 
 tmpfiles_cache::tmpfiles_cache()
 {
 	*_M_path = 0;
 	_M_dirlen = 0;
 
-	_M_in_use.files = NULL;
-	_M_in_use.size = 0;
-	_M_in_use.used = 0;
+	_M_files = NULL;
+	_M_max_open_files = 0;
+
+	for (size_t i = 0; i < 2; i++) {
+		_M_spare_files[i].fds = NULL;
+		_M_spare_files[i].used = 0;
+	}
 
-	_M_spare_files.files = NULL;
-	_M_spare_files.size = 0;
-	_M_spare_files.used = 0;
+	_M_max_spare_files = 0;
+
+	_M_max_memory = 0;
 
 	_M_count = 0;
+
+	memset(&_M_stats, 0, sizeof(statistics));
+
+	_M_workers = NULL;
+
+	_M_pending = 0;
+	_M_max_pending = 0;
+
+	_M_resume = NULL;
+	_M_arg = NULL;
 }
 
 tmpfiles_cache::~tmpfiles_cache()
 {
-	tmpfiles* files[2] = {&_M_in_use, &_M_spare_files};
-
-	for (size_t i = 0; i < 2; i++) {
-		if (files[i]->files) {
-			for (size_t j = 0; j < files[i]->used; j++) {
-				file_wrapper::close(files[i]->files[j].fd);
-
-				sprintf(_M_path + _M_dirlen, "%0*u", TMPFILE_NAME_LEN, files[i]->files[j].count);
-				unlink(_M_path);
+	if (_M_files) {
+		for (size_t i = 0; i < _M_max_open_files; i++) {
+			if (_M_files[i].state != FREE) {
+				remove(i);
 			}
+		}
+
+		free(_M_files);
+	}
 
-			free(files[i]->files);
+	for (size_t i = 0; i < 2; i++) {
+		if (_M_spare_files[i].fds) {
+			free(_M_spare_files[i].fds);
 		}
 	}
 }
 
-bool tmpfiles_cache::create(const char* dir, size_t max_open_files, size_t max_spare_files)
+bool tmpfiles_cache::create(const char* dir, size_t max_open_files, size_t max_spare_files, off_t max_memory)
 {
 	struct stat buf;
 	if ((stat(dir, &buf) < 0) || (!S_ISDIR(buf.st_mode))) {
@@ -60,95 +126,387 @@ bool tmpfiles_cache::create(const char* dir, size_t max_open_files, size_t max_s
 		return false;
 	}
 
-	if ((_M_in_use.files = (struct tmpfile*) malloc(max_open_files * sizeof(struct tmpfile))) == NULL) {
+	if ((_M_files = (struct tmpfile*) malloc(max_open_files * sizeof(struct tmpfile))) == NULL) {
 		return false;
 	}
 
-	if ((_M_spare_files.files = (struct tmpfile*) malloc(max_spare_files * sizeof(struct tmpfile))) == NULL) {
-		return false;
+	for (size_t i = 0; i < max_open_files; i++) {
+		_M_files[i].state = FREE;
 	}
 
+	_M_max_open_files = max_open_files;
+
+	for (size_t i = 0; i < 2; i++) {
+		if ((_M_spare_files[i].fds = (unsigned*) malloc(max_spare_files * sizeof(unsigned))) == NULL) {
+			return false;
+		}
+	}
+
+	_M_max_spare_files = max_spare_files;
+
 	memcpy(_M_path, dir, len);
 	_M_path[len++] = '/';
+	_M_path[len] = 0;
 
 	_M_dirlen = len;
 
-	_M_in_use.size = max_open_files;
-	_M_spare_files.size = max_spare_files;
+#if HAVE_MEMFD_CREATE
+	_M_max_memory = max_memory;
+#else
+	_M_max_memory = 0;
+#endif
 
 	return true;
 }
 
-int tmpfiles_cache::open()
+void tmpfiles_cache::set_writer(worker_pool* workers, size_t max_pending, resume_callback resume, void* arg)
+{
+	_M_workers = workers;
+	_M_max_pending = max_pending;
+
+	_M_resume = resume;
+	_M_arg = arg;
+}
+
+int tmpfiles_cache::open(off_t size)
 {
+	// The files of unknown size might grow past the budget.
+	unsigned tier;
+	if ((_M_max_memory > 0) && (size >= 0) && (_M_stats.size[MEMORY_TIER] + size <= _M_max_memory)) {
+		tier = MEMORY_TIER;
+	} else {
+		tier = DISK_TIER;
+	}
+
+	int fd;
+
 	// If there is a temporary file available...
-	if (_M_spare_files.used > 0) {
-		unsigned count = _M_spare_files.files[--_M_spare_files.used].count;
-		_M_in_use.files[_M_in_use.used].count = count;
+	if (_M_spare_files[tier].used > 0) {
+		fd = _M_spare_files[tier].fds[--_M_spare_files[tier].used];
+
+		logger::instance().log(logger::LOG_DEBUG, "Reusing temporary file (fd %d).", fd);
+	} else if ((fd = create_file(tier)) < 0) {
+		return -1;
+	}
+
+	tmpfile* file = &_M_files[fd];
 
-		unsigned fd = _M_spare_files.files[_M_spare_files.used].fd;
-		_M_in_use.files[_M_in_use.used++].fd = fd;
+	file->size = (size >= 0) ? size : 0;
+	file->state = IN_USE;
 
-		file_wrapper::seek(fd, 0, SEEK_SET);
+	file->offset = 0;
+	file->owner = -1;
+	file->writing_job = false;
+	file->failed = false;
 
-		logger::instance().log(logger::LOG_DEBUG, "Reusing file %0*u, fd %u.", TMPFILE_NAME_LEN, count, fd);
+	_M_stats.files[tier]++;
+	_M_stats.size[tier] += file->size;
 
-		return fd;
+	return fd;
+}
+
+bool tmpfiles_cache::write(unsigned fd, const void* buf, size_t len)
+{
+	// Synchronous writes?
+	if (!_M_workers) {
+		return file_wrapper::write(fd, buf, len);
 	}
 
-	tmpfile* file = &_M_in_use.files[_M_in_use.used];
+	tmpfile* file = &_M_files[fd];
 
-	file->count = _M_count++;
-	sprintf(_M_path + _M_dirlen, "%0*u", TMPFILE_NAME_LEN, file->count);
+	if (file->failed) {
+		return false;
+	}
 
-	int fd;
-	if ((fd = file_wrapper::open(_M_path, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0) {
-		logger::instance().log(logger::LOG_ERROR, "Couldn't create temporary file %s.", _M_path);
-		return -1;
+	if ((!file->queued) && ((file->queued = new (std::nothrow) buffer()) == NULL)) {
+		return false;
+	}
+
+	if (!file->queued->append((const char*) buf, len)) {
+		return false;
 	}
 
-	file->fd = fd;
+	_M_pending += len;
 
-	_M_in_use.used++;
+	// The data is written once the job in flight has completed.
+	if (file->writing_job) {
+		return true;
+	}
 
-	logger::instance().log(logger::LOG_DEBUG, "Created temporary file %0*u, fd %u.", TMPFILE_NAME_LEN, file->count, fd);
+	return submit(fd);
+}
 
-	return fd;
+bool tmpfiles_cache::throttled(unsigned fd, unsigned owner)
+{
+	tmpfile* file = &_M_files[fd];
+
+	if ((file->state != IN_USE) || (!file->writing_job) || (_M_pending < _M_max_pending)) {
+		return false;
+	}
+
+	file->owner = owner;
+
+	return true;
+}
+
+tmpfiles_cache::write_state tmpfiles_cache::flush(unsigned fd, unsigned owner)
+{
+	tmpfile* file = &_M_files[fd];
+
+	// Not a temporary file (response of the cache)?
+	if (file->state != IN_USE) {
+		return WRITTEN;
+	}
+
+	if (file->writing_job) {
+		file->owner = owner;
+		return WRITING;
+	}
+
+	return file->failed ? WRITE_FAILED : WRITTEN;
 }
 
 bool tmpfiles_cache::close(unsigned fd)
 {
-	for (size_t i = 0; i < _M_in_use.used; i++) {
-		tmpfile* file = &_M_in_use.files[i];
+	if ((fd >= _M_max_open_files) || (_M_files[fd].state != IN_USE)) {
+		logger::instance().log(logger::LOG_WARNING, "[tmpfiles_cache::close] Temporary file (fd %u) not found.", fd);
+		return false;
+	}
 
-		if (fd == file->fd) {
-			_M_in_use.used--;
+	tmpfile* file = &_M_files[fd];
 
-			// Too many spare files?
-			if (_M_spare_files.used == _M_spare_files.size) {
-				logger::instance().log(logger::LOG_DEBUG, "Closing spare file %0*u, fd %u.", TMPFILE_NAME_LEN, file->count, fd);
+	_M_stats.files[file->tier]--;
+	_M_stats.size[file->tier] -= file->size;
 
-				file_wrapper::close(fd);
+	file->owner = -1;
 
-				sprintf(_M_path + _M_dirlen, "%0*u", TMPFILE_NAME_LEN, file->count);
-				unlink(_M_path);
-			} else {
-				logger::instance().log(logger::LOG_DEBUG, "Temporary file %0*u (fd %u) will be reused.", TMPFILE_NAME_LEN, file->count, fd);
+	// The data which hasn't been written yet is dropped.
+	if ((file->queued) && (file->queued->count() > 0)) {
+		_M_pending -= file->queued->count();
+		file->queued->reset();
+	}
 
-				_M_spare_files.files[_M_spare_files.used].count = file->count;
-				_M_spare_files.files[_M_spare_files.used++].fd = fd;
-			}
+	// Is a worker thread writing to the file? It is released once it
+	// has finished.
+	if (file->writing_job) {
+		file->state = CLOSING;
+		return true;
+	}
+
+	release(fd);
+
+	return true;
+}
+
+bool tmpfiles_cache::detach(unsigned fd)
+{
+	if ((fd >= _M_max_open_files) || (_M_files[fd].state != IN_USE)) {
+		logger::instance().log(logger::LOG_WARNING, "[tmpfiles_cache::detach] Temporary file (fd %u) not found.", fd);
+		return false;
+	}
+
+	tmpfile* file = &_M_files[fd];
+
+	logger::instance().log(logger::LOG_DEBUG, "Detaching temporary file (fd %u).", fd);
+
+	// The writes have completed (flush()).
+	delete_buffers(file);
+
+	// The file is removed once closed.
+	if (file->count != ANONYMOUS) {
+		sprintf(_M_path + _M_dirlen, "%0*u", TMPFILE_NAME_LEN, file->count);
+		unlink(_M_path);
+	}
 
-			if (i < _M_in_use.used) {
-				_M_in_use.files[i].count = _M_in_use.files[_M_in_use.used].count;
-				_M_in_use.files[i].fd = _M_in_use.files[_M_in_use.used].fd;
+	_M_stats.files[file->tier]--;
+	_M_stats.size[file->tier] -= file->size;
+
+	file->state = FREE;
+
+	return true;
+}
+
+bool tmpfiles_cache::submit(unsigned fd)
+{
+	tmpfile* file = &_M_files[fd];
+
+	if ((!file->writing) && ((file->writing = new (std::nothrow) buffer()) == NULL)) {
+		return false;
+	}
+
+	write_job* job;
+	if ((job = new (std::nothrow) write_job()) == NULL) {
+		return false;
+	}
+
+	buffer* writing = file->queued;
+	file->queued = file->writing;
+	file->writing = writing;
+
+	job->cache = this;
+	job->fd = fd;
+
+	job->data = writing->data();
+	job->len = writing->count();
+	job->offset = file->offset;
+
+	file->offset += job->len;
+
+	file->writing_job = true;
+
+	// The job might be completed before submit() returns (if there
+	// are no worker threads).
+	if (!_M_workers->submit(job)) {
+		_M_pending -= writing->count();
+		writing->reset();
+
+		file->writing_job = false;
+		file->failed = true;
+
+		return false;
+	}
+
+	return true;
+}
+
+void tmpfiles_cache::written(write_job* job)
+{
+	tmpfile* file = &_M_files[job->fd];
+
+	_M_pending -= file->writing->count();
+	file->writing->reset();
+
+	file->writing_job = false;
+
+	if (!job->success) {
+		logger::instance().log(logger::LOG_ERROR, "Couldn't write temporary file (fd %u).", job->fd);
+
+		file->failed = true;
+	}
+
+	if (file->state == CLOSING) {
+		release(job->fd);
+		return;
+	}
+
+	if ((file->queued) && (file->queued->count() > 0)) {
+		if (file->failed) {
+			_M_pending -= file->queued->count();
+			file->queued->reset();
+		} else {
+			submit(job->fd);
+		}
+	}
+
+	// Resume the connection reading the data / waiting for the file.
+	if (file->owner != -1) {
+		unsigned owner = file->owner;
+		file->owner = -1;
+
+		_M_resume(owner, _M_arg);
+	}
+}
+
+void tmpfiles_cache::release(unsigned fd)
+{
+	tmpfile* file = &_M_files[fd];
+
+	// The buffers are only kept while the file is being written.
+	delete_buffers(file);
+
+	spare_files* spare = &_M_spare_files[file->tier];
+
+	// Too many spare files?
+	if (_M_spare_files[MEMORY_TIER].used + _M_spare_files[DISK_TIER].used == _M_max_spare_files) {
+		logger::instance().log(logger::LOG_DEBUG, "Closing spare file (fd %u).", fd);
+
+		remove(fd);
+	} else if ((!file_wrapper::truncate(fd, 0)) || (file_wrapper::seek(fd, 0, SEEK_SET) < 0)) {
+		remove(fd);
+	} else {
+		// Emptied, the memory / disk space is released until the file
+		// is reused.
+		logger::instance().log(logger::LOG_DEBUG, "Temporary file (fd %u) will be reused.", fd);
+
+		file->state = SPARE;
+		spare->fds[spare->used++] = fd;
+	}
+}
+
+int tmpfiles_cache::create_file(unsigned tier)
+{
+	int fd = -1;
+	unsigned count = ANONYMOUS;
+
+	if (tier == MEMORY_TIER) {
+#if HAVE_MEMFD_CREATE
+		if ((fd = memfd_create("gweb++", MFD_CLOEXEC)) < 0) {
+			logger::instance().perror("memfd_create");
+			return -1;
+		}
+#endif
+	} else {
+#ifdef O_TMPFILE
+		// Unnamed file (not supported by all the filesystems).
+		_M_path[_M_dirlen] = 0;
+		fd = ::open(_M_path, O_TMPFILE | O_RDWR, 0600);
+#endif
+
+		if (fd < 0) {
+			count = _M_count++;
+			sprintf(_M_path + _M_dirlen, "%0*u", TMPFILE_NAME_LEN, count);
+
+			if ((fd = file_wrapper::open(_M_path, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0) {
+				logger::instance().log(logger::LOG_ERROR, "Couldn't create temporary file %s.", _M_path);
+				return -1;
 			}
+		}
+	}
+
+	if ((size_t) fd >= _M_max_open_files) {
+		file_wrapper::close(fd);
 
-			return true;
+		if (count != ANONYMOUS) {
+			unlink(_M_path);
 		}
+
+		return -1;
 	}
 
-	logger::instance().log(logger::LOG_WARNING, "[tmpfiles_cache::close] Temporary file (fd %u) not found.", fd);
+	_M_files[fd].count = count;
+	_M_files[fd].tier = tier;
+
+	_M_files[fd].queued = NULL;
+	_M_files[fd].writing = NULL;
 
-	return false;
+	logger::instance().log(logger::LOG_DEBUG, "Created temporary file (fd %d) %s.", fd, (tier == MEMORY_TIER) ? "in memory" : "on disk");
+
+	return fd;
+}
+
+void tmpfiles_cache::remove(unsigned fd)
+{
+	delete_buffers(&_M_files[fd]);
+
+	file_wrapper::close(fd);
+
+	if (_M_files[fd].count != ANONYMOUS) {
+		sprintf(_M_path + _M_dirlen, "%0*u", TMPFILE_NAME_LEN, _M_files[fd].count);
+		unlink(_M_path);
+	}
+
+	_M_files[fd].state = FREE;
+}
+
+void tmpfiles_cache::delete_buffers(tmpfile* file)
+{
+	if (file->queued) {
+		delete file->queued;
+		file->queued = NULL;
+	}
+
+	if (file->writing) {
+		delete file->writing;
+		file->writing = NULL;
+	}
 }
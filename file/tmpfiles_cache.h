@@ -1,11 +1,40 @@
 #ifndef TMPFILES_CACHE_H
 #define TMPFILES_CACHE_H
 
+#include <sys/types.h>
 #include <limits.h>
+#include "string/buffer.h"
+#include "util/worker_pool.h"
 
 class tmpfiles_cache {
 	public:
 		static const size_t DEFAULT_MAX_SPARE_FILES;
+		static const off_t DEFAULT_MAX_MEMORY;
+		static const size_t DEFAULT_MAX_PENDING_WRITES;
+
+		// Where the files are kept.
+		enum tier {
+			MEMORY_TIER, // Anonymous files in memory (memfd).
+			DISK_TIER // Payload directory.
+		};
+
+		// State of the writes to a file.
+		enum write_state {
+			WRITTEN,
+			WRITING,
+			WRITE_FAILED
+		};
+
+		// Called from the event loop when the writes to a file have
+		// progressed.
+		typedef void (*resume_callback)(unsigned owner, void* arg);
+
+		struct statistics {
+			// Files in use and their expected size (the files of
+			// unknown size count as empty).
+			size_t files[2];
+			off_t size[2];
+		};
 
 		// Constructor.
 		tmpfiles_cache();
@@ -13,36 +42,123 @@ class tmpfiles_cache {
 		// Destructor.
 		virtual ~tmpfiles_cache();
 
-		// Create.
-		bool create(const char* dir, size_t max_open_files, size_t max_spare_files = DEFAULT_MAX_SPARE_FILES);
+		// Create ('max_memory': maximum size of the files in memory, 0:
+		// they are all created on disk).
+		bool create(const char* dir, size_t max_open_files, size_t max_spare_files = DEFAULT_MAX_SPARE_FILES, off_t max_memory = DEFAULT_MAX_MEMORY);
+
+		// Write the files in the worker threads, with at most
+		// 'max_pending' bytes waiting to be written (without calling
+		// this, the writes are synchronous).
+		void set_writer(worker_pool* workers, size_t max_pending, resume_callback resume, void* arg);
 
-		// Open.
-		int open();
+		// Open ('size': expected size, -1: unknown). The file is kept in
+		// memory if it fits in the budget, on disk otherwise.
+		int open(off_t size = -1);
+
+		// Append data to the file (false: the file couldn't be written).
+		bool write(unsigned fd, const void* buf, size_t len);
+
+		// Are too many bytes waiting to be written? If so, 'owner' (who
+		// has to stop reading) is resumed once the writes to the file
+		// have progressed.
+		bool throttled(unsigned fd, unsigned owner);
+
+		// Have the writes to the file completed? While they haven't,
+		// 'owner' is resumed each time they progress.
+		write_state flush(unsigned fd, unsigned owner);
 
 		// Close.
 		bool close(unsigned fd);
 
+		// Hand over the file to the caller, who will close it (it is
+		// unlinked).
+		bool detach(unsigned fd);
+
+		// Get statistics.
+		const statistics& get_statistics() const;
+
 	protected:
 		static const size_t TMPFILE_NAME_LEN;
+		static const unsigned ANONYMOUS;
+
+		enum state {
+			FREE,
+			IN_USE,
+			SPARE,
+			CLOSING // Closed while being written.
+		};
+
+		struct write_job;
 
 		char _M_path[PATH_MAX + 1];
 		size_t _M_dirlen;
 
+		// Indexed by file descriptor.
 		struct tmpfile {
-			unsigned count;
-			unsigned fd;
+			unsigned count; // Name (ANONYMOUS: none).
+			off_t size;
+			unsigned char tier;
+			unsigned char state;
+
+			// Data waiting for the worker thread / being written.
+			buffer* queued;
+			buffer* writing;
+
+			off_t offset; // Where the queued data goes.
+			int owner; // -1: none.
+			bool writing_job;
+			bool failed;
 		};
 
-		struct tmpfiles {
-			tmpfile* files;
-			size_t size;
+		tmpfile* _M_files;
+		size_t _M_max_open_files;
+
+		// Spare files of each tier (file descriptors).
+		struct spare_files {
+			unsigned* fds;
 			size_t used;
 		};
 
-		tmpfiles _M_in_use;
-		tmpfiles _M_spare_files;
+		spare_files _M_spare_files[2];
+		size_t _M_max_spare_files;
+
+		off_t _M_max_memory;
 
 		size_t _M_count;
+
+		statistics _M_stats;
+
+		worker_pool* _M_workers;
+
+		// Bytes waiting to be written.
+		size_t _M_pending;
+		size_t _M_max_pending;
+
+		resume_callback _M_resume;
+		void* _M_arg;
+
+		// Write the queued data.
+		bool submit(unsigned fd);
+
+		// The job has completed (called from the event loop).
+		void written(write_job* job);
+
+		// Release file (spare or removed).
+		void release(unsigned fd);
+
+		// Create file.
+		int create_file(unsigned tier);
+
+		// Close file and remove it.
+		void remove(unsigned fd);
+
+		// Free the write buffers of the file.
+		static void delete_buffers(tmpfile* file);
 };
 
+inline const tmpfiles_cache::statistics& tmpfiles_cache::get_statistics() const
+{
+	return _M_stats;
+}
+
 #endif // TMPFILES_CACHE_H
@@ -1,12 +1,216 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <new>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/time.h>
 #include <arpa/inet.h>
 #include "backend_list.h"
 #include "net/socket_wrapper.h"
-#include "net/resolver.h"
+#include "net/url_parser.h"
+#include "logger/logger.h"
 
 const time_t backend_list::DEFAULT_RETRY_INTERVAL = 30;
+const unsigned backend_list::DEFAULT_MAX_IDLE_CONNECTIONS = 16;
+const time_t backend_list::DEFAULT_IDLE_TIMEOUT = 4;
+const time_t backend_list::DEFAULT_MIN_DNS_TTL = 5;
+const time_t backend_list::DEFAULT_MAX_DNS_TTL = 3600;
+const unsigned backend_list::DEFAULT_WEIGHT = 1;
+const unsigned backend_list::MAX_WEIGHT = 100;
+const size_t backend_list::COOKIE_NAME_MAX_LEN = 64;
 const size_t backend_list::BACKEND_ALLOC = 4;
+const unsigned backend_list::POINTS_PER_WEIGHT = 100;
+const unsigned backend_list::LATENCY_SMOOTHING = 8;
+const unsigned backend_list::DEFAULT_HEALTH_CHECK_TIMEOUT = 2000;
+const unsigned backend_list::DEFAULT_HEALTHY_THRESHOLD = 2;
+const unsigned backend_list::DEFAULT_UNHEALTHY_THRESHOLD = 3;
+const time_t backend_list::DEFAULT_EJECTION_TIME = 30;
+const size_t backend_list::HEALTH_CHECK_PATH_MAX_LEN = 256;
+const unsigned backend_list::WEIGHT_SCALE = 100;
+const unsigned backend_list::DEFAULT_RETRIES = 2;
+const unsigned backend_list::LATENCY_BUCKETS = 128;
+const unsigned backend_list::HEDGE_SAMPLES = 200;
+const unsigned backend_list::DEFAULT_QUEUE_SIZE = 100;
+const time_t backend_list::DEFAULT_QUEUE_TIMEOUT = 5;
+const unsigned backend_list::LATENCY_TOLERANCE = 2;
+const unsigned backend_list::MIN_LATENCY_DRIFT = 256;
+const char backend_list::UNIX_SOCKET_HOST[] = "localhost";
+
+struct backend_list::resolve_job : public worker_pool::job {
+	backend_list* backends;
+	size_t index;
+
+	char host[NI_MAXHOST];
+	unsigned short port;
+
+	bool success;
+	resolver::address addr;
+	time_t ttl;
+
+	// Run (called from a worker thread).
+	void run();
+
+	// Completed (called from the event loop).
+	void completed();
+};
+
+void backend_list::resolve_job::run()
+{
+	success = resolver::resolve(host, port, addr, ttl);
+}
+
+void backend_list::resolve_job::completed()
+{
+	backends->resolved(index, success, addr, ttl);
+}
+
+struct backend_list::health_check_job : public worker_pool::job {
+	backend_list* backends;
+	size_t index;
+
+	resolver::address addr;
+
+	char host[NI_MAXHOST];
+	unsigned short port;
+
+	const char* path;
+	unsigned status;
+
+	unsigned timeout; // [ms]
+
+	bool success;
+
+	// Run (called from a worker thread).
+	void run();
+
+	// Completed (called from the event loop).
+	void completed();
+
+	// Check the backend (the logger is not thread-safe, nothing is
+	// logged here).
+	bool check();
+
+	// Wait for 'events' until the deadline.
+	static bool wait(int sd, short events, unsigned long long deadline);
+};
+
+void backend_list::health_check_job::run()
+{
+	success = check();
+}
+
+void backend_list::health_check_job::completed()
+{
+	backends->health_checked(index, success);
+}
+
+bool backend_list::health_check_job::check()
+{
+	unsigned long long deadline = microseconds() + timeout * 1000ULL;
+
+	int sd;
+	if ((sd = socket(addr.addr.ss_family, SOCK_STREAM, (addr.addr.ss_family == AF_UNIX) ? 0 : IPPROTO_TCP)) < 0) {
+		return false;
+	}
+
+	int flags = fcntl(sd, F_GETFL);
+	if ((flags < 0) || (fcntl(sd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+		close(sd);
+		return false;
+	}
+
+	if (::connect(sd, (const struct sockaddr*) &addr.addr, addr.addrlen) < 0) {
+		int error = 0;
+		socklen_t errorlen = sizeof(int);
+
+		if ((errno != EINPROGRESS) || (!wait(sd, POLLOUT, deadline)) || (getsockopt(sd, SOL_SOCKET, SO_ERROR, &error, &errorlen) < 0) || (error != 0)) {
+			close(sd);
+			return false;
+		}
+	}
+
+	// Only connect?
+	if (!path) {
+		close(sd);
+		return true;
+	}
+
+	char buf[HEALTH_CHECK_PATH_MAX_LEN + NI_MAXHOST + 128];
+	int len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s:%u\r\nUser-Agent: gweb++ (health check)\r\nConnection: close\r\n\r\n", path, host, port);
+	if ((len < 0) || ((size_t) len >= sizeof(buf))) {
+		close(sd);
+		return false;
+	}
+
+	int written = 0;
+	while (written < len) {
+		ssize_t ret = send(sd, buf + written, len - written, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if ((errno != EAGAIN) || (!wait(sd, POLLOUT, deadline))) {
+				close(sd);
+				return false;
+			}
+		} else {
+			written += ret;
+		}
+	}
+
+	// Read the status line ("HTTP/1.x NNN ...").
+	static const size_t STATUS_LINE_LEN = 12;
+
+	size_t count = 0;
+	while (count < STATUS_LINE_LEN) {
+		ssize_t ret = recv(sd, buf + count, sizeof(buf) - count, 0);
+		if (ret < 0) {
+			if ((errno != EAGAIN) || (!wait(sd, POLLIN, deadline))) {
+				close(sd);
+				return false;
+			}
+		} else if (ret == 0) {
+			close(sd);
+			return false;
+		} else {
+			count += ret;
+		}
+	}
+
+	close(sd);
+
+	if ((strncmp(buf, "HTTP/1.", 7) != 0) || (buf[8] != ' ')) {
+		return false;
+	}
+
+	unsigned code = 0;
+	for (unsigned i = 9; i < 12; i++) {
+		if ((buf[i] < '0') || (buf[i] > '9')) {
+			return false;
+		}
+
+		code = (code * 10) + (buf[i] - '0');
+	}
+
+	return (code == status);
+}
+
+bool backend_list::health_check_job::wait(int sd, short events, unsigned long long deadline)
+{
+	unsigned long long now = microseconds();
+	if (now >= deadline) {
+		return false;
+	}
+
+	struct pollfd fds;
+	fds.fd = sd;
+	fds.events = events;
+	fds.revents = 0;
+
+	return (poll(&fds, 1, (int) ((deadline - now + 999) / 1000)) == 1);
+}
 
 backend_list::backend_list() : _M_buf(256)
 {
@@ -20,7 +224,62 @@ backend_list::backend_list() : _M_buf(256)
 
 	_M_connections = NULL;
 
+	_M_requests = NULL;
+
+	_M_policy = ROUND_ROBIN;
+
+	_M_hash_key = CLIENT_IP_KEY;
+	_M_cookie = NULL;
+	_M_cookielen = 0;
+
+	_M_ring = NULL;
+	_M_npoints = 0;
+
+	_M_check_interval = 0;
+	_M_check_timeout = DEFAULT_HEALTH_CHECK_TIMEOUT;
+	_M_check_path = NULL;
+	_M_check_status = 0;
+	_M_healthy_threshold = DEFAULT_HEALTHY_THRESHOLD;
+	_M_unhealthy_threshold = DEFAULT_UNHEALTHY_THRESHOLD;
+
+	_M_max_errors = 0;
+	_M_max_latency = 0;
+	_M_ejection_time = DEFAULT_EJECTION_TIME;
+
+	_M_slow_start = 0;
+
+	_M_retries = DEFAULT_RETRIES;
+
+	_M_hedge_percentile = 0;
+	_M_hedge_delay = 0;
+
+	_M_histogram = NULL;
+	_M_nsamples = 0;
+
+	_M_initial_concurrency = 0;
+	_M_max_concurrency = 0;
+
+	_M_queue = NULL;
+	_M_queue_size = 0;
+	_M_queue_head = 0;
+	_M_queue_count = 0;
+	_M_nqueued = 0;
+	_M_queue_timeout = DEFAULT_QUEUE_TIMEOUT;
+
+	_M_max_queued = 0;
+	_M_dequeued = 0;
+	_M_total_wait = 0;
+	_M_max_wait = 0;
+	_M_rejected = 0;
+	_M_timed_out = 0;
+
 	_M_retry_interval = DEFAULT_RETRY_INTERVAL;
+
+	_M_max_idle_connections = DEFAULT_MAX_IDLE_CONNECTIONS;
+	_M_idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+	_M_min_dns_ttl = DEFAULT_MIN_DNS_TTL;
+	_M_max_dns_ttl = DEFAULT_MAX_DNS_TTL;
 }
 
 void backend_list::free()
@@ -28,6 +287,12 @@ void backend_list::free()
 	_M_max_open_files = 0;
 
 	if (_M_backends) {
+		for (size_t i = 0; i < _M_used; i++) {
+			if (_M_backends[i].idle) {
+				::free(_M_backends[i].idle);
+			}
+		}
+
 		::free(_M_backends);
 		_M_backends = NULL;
 	}
@@ -42,7 +307,87 @@ void backend_list::free()
 		_M_connections = NULL;
 	}
 
+	if (_M_requests) {
+		::free(_M_requests);
+		_M_requests = NULL;
+	}
+
+	_M_policy = ROUND_ROBIN;
+
+	_M_hash_key = CLIENT_IP_KEY;
+
+	if (_M_cookie) {
+		::free(_M_cookie);
+		_M_cookie = NULL;
+	}
+
+	_M_cookielen = 0;
+
+	if (_M_ring) {
+		::free(_M_ring);
+		_M_ring = NULL;
+	}
+
+	_M_npoints = 0;
+
+	_M_check_interval = 0;
+	_M_check_timeout = DEFAULT_HEALTH_CHECK_TIMEOUT;
+
+	if (_M_check_path) {
+		::free(_M_check_path);
+		_M_check_path = NULL;
+	}
+
+	_M_check_status = 0;
+	_M_healthy_threshold = DEFAULT_HEALTHY_THRESHOLD;
+	_M_unhealthy_threshold = DEFAULT_UNHEALTHY_THRESHOLD;
+
+	_M_max_errors = 0;
+	_M_max_latency = 0;
+	_M_ejection_time = DEFAULT_EJECTION_TIME;
+
+	_M_slow_start = 0;
+
+	_M_retries = DEFAULT_RETRIES;
+
+	_M_hedge_percentile = 0;
+	_M_hedge_delay = 0;
+
+	if (_M_histogram) {
+		::free(_M_histogram);
+		_M_histogram = NULL;
+	}
+
+	_M_nsamples = 0;
+
+	_M_initial_concurrency = 0;
+	_M_max_concurrency = 0;
+
+	if (_M_queue) {
+		::free(_M_queue);
+		_M_queue = NULL;
+	}
+
+	_M_queue_size = 0;
+	_M_queue_head = 0;
+	_M_queue_count = 0;
+	_M_nqueued = 0;
+	_M_queue_timeout = DEFAULT_QUEUE_TIMEOUT;
+
+	_M_max_queued = 0;
+	_M_dequeued = 0;
+	_M_total_wait = 0;
+	_M_max_wait = 0;
+	_M_rejected = 0;
+	_M_timed_out = 0;
+
 	_M_retry_interval = DEFAULT_RETRY_INTERVAL;
+
+	_M_max_idle_connections = DEFAULT_MAX_IDLE_CONNECTIONS;
+	_M_idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+	_M_min_dns_ttl = DEFAULT_MIN_DNS_TTL;
+	_M_max_dns_ttl = DEFAULT_MAX_DNS_TTL;
 }
 
 bool backend_list::create(size_t max_open_files)
@@ -53,23 +398,129 @@ bool backend_list::create(size_t max_open_files)
 		return false;
 	}
 
+	if ((_M_requests = (request*) calloc(_M_max_open_files, sizeof(request))) == NULL) {
+		return false;
+	}
+
+	if ((_M_policy == HASH) && (!build_ring())) {
+		return false;
+	}
+
+	if ((_M_hedge_percentile > 0) && ((_M_histogram = (unsigned*) calloc(LATENCY_BUCKETS, sizeof(unsigned))) == NULL)) {
+		return false;
+	}
+
 	return true;
 }
 
-bool backend_list::add(const char* host, unsigned short hostlen, unsigned short port)
+bool backend_list::set_health_check(time_t interval, unsigned timeout, const char* path, size_t pathlen, unsigned status, unsigned healthy_threshold, unsigned unhealthy_threshold)
 {
-	size_t offset = _M_buf.count();
+	_M_check_interval = interval;
+	_M_check_timeout = timeout;
 
-	if (!_M_buf.append_nul_terminated_string(host, hostlen)) {
+	if (path) {
+		if ((pathlen == 0) || (pathlen > HEALTH_CHECK_PATH_MAX_LEN) || (*path != '/')) {
+			return false;
+		}
+
+		if ((_M_check_path = (char*) malloc(pathlen + 1)) == NULL) {
+			return false;
+		}
+
+		memcpy(_M_check_path, path, pathlen);
+		_M_check_path[pathlen] = 0;
+	}
+
+	_M_check_status = status;
+
+	_M_healthy_threshold = healthy_threshold;
+	_M_unhealthy_threshold = unhealthy_threshold;
+
+	return true;
+}
+
+bool backend_list::set_concurrency_limit(unsigned initial, unsigned max, unsigned queue_size, time_t queue_timeout)
+{
+	if (max == 0) {
+		return true;
+	}
+
+	if ((initial == 0) || (initial > max)) {
+		return false;
+	}
+
+	if ((queue_size > 0) && ((_M_queue = (queued_request*) malloc(queue_size * sizeof(queued_request))) == NULL)) {
 		return false;
 	}
 
-	struct sockaddr addr;
-	if (!resolver::resolve(_M_buf.data() + offset, &addr)) {
+	_M_initial_concurrency = initial;
+	_M_max_concurrency = max;
+
+	_M_queue_size = queue_size;
+	_M_queue_timeout = queue_timeout;
+
+	return true;
+}
+
+bool backend_list::set_hash_key(hash_key key, const char* cookie, size_t cookielen)
+{
+	_M_hash_key = key;
+
+	if (key == COOKIE_KEY) {
+		if ((cookielen == 0) || (cookielen > COOKIE_NAME_MAX_LEN)) {
+			return false;
+		}
+
+		if ((_M_cookie = (char*) malloc(cookielen + 1)) == NULL) {
+			return false;
+		}
+
+		memcpy(_M_cookie, cookie, cookielen);
+		_M_cookie[cookielen] = 0;
+
+		_M_cookielen = cookielen;
+	}
+
+	return true;
+}
+
+bool backend_list::add(const char* host, unsigned short hostlen, unsigned short port, unsigned weight)
+{
+	size_t offset = _M_buf.count();
+
+	if (!_M_buf.append_nul_terminated_string(host, hostlen)) {
 		return false;
 	}
 
-	((struct sockaddr_in*) &addr)->sin_port = htons(port);
+	resolver::address addr;
+	time_t ttl;
+	size_t name;
+
+	// Unix domain socket?
+	if (resolver::is_unix(host, hostlen)) {
+		if (!resolver::parse_unix(_M_buf.data() + offset + resolver::UNIX_PREFIX_LEN, addr)) {
+			logger::instance().log(logger::LOG_ERROR, "Invalid Unix domain socket %s.", _M_buf.data() + offset);
+			return false;
+		}
+
+		// Never resolved again.
+		ttl = -1;
+
+		name = offset;
+		port = 0;
+	} else {
+		// The server doesn't run yet, the name can be resolved here.
+		if (!resolver::resolve(_M_buf.data() + offset, port, addr, ttl)) {
+			logger::instance().log(logger::LOG_ERROR, "Couldn't resolve backend %s.", _M_buf.data() + offset);
+			return false;
+		}
+
+		name = _M_buf.count();
+
+		if ((!_M_buf.format("%.*s:%u", hostlen, host, port)) || (!_M_buf.append('\0'))) {
+			return false;
+		}
+	}
 
 	if (_M_used == _M_size) {
 		size_t size = _M_size + BACKEND_ALLOC;
@@ -89,41 +540,1057 @@ bool backend_list::add(const char* host, unsigned short hostlen, unsigned short
 
 	backend->port = port;
 
-	memcpy(&backend->addr, &addr, sizeof(struct sockaddr));
+	backend->name = name;
+
+	backend->addr = addr;
+
+	set_expiration(backend, ttl);
+	backend->resolving = false;
 
 	backend->available = true;
 
+	backend->idle = NULL;
+	backend->nidle = 0;
+	backend->max_idle = _M_max_idle_connections;
+
+	backend->probed = false;
+
+	backend->weight = weight;
+	backend->current_weight = 0;
+
+	backend->outstanding = 0;
+	backend->requests = 0;
+	backend->latency = 0;
+
+	backend->limit = _M_initial_concurrency;
+	backend->increase = 0;
+	backend->min_latency = 0;
+	backend->decreased = 0;
+
+	backend->checking = false;
+	backend->next_check = now::_M_time;
+	backend->successes = 0;
+	backend->failures = 0;
+
+	backend->errors = 0;
+	backend->ejected_until = 0;
+
+	backend->recovered = 0;
+
+	backend->busy_until = 0;
+
 	_M_used++;
 
 	return true;
 }
 
-int backend_list::connect(const char*& host, unsigned short& hostlen, unsigned short& port)
+int backend_list::connect(unsigned hash, const char*& host, unsigned short& hostlen, unsigned short& port, bool& reused)
 {
-	unsigned first = _M_current;
+	// A backend which cannot be connected to is not selected again.
+	for (size_t i = 0; i < _M_used; i++) {
+		backend* backend;
+		if ((backend = select(hash)) == NULL) {
+			return -1;
+		}
+
+		int sd;
+		if ((sd = connect(backend, host, hostlen, port, reused)) != -1) {
+			return sd;
+		}
+	}
+
+	return -1;
+}
 
-	do {
-		backend* backend = &_M_backends[_M_current];
+int backend_list::connect_hedge(unsigned fd, const char*& host, unsigned short& hostlen, unsigned short& port, bool& reused)
+{
+	backend* backend;
+	if ((backend = select_hedge(_M_connections[fd])) == NULL) {
+		return -1;
+	}
 
-		_M_current = (_M_current + 1) % _M_used; // Round-robin.
+	return connect(backend, host, hostlen, port, reused);
+}
 
-		if ((backend->available) || (backend->downtime + _M_retry_interval <= now::_M_time)) {
-			int sd;
-			if ((sd = socket_wrapper::connect(&backend->addr)) != -1) {
-				_M_connections[sd] = backend;
+int backend_list::connect(backend* backend, const char*& host, unsigned short& hostlen, unsigned short& port, bool& reused)
+{
+	if (backend->addr.addr.ss_family != AF_UNIX) {
+		host = _M_buf.data() + backend->offset;
+		hostlen = backend->hostlen;
 
-				host = _M_buf.data() + backend->offset;
-				hostlen = backend->hostlen;
+		port = backend->port;
+	} else {
+		host = UNIX_SOCKET_HOST;
+		hostlen = sizeof(UNIX_SOCKET_HOST) - 1;
 
-				port = backend->port;
+		port = url_parser::HTTP_DEFAULT_PORT;
+	}
 
-				return sd;
-			}
+	int sd;
 
-			backend->available = false;
-			backend->downtime = now::_M_time;
+	// If there is an idle connection to the backend...
+	if (backend->nidle > 0) {
+		sd = backend->idle[--backend->nidle];
+
+		reused = true;
+	} else if ((sd = socket_wrapper::connect((const struct sockaddr*) &backend->addr.addr, backend->addr.addrlen)) != -1) {
+		_M_connections[sd] = backend;
+
+		reused = false;
+	} else {
+		// The listen queue of the Unix domain socket is full: the
+		// backend is busy, not down.
+		if ((errno == EAGAIN) && (backend->addr.addr.ss_family == AF_UNIX)) {
+			backend->busy_until = now::_M_time + 1;
+		} else {
+			mark_down(backend);
 		}
-	} while (_M_current != first);
 
-	return -1;
+		return -1;
+	}
+
+	// A previous request on this descriptor which hasn't been
+	// accounted for?
+	request_completed(sd);
+
+	_M_requests[sd].started = microseconds();
+	_M_requests[sd].responded = false;
+
+	backend->outstanding++;
+	backend->requests++;
+
+	return sd;
+}
+
+int backend_list::connect(unsigned fd)
+{
+	backend* backend = _M_connections[fd];
+
+	int sd;
+	if ((sd = socket_wrapper::connect((const struct sockaddr*) &backend->addr.addr, backend->addr.addrlen)) != -1) {
+		_M_connections[sd] = backend;
+	}
+
+	return sd;
+}
+
+void backend_list::limit_idle_connections(unsigned fd, unsigned max_idle_connections)
+{
+	backend* backend = _M_connections[fd];
+
+	if (max_idle_connections < backend->max_idle) {
+		backend->max_idle = max_idle_connections;
+
+		logger::instance().log(logger::LOG_INFO, "Keeping at most %u idle connection(s) to backend %s.", max_idle_connections, _M_buf.data() + backend->name);
+	}
+}
+
+bool backend_list::add_idle_connection(unsigned fd)
+{
+	backend* backend = _M_connections[fd];
+
+	if (backend->nidle >= backend->max_idle) {
+		return false;
+	}
+
+	if (!backend->idle) {
+		if ((backend->idle = (int*) malloc(_M_max_idle_connections * sizeof(int))) == NULL) {
+			return false;
+		}
+	}
+
+	backend->idle[backend->nidle++] = fd;
+
+	return true;
+}
+
+void backend_list::remove_idle_connection(unsigned fd)
+{
+	backend* backend = _M_connections[fd];
+
+	for (unsigned i = backend->nidle; i > 0; i--) {
+		if (backend->idle[i - 1] == (int) fd) {
+			memmove(&backend->idle[i - 1], &backend->idle[i], (backend->nidle - i) * sizeof(int));
+			backend->nidle--;
+
+			return;
+		}
+	}
+}
+
+bool backend_list::refresh(worker_pool& workers)
+{
+	for (size_t i = 0; i < _M_used; i++) {
+		backend* backend = &_M_backends[i];
+
+		if ((backend->addr.addr.ss_family == AF_UNIX) || (backend->expires == 0) || (backend->expires > now::_M_time) || (backend->resolving) || (backend->hostlen >= NI_MAXHOST)) {
+			continue;
+		}
+
+		resolve_job* job;
+		if ((job = new (std::nothrow) resolve_job()) == NULL) {
+			return false;
+		}
+
+		job->backends = this;
+		job->index = i;
+
+		memcpy(job->host, _M_buf.data() + backend->offset, backend->hostlen + 1);
+		job->port = backend->port;
+
+		backend->resolving = true;
+
+		// The job might be completed before submit() returns (if there
+		// are no worker threads).
+		if (!workers.submit(job)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void backend_list::set_expiration(backend* backend, time_t ttl)
+{
+	if (ttl < 0) {
+		// Numeric address.
+		backend->expires = 0;
+	} else {
+		if (ttl < _M_min_dns_ttl) {
+			ttl = _M_min_dns_ttl;
+		} else if (ttl > _M_max_dns_ttl) {
+			ttl = _M_max_dns_ttl;
+		}
+
+		backend->expires = now::_M_time + ttl;
+	}
+}
+
+void backend_list::resolved(size_t index, bool success, const resolver::address& addr, time_t ttl)
+{
+	backend* backend = &_M_backends[index];
+
+	backend->resolving = false;
+
+	if (!success) {
+		logger::instance().log(logger::LOG_WARNING, "Couldn't resolve backend %s, keeping its last known address.", _M_buf.data() + backend->name);
+
+		// Keep the last known address.
+		set_expiration(backend, resolver::DEFAULT_TTL);
+		return;
+	}
+
+	// The idle connections to the previous address are kept until they
+	// time out.
+	if (!resolver::equal(addr, backend->addr)) {
+		char buf[64];
+		logger::instance().log(logger::LOG_INFO, "Backend %s resolved to %s.", _M_buf.data() + backend->name, resolver::to_string(addr, buf, sizeof(buf)));
+
+		backend->addr = addr;
+	}
+
+	set_expiration(backend, ttl);
+}
+
+void backend_list::response_received(unsigned fd, unsigned status_code)
+{
+	if ((_M_requests[fd].started == 0) || (_M_requests[fd].responded)) {
+		return;
+	}
+
+	unsigned latency = update_latency(fd);
+
+	if (_M_histogram) {
+		add_latency_sample(latency);
+	}
+
+	_M_requests[fd].responded = true;
+
+	backend* backend = _M_connections[fd];
+
+	if (status_code >= 500) {
+		adapt_limit(backend, latency, true);
+
+		request_failed(backend);
+		return;
+	}
+
+	adapt_limit(backend, latency, false);
+
+	backend->errors = 0;
+
+	// Without active health checks, the backend is up again when it
+	// answers a request.
+	if ((!backend->available) && (_M_check_interval == 0)) {
+		mark_up(backend);
+	}
+
+	if ((_M_max_latency > 0) && (backend->latency > _M_max_latency)) {
+		eject(backend, "latency");
+	}
+}
+
+void backend_list::request_completed(unsigned fd, bool failed)
+{
+	if (_M_requests[fd].started == 0) {
+		return;
+	}
+
+	backend* backend = _M_connections[fd];
+
+	// A request which failed counts as slow as it has lasted.
+	if (!_M_requests[fd].responded) {
+		update_latency(fd);
+
+		if (failed) {
+			adapt_limit(backend, 0, true);
+
+			request_failed(backend);
+		}
+	}
+
+	_M_requests[fd].started = 0;
+
+	backend->outstanding--;
+
+	// The backend is accepting connections again.
+	backend->busy_until = 0;
+}
+
+void backend_list::request_cancelled(unsigned fd)
+{
+	if (_M_requests[fd].started == 0) {
+		return;
+	}
+
+	// The backend was only slower than another one.
+	_M_requests[fd].started = 0;
+
+	_M_connections[fd]->outstanding--;
+}
+
+bool backend_list::check_health(worker_pool& workers)
+{
+	if (_M_check_interval == 0) {
+		return true;
+	}
+
+	for (size_t i = 0; i < _M_used; i++) {
+		backend* backend = &_M_backends[i];
+
+		if ((backend->checking) || (backend->next_check > now::_M_time) || (backend->hostlen >= NI_MAXHOST)) {
+			continue;
+		}
+
+		health_check_job* job;
+		if ((job = new (std::nothrow) health_check_job()) == NULL) {
+			return false;
+		}
+
+		job->backends = this;
+		job->index = i;
+
+		job->addr = backend->addr;
+
+		if (backend->addr.addr.ss_family != AF_UNIX) {
+			memcpy(job->host, _M_buf.data() + backend->offset, backend->hostlen + 1);
+			job->port = backend->port;
+		} else {
+			memcpy(job->host, UNIX_SOCKET_HOST, sizeof(UNIX_SOCKET_HOST));
+			job->port = url_parser::HTTP_DEFAULT_PORT;
+		}
+
+		job->path = _M_check_path;
+		job->status = _M_check_status;
+
+		job->timeout = _M_check_timeout;
+
+		backend->checking = true;
+		backend->next_check = now::_M_time + _M_check_interval;
+
+		// The job might be completed before submit() returns (if there
+		// are no worker threads).
+		if (!workers.submit(job)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void backend_list::health_checked(size_t index, bool success)
+{
+	backend* backend = &_M_backends[index];
+
+	backend->checking = false;
+
+	if (success) {
+		backend->failures = 0;
+
+		if ((++backend->successes >= _M_healthy_threshold) && (!backend->available)) {
+			mark_up(backend);
+		}
+	} else {
+		backend->successes = 0;
+
+		if ((++backend->failures >= _M_unhealthy_threshold) && (backend->available)) {
+			logger::instance().log(logger::LOG_WARNING, "Backend %s has failed %u health check(s).", _M_buf.data() + backend->name, backend->failures);
+
+			mark_down(backend);
+		}
+	}
+}
+
+void backend_list::mark_down(backend* backend)
+{
+	if (backend->available) {
+		logger::instance().log(logger::LOG_WARNING, "Backend %s is down.", _M_buf.data() + backend->name);
+	}
+
+	backend->available = false;
+	backend->downtime = now::_M_time;
+
+	backend->successes = 0;
+}
+
+void backend_list::mark_up(backend* backend)
+{
+	logger::instance().log(logger::LOG_INFO, "Backend %s is up.", _M_buf.data() + backend->name);
+
+	backend->available = true;
+
+	backend->failures = 0;
+	backend->errors = 0;
+
+	backend->recovered = now::_M_time;
+
+	// Start again from the initial concurrency limit.
+	backend->limit = _M_initial_concurrency;
+	backend->increase = 0;
+	backend->min_latency = 0;
+}
+
+void backend_list::request_failed(backend* backend)
+{
+	if ((++backend->errors >= _M_max_errors) && (_M_max_errors > 0)) {
+		eject(backend, "consecutive errors");
+	}
+}
+
+void backend_list::eject(backend* backend, const char* reason)
+{
+	if (backend->ejected_until > now::_M_time) {
+		return;
+	}
+
+	// Keep at least one backend.
+	size_t nusable = 0;
+	for (size_t i = 0; i < _M_used; i++) {
+		if ((&_M_backends[i] != backend) && (usable(&_M_backends[i]))) {
+			nusable++;
+		}
+	}
+
+	if (nusable == 0) {
+		return;
+	}
+
+	logger::instance().log(logger::LOG_WARNING, "Ejecting backend %s for %d second(s) (%s).", _M_buf.data() + backend->name, (int) _M_ejection_time, reason);
+
+	backend->ejected_until = now::_M_time + _M_ejection_time;
+
+	// The latency will be measured again.
+	backend->errors = 0;
+	backend->latency = 0;
+
+	backend->limit = _M_initial_concurrency;
+	backend->increase = 0;
+	backend->min_latency = 0;
+
+	backend->recovered = backend->ejected_until;
+}
+
+unsigned backend_list::effective_weight(const backend* backend) const
+{
+	unsigned weight = backend->weight * WEIGHT_SCALE;
+
+	if ((_M_slow_start > 0) && (backend->recovered + _M_slow_start > now::_M_time) && (backend->recovered <= now::_M_time)) {
+		weight = (unsigned) ((unsigned long long) weight * (now::_M_time - backend->recovered + 1) / (_M_slow_start + 1));
+		if (weight == 0) {
+			weight = 1;
+		}
+	}
+
+	return weight;
+}
+
+bool backend_list::get_statistics(size_t idx, statistics& stats)
+{
+	if (idx >= _M_used) {
+		return false;
+	}
+
+	backend* backend = &_M_backends[idx];
+
+	stats.name = _M_buf.data() + backend->name;
+
+	stats.weight = backend->weight;
+	stats.available = usable(backend);
+
+	stats.outstanding = backend->outstanding;
+	stats.limit = (_M_max_concurrency > 0) ? backend->limit : 0;
+	stats.requests = backend->requests;
+	stats.latency = backend->latency;
+
+	backend->requests = 0;
+
+	return true;
+}
+
+bool backend_list::get_queue_statistics(queue_statistics& stats)
+{
+	if (_M_max_concurrency == 0) {
+		return false;
+	}
+
+	stats.queued = _M_nqueued;
+	stats.max_queued = _M_max_queued;
+	stats.dequeued = _M_dequeued;
+	stats.total_wait = _M_total_wait;
+	stats.max_wait = _M_max_wait;
+	stats.rejected = _M_rejected;
+	stats.timed_out = _M_timed_out;
+
+	_M_max_queued = _M_nqueued;
+	_M_dequeued = 0;
+	_M_total_wait = 0;
+	_M_max_wait = 0;
+	_M_rejected = 0;
+	_M_timed_out = 0;
+
+	return true;
+}
+
+bool backend_list::saturated() const
+{
+	if (_M_max_concurrency == 0) {
+		return false;
+	}
+
+	bool found = false;
+
+	for (size_t i = 0; i < _M_used; i++) {
+		const backend* backend = &_M_backends[i];
+
+		if (usable(backend)) {
+			if ((has_room(backend)) && (!busy(backend))) {
+				return false;
+			}
+
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+bool backend_list::busy() const
+{
+	for (size_t i = 0; i < _M_used; i++) {
+		const backend* backend = &_M_backends[i];
+
+		if ((usable(backend)) && (busy(backend))) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool backend_list::accepting() const
+{
+	bool found = false;
+
+	for (size_t i = 0; i < _M_used; i++) {
+		const backend* backend = &_M_backends[i];
+
+		if (usable(backend)) {
+			if ((has_room(backend)) && (!busy(backend))) {
+				return true;
+			}
+
+			found = true;
+		}
+	}
+
+	// All the usable backends are at their concurrency limit or busy.
+	return ((found) && (_M_queue_count < _M_queue_size));
+}
+
+int backend_list::enqueue(unsigned fd)
+{
+	if (_M_queue_count == _M_queue_size) {
+		_M_rejected++;
+		return -1;
+	}
+
+	unsigned pos = (_M_queue_head + _M_queue_count) % _M_queue_size;
+
+	_M_queue[pos].fd = fd;
+	_M_queue[pos].since = microseconds();
+
+	_M_queue_count++;
+
+	if (++_M_nqueued > _M_max_queued) {
+		_M_max_queued = _M_nqueued;
+	}
+
+	return pos;
+}
+
+void backend_list::cancel_queued(unsigned pos)
+{
+	_M_queue[pos].fd = -1;
+	_M_nqueued--;
+}
+
+int backend_list::dequeue()
+{
+	if (_M_nqueued == 0) {
+		return -1;
+	}
+
+	// Is there a backend with room?
+	size_t i;
+	for (i = 0; (i < _M_used) && (!selectable(&_M_backends[i])); i++);
+
+	if (i == _M_used) {
+		return -1;
+	}
+
+	skip_cancelled();
+
+	unsigned long long since = _M_queue[_M_queue_head].since;
+
+	int fd;
+	if ((fd = pop()) < 0) {
+		return -1;
+	}
+
+	unsigned long long now = microseconds();
+	unsigned wait = (now > since) ? (unsigned) (now - since) : 0;
+
+	_M_dequeued++;
+	_M_total_wait += wait;
+
+	if (wait > _M_max_wait) {
+		_M_max_wait = wait;
+	}
+
+	return fd;
+}
+
+int backend_list::expire()
+{
+	if (_M_nqueued == 0) {
+		return -1;
+	}
+
+	unsigned long long now = microseconds();
+
+	skip_cancelled();
+
+	// The oldest requests are first.
+	if (_M_queue[_M_queue_head].since + (unsigned long long) _M_queue_timeout * 1000000ULL > now) {
+		return -1;
+	}
+
+	int fd;
+	if ((fd = pop()) >= 0) {
+		_M_timed_out++;
+	}
+
+	return fd;
+}
+
+int backend_list::pop()
+{
+	skip_cancelled();
+
+	if (_M_queue_count == 0) {
+		return -1;
+	}
+
+	int fd = _M_queue[_M_queue_head].fd;
+
+	_M_queue_head = (_M_queue_head + 1) % _M_queue_size;
+	_M_queue_count--;
+
+	_M_nqueued--;
+
+	return fd;
+}
+
+void backend_list::skip_cancelled()
+{
+	while ((_M_queue_count > 0) && (_M_queue[_M_queue_head].fd < 0)) {
+		_M_queue_head = (_M_queue_head + 1) % _M_queue_size;
+		_M_queue_count--;
+	}
+}
+
+void backend_list::adapt_limit(backend* backend, unsigned latency, bool failed)
+{
+	if (_M_max_concurrency == 0) {
+		return;
+	}
+
+	if (!failed) {
+		// Latency without load: the lowest latency, slowly drifting up
+		// (the requests might get heavier).
+		if ((backend->min_latency == 0) || (latency < backend->min_latency)) {
+			backend->min_latency = latency;
+		} else {
+			backend->min_latency += (latency - backend->min_latency) / MIN_LATENCY_DRIFT;
+		}
+
+		if ((unsigned long long) latency <= (unsigned long long) backend->min_latency * LATENCY_TOLERANCE) {
+			// Additive increase (one more request after 'limit' fast
+			// responses, only if the limit is being used).
+			if ((backend->outstanding * 2 >= backend->limit) && (++backend->increase >= backend->limit)) {
+				if (backend->limit < _M_max_concurrency) {
+					backend->limit++;
+				}
+
+				backend->increase = 0;
+			}
+
+			return;
+		}
+	}
+
+	// Multiplicative decrease (at most once per round trip, the
+	// responses to the requests sent before have the same latency).
+	unsigned long long now = microseconds();
+	if (backend->decreased + backend->latency > now) {
+		return;
+	}
+
+	backend->limit = (backend->limit * 3) / 4;
+	if (backend->limit == 0) {
+		backend->limit = 1;
+	}
+
+	backend->increase = 0;
+	backend->decreased = now;
+}
+
+backend_list::backend* backend_list::select(unsigned hash)
+{
+	switch (_M_policy) {
+		case LEAST_REQUESTS:
+			return select_least_requests();
+		case LATENCY:
+			return select_latency();
+		case HASH:
+			return select_hash(hash);
+		default:
+			return select_round_robin();
+	}
+}
+
+backend_list::backend* backend_list::select_round_robin()
+{
+	// Smooth weighted round-robin: the backends are interleaved (with
+	// equal weights, they are taken in turn).
+	backend* best = NULL;
+	int total = 0;
+
+	for (size_t i = 0; i < _M_used; i++) {
+		backend* backend = &_M_backends[i];
+
+		if (!selectable(backend)) {
+			continue;
+		}
+
+		unsigned weight = effective_weight(backend);
+
+		backend->current_weight += weight;
+		total += weight;
+
+		if ((!best) || (backend->current_weight > best->current_weight)) {
+			best = backend;
+		}
+	}
+
+	if (best) {
+		best->current_weight -= total;
+	}
+
+	return best;
+}
+
+backend_list::backend* backend_list::select_least_requests()
+{
+	backend* best = NULL;
+
+	// Start after the last backend chosen, to spread the ties.
+	for (size_t i = 0; i < _M_used; i++) {
+		backend* backend = &_M_backends[(_M_current + i) % _M_used];
+
+		if (!selectable(backend)) {
+			continue;
+		}
+
+		// outstanding / weight < best->outstanding / best->weight?
+		if ((!best) || ((unsigned long long) backend->outstanding * effective_weight(best) < (unsigned long long) best->outstanding * effective_weight(backend))) {
+			best = backend;
+		}
+	}
+
+	if (best) {
+		_M_current = ((best - _M_backends) + 1) % _M_used;
+	}
+
+	return best;
+}
+
+backend_list::backend* backend_list::select_latency()
+{
+	size_t nusable = 0;
+	for (size_t i = 0; i < _M_used; i++) {
+		if (selectable(&_M_backends[i])) {
+			nusable++;
+		}
+	}
+
+	if (nusable == 0) {
+		return NULL;
+	}
+
+	// Power of two choices: compare two random backends (comparing all
+	// of them would send every request to the same one until its
+	// latency is updated).
+	size_t choices[2];
+	choices[0] = random() % nusable;
+
+	if (nusable == 1) {
+		choices[1] = choices[0];
+	} else {
+		choices[1] = random() % (nusable - 1);
+		if (choices[1] >= choices[0]) {
+			choices[1]++;
+		}
+	}
+
+	backend* candidates[2];
+	size_t n = 0;
+	for (size_t i = 0; i < _M_used; i++) {
+		if (selectable(&_M_backends[i])) {
+			for (unsigned j = 0; j < 2; j++) {
+				if (choices[j] == n) {
+					candidates[j] = &_M_backends[i];
+				}
+			}
+
+			n++;
+		}
+	}
+
+	// Cost: latency x (requests in flight + 1) / weight (a backend
+	// without latency yet is tried first).
+	unsigned long long cost[2];
+	for (unsigned j = 0; j < 2; j++) {
+		cost[j] = (unsigned long long) candidates[j]->latency * (candidates[j]->outstanding + 1) * effective_weight(candidates[1 - j]);
+	}
+
+	return (cost[1] < cost[0]) ? candidates[1] : candidates[0];
+}
+
+backend_list::backend* backend_list::select_hash(unsigned hash)
+{
+	if (_M_npoints == 0) {
+		return select_round_robin();
+	}
+
+	// First point whose hash is >= hash.
+	size_t lo = 0;
+	size_t hi = _M_npoints;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (_M_ring[mid].hash < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	// If the backend is down (or at its concurrency limit), its keys go
+	// to the next backends of the ring (the other keys don't move).
+	for (size_t i = 0; i < _M_npoints; i++) {
+		backend* backend = &_M_backends[_M_ring[(lo + i) % _M_npoints].backend];
+
+		if (selectable(backend)) {
+			return backend;
+		}
+	}
+
+	return NULL;
+}
+
+backend_list::backend* backend_list::select_hedge(const backend* exclude)
+{
+	// The fastest of the other backends.
+	backend* best = NULL;
+
+	for (size_t i = 0; i < _M_used; i++) {
+		backend* backend = &_M_backends[i];
+
+		if ((backend == exclude) || (!selectable(backend))) {
+			continue;
+		}
+
+		// latency * (outstanding + 1) / weight < best's?
+		if ((!best) || ((unsigned long long) backend->latency * (backend->outstanding + 1) * effective_weight(best) < (unsigned long long) best->latency * (best->outstanding + 1) * effective_weight(backend))) {
+			best = backend;
+		}
+	}
+
+	return best;
+}
+
+bool backend_list::build_ring()
+{
+	size_t npoints = 0;
+	for (size_t i = 0; i < _M_used; i++) {
+		npoints += _M_backends[i].weight * POINTS_PER_WEIGHT;
+	}
+
+	if ((_M_ring = (point*) malloc(npoints * sizeof(point))) == NULL) {
+		return false;
+	}
+
+	// The points depend on the names of the backends (not on their
+	// order nor on their addresses).
+	char key[NI_MAXHOST + 32];
+
+	for (size_t i = 0; i < _M_used; i++) {
+		backend* backend = &_M_backends[i];
+
+		for (unsigned j = 0; j < backend->weight * POINTS_PER_WEIGHT; j++) {
+			size_t keylen = snprintf(key, sizeof(key), "%s:%u-%u", _M_buf.data() + backend->offset, backend->port, j);
+			if (keylen >= sizeof(key)) {
+				keylen = sizeof(key) - 1;
+			}
+
+			_M_ring[_M_npoints].hash = hash(key, keylen);
+			_M_ring[_M_npoints].backend = i;
+
+			_M_npoints++;
+		}
+	}
+
+	qsort(_M_ring, _M_npoints, sizeof(point), compare);
+
+	return true;
+}
+
+int backend_list::compare(const void* p1, const void* p2)
+{
+	unsigned h1 = ((const point*) p1)->hash;
+	unsigned h2 = ((const point*) p2)->hash;
+
+	if (h1 < h2) {
+		return -1;
+	} else if (h1 > h2) {
+		return 1;
+	} else {
+		return ((const point*) p1)->backend - ((const point*) p2)->backend;
+	}
+}
+
+unsigned backend_list::update_latency(unsigned fd)
+{
+	unsigned long long now = microseconds();
+	unsigned long long started = _M_requests[fd].started;
+
+	unsigned sample = (now > started) ? (unsigned) (now - started) : 1;
+
+	backend* backend = _M_connections[fd];
+
+	if (backend->latency == 0) {
+		backend->latency = sample;
+	} else {
+		backend->latency = (unsigned) ((long long) backend->latency + ((long long) sample - (long long) backend->latency) / (long long) LATENCY_SMOOTHING);
+		if (backend->latency == 0) {
+			backend->latency = 1;
+		}
+	}
+
+	return sample;
+}
+
+void backend_list::add_latency_sample(unsigned latency)
+{
+	_M_histogram[latency_bucket(latency)]++;
+
+	if (++_M_nsamples < HEDGE_SAMPLES) {
+		return;
+	}
+
+	// Percentile of the latency.
+	unsigned long long target = (unsigned long long) _M_nsamples * _M_hedge_percentile / 100;
+	unsigned long long count = 0;
+
+	unsigned i;
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		if ((count += _M_histogram[i]) >= target) {
+			break;
+		}
+	}
+
+	_M_hedge_delay = bucket_latency(i);
+
+	// The older samples weigh less and less.
+	_M_nsamples = 0;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		_M_histogram[i] /= 2;
+		_M_nsamples += _M_histogram[i];
+	}
+}
+
+unsigned backend_list::latency_bucket(unsigned latency)
+{
+	if (latency < 4) {
+		return latency;
+	}
+
+	// Four buckets per power of two.
+	unsigned msb = 2;
+	while ((latency >> msb) > 1) {
+		msb++;
+	}
+
+	return (msb * 4) + ((latency >> (msb - 2)) & 3);
+}
+
+unsigned backend_list::bucket_latency(unsigned bucket)
+{
+	if (bucket < 4) {
+		return bucket + 1;
+	}
+
+	unsigned msb = bucket / 4;
+
+	unsigned long long latency = (unsigned long long) (4 + (bucket % 4) + 1) << (msb - 2);
+
+	return (latency > UINT_MAX) ? UINT_MAX : (unsigned) latency;
+}
+
+unsigned long long backend_list::microseconds()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	return (unsigned long long) tv.tv_sec * 1000000ULL + tv.tv_usec;
 }
@@ -4,11 +4,65 @@
 #include <time.h>
 #include <sys/socket.h>
 #include "string/buffer.h"
+#include "net/resolver.h"
+#include "util/worker_pool.h"
 #include "util/now.h"
+#include "util/fnv.h"
 
 class backend_list {
 	public:
 		static const time_t DEFAULT_RETRY_INTERVAL;
+		static const unsigned DEFAULT_MAX_IDLE_CONNECTIONS;
+		static const time_t DEFAULT_IDLE_TIMEOUT;
+		static const time_t DEFAULT_MIN_DNS_TTL;
+		static const time_t DEFAULT_MAX_DNS_TTL;
+		static const unsigned DEFAULT_WEIGHT;
+		static const unsigned MAX_WEIGHT;
+		static const size_t COOKIE_NAME_MAX_LEN;
+		static const unsigned DEFAULT_HEALTH_CHECK_TIMEOUT;
+		static const unsigned DEFAULT_HEALTHY_THRESHOLD;
+		static const unsigned DEFAULT_UNHEALTHY_THRESHOLD;
+		static const time_t DEFAULT_EJECTION_TIME;
+		static const size_t HEALTH_CHECK_PATH_MAX_LEN;
+		static const unsigned DEFAULT_RETRIES;
+		static const unsigned DEFAULT_QUEUE_SIZE;
+		static const time_t DEFAULT_QUEUE_TIMEOUT;
+
+		// How the backend of a request is chosen.
+		enum policy {
+			ROUND_ROBIN, // Weighted round-robin.
+			LEAST_REQUESTS, // Fewest requests in flight (per unit of weight).
+			LATENCY, // Best of two random backends (latency EWMA x requests in flight).
+			HASH // Consistent hashing of a key of the request.
+		};
+
+		enum hash_key {
+			CLIENT_IP_KEY,
+			URL_KEY,
+			COOKIE_KEY
+		};
+
+		struct statistics {
+			const char* name; // "host:port" or "unix:/path".
+
+			unsigned weight;
+			bool available; // Neither down nor ejected.
+
+			unsigned outstanding; // Requests in flight.
+			unsigned limit; // Concurrency limit (0: none).
+			unsigned long long requests;
+			unsigned latency; // [us] EWMA of the time to the response headers.
+		};
+
+		struct queue_statistics {
+			unsigned queued;
+			unsigned max_queued;
+			unsigned long long dequeued;
+			unsigned long long total_wait; // [us]
+			unsigned max_wait; // [us]
+			unsigned long long rejected; // The queue was full.
+			unsigned long long timed_out;
+		};
 
 		// Constructor.
 		backend_list();
@@ -25,20 +79,182 @@ class backend_list {
 		// Set retry interval.
 		void set_retry_interval(time_t retry_interval);
 
+		// Set maximum number of idle connections per backend and how
+		// long they can be kept (0: connections are not reused).
+		void set_idle_connections(unsigned max_idle_connections, time_t idle_timeout);
+
+		// Set the bounds of the time the addresses of the backends are
+		// kept before resolving their names again.
+		void set_dns_ttl(time_t min_ttl, time_t max_ttl);
+
+		// Check the backends every 'interval' seconds (path: path of an
+		// HTTP GET request whose response must have the status code
+		// 'status', NULL: only connect).
+		bool set_health_check(time_t interval, unsigned timeout, const char* path, size_t pathlen, unsigned status, unsigned healthy_threshold, unsigned unhealthy_threshold);
+
+		// Eject for 'ejection_time' seconds the backends which fail
+		// 'max_errors' requests in a row (0: disabled) or whose latency
+		// exceeds 'max_latency' milliseconds (0: disabled).
+		void set_outlier_detection(unsigned max_errors, unsigned max_latency, time_t ejection_time);
+
+		// Ramp up the weight of the backends which come back during
+		// 'slow_start' seconds.
+		void set_slow_start(time_t slow_start);
+
+		// Set how many times a request can be sent again to another
+		// backend when the backend fails before answering.
+		void set_retries(unsigned retries);
+
+		// Get the number of retries.
+		unsigned get_retries() const;
+
+		// Send a second request to another backend when the response
+		// hasn't been received after the 'percentile' percentile of the
+		// latency (0: disabled).
+		void set_hedging(unsigned percentile);
+
+		// After how long a request is sent to a second backend [us]
+		// (0: not yet known or disabled).
+		unsigned get_hedge_delay() const;
+
+		// Limit the requests in flight to each backend: the limit starts
+		// at 'initial' and adapts to the latency of the backend, up to
+		// 'max' (0: no limit). The requests over the limit wait in a
+		// queue of 'queue_size' requests for at most 'queue_timeout'
+		// seconds.
+		bool set_concurrency_limit(unsigned initial, unsigned max, unsigned queue_size, time_t queue_timeout);
+
+		// Are all the usable backends at their concurrency limit or busy?
+		bool saturated() const;
+
+		// Is a usable backend busy (the listen queue of its Unix domain
+		// socket is full)?
+		bool busy() const;
+
+		// Can a request be accepted (a backend is usable and has room or
+		// the request can wait in the queue)?
+		bool accepting() const;
+
+		// Number of requests in the queue.
+		unsigned queued() const;
+
+		// Add the request of the client fd to the queue (returns its
+		// position or -1 if the queue is full).
+		int enqueue(unsigned fd);
+
+		// The client at position 'pos' of the queue has gone away.
+		void cancel_queued(unsigned pos);
+
+		// Remove the first request of the queue if a backend has room
+		// for it (returns the client's fd or -1).
+		int dequeue();
+
+		// Remove the first request of the queue if it has waited too
+		// long (returns the client's fd or -1).
+		int expire();
+
+		// How long the clients should wait before trying again [s].
+		time_t get_retry_after() const;
+
+		// Set load-balancing policy.
+		void set_policy(policy policy);
+
+		// Set the key of the requests for consistent hashing (cookie: name
+		// of the cookie for COOKIE_KEY).
+		bool set_hash_key(hash_key key, const char* cookie = NULL, size_t cookielen = 0);
+
+		// Get load-balancing policy.
+		policy get_policy() const;
+
+		// Get the key of the requests for consistent hashing.
+		hash_key get_hash_key(const char*& cookie, size_t& cookielen) const;
+
+		// Keep connections to the backends alive?
+		bool keep_alive() const;
+
+		// Get idle timeout.
+		time_t get_idle_timeout() const;
+
 		// Create.
 		bool create(size_t max_open_files);
 
-		// Add backend.
-		bool add(const char* host, unsigned short hostlen, unsigned short port);
+		// Add backend ('host' "unix:/path": Unix domain socket, 'port'
+		// is ignored).
+		bool add(const char* host, unsigned short hostlen, unsigned short port, unsigned weight = DEFAULT_WEIGHT);
+
+		// Connect (reused is set when an idle connection is returned,
+		// 'hash' is the hash of the key of the request for the HASH
+		// policy).
+		int connect(unsigned hash, const char*& host, unsigned short& hostlen, unsigned short& port, bool& reused);
+
+		// Open another connection to the backend of fd.
+		int connect(unsigned fd);
+
+		// Connect to another backend than the one of fd (hedged request).
+		int connect_hedge(unsigned fd, const char*& host, unsigned short& hostlen, unsigned short& port, bool& reused);
+
+		// Should the limits of the backend of fd be queried? (returns
+		// true only once per backend).
+		bool needs_probe(unsigned fd);
 
-		// Connect.
-		int connect(const char*& host, unsigned short& hostlen, unsigned short& port);
+		// Limit the number of idle connections to the backend of fd.
+		void limit_idle_connections(unsigned fd, unsigned max_idle_connections);
+
+		// Add idle connection to the pool of its backend.
+		bool add_idle_connection(unsigned fd);
+
+		// Remove idle connection from the pool of its backend.
+		void remove_idle_connection(unsigned fd);
 
 		// Connection failed.
 		void connection_failed(unsigned fd);
 
+		// The response headers have been received from the backend of fd.
+		void response_received(unsigned fd, unsigned status_code);
+
+		// The request sent through fd has completed ('failed': the
+		// backend hasn't sent a response).
+		void request_completed(unsigned fd, bool failed = false);
+
+		// The request sent through fd has been cancelled (another backend
+		// has answered first).
+		void request_cancelled(unsigned fd);
+
+		// Get the statistics of a backend (and reset the counters).
+		bool get_statistics(size_t idx, statistics& stats);
+
+		// Get the statistics of the queue (and reset the counters).
+		bool get_queue_statistics(queue_statistics& stats);
+
+		// Hash key.
+		static unsigned hash(const char* key, size_t keylen);
+
+		// Resolve again the names of the backends whose addresses have
+		// expired (in the worker threads).
+		bool refresh(worker_pool& workers);
+
+		// Check the health of the backends whose check is due (in the
+		// worker threads).
+		bool check_health(worker_pool& workers);
+
+		// Get current time in microseconds.
+		static unsigned long long microseconds();
+
 	protected:
 		static const size_t BACKEND_ALLOC;
+		static const unsigned POINTS_PER_WEIGHT;
+		static const unsigned LATENCY_SMOOTHING;
+		static const unsigned WEIGHT_SCALE;
+		static const unsigned LATENCY_BUCKETS;
+		static const unsigned HEDGE_SAMPLES;
+		static const unsigned LATENCY_TOLERANCE;
+		static const unsigned MIN_LATENCY_DRIFT;
+
+		// Host sent to the Unix domain socket backends.
+		static const char UNIX_SOCKET_HOST[];
+
+		struct resolve_job;
+		struct health_check_job;
 
 		buffer _M_buf;
 
@@ -50,10 +266,48 @@ class backend_list {
 
 			unsigned short port;
 
-			struct sockaddr addr;
+			size_t name; // Offset of the name shown in the logs.
+
+			resolver::address addr;
+			time_t expires; // 0: numeric address.
+			bool resolving;
 
 			bool available;
 			time_t downtime;
+
+			// Idle connections (the most recently used is the last one).
+			int* idle;
+			unsigned nidle;
+			unsigned max_idle;
+
+			bool probed;
+
+			unsigned weight;
+			int current_weight; // Smooth weighted round-robin.
+
+			unsigned outstanding;
+			unsigned long long requests;
+			unsigned latency; // [us]
+
+			// Concurrency limit (AIMD).
+			unsigned limit;
+			unsigned increase; // Responses since the last increase.
+			unsigned min_latency; // [us] Latency without load.
+			unsigned long long decreased; // [us] Last decrease.
+
+			bool checking;
+			time_t next_check;
+			unsigned successes; // Consecutive successful health checks.
+			unsigned failures; // Consecutive failed health checks.
+
+			unsigned errors; // Consecutive failed requests.
+			time_t ejected_until;
+
+			time_t recovered; // Beginning of the slow start.
+
+			// Not chosen until then (the listen queue of its Unix domain
+			// socket was full).
+			time_t busy_until;
 		};
 
 		backend* _M_backends;
@@ -64,7 +318,164 @@ class backend_list {
 
 		struct backend** _M_connections;
 
+		// Request in flight on each connection.
+		struct request {
+			unsigned long long started; // [us] (0: none).
+			bool responded;
+		};
+
+		request* _M_requests;
+
+		policy _M_policy;
+
+		hash_key _M_hash_key;
+		char* _M_cookie;
+		size_t _M_cookielen;
+
+		// Consistent hashing ring.
+		struct point {
+			unsigned hash;
+			unsigned backend;
+		};
+
+		point* _M_ring;
+		size_t _M_npoints;
+
+		// Active health checks.
+		time_t _M_check_interval; // 0: disabled.
+		unsigned _M_check_timeout; // [ms]
+		char* _M_check_path; // NULL: connect only.
+		unsigned _M_check_status;
+		unsigned _M_healthy_threshold;
+		unsigned _M_unhealthy_threshold;
+
+		// Outlier detection.
+		unsigned _M_max_errors;
+		unsigned _M_max_latency; // [us]
+		time_t _M_ejection_time;
+
+		time_t _M_slow_start;
+
+		unsigned _M_retries;
+
+		// Hedged requests.
+		unsigned _M_hedge_percentile; // 0: disabled.
+		unsigned _M_hedge_delay; // [us]
+
+		// Histogram of the latencies (response headers received).
+		unsigned* _M_histogram;
+		unsigned _M_nsamples;
+
+		// Concurrency limits.
+		unsigned _M_initial_concurrency;
+		unsigned _M_max_concurrency; // 0: no limit.
+
+		// Requests waiting for a backend to have room (FIFO).
+		struct queued_request {
+			int fd; // -1: the client has gone away.
+			unsigned long long since; // [us]
+		};
+
+		queued_request* _M_queue;
+		unsigned _M_queue_size;
+		unsigned _M_queue_head;
+		unsigned _M_queue_count; // Including the clients which have gone away.
+		unsigned _M_nqueued;
+		time_t _M_queue_timeout;
+
+		unsigned _M_max_queued;
+		unsigned long long _M_dequeued;
+		unsigned long long _M_total_wait;
+		unsigned _M_max_wait;
+		unsigned long long _M_rejected;
+		unsigned long long _M_timed_out;
+
 		time_t _M_retry_interval;
+
+		unsigned _M_max_idle_connections;
+		time_t _M_idle_timeout;
+
+		time_t _M_min_dns_ttl;
+		time_t _M_max_dns_ttl;
+
+		// Can the backend be tried?
+		bool usable(const backend* backend) const;
+
+		// Can the backend take one more request?
+		bool has_room(const backend* backend) const;
+
+		// Is the backend busy?
+		bool busy(const backend* backend) const;
+
+		// Can the backend be chosen for a request?
+		bool selectable(const backend* backend) const;
+
+		// Weight of the backend (lower during the slow start).
+		unsigned effective_weight(const backend* backend) const;
+
+		// Adapt the concurrency limit of the backend to the latency of a
+		// request ('failed': the request has failed).
+		void adapt_limit(backend* backend, unsigned latency, bool failed);
+
+		// Remove the first request of the queue.
+		int pop();
+
+		// Drop the clients which have gone away from the head of the
+		// queue.
+		void skip_cancelled();
+
+		// The backend is down.
+		void mark_down(backend* backend);
+
+		// The backend is up again.
+		void mark_up(backend* backend);
+
+		// Eject backend.
+		void eject(backend* backend, const char* reason);
+
+		// Count a failed request.
+		void request_failed(backend* backend);
+
+		// The health of the backend has been checked.
+		void health_checked(size_t index, bool success);
+
+		// Choose backend.
+		backend* select(unsigned hash);
+		backend* select_round_robin();
+		backend* select_least_requests();
+		backend* select_latency();
+		backend* select_hash(unsigned hash);
+
+		// Choose the backend of a hedged request.
+		backend* select_hedge(const backend* exclude);
+
+		// Connect to backend.
+		int connect(backend* backend, const char*& host, unsigned short& hostlen, unsigned short& port, bool& reused);
+
+		// Build the consistent hashing ring.
+		bool build_ring();
+
+		// Compare points of the ring.
+		static int compare(const void* p1, const void* p2);
+
+		// Record the latency of the backend of fd (returns the latency
+		// of the request).
+		unsigned update_latency(unsigned fd);
+
+		// Add latency to the histogram (and update the hedge delay).
+		void add_latency_sample(unsigned latency);
+
+		// Bucket of the histogram of a latency.
+		static unsigned latency_bucket(unsigned latency);
+
+		// Upper bound of a bucket of the histogram.
+		static unsigned bucket_latency(unsigned bucket);
+
+		// Set when the address of the backend expires.
+		void set_expiration(backend* backend, time_t ttl);
+
+		// The name of the backend has been resolved.
+		void resolved(size_t index, bool success, const resolver::address& addr, time_t ttl);
 };
 
 inline backend_list::~backend_list()
@@ -83,10 +494,142 @@ inline void backend_list::set_retry_interval(time_t retry_interval)
 	_M_retry_interval = retry_interval;
 }
 
+inline void backend_list::set_idle_connections(unsigned max_idle_connections, time_t idle_timeout)
+{
+	_M_max_idle_connections = max_idle_connections;
+	_M_idle_timeout = idle_timeout;
+}
+
+inline void backend_list::set_dns_ttl(time_t min_ttl, time_t max_ttl)
+{
+	_M_min_dns_ttl = min_ttl;
+	_M_max_dns_ttl = max_ttl;
+}
+
+inline void backend_list::set_policy(policy policy)
+{
+	_M_policy = policy;
+}
+
+inline backend_list::policy backend_list::get_policy() const
+{
+	return _M_policy;
+}
+
+inline backend_list::hash_key backend_list::get_hash_key(const char*& cookie, size_t& cookielen) const
+{
+	cookie = _M_cookie;
+	cookielen = _M_cookielen;
+
+	return _M_hash_key;
+}
+
+inline bool backend_list::keep_alive() const
+{
+	return (_M_max_idle_connections > 0);
+}
+
+inline time_t backend_list::get_idle_timeout() const
+{
+	return _M_idle_timeout;
+}
+
+inline bool backend_list::needs_probe(unsigned fd)
+{
+	if (_M_connections[fd]->probed) {
+		return false;
+	}
+
+	_M_connections[fd]->probed = true;
+
+	return true;
+}
+
+inline void backend_list::set_outlier_detection(unsigned max_errors, unsigned max_latency, time_t ejection_time)
+{
+	_M_max_errors = max_errors;
+	_M_max_latency = max_latency * 1000;
+	_M_ejection_time = ejection_time;
+}
+
+inline void backend_list::set_slow_start(time_t slow_start)
+{
+	_M_slow_start = slow_start;
+}
+
+inline void backend_list::set_retries(unsigned retries)
+{
+	_M_retries = retries;
+}
+
+inline unsigned backend_list::get_retries() const
+{
+	return _M_retries;
+}
+
+inline void backend_list::set_hedging(unsigned percentile)
+{
+	_M_hedge_percentile = percentile;
+}
+
+inline unsigned backend_list::get_hedge_delay() const
+{
+	return _M_hedge_delay;
+}
+
+inline unsigned backend_list::queued() const
+{
+	return _M_nqueued;
+}
+
+inline time_t backend_list::get_retry_after() const
+{
+	return (_M_queue_timeout > 0) ? _M_queue_timeout : 1;
+}
+
 inline void backend_list::connection_failed(unsigned fd)
 {
-	_M_connections[fd]->available = false;
-	_M_connections[fd]->downtime = now::_M_time;
+	mark_down(_M_connections[fd]);
+}
+
+inline bool backend_list::usable(const backend* backend) const
+{
+	if (backend->ejected_until > now::_M_time) {
+		return false;
+	}
+
+	// With active health checks, a backend which is down comes back only
+	// when it passes them (the requests are not used as probes).
+	return ((backend->available) || ((_M_check_interval == 0) && (backend->downtime + _M_retry_interval <= now::_M_time)));
+}
+
+inline bool backend_list::has_room(const backend* backend) const
+{
+	return ((_M_max_concurrency == 0) || (backend->outstanding < backend->limit));
+}
+
+inline bool backend_list::busy(const backend* backend) const
+{
+	return (backend->busy_until > now::_M_time);
+}
+
+inline bool backend_list::selectable(const backend* backend) const
+{
+	return ((usable(backend)) && (has_room(backend)) && (!busy(backend)));
+}
+
+inline unsigned backend_list::hash(const char* key, size_t keylen)
+{
+	unsigned h = fnv::hash(key, keylen);
+
+	// Spread short keys (IP addresses, ...) over the whole ring.
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+
+	return h;
 }
 
 #endif // BACKEND_LIST_H
@@ -5,23 +5,125 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <time.h>
+#include <new>
 #include "dirlisting.h"
 #include "net/url_encoder.h"
 #include "html/html_encoder.h"
 #include "string/utf8.h"
 #include "constants/months_and_days.h"
+#include "util/now.h"
 
 const off_t dirlisting::MAX_FOOTER_SIZE = 32 * 1024;
+const size_t dirlisting::DEFAULT_MAX_CACHED_LISTINGS = 64;
+const size_t dirlisting::STREAMING_MIN_ENTRIES = 2048;
+const size_t dirlisting::ENTRIES_PER_PAGE = 256;
 const unsigned short dirlisting::WIDTH_OF_NAME_COLUMN = 32;
+const size_t dirlisting::LISTING_BUFFER_INCREMENT = 16 * 1024;
+
+struct dirlisting::rebuild_job : public worker_pool::job {
+	dirlisting* owner;
+	size_t idx;
+
+	dirlisting::stream entries;
+
+	buffer html;
+
+	time_t mtime;
+	time_t built;
+
+	bool succeeded;
+
+	// Constructor.
+	rebuild_job(dirlisting* owner, size_t idx);
+
+	// Run (called from a worker thread).
+	void run();
+
+	// Completed (called from the event loop).
+	void completed();
+};
+
+dirlisting::rebuild_job::rebuild_job(dirlisting* owner, size_t idx) : html(LISTING_BUFFER_INCREMENT)
+{
+	this->owner = owner;
+	this->idx = idx;
+
+	mtime = 0;
+	built = 0;
+
+	succeeded = false;
+}
+
+void dirlisting::rebuild_job::run()
+{
+	entries.built = time(NULL);
+
+	if (!owner->load(entries.dir.data(), entries.dir.count(), entries)) {
+		return;
+	}
+
+	// Huge directories are streamed, not cached.
+	if (entries.count() >= STREAMING_MIN_ENTRIES) {
+		return;
+	}
+
+	mtime = entries.mtime;
+	built = entries.built;
+
+	succeeded = owner->render(entries, html);
+}
+
+void dirlisting::rebuild_job::completed()
+{
+	owner->rebuilt(this);
+}
 
 dirlisting::dirlisting()
 {
+	_M_sort_criteria = filelist::SORT_BY_NAME;
+	_M_sort_order = filelist::ASCENDING;
+
 	_M_rootlen = 0;
 
 	*_M_path = 0;
-	_M_pathlen = 0;
 
 	_M_exact_size = false;
+
+	_M_listings = NULL;
+	_M_max_listings = 0;
+	_M_nlistings = 0;
+
+	_M_buckets = NULL;
+	_M_nbuckets = 0;
+
+	_M_workers = NULL;
+}
+
+void dirlisting::free()
+{
+	_M_stream.free();
+	_M_footer.free();
+
+	if (_M_listings) {
+		for (size_t i = 0; i < _M_nlistings; i++) {
+			if (_M_listings[i].dir) {
+				::free(_M_listings[i].dir);
+			}
+		}
+
+		delete [] _M_listings;
+		_M_listings = NULL;
+	}
+
+	_M_max_listings = 0;
+	_M_nlistings = 0;
+
+	if (_M_buckets) {
+		::free(_M_buckets);
+		_M_buckets = NULL;
+	}
+
+	_M_nbuckets = 0;
 }
 
 bool dirlisting::set_root(const char* root, size_t rootlen)
@@ -33,7 +135,6 @@ bool dirlisting::set_root(const char* root, size_t rootlen)
 	_M_rootlen = rootlen;
 
 	memcpy(_M_path, root, rootlen);
-	_M_pathlen = rootlen;
 
 	return true;
 }
@@ -84,20 +185,234 @@ bool dirlisting::load_footer(const char* filename)
 	return true;
 }
 
+bool dirlisting::create_cache(size_t max_listings, worker_pool* workers)
+{
+	if (max_listings == 0) {
+		return true;
+	}
+
+	size_t nbuckets = 16;
+	while (nbuckets < 2 * max_listings) {
+		nbuckets *= 2;
+	}
+
+	if ((_M_buckets = (int*) malloc(nbuckets * sizeof(int))) == NULL) {
+		return false;
+	}
+
+	if ((_M_listings = new (std::nothrow) listing[max_listings]) == NULL) {
+		::free(_M_buckets);
+		_M_buckets = NULL;
+
+		return false;
+	}
+
+	for (size_t i = 0; i < nbuckets; i++) {
+		_M_buckets[i] = -1;
+	}
+
+	for (size_t i = 0; i < max_listings; i++) {
+		_M_listings[i].dir = NULL;
+		_M_listings[i].dirlen = 0;
+		_M_listings[i].next = -1;
+		_M_listings[i].last_access = 0;
+		_M_listings[i].building = false;
+	}
+
+	_M_nbuckets = nbuckets;
+	_M_max_listings = max_listings;
+
+	_M_workers = workers;
+
+	return true;
+}
+
+bool dirlisting::build(const char* dir, size_t dirlen, time_t mtime, buffer& buf)
+{
+	if (lookup(dir, dirlen, mtime, buf)) {
+		return true;
+	}
+
+	_M_stream.built = now::_M_time;
+
+	if (!load(dir, dirlen, _M_stream)) {
+		return false;
+	}
+
+	size_t offset = buf.count();
+
+	if (!render(_M_stream, buf)) {
+		return false;
+	}
+
+	store(_M_stream, mtime, buf.data() + offset, buf.count() - offset);
+
+	return true;
+}
+
 bool dirlisting::build(const char* dir, size_t dirlen, buffer& buf)
 {
-	if (_M_rootlen + dirlen >= sizeof(_M_path)) {
+	_M_stream.built = now::_M_time;
+
+	if (!load(dir, dirlen, _M_stream)) {
 		return false;
 	}
 
-	memcpy(_M_path + _M_rootlen, dir, dirlen);
-	_M_pathlen = _M_rootlen + dirlen;
-	_M_path[_M_pathlen] = 0;
+	return render(_M_stream, buf);
+}
 
-	if (!build_file_lists()) {
+bool dirlisting::lookup(const char* dir, size_t dirlen, time_t mtime, buffer& buf)
+{
+	// If the cache is disabled...
+	if (!_M_listings) {
 		return false;
 	}
 
+	listing* listing;
+	if ((listing = find(dir, dirlen, hash(dir, dirlen))) == NULL) {
+		return false;
+	}
+
+	listing->last_access = now::_M_time;
+
+	// If the directory might have been modified since the listing
+	// was built...
+	if ((listing->mtime != mtime) || (listing->built <= listing->mtime)) {
+		if (!listing->building) {
+			rebuild(listing);
+		}
+	}
+
+	// Serve the cached copy (it might be stale until the listing
+	// has been rebuilt).
+	return buf.append(listing->html.data(), listing->html.count());
+}
+
+bool dirlisting::load(const char* dir, size_t dirlen, stream& stream) const
+{
+	char path[PATH_MAX + 1];
+
+	if (_M_rootlen + dirlen >= sizeof(path)) {
+		return false;
+	}
+
+	memcpy(path, _M_path, _M_rootlen);
+	memcpy(path + _M_rootlen, dir, dirlen);
+	size_t pathlen = _M_rootlen + dirlen;
+	path[pathlen] = 0;
+
+	if (stream.dir.data() != dir) {
+		stream.dir.reset();
+		if (!stream.dir.append(dir, dirlen)) {
+			return false;
+		}
+	}
+
+	stream.directories.reset();
+	stream.directories.set_sort_criteria(_M_sort_criteria);
+	stream.directories.set_sort_order(_M_sort_order);
+
+	stream.files.reset();
+	stream.files.set_sort_criteria(_M_sort_criteria);
+	stream.files.set_sort_order(_M_sort_order);
+
+	if (!build_file_lists(path, pathlen, stream)) {
+		return false;
+	}
+
+	if ((!stream.directories.sort()) || (!stream.files.sort())) {
+		return false;
+	}
+
+	stream.next = 0;
+	stream.done = false;
+
+	return true;
+}
+
+bool dirlisting::render(stream& stream, buffer& buf, size_t max_entries) const
+{
+	if (stream.done) {
+		return true;
+	}
+
+	if (stream.next == 0) {
+		if (!render_header(stream.dir.data(), stream.dir.count(), buf)) {
+			return false;
+		}
+	}
+
+	size_t ndirectories = stream.directories.count();
+	size_t total = stream.count();
+
+	for (; (stream.next < total) && (max_entries > 0); stream.next++, max_entries--) {
+		if (stream.next < ndirectories) {
+			if (!render_directory(stream.directories, stream.directories.get_file(stream.next), buf)) {
+				return false;
+			}
+		} else {
+			if (!render_file(stream.files, stream.files.get_file(stream.next - ndirectories), buf)) {
+				return false;
+			}
+		}
+	}
+
+	if (stream.next == total) {
+		if (!render_footer(buf)) {
+			return false;
+		}
+
+		stream.done = true;
+	}
+
+	return true;
+}
+
+void dirlisting::store(const stream& stream, time_t mtime, const char* html, size_t len)
+{
+	// If the cache is disabled or the listing is too big...
+	if ((!_M_listings) || (stream.count() >= STREAMING_MIN_ENTRIES)) {
+		return;
+	}
+
+	const char* dir = stream.dir.data();
+	size_t dirlen = stream.dir.count();
+
+	unsigned h = hash(dir, dirlen);
+
+	// Another request might have stored the listing meanwhile.
+	listing* listing;
+	bool found;
+	if ((listing = find(dir, dirlen, h)) != NULL) {
+		found = true;
+	} else if ((listing = add(dir, dirlen, h)) != NULL) {
+		found = false;
+	} else {
+		return;
+	}
+
+	listing->html.reset();
+
+	if (!listing->html.append(html, len)) {
+		if (found) {
+			unlink(listing);
+		}
+
+		return;
+	}
+
+	listing->mtime = mtime;
+	listing->built = stream.built;
+	listing->last_access = now::_M_time;
+
+	if (!found) {
+		listing->next = _M_buckets[h & (_M_nbuckets - 1)];
+		_M_buckets[h & (_M_nbuckets - 1)] = listing - _M_listings;
+	}
+}
+
+bool dirlisting::render_header(const char* dir, size_t dirlen, buffer& buf) const
+{
 #define FIRST  "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 3.2 Final//EN\"><html><head><title>Index of "
 #define SECOND "</title></head><body><h1>Index of "
 #define THIRD  "</h1><pre>Name"
@@ -158,123 +473,131 @@ bool dirlisting::build(const char* dir, size_t dirlen, buffer& buf)
 		}
 	}
 
-	// For each directory...
-	const filelist::file* file;
-	for (unsigned i = 0; ((file = _M_directories.get_file(i)) != NULL); i++) {
-		if (!buf.append("<a href=\"", 9)) {
+	return true;
+}
+
+bool dirlisting::render_directory(const filelist& directories, const filelist::file* file, buffer& buf) const
+{
+	const char* name = directories.get_name(file);
+
+	if (!buf.append("<a href=\"", 9)) {
+		return false;
+	}
+
+	if (url_encoder::encode(name, file->namelen, buf) < 0) {
+		return false;
+	}
+
+	if (!buf.append("/\">", 3)) {
+		return false;
+	}
+
+	if (file->utf8len + 1 > WIDTH_OF_NAME_COLUMN) {
+		if (html_encoder::encode(name, WIDTH_OF_NAME_COLUMN - 4, buf) < 0) {
 			return false;
 		}
 
-		if (url_encoder::encode(file->name, file->namelen, buf) < 0) {
+		if (!buf.append(".../</a>", 8)) {
 			return false;
 		}
-
-		if (!buf.append("/\">", 3)) {
+	} else {
+		if (html_encoder::encode(name, file->namelen, buf) < 0) {
 			return false;
 		}
 
-		if (file->utf8len + 1 > WIDTH_OF_NAME_COLUMN) {
-			if (html_encoder::encode(file->name, WIDTH_OF_NAME_COLUMN - 4, buf) < 0) {
-				return false;
-			}
-
-			if (!buf.append(".../</a>", 8)) {
+		if (file->utf8len + 1 < WIDTH_OF_NAME_COLUMN) {
+			if (!buf.format("/</a>%*s", WIDTH_OF_NAME_COLUMN - file->utf8len - 1, " ")) {
 				return false;
 			}
 		} else {
-			if (html_encoder::encode(file->name, file->namelen, buf) < 0) {
+			if (!buf.append("/</a>", 5)) {
 				return false;
 			}
-
-			if (file->utf8len + 1 < WIDTH_OF_NAME_COLUMN) {
-				if (!buf.format("/</a>%*s", WIDTH_OF_NAME_COLUMN - file->utf8len - 1, " ")) {
-					return false;
-				}
-			} else {
-				if (!buf.append("/</a>", 5)) {
-					return false;
-				}
-			}
 		}
+	}
 
-		struct tm stm;
-		gmtime_r(&file->mtime, &stm);
+	struct tm stm;
+	gmtime_r(&file->mtime, &stm);
 
-		if (!buf.format("    %02d-%s-%04d %02d:%02d     -\n", stm.tm_mday, months[stm.tm_mon], 1900 + stm.tm_year, stm.tm_hour, stm.tm_min)) {
-			return false;
-		}
+	return buf.format("    %02d-%s-%04d %02d:%02d     -\n", stm.tm_mday, months[stm.tm_mon], 1900 + stm.tm_year, stm.tm_hour, stm.tm_min);
+}
+
+bool dirlisting::render_file(const filelist& files, const filelist::file* file, buffer& buf) const
+{
+	const char* name = files.get_name(file);
+
+	if (!buf.append("<a href=\"", 9)) {
+		return false;
 	}
 
-	// For each file...
-	for (unsigned i = 0; ((file = _M_files.get_file(i)) != NULL); i++) {
-		if (!buf.append("<a href=\"", 9)) {
+	if (url_encoder::encode(name, file->namelen, buf) < 0) {
+		return false;
+	}
+
+	if (!buf.append("\">", 2)) {
+		return false;
+	}
+
+	if (file->utf8len > WIDTH_OF_NAME_COLUMN) {
+		if (html_encoder::encode(name, WIDTH_OF_NAME_COLUMN - 3, buf) < 0) {
 			return false;
 		}
 
-		if (url_encoder::encode(file->name, file->namelen, buf) < 0) {
+		if (!buf.append("...</a>", 7)) {
 			return false;
 		}
-
-		if (!buf.append("\">", 2)) {
+	} else {
+		if (html_encoder::encode(name, file->namelen, buf) < 0) {
 			return false;
 		}
 
-		if (file->utf8len > WIDTH_OF_NAME_COLUMN) {
-			if (html_encoder::encode(file->name, WIDTH_OF_NAME_COLUMN - 3, buf) < 0) {
-				return false;
-			}
-
-			if (!buf.append("...</a>", 7)) {
+		if (file->utf8len < WIDTH_OF_NAME_COLUMN) {
+			if (!buf.format("</a>%*s", WIDTH_OF_NAME_COLUMN - file->utf8len, " ")) {
 				return false;
 			}
 		} else {
-			if (html_encoder::encode(file->name, file->namelen, buf) < 0) {
+			if (!buf.append("</a>", 4)) {
 				return false;
 			}
-
-			if (file->utf8len < WIDTH_OF_NAME_COLUMN) {
-				if (!buf.format("</a>%*s", WIDTH_OF_NAME_COLUMN - file->utf8len, " ")) {
-					return false;
-				}
-			} else {
-				if (!buf.append("</a>", 4)) {
-					return false;
-				}
-			}
 		}
+	}
 
-		struct tm stm;
-		gmtime_r(&file->mtime, &stm);
+	struct tm stm;
+	gmtime_r(&file->mtime, &stm);
 
-		if (!buf.format("    %02d-%s-%04d %02d:%02d    ", stm.tm_mday, months[stm.tm_mon], 1900 + stm.tm_year, stm.tm_hour, stm.tm_min)) {
+	if (!buf.format("    %02d-%s-%04d %02d:%02d    ", stm.tm_mday, months[stm.tm_mon], 1900 + stm.tm_year, stm.tm_hour, stm.tm_min)) {
+		return false;
+	}
+
+	if (_M_exact_size) {
+		if (!buf.format("%lld", file->size)) {
 			return false;
 		}
-
-		if (_M_exact_size) {
-			if (!buf.format("%lld", file->size)) {
+	} else {
+		if (file->size > (off_t) 1024 * 1024 * 1024) {
+			if (!buf.format("%.01fG\n", (float) file->size / (float) (1024.0 * 1024.0 * 1024.0))) {
+				return false;
+			}
+		} else if (file->size > 1024 * 1024) {
+			if (!buf.format("%.01fM\n", (float) file->size / (float) (1024.0 * 1024.0))) {
+				return false;
+			}
+		} else if (file->size > 1024) {
+			if (!buf.format("%.01fK\n", (float) file->size / (float) (1024.0))) {
 				return false;
 			}
 		} else {
-			if (file->size > (off_t) 1024 * 1024 * 1024) {
-				if (!buf.format("%.01fG\n", (float) file->size / (float) (1024.0 * 1024.0 * 1024.0))) {
-					return false;
-				}
-			} else if (file->size > 1024 * 1024) {
-				if (!buf.format("%.01fM\n", (float) file->size / (float) (1024.0 * 1024.0))) {
-					return false;
-				}
-			} else if (file->size > 1024) {
-				if (!buf.format("%.01fK\n", (float) file->size / (float) (1024.0))) {
-					return false;
-				}
-			} else {
-				if (!buf.format("%lu\n", file->size)) {
-					return false;
-				}
+			if (!buf.format("%lu\n", file->size)) {
+				return false;
 			}
 		}
 	}
 
+	return true;
+}
+
+bool dirlisting::render_footer(buffer& buf) const
+{
 	if (!buf.append("</pre><hr>", 10)) {
 		return false;
 	}
@@ -288,18 +611,30 @@ bool dirlisting::build(const char* dir, size_t dirlen, buffer& buf)
 	return buf.append("</body></html>", 14);
 }
 
-bool dirlisting::build_file_lists()
+bool dirlisting::build_file_lists(char* path, size_t pathlen, stream& stream) const
 {
-	DIR* dp = opendir(_M_path);
+	DIR* dp = opendir(path);
 	if (!dp) {
 		return false;
 	}
 
-	const char* end = _M_path + sizeof(_M_path) - 1;
-	char* name = _M_path + _M_pathlen;
+	struct stat buf;
+
+#if HAVE_FSTATAT
+	int fd = dirfd(dp);
+
+	if (fstat(fd, &buf) < 0) {
+#else
+	if (stat(path, &buf) < 0) {
+#endif
+		closedir(dp);
+		return false;
+	}
+
+	stream.mtime = buf.st_mtime;
 
-	_M_directories.reset();
-	_M_files.reset();
+	const char* end = path + PATH_MAX;
+	char* name = path + pathlen;
 
 	struct dirent* ep;
 	while ((ep = readdir(dp)) != NULL) {
@@ -321,8 +656,12 @@ bool dirlisting::build_file_lists()
 
 		*dest = 0;
 
-		struct stat buf;
-		if (stat(_M_path, &buf) < 0) {
+#if HAVE_FSTATAT
+		// Stat relative to the directory, saves the path lookup.
+		if (fstatat(fd, name, &buf, 0) < 0) {
+#else
+		if (stat(path, &buf) < 0) {
+#endif
 			continue;
 		}
 
@@ -333,7 +672,7 @@ bool dirlisting::build_file_lists()
 				continue;
 			}
 
-			if (!_M_directories.insert(name, dest - name, utf8len, buf.st_size, buf.st_mtime)) {
+			if (!stream.directories.insert(name, dest - name, utf8len, buf.st_size, buf.st_mtime)) {
 				closedir(dp);
 				return false;
 			}
@@ -343,7 +682,7 @@ bool dirlisting::build_file_lists()
 				continue;
 			}
 
-			if (!_M_files.insert(name, dest - name, utf8len, buf.st_size, buf.st_mtime)) {
+			if (!stream.files.insert(name, dest - name, utf8len, buf.st_size, buf.st_mtime)) {
 				closedir(dp);
 				return false;
 			}
@@ -352,5 +691,127 @@ bool dirlisting::build_file_lists()
 
 	closedir(dp);
 
+	path[pathlen] = 0;
+
 	return true;
 }
+
+dirlisting::listing* dirlisting::find(const char* dir, size_t dirlen, unsigned hash)
+{
+	for (int i = _M_buckets[hash & (_M_nbuckets - 1)]; i != -1; i = _M_listings[i].next) {
+		listing* listing = &_M_listings[i];
+
+		if ((listing->hash == hash) && (listing->dirlen == dirlen) && (memcmp(listing->dir, dir, dirlen) == 0)) {
+			return listing;
+		}
+	}
+
+	return NULL;
+}
+
+dirlisting::listing* dirlisting::add(const char* dir, size_t dirlen, unsigned hash)
+{
+	listing* listing;
+
+	if (_M_nlistings < _M_max_listings) {
+		listing = &_M_listings[_M_nlistings++];
+
+		listing->html.set_buffer_increment(LISTING_BUFFER_INCREMENT);
+	} else {
+		// Evict the least recently used listing which is not being rebuilt.
+		listing = NULL;
+
+		for (size_t i = 0; i < _M_nlistings; i++) {
+			if ((!_M_listings[i].building) && ((!listing) || (_M_listings[i].last_access < listing->last_access))) {
+				listing = &_M_listings[i];
+			}
+		}
+
+		if (!listing) {
+			return NULL;
+		}
+
+		unlink(listing);
+	}
+
+	if (listing->dir) {
+		::free(listing->dir);
+	}
+
+	if ((listing->dir = (char*) malloc(dirlen)) == NULL) {
+		listing->dirlen = 0;
+		listing->last_access = 0;
+
+		return NULL;
+	}
+
+	memcpy(listing->dir, dir, dirlen);
+	listing->dirlen = dirlen;
+
+	listing->hash = hash;
+	listing->next = -1;
+
+	listing->building = false;
+
+	return listing;
+}
+
+void dirlisting::unlink(listing* listing)
+{
+	int idx = listing - _M_listings;
+	int* prev = &_M_buckets[listing->hash & (_M_nbuckets - 1)];
+
+	while (*prev != -1) {
+		if (*prev == idx) {
+			*prev = listing->next;
+			break;
+		}
+
+		prev = &_M_listings[*prev].next;
+	}
+
+	listing->next = -1;
+	listing->last_access = 0;
+}
+
+bool dirlisting::rebuild(listing* listing)
+{
+	rebuild_job* job;
+	if ((job = new (std::nothrow) rebuild_job(this, listing - _M_listings)) == NULL) {
+		return false;
+	}
+
+	if (!job->entries.dir.append(listing->dir, listing->dirlen)) {
+		delete job;
+		return false;
+	}
+
+	listing->building = true;
+
+	if (!_M_workers->submit(job)) {
+		listing->building = false;
+
+		delete job;
+		return false;
+	}
+
+	return true;
+}
+
+void dirlisting::rebuilt(rebuild_job* job)
+{
+	listing* listing = &_M_listings[job->idx];
+
+	listing->building = false;
+
+	if (!job->succeeded) {
+		// Drop the listing, the next request will build it again.
+		unlink(listing);
+		return;
+	}
+
+	listing->html.swap(job->html);
+
+	listing->mtime = job->mtime;
+	listing->built = job->built;
+}
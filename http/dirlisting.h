@@ -2,13 +2,39 @@
 #define DIRLISTING_H
 
 #include <sys/types.h>
+#include <time.h>
 #include <limits.h>
 #include "http/filelist.h"
 #include "string/buffer.h"
+#include "util/worker_pool.h"
+#include "util/fnv.h"
 
 class dirlisting {
 	public:
 		static const off_t MAX_FOOTER_SIZE;
+		static const size_t DEFAULT_MAX_CACHED_LISTINGS;
+		static const size_t STREAMING_MIN_ENTRIES;
+		static const size_t ENTRIES_PER_PAGE;
+
+		// Directory listing which is rendered in pages.
+		struct stream {
+			filelist directories;
+			filelist files;
+
+			buffer dir;
+
+			time_t mtime; // Modification time of the directory.
+			time_t built; // When the directory was read.
+
+			size_t next; // Next entry to be rendered.
+			bool done;
+
+			// Free.
+			void free();
+
+			// Get number of entries.
+			size_t count() const;
+		};
 
 		// Constructor.
 		dirlisting();
@@ -34,46 +60,137 @@ class dirlisting {
 		// Load footer.
 		bool load_footer(const char* filename);
 
+		// Create cache of directory listings.
+		bool create_cache(size_t max_listings, worker_pool* workers);
+
 		// Build directory listing.
 		bool build(const char* dir, size_t dirlen, buffer& buf);
 
+		// Build directory listing using the cache (mtime: modification time
+		// of the directory). If the cached listing is stale, it is served
+		// while a fresh one is built in the background.
+		bool build(const char* dir, size_t dirlen, time_t mtime, buffer& buf);
+
+		// Look up directory listing in the cache.
+		bool lookup(const char* dir, size_t dirlen, time_t mtime, buffer& buf);
+
+		// Read directory (stream.built has to be set by the caller).
+		bool load(const char* dir, size_t dirlen, stream& stream) const;
+
+		// Render the next max_entries entries (the first page includes the
+		// header and the last one the footer).
+		bool render(stream& stream, buffer& buf, size_t max_entries = (size_t) -1) const;
+
+		// Add rendered directory listing to the cache.
+		void store(const stream& stream, time_t mtime, const char* html, size_t len);
+
 	protected:
 		static const unsigned short WIDTH_OF_NAME_COLUMN;
+		static const size_t LISTING_BUFFER_INCREMENT;
 
-		filelist _M_directories;
-		filelist _M_files;
+		filelist::sort_criteria _M_sort_criteria;
+		filelist::sort_order _M_sort_order;
 
 		size_t _M_rootlen;
 
 		char _M_path[PATH_MAX + 1];
-		size_t _M_pathlen;
+
+		stream _M_stream;
 
 		bool _M_exact_size;
 
 		buffer _M_footer;
 
-		bool build_file_lists();
+		struct listing {
+			char* dir;
+			size_t dirlen;
+
+			unsigned hash;
+			int next;
+
+			time_t mtime; // Modification time of the directory.
+			time_t built; // When the listing was built.
+			time_t last_access;
+
+			bool building;
+
+			buffer html;
+		};
+
+		listing* _M_listings;
+		size_t _M_max_listings;
+		size_t _M_nlistings;
+
+		int* _M_buckets;
+		size_t _M_nbuckets;
+
+		worker_pool* _M_workers;
+
+		struct rebuild_job;
+		friend struct rebuild_job;
+
+		// Build file lists.
+		bool build_file_lists(char* path, size_t pathlen, stream& stream) const;
+
+		// Render header.
+		bool render_header(const char* dir, size_t dirlen, buffer& buf) const;
+
+		// Render directory.
+		bool render_directory(const filelist& directories, const filelist::file* file, buffer& buf) const;
+
+		// Render file.
+		bool render_file(const filelist& files, const filelist::file* file, buffer& buf) const;
+
+		// Render footer.
+		bool render_footer(buffer& buf) const;
+
+		// Find listing.
+		listing* find(const char* dir, size_t dirlen, unsigned hash);
+
+		// Add listing (might evict the least recently used listing).
+		listing* add(const char* dir, size_t dirlen, unsigned hash);
+
+		// Remove listing from the hash table.
+		void unlink(listing* listing);
+
+		// Rebuild listing in the background.
+		bool rebuild(listing* listing);
+
+		// Listing has been rebuilt.
+		void rebuilt(rebuild_job* job);
+
+		// Hash function.
+		static unsigned hash(const char* dir, size_t dirlen);
 };
 
 inline dirlisting::~dirlisting()
 {
+	free();
 }
 
-inline void dirlisting::free()
+inline void dirlisting::stream::free()
 {
-	_M_directories.free();
-	_M_files.free();
-	_M_footer.free();
+	directories.free();
+	files.free();
+
+	dir.free();
+}
+
+inline size_t dirlisting::stream::count() const
+{
+	return directories.count() + files.count();
 }
 
 inline bool dirlisting::set_sort_criteria(filelist::sort_criteria sort_criteria)
 {
-	return _M_directories.set_sort_criteria(sort_criteria) && _M_files.set_sort_criteria(sort_criteria);
+	_M_sort_criteria = sort_criteria;
+	return true;
 }
 
 inline bool dirlisting::set_sort_order(filelist::sort_order sort_order)
 {
-	return _M_directories.set_sort_order(sort_order) && _M_files.set_sort_order(sort_order);
+	_M_sort_order = sort_order;
+	return true;
 }
 
 inline void dirlisting::set_exact_size(bool exact_size)
@@ -81,4 +198,9 @@ inline void dirlisting::set_exact_size(bool exact_size)
 	_M_exact_size = exact_size;
 }
 
+inline unsigned dirlisting::hash(const char* dir, size_t dirlen)
+{
+	return fnv::hash(dir, dirlen);
+}
+
 #endif // DIRLISTING_H
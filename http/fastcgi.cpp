@@ -165,6 +165,76 @@ bool fastcgi::name_value_pairs::add(const char* name, unsigned short namelen, co
 	return true;
 }
 
+bool fastcgi::name_value_pairs::add(const char* name, unsigned short namelen, const file_wrapper::io_vector* value, unsigned nvalues)
+{
+	size_t valuelen = 0;
+	for (unsigned i = 0; i < nvalues; i++) {
+		valuelen += value[i].iov_len;
+	}
+
+	size_t size = namelen + valuelen;
+	size += (namelen <= 127) ? 1 : 4;
+	size += (valuelen <= 127) ? 1 : 4;
+
+	if ((size_t) _M_contentLength + size > 0xffff) {
+		return false;
+	}
+
+	if (!_M_out.allocate(size)) {
+		return false;
+	}
+
+	unsigned char* data = reinterpret_cast<unsigned char*>(_M_out.data());
+	size_t count = _M_out.count();
+
+	if (namelen <= 127) {
+		data[count++] = namelen;
+	} else {
+		data[count++] = 0x80 | ((namelen & 0xff000000) >> 24);
+		data[count++] = (namelen & 0x00ff0000) >> 16;
+		data[count++] = (namelen & 0x0000ff00) >> 8;
+		data[count++] = namelen & 0x000000ff;
+	}
+
+	if (valuelen <= 127) {
+		data[count++] = valuelen;
+	} else {
+		data[count++] = 0x80 | ((valuelen & 0xff000000) >> 24);
+		data[count++] = (valuelen & 0x00ff0000) >> 16;
+		data[count++] = (valuelen & 0x0000ff00) >> 8;
+		data[count++] = valuelen & 0x000000ff;
+	}
+
+	memcpy(data + count, name, namelen);
+	count += namelen;
+
+	for (unsigned i = 0; i < nvalues; i++) {
+		memcpy(data + count, value[i].iov_base, value[i].iov_len);
+		count += value[i].iov_len;
+	}
+
+	_M_out.increment_count(size);
+
+	_M_contentLength += size;
+
+	return true;
+}
+
+bool fastcgi::name_value_pairs::add(const char* pairs, size_t len)
+{
+	if ((size_t) _M_contentLength + len > 0xffff) {
+		return false;
+	}
+
+	if (!_M_out.append(pairs, len)) {
+		return false;
+	}
+
+	_M_contentLength += len;
+
+	return true;
+}
+
 bool fastcgi::name_value_pairs::end()
 {
 	_M_header->contentLengthB1 = (_M_contentLength & 0xff00) >> 8;
@@ -205,6 +275,21 @@ bool fastcgi::abort_request(unsigned short requestId, buffer& out)
 	return true;
 }
 
+bool fastcgi::get_values(buffer& out)
+{
+	name_value_pairs pairs(out);
+
+	if (!pairs.header(FCGI_GET_VALUES, FCGI_NULL_REQUEST_ID)) {
+		return false;
+	}
+
+	if ((!pairs.add(FCGI_MAX_CONNS, strlen(FCGI_MAX_CONNS), NULL, 0, false, false)) || (!pairs.add(FCGI_MAX_REQS, strlen(FCGI_MAX_REQS), NULL, 0, false, false))) {
+		return false;
+	}
+
+	return pairs.end();
+}
+
 bool fastcgi::process(buffer& buf)
 {
 	size_t offset = 0;
@@ -385,6 +470,57 @@ bool fastcgi::decode_name_value_pairs(const void* buf, unsigned short len)
 	return true;
 }
 
+void fastcgi::stdin_framer::init(unsigned short requestId, off_t len)
+{
+	_M_len = len;
+
+	_M_nrecords = len / 0xffff;
+	if ((len % 0xffff) != 0) {
+		_M_nrecords++;
+	}
+
+	fill_header(FCGI_STDIN, requestId, 0xffff, 0, &_M_header);
+
+	// The last record is padded to a multiple of 8 bytes.
+	unsigned short last = (_M_nrecords > 0) ? len - ((_M_nrecords - 1) * 0xffff) : 0;
+	unsigned char remainder = last % 8;
+	unsigned char paddingLength = (remainder == 0) ? 0 : 8 - remainder;
+
+	fill_header(FCGI_STDIN, requestId, last, paddingLength, &_M_last);
+
+	memset(_M_trailer, 0, paddingLength);
+	fill_header(FCGI_STDIN, requestId, 0, 0, (FCGI_Header*) (_M_trailer + paddingLength));
+
+	_M_trailerlen = paddingLength + sizeof(FCGI_Header);
+}
+
+void fastcgi::stdin_framer::get(off_t offset, piece& piece) const
+{
+	off_t trailer = (_M_nrecords * sizeof(FCGI_Header)) + _M_len;
+	if (offset >= trailer) {
+		piece.framing = (const char*) _M_trailer + (offset - trailer);
+		piece.len = _M_trailerlen - (offset - trailer);
+
+		return;
+	}
+
+	off_t record = offset / (sizeof(FCGI_Header) + 0xffff);
+	size_t pos = offset % (sizeof(FCGI_Header) + 0xffff);
+
+	if (pos < sizeof(FCGI_Header)) {
+		const FCGI_Header* header = (record == _M_nrecords - 1) ? &_M_last : &_M_header;
+
+		piece.framing = (const char*) header + pos;
+		piece.len = sizeof(FCGI_Header) - pos;
+	} else {
+		pos -= sizeof(FCGI_Header);
+
+		piece.framing = NULL;
+		piece.body_offset = (record * 0xffff) + pos;
+		piece.len = MIN(0xffff, _M_len - (record * 0xffff)) - pos;
+	}
+}
+
 bool fastcgi::input_stream(unsigned char type, unsigned short requestId, const void* buf, size_t len, buffer& out)
 {
 	size_t nrecords = len / 0xffff;
@@ -404,7 +540,7 @@ bool fastcgi::input_stream(unsigned char type, unsigned short requestId, const v
 	size_t count = len;
 
 	for (size_t i = 1; i < nrecords; i++) {
-		len = count % 0xffff;
+		len = 0xffff;
 
 		fill_stream_record(type, requestId, len, 0, buf, out);
 
@@ -431,7 +567,7 @@ bool fastcgi::input_stream(unsigned char type, unsigned short requestId, const v
 	size_t count = len;
 
 	for (size_t i = 1; i < nrecords; i++) {
-		len = count % 0xffff;
+		len = 0xffff;
 
 		fill_stream_record(type, requestId, len, 0, buf, fd, filesize);
 
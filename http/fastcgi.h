@@ -4,9 +4,11 @@
 #include <sys/types.h>
 #include <string.h>
 #include "string/buffer.h"
+#include "file/file_wrapper.h"
 
 class fastcgi {
 	friend class name_value_pairs;
+	friend class stdin_framer;
 
 	public:
 		// Values for type component of FCGI_Header.
@@ -53,6 +55,13 @@ class fastcgi {
 				// Add name-value pair.
 				bool add(const char* name, unsigned short namelen, const char* value, unsigned short valuelen, bool prepend_HTTP_, bool to_uppercase);
 
+				// Add name-value pair, the value being gathered from
+				// several buffers.
+				bool add(const char* name, unsigned short namelen, const file_wrapper::io_vector* value, unsigned nvalues);
+
+				// Add name-value pairs already encoded.
+				bool add(const char* pairs, size_t len);
+
 				// End.
 				virtual bool end();
 
@@ -78,6 +87,42 @@ class fastcgi {
 				unsigned short _M_requestId;
 		};
 
+		// FCGI_STDIN records of a body of known size, followed by the
+		// empty record which ends the stream. The headers are generated
+		// while sending, between the pieces of the body (which is neither
+		// copied nor rewritten).
+		class stdin_framer {
+			public:
+				// Piece of the stream: framing ('framing' != NULL) or part of
+				// the body (at 'body_offset').
+				struct piece {
+					const char* framing;
+					off_t body_offset;
+					size_t len;
+				};
+
+				// Initialize.
+				void init(unsigned short requestId, off_t len);
+
+				// Get the size of the stream.
+				off_t size() const;
+
+				// Get the piece of the stream at 'offset' (< size()).
+				void get(off_t offset, piece& piece) const;
+
+			protected:
+				off_t _M_len;
+				off_t _M_nrecords;
+
+				// Header of the full records / of the last one.
+				FCGI_Header _M_header;
+				FCGI_Header _M_last;
+
+				// Padding of the last record and end of the stream.
+				unsigned char _M_trailer[8 + sizeof(FCGI_Header)];
+				size_t _M_trailerlen;
+		};
+
 		// stdin.
 		static bool stdin_stream(unsigned short requestId, const void* buf, size_t len, buffer& out);
 		static bool stdin_stream(unsigned short requestId, const void* buf, size_t len, int fd, off_t& filesize);
@@ -89,6 +134,9 @@ class fastcgi {
 		// Abort request.
 		static bool abort_request(unsigned short requestId, buffer& out);
 
+		// Query the maximum number of connections and requests.
+		static bool get_values(buffer& out);
+
 		// Process data received from the FastCGI application.
 		bool process(buffer& buf);
 
@@ -180,6 +228,8 @@ class fastcgi {
 
 inline fastcgi::name_value_pairs::name_value_pairs(buffer& out) : _M_out(out)
 {
+	_M_header = NULL;
+	_M_contentLength = 0;
 }
 
 inline fastcgi::params::params(buffer& out) : name_value_pairs(out)
@@ -222,6 +272,11 @@ inline void fastcgi::fill_header(unsigned char type, unsigned short requestId, u
 	header->reserved = 0;
 }
 
+inline off_t fastcgi::stdin_framer::size() const
+{
+	return (_M_nrecords * sizeof(FCGI_Header)) + _M_len + _M_trailerlen;
+}
+
 inline bool fastcgi::stdin_stream(unsigned short requestId, const void* buf, size_t len, buffer& out)
 {
 	return input_stream(FCGI_STDIN, requestId, buf, len, out);
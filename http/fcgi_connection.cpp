@@ -5,9 +5,12 @@
 #include "http/version.h"
 #include "net/socket_wrapper.h"
 #include "net/tcp_connection.inl"
+#include "util/number.h"
 #include "util/now.h"
 #include "logger/logger.h"
 
+const size_t fcgi_connection::STREAM_BUFFER_SIZE = 64 * 1024;
+
 const unsigned char fcgi_connection::CONNECTING_STATE = 0;
 const unsigned char fcgi_connection::SENDING_REQUEST_STATE = 1;
 const unsigned char fcgi_connection::SENDING_STDIN_STATE = 2;
@@ -15,6 +18,13 @@ const unsigned char fcgi_connection::READING_HEADERS_STATE = 3;
 const unsigned char fcgi_connection::READING_BODY_STATE = 4;
 const unsigned char fcgi_connection::PREPARING_ERROR_PAGE_STATE = 5;
 const unsigned char fcgi_connection::RESPONSE_COMPLETED_STATE = 6;
+const unsigned char fcgi_connection::IDLE_STATE = 7;
+const unsigned char fcgi_connection::SENDING_GET_VALUES_STATE = 8;
+const unsigned char fcgi_connection::READING_GET_VALUES_RESULT_STATE = 9;
+const unsigned char fcgi_connection::RELAYING_STDIN_STATE = 10;
+const unsigned char fcgi_connection::BUFFERING_BODY_STATE = 11;
+const unsigned char fcgi_connection::STREAMING_BODY_STATE = 12;
+const unsigned char fcgi_connection::RESPONSE_STREAMED_STATE = 13;
 
 fcgi_connection::fcgi_connection()
 {
@@ -24,7 +34,17 @@ fcgi_connection::fcgi_connection()
 
 	_M_client = NULL;
 
+	_M_backends = NULL;
+
+	_M_max_conns = 0;
+	_M_max_reqs = 0;
+
+	_M_left = -1;
+
 	_M_state = CONNECTING_STATE;
+
+	_M_reusable = 0;
+	_M_chunked = 0;
 }
 
 void fcgi_connection::reset()
@@ -40,12 +60,25 @@ void fcgi_connection::reset()
 
 	_M_client = NULL;
 
+	_M_backends = NULL;
+
+	_M_max_conns = 0;
+	_M_max_reqs = 0;
+
+	_M_left = -1;
+
 	_M_state = CONNECTING_STATE;
+
+	_M_reusable = 0;
+	_M_chunked = 0;
 }
 
 bool fcgi_connection::loop(unsigned fd)
 {
 	size_t total = 0;
+	unsigned status;
+	off_t count;
+	bool ret;
 	int error;
 
 	do {
@@ -60,8 +93,16 @@ bool fcgi_connection::loop(unsigned fd)
 				if ((!socket_wrapper::get_socket_error(fd, error)) || (error)) {
 					logger::instance().log(logger::LOG_WARNING, "(fd %d) Connection to backend failed with error: %d.", fd, error);
 
+#if !PROXY
 					_M_client->_M_rule->backends.connection_failed(fd);
 
+					// Try another backend.
+					if (_M_client->backend_failed(_M_fd, fd, false)) {
+						_M_client = NULL;
+						return false;
+					}
+#endif
+
 					_M_client->_M_error = http_error::GATEWAY_TIMEOUT;
 					_M_state = PREPARING_ERROR_PAGE_STATE;
 				} else {
@@ -74,17 +115,39 @@ bool fcgi_connection::loop(unsigned fd)
 
 				break;
 			case SENDING_REQUEST_STATE:
+				// Has the client gone away while sending the body?
+				if (!_M_client) {
+					return false;
+				}
+
 				if (!_M_writable) {
 					return true;
 				}
 
-				if (!write(fd, total)) {
+				if (_M_client->_M_payload_in_memory) {
+					count = _M_out.count() + _M_stdin.size();
+
+					ret = send_request(fd, total);
+				} else {
+					count = _M_out.count();
+
+					ret = write(fd, total);
+				}
+
+				if (!ret) {
+#if !PROXY
+					if (_M_client->backend_failed(_M_fd, fd, true)) {
+						_M_client = NULL;
+						return false;
+					}
+#endif
+
 					_M_client->_M_error = http_error::GATEWAY_TIMEOUT;
 					_M_state = PREPARING_ERROR_PAGE_STATE;
 				} else {
 					_M_client->_M_timestamp = now::_M_time;
 
-					if (_M_outp == (off_t) _M_out.count()) {
+					if (_M_outp == count) {
 						if (_M_client->_M_payload_in_memory) {
 							if (!modify(fd, tcp_server::READ)) {
 								_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
@@ -92,9 +155,6 @@ bool fcgi_connection::loop(unsigned fd)
 							} else {
 								_M_out.reset();
 
-								// Reuse client's headers.
-								_M_client->_M_headers.reset();
-
 								_M_client->_M_body.reset();
 
 								_M_state = READING_HEADERS_STATE;
@@ -102,7 +162,7 @@ bool fcgi_connection::loop(unsigned fd)
 						} else {
 							_M_outp = 0;
 
-							_M_state = SENDING_STDIN_STATE;
+							_M_state = (_M_client->_M_relaying_body) ? RELAYING_STDIN_STATE : SENDING_STDIN_STATE;
 						}
 					}
 				}
@@ -113,13 +173,20 @@ bool fcgi_connection::loop(unsigned fd)
 					return true;
 				}
 
-				if (!sendfile(fd, _M_client->_M_tmpfile, _M_client->_M_tmpfilesize, total)) {
+				if (!send_stdin(fd, total)) {
+#if !PROXY
+					if (_M_client->backend_failed(_M_fd, fd, true)) {
+						_M_client = NULL;
+						return false;
+					}
+#endif
+
 					_M_client->_M_error = http_error::GATEWAY_TIMEOUT;
 					_M_state = PREPARING_ERROR_PAGE_STATE;
 				} else {
 					_M_client->_M_timestamp = now::_M_time;
 
-					if (_M_outp == _M_client->_M_tmpfilesize) {
+					if (_M_outp == _M_stdin.size()) {
 						// We don't need the client's temporary file anymore.
 						static_cast<http_server*>(_M_server)->_M_tmpfiles.close(_M_client->_M_tmpfile);
 						_M_client->_M_tmpfile = -1;
@@ -132,9 +199,6 @@ bool fcgi_connection::loop(unsigned fd)
 						} else {
 							_M_out.reset();
 
-							// Reuse client's headers.
-							_M_client->_M_headers.reset();
-
 							_M_client->_M_body.reset();
 
 							_M_state = READING_HEADERS_STATE;
@@ -142,19 +206,120 @@ bool fcgi_connection::loop(unsigned fd)
 					}
 				}
 
+				break;
+			case RELAYING_STDIN_STATE:
+				// Has the client gone away while sending the body?
+				if (!_M_client) {
+					return false;
+				}
+
+				// The client's buffer holds FCGI_STDIN records.
+				if (_M_outp < (off_t) _M_client->_M_body.count()) {
+					if (!_M_writable) {
+						return true;
+					}
+
+					if (!write(fd, _M_client->_M_body, total)) {
+						_M_client->_M_error = http_error::GATEWAY_TIMEOUT;
+						_M_state = PREPARING_ERROR_PAGE_STATE;
+					} else {
+						_M_client->_M_timestamp = now::_M_time;
+					}
+				} else if (!_M_client->relaying_body()) {
+					// The whole stdin stream has been sent.
+					socket_wrapper::uncork(fd);
+
+					if (!modify(fd, tcp_server::READ)) {
+						_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
+						_M_state = PREPARING_ERROR_PAGE_STATE;
+					} else {
+						_M_out.reset();
+
+						_M_client->_M_body.reset();
+
+						_M_state = READING_HEADERS_STATE;
+					}
+				} else {
+					_M_client->_M_body.reset();
+					_M_outp = 0;
+
+					// If the client has stopped reading because the buffer
+					// was full, let it go on.
+					_M_client->resume_body(_M_fd);
+
+					return true;
+				}
+
 				break;
 			case READING_HEADERS_STATE:
 			case READING_BODY_STATE:
-				if (!_M_readable) {
+				// If too much data is waiting to be written to the
+				// temporary file, we will be added to the ready list once
+				// it has progressed.
+				if ((!_M_readable) || ((_M_tmpfile != -1) && (static_cast<http_server*>(_M_server)->_M_tmpfiles.throttled(_M_tmpfile, fd)))) {
 					return true;
 				}
 
 				if (!read_response(fd, total)) {
+#if !PROXY
+					// Nothing received?
+					if ((_M_state == READING_HEADERS_STATE) && (_M_client->_M_error == http_error::GATEWAY_TIMEOUT) && (_M_in.count() == 0) && (_M_out.count() == 0) && (_M_client->backend_failed(_M_fd, fd, true))) {
+						_M_client = NULL;
+						return false;
+					}
+#endif
+
 					_M_state = PREPARING_ERROR_PAGE_STATE;
 				}
+#if !PROXY
+				else if (_M_state != READING_HEADERS_STATE) {
+					_M_client->_M_rule->backends.response_received(fd, status_code());
+				}
+#endif
 
 				break;
+			case STREAMING_BODY_STATE:
+				// Has the client gone away?
+				if (!_M_client) {
+					return false;
+				}
+
+				// If the client has to send what has been read already
+				// first, it will add us to the ready list.
+				if ((!_M_readable) || (_M_client->_M_body.count() >= STREAM_BUFFER_SIZE)) {
+					return true;
+				}
+
+				if (!read_response(fd, total)) {
+					// The headers have been sent already, the client
+					// connection will be closed.
+					_M_reusable = 0;
+					_M_client->_M_keep_alive = 0;
+
+					return false;
+				}
+
+				break;
+			case RESPONSE_STREAMED_STATE:
+				// Don't reuse the connection if the application has sent
+				// more data than expected.
+				if (_M_in.count() > 0) {
+					_M_reusable = 0;
+				}
+
+				return false;
 			case PREPARING_ERROR_PAGE_STATE:
+				// Serve the stale response instead?
+				if ((_M_client->_M_error >= http_error::INTERNAL_SERVER_ERROR) && (_M_client->serve_stale(_M_fd))) {
+					_M_client->_M_in_ready_list = 1;
+					return false;
+				}
+
+				// The rest of the request body won't be read.
+				if (_M_client->relaying_body()) {
+					_M_client->_M_keep_alive = 0;
+				}
+
 				if (!http_error::build_page(_M_client)) {
 					return false;
 				}
@@ -175,20 +340,93 @@ bool fcgi_connection::loop(unsigned fd)
 
 				return false;
 			case RESPONSE_COMPLETED_STATE:
+				status = status_code();
+
+				// Serve the stale response instead?
+				if ((status >= 500) && (_M_client->serve_stale(_M_fd))) {
+					_M_client->_M_in_ready_list = 1;
+					return false;
+				}
+
+				// Has the whole body been received with the headers?
+				if (_M_tmpfile == -1) {
+					_M_client->_M_backend_response_header_size = 0;
+					_M_client->_M_filesize = _M_client->_M_body.count();
+				} else {
+					// Wait for the body to be written to the temporary
+					// file.
+					tmpfiles_cache::write_state state = static_cast<http_server*>(_M_server)->_M_tmpfiles.flush(_M_tmpfile, fd);
+					if (state == tmpfiles_cache::WRITING) {
+						return true;
+					} else if (state == tmpfiles_cache::WRITE_FAILED) {
+						_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
+						_M_state = PREPARING_ERROR_PAGE_STATE;
+
+						break;
+					}
+				}
+
 				if (!prepare_http_response(fd)) {
 					_M_state = PREPARING_ERROR_PAGE_STATE;
 				} else {
-					_M_client->_M_payload_in_memory = 0;
+					// Don't reuse the connection if the application has sent
+					// more data than expected.
+					if (_M_in.count() > 0) {
+						_M_reusable = 0;
+					}
 
 					_M_client->_M_in_ready_list = 1;
 
-					_M_client->_M_tmpfile = _M_tmpfile;
-					_M_tmpfile = -1;
+					if (_M_tmpfile == -1) {
+						_M_client->_M_payload_in_memory = 1;
+					} else {
+						_M_client->_M_payload_in_memory = 0;
+
+						_M_client->_M_tmpfile = _M_tmpfile;
+						_M_tmpfile = -1;
+
+						socket_wrapper::cork(_M_fd);
+					}
+
+					_M_client->cache_response(status);
 
 					_M_client->_M_state = http_connection::SENDING_BACKEND_HEADERS_STATE;
 
-					socket_wrapper::cork(_M_fd);
+					return false;
+				}
+
+				break;
+			case IDLE_STATE:
+				// Has the application closed the connection (or sent
+				// unexpected data)?
+				if (_M_readable) {
+					return false;
+				}
+
+				return true;
+			case SENDING_GET_VALUES_STATE:
+				if (!_M_writable) {
+					return true;
+				}
+
+				if (!write(fd, total)) {
+					return false;
+				}
+
+				if (_M_outp == (off_t) _M_out.count()) {
+					_M_out.reset();
+					_M_outp = 0;
+
+					_M_state = READING_GET_VALUES_RESULT_STATE;
+				}
+
+				break;
+			case READING_GET_VALUES_RESULT_STATE:
+				if (!_M_readable) {
+					return true;
+				}
 
+				if (!read_get_values_result(fd, total)) {
 					return false;
 				}
 
@@ -199,27 +437,173 @@ bool fcgi_connection::loop(unsigned fd)
 	return true;
 }
 
+bool fcgi_connection::send_request(unsigned fd, size_t& total)
+{
+	const char* body = _M_client->_M_in.data() + _M_client->_M_request_header_size;
+
+	socket_wrapper::io_vector io_vector[IOV_MAX];
+	unsigned iovcnt = 0;
+
+	// Begin request and parameters.
+	off_t outp = _M_outp;
+	if (outp < (off_t) _M_out.count()) {
+		io_vector[0].iov_base = _M_out.data() + outp;
+		io_vector[0].iov_len = _M_out.count() - outp;
+
+		iovcnt = 1;
+
+		outp = 0;
+	} else {
+		outp -= _M_out.count();
+	}
+
+	// Headers of the FCGI_STDIN records and pieces of the body.
+	off_t size = _M_stdin.size();
+	while ((outp < size) && (iovcnt < IOV_MAX)) {
+		stdin_framer::piece piece;
+		_M_stdin.get(outp, piece);
+
+		io_vector[iovcnt].iov_base = (piece.framing) ? (void*) piece.framing : (void*) (body + piece.body_offset);
+		io_vector[iovcnt].iov_len = piece.len;
+
+		iovcnt++;
+
+		outp += piece.len;
+	}
+
+	// The vectors begin at the current offset.
+	outp = _M_outp;
+	_M_outp = 0;
+
+	bool ret = writev(fd, io_vector, iovcnt, total);
+
+	_M_outp += outp;
+
+	return ret;
+}
+
+bool fcgi_connection::send_stdin(unsigned fd, size_t& total)
+{
+	stdin_framer::piece piece;
+	_M_stdin.get(_M_outp, piece);
+
+	off_t outp = _M_outp;
+
+	bool ret;
+	if (piece.framing) {
+		socket_wrapper::io_vector io_vector;
+		io_vector.iov_base = (void*) piece.framing;
+		io_vector.iov_len = piece.len;
+
+		_M_outp = 0;
+
+		ret = writev(fd, &io_vector, 1, total);
+
+		_M_outp += outp;
+	} else {
+		// The socket is corked, the header and the piece of the body
+		// leave together.
+		_M_outp = piece.body_offset;
+
+		ret = sendfile(fd, _M_client->_M_tmpfile, piece.body_offset + piece.len, total);
+
+		_M_outp = outp + (_M_outp - piece.body_offset);
+	}
+
+	return ret;
+}
+
+bool fcgi_connection::read_get_values_result(unsigned fd, size_t& total)
+{
+	io_result res;
+
+	do {
+		if ((res = read(fd, _M_in, total)) == IO_ERROR) {
+			return false;
+		} else if (res == IO_NO_DATA_READ) {
+			return true;
+		}
+
+		if (!process(_M_in)) {
+			return false;
+		}
+
+		// If the result has been received...
+		if ((_M_max_conns > 0) || (_M_max_reqs > 0)) {
+			unsigned max = _M_max_conns;
+			if ((max == 0) || ((_M_max_reqs > 0) && (_M_max_reqs < max))) {
+				max = _M_max_reqs;
+			}
+
+			// An idle connection might keep a process of the application
+			// busy.
+			_M_backends->limit_idle_connections(fd, max);
+
+			return false;
+		}
+	} while (res == IO_SUCCESS);
+
+	return true;
+}
+
+bool fcgi_connection::get_values_result(const char* name, unsigned short namelen, const char* value, unsigned short valuelen)
+{
+	unsigned* n;
+	if ((namelen == 14) && (memcmp(name, FCGI_MAX_CONNS, 14) == 0)) {
+		n = &_M_max_conns;
+	} else if ((namelen == 13) && (memcmp(name, FCGI_MAX_REQS, 13) == 0)) {
+		n = &_M_max_reqs;
+	} else {
+		return true;
+	}
+
+	if (number::parse_unsigned(value, valuelen, *n, 1) != number::PARSE_SUCCEEDED) {
+		logger::instance().log(logger::LOG_WARNING, "Invalid value for %.*s received from the FastCGI application.", namelen, name);
+		*n = 0;
+	}
+
+	return true;
+}
+
 bool fcgi_connection::read_response(unsigned fd, size_t& total)
 {
+	// The body is relayed through the client's buffer.
+	buffer* body = &_M_client->_M_body;
+	size_t count = body->count();
+
 	io_result res;
 
 	do {
-		if ((res = read(fd, _M_client->_M_body, total)) == IO_ERROR) {
+		if ((res = read(fd, _M_in, total)) == IO_ERROR) {
 			_M_client->_M_error = http_error::GATEWAY_TIMEOUT;
 
 			return false;
 		} else if (res == IO_NO_DATA_READ) {
-			return true;
+			break;
 		}
 
 		_M_client->_M_timestamp = now::_M_time;
 
-		if (!process(_M_client->_M_body)) {
+		if (!process(_M_in)) {
 			_M_client->_M_error = http_error::BAD_GATEWAY;
 
 			return false;
 		}
-	} while ((res == IO_SUCCESS) && (_M_state != RESPONSE_COMPLETED_STATE));
+	} while ((res == IO_SUCCESS) && \
+	         (_M_state != RESPONSE_COMPLETED_STATE) && \
+	         (_M_state != RESPONSE_STREAMED_STATE) && \
+	         (body->count() < STREAM_BUFFER_SIZE) && \
+	         ((_M_tmpfile == -1) || (!static_cast<http_server*>(_M_server)->_M_tmpfiles.throttled(_M_tmpfile, fd))));
+
+	// If the response is not complete yet, don't wait for the rest of
+	// the body to send the headers.
+	if (_M_state == BUFFERING_BODY_STATE) {
+		return start_streaming(fd);
+	}
+
+	if ((streaming()) && (body->count() > count)) {
+		wake_client();
+	}
 
 	return true;
 }
@@ -268,11 +652,22 @@ bool fcgi_connection::prepare_http_response(unsigned fd)
 		return false;
 	}
 
-	char num[32];
-	int numlen = snprintf(num, sizeof(num), "%lld", _M_client->_M_filesize);
-	if (!headers->add_known_header(http_headers::CONTENT_LENGTH_HEADER, num, numlen, true)) {
-		_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
-		return false;
+	headers->remove_known_header(http_headers::TRANSFER_ENCODING_HEADER);
+
+	if (_M_state == STREAMING_BODY_STATE) {
+		// Otherwise, the Content-Length header of the application (if
+		// any) is kept.
+		if ((_M_chunked) && (!headers->add_known_header(http_headers::TRANSFER_ENCODING_HEADER, "chunked", 7, true))) {
+			_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
+			return false;
+		}
+	} else {
+		char num[32];
+		int numlen = snprintf(num, sizeof(num), "%lld", _M_client->_M_filesize);
+		if (!headers->add_known_header(http_headers::CONTENT_LENGTH_HEADER, num, numlen, true)) {
+			_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
+			return false;
+		}
 	}
 
 	if (!headers->serialize(*out)) {
@@ -288,6 +683,12 @@ bool fcgi_connection::prepare_http_response(unsigned fd)
 bool fcgi_connection::stdout_stream(unsigned short requestId, const void* buf, unsigned short len)
 {
 	if (_M_state == READING_HEADERS_STATE) {
+		// Reuse client's headers (they are kept until the response
+		// arrives, the request might be sent again to another backend).
+		if (_M_out.count() == 0) {
+			_M_client->_M_headers.reset();
+		}
+
 		if (!_M_out.append((const char*) buf, len)) {
 			return false;
 		}
@@ -295,14 +696,28 @@ bool fcgi_connection::stdout_stream(unsigned short requestId, const void* buf, u
 		size_t body_offset;
 		http_headers::parse_result parse_result = _M_client->_M_headers.parse(_M_out.data(), _M_out.count(), body_offset);
 		if (parse_result == http_headers::END_OF_HEADER) {
+			size_t left = _M_out.count() - body_offset;
+
+			// Responses to be cached are saved first.
+			if ((static_cast<http_server*>(_M_server)->_M_stream_backend_responses) && (!cacheable())) {
+				// Keep the body in the client's buffer until the end of
+				// the data received so far.
+				if ((left > 0) && (!_M_client->_M_body.append(_M_out.data() + body_offset, left))) {
+					return false;
+				}
+
+				_M_state = BUFFERING_BODY_STATE;
+
+				return true;
+			}
+
 			// Open a temporary file.
 			if ((_M_tmpfile = static_cast<http_server*>(_M_server)->_M_tmpfiles.open()) < 0) {
 				return false;
 			}
 
-			size_t left = _M_out.count() - body_offset;
 			if (left > 0) {
-				if (!file_wrapper::write(_M_tmpfile, _M_out.data() + body_offset, left)) {
+				if (!static_cast<http_server*>(_M_server)->_M_tmpfiles.write(_M_tmpfile, _M_out.data() + body_offset, left)) {
 					return false;
 				}
 			}
@@ -322,17 +737,184 @@ bool fcgi_connection::stdout_stream(unsigned short requestId, const void* buf, u
 		} else if (parse_result == http_headers::ERROR_NO_MEMORY) {
 			return false;
 		}
-	} else {
-		if (!file_wrapper::write(_M_tmpfile, buf, len)) {
+	} else if (_M_state == READING_BODY_STATE) {
+		if (!static_cast<http_server*>(_M_server)->_M_tmpfiles.write(_M_tmpfile, buf, len)) {
 			return false;
 		}
 
 		_M_client->_M_filesize += len;
+	} else if (_M_state == BUFFERING_BODY_STATE) {
+		return _M_client->_M_body.append((const char*) buf, len);
+	} else if (_M_state == STREAMING_BODY_STATE) {
+		return relay((const char*) buf, len);
+	} else {
+		// Output after the end of the request.
+		_M_reusable = 0;
+	}
+
+	return true;
+}
+
+bool fcgi_connection::end_request(unsigned short requestId, unsigned appStatus, unsigned char protocolStatus)
+{
+	// Has the application ended the request without headers?
+	if (_M_state == READING_HEADERS_STATE) {
+		return false;
+	}
+
+	// The application keeps the connection open only if it has
+	// completed the request.
+	_M_reusable = (protocolStatus == FCGI_REQUEST_COMPLETE);
+
+	if (_M_state == STREAMING_BODY_STATE) {
+		if (_M_chunked) {
+			// Last chunk.
+			if (!_M_client->_M_body.append("0\r\n\r\n", 5)) {
+				return false;
+			}
+		} else if (_M_left > 0) {
+			// The body is shorter than announced, the client connection
+			// will be closed.
+			_M_client->_M_keep_alive = 0;
+		}
+
+		_M_state = RESPONSE_STREAMED_STATE;
+	} else {
+		_M_state = RESPONSE_COMPLETED_STATE;
+	}
+
+	return true;
+}
+
+unsigned fcgi_connection::status_code() const
+{
+	unsigned status_code = 200;
+
+	const char* value;
+	unsigned short valuelen;
+	if ((_M_client->_M_headers.get_value_known_header(http_headers::STATUS_HEADER, value, &valuelen)) && (valuelen >= 3)) {
+		number::parse_unsigned(value, 3, status_code);
+	}
+
+	return status_code;
+}
+
+bool fcgi_connection::cacheable() const
+{
+	off_t size = -1;
+
+	const char* value;
+	unsigned short valuelen;
+	if ((_M_client->_M_headers.get_value_known_header(http_headers::CONTENT_LENGTH_HEADER, value, &valuelen)) && \
+	    (number::parse_off_t(value, valuelen, size, 0) != number::PARSE_SUCCEEDED)) {
+		return false;
+	}
+
+	return _M_client->cacheable(status_code(), size);
+}
+
+bool fcgi_connection::start_streaming(unsigned fd)
+{
+	http_headers* headers = &_M_client->_M_headers;
+
+	unsigned status_code = this->status_code();
+
+	const char* value;
+	unsigned short valuelen;
+
+	if ((_M_client->_M_method == http_method::HEAD) || (status_code < 200) || (status_code == 204) || (status_code == 304)) {
+		// No body.
+		_M_left = 0;
+	} else if (headers->get_value_known_header(http_headers::CONTENT_LENGTH_HEADER, value, &valuelen)) {
+		if (number::parse_off_t(value, valuelen, _M_left, 0) != number::PARSE_SUCCEEDED) {
+			logger::instance().log(logger::LOG_DEBUG, "[fcgi_connection::start_streaming] (fd %d) Invalid body size.", fd);
+
+			_M_client->_M_error = http_error::BAD_GATEWAY;
+			return false;
+		}
+	} else if ((_M_client->_M_major_number == 1) && (_M_client->_M_minor_number == 1)) {
+		_M_chunked = 1;
+	} else {
+		// The end of the body will be signaled by closing the
+		// connection.
+		_M_client->_M_keep_alive = 0;
 	}
 
+	_M_state = STREAMING_BODY_STATE;
+
+	if (!prepare_http_response(fd)) {
+		return false;
+	}
+
+	// Relay what has been buffered.
+	_M_out.swap(_M_client->_M_body);
+	_M_client->_M_body.reset();
+
+	_M_client->_M_filesize = 0;
+
+	if (!relay(_M_out.data(), _M_out.count())) {
+		_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return false;
+	}
+
+	_M_out.reset();
+
+	_M_client->_M_payload_in_memory = 0;
+
+	// The response won't be stored, the requests waiting for it are
+	// sent to the backend.
+	_M_client->end_fetch();
+
+	_M_client->_M_streaming = 1;
+
+	_M_client->_M_state = http_connection::SENDING_BACKEND_HEADERS_STATE;
+
+	wake_client();
+
 	return true;
 }
 
+bool fcgi_connection::relay(const char* buf, size_t len)
+{
+	if (_M_left != -1) {
+		// Discard what goes beyond the announced size.
+		if ((off_t) len > _M_left) {
+			len = _M_left;
+		}
+
+		_M_left -= len;
+	}
+
+	if (len == 0) {
+		return true;
+	}
+
+	buffer* body = &_M_client->_M_body;
+
+	if (_M_chunked) {
+		if ((!body->format("%lx\r\n", (unsigned long) len)) || (!body->append(buf, len)) || (!body->append("\r\n", 2))) {
+			return false;
+		}
+	} else if (!body->append(buf, len)) {
+		return false;
+	}
+
+	_M_client->_M_filesize += len;
+
+	return true;
+}
+
+void fcgi_connection::wake_client()
+{
+	// If the client cannot write, it will receive an event.
+	if ((!_M_client->_M_in_ready_list) && (_M_client->_M_writable)) {
+		http_server* server = static_cast<http_server*>(_M_server);
+
+		_M_client->_M_in_ready_list = 1;
+		server->_M_ready_list[server->_M_nready++] = _M_fd;
+	}
+}
+
 const char* fcgi_connection::state_to_string(unsigned state)
 {
 	switch (state) {
@@ -350,6 +932,20 @@ const char* fcgi_connection::state_to_string(unsigned state)
 			return "PREPARING_ERROR_PAGE_STATE";
 		case RESPONSE_COMPLETED_STATE:
 			return "RESPONSE_COMPLETED_STATE";
+		case IDLE_STATE:
+			return "IDLE_STATE";
+		case SENDING_GET_VALUES_STATE:
+			return "SENDING_GET_VALUES_STATE";
+		case READING_GET_VALUES_RESULT_STATE:
+			return "READING_GET_VALUES_RESULT_STATE";
+		case RELAYING_STDIN_STATE:
+			return "RELAYING_STDIN_STATE";
+		case BUFFERING_BODY_STATE:
+			return "BUFFERING_BODY_STATE";
+		case STREAMING_BODY_STATE:
+			return "STREAMING_BODY_STATE";
+		case RESPONSE_STREAMED_STATE:
+			return "RESPONSE_STREAMED_STATE";
 		default:
 			return "(unknown)";
 	}
@@ -9,6 +9,10 @@
 
 struct fcgi_connection : public tcp_connection,
                          public fastcgi {
+	// The output of the application is not read while the client has
+	// more than this to send.
+	static const size_t STREAM_BUFFER_SIZE;
+
 	// FastCGI states.
 	static const unsigned char CONNECTING_STATE;
 	static const unsigned char SENDING_REQUEST_STATE;
@@ -17,6 +21,13 @@ struct fcgi_connection : public tcp_connection,
 	static const unsigned char READING_BODY_STATE;
 	static const unsigned char PREPARING_ERROR_PAGE_STATE;
 	static const unsigned char RESPONSE_COMPLETED_STATE;
+	static const unsigned char IDLE_STATE;
+	static const unsigned char SENDING_GET_VALUES_STATE;
+	static const unsigned char READING_GET_VALUES_RESULT_STATE;
+	static const unsigned char RELAYING_STDIN_STATE;
+	static const unsigned char BUFFERING_BODY_STATE;
+	static const unsigned char STREAMING_BODY_STATE;
+	static const unsigned char RESPONSE_STREAMED_STATE;
 
 	int _M_fd;
 
@@ -24,8 +35,27 @@ struct fcgi_connection : public tcp_connection,
 
 	http_connection* _M_client;
 
+	// Pool the connection belongs to while it is idle (or backends of
+	// the application whose limits are being queried).
+	backend_list* _M_backends;
+
+	// Maximum number of connections / requests accepted by the
+	// application (0: unknown).
+	unsigned _M_max_conns;
+	unsigned _M_max_reqs;
+
+	// Bytes of the body still to be relayed (-1: unknown).
+	off_t _M_left;
+
+	// FCGI_STDIN records of the request body (in memory or in the
+	// client's temporary file).
+	stdin_framer _M_stdin;
+
 	unsigned _M_state:4;
 
+	unsigned _M_reusable:1; // Can the connection be reused once the response has been read?
+	unsigned _M_chunked:1; // Relaying the body as chunks?
+
 	// Constructor.
 	fcgi_connection();
 
@@ -41,12 +71,39 @@ struct fcgi_connection : public tcp_connection,
 	// Loop.
 	virtual bool loop(unsigned fd);
 
+	// Send the request with the body in memory.
+	bool send_request(unsigned fd, size_t& total);
+
+	// Send the body from the client's temporary file.
+	bool send_stdin(unsigned fd, size_t& total);
+
 	// Read response.
 	bool read_response(unsigned fd, size_t& total);
 
 	// Prepare HTTP response.
 	bool prepare_http_response(unsigned fd);
 
+	// Status code of the response (from the Status header).
+	unsigned status_code() const;
+
+	// Will the response be stored in the response cache?
+	bool cacheable() const;
+
+	// Send the headers to the client and relay the body as it arrives.
+	bool start_streaming(unsigned fd);
+
+	// Relay (part of) the body.
+	bool relay(const char* buf, size_t len);
+
+	// Add the client to the ready list.
+	void wake_client();
+
+	// Is the response being relayed?
+	bool streaming() const;
+
+	// Read the result of the FCGI_GET_VALUES request.
+	bool read_get_values_result(unsigned fd, size_t& total);
+
 	virtual bool get_values_result(const char* name, unsigned short namelen, const char* value, unsigned short valuelen);
 
 	virtual bool stdout_stream(unsigned short requestId, const void* buf, unsigned short len);
@@ -67,9 +124,9 @@ inline void fcgi_connection::free()
 	tcp_connection::free();
 }
 
-inline bool fcgi_connection::get_values_result(const char* name, unsigned short namelen, const char* value, unsigned short valuelen)
+inline bool fcgi_connection::streaming() const
 {
-	return true;
+	return ((_M_state == STREAMING_BODY_STATE) || (_M_state == RESPONSE_STREAMED_STATE));
 }
 
 inline bool fcgi_connection::stderr_stream(unsigned short requestId, const void* buf, unsigned short len)
@@ -77,10 +134,4 @@ inline bool fcgi_connection::stderr_stream(unsigned short requestId, const void*
 	return true;
 }
 
-inline bool fcgi_connection::end_request(unsigned short requestId, unsigned appStatus, unsigned char protocolStatus)
-{
-	_M_state = RESPONSE_COMPLETED_STATE;
-	return true;
-}
-
 #endif // FCGI_CONNECTION_H
@@ -3,8 +3,9 @@
 #include "filelist.h"
 
 const size_t filelist::FILE_ALLOC = 64;
+const size_t filelist::NAMES_BUFFER_INCREMENT = 4 * 1024;
 
-filelist::filelist()
+filelist::filelist() : _M_names(NAMES_BUFFER_INCREMENT)
 {
 	_M_files = NULL;
 	_M_index = NULL;
@@ -31,6 +32,8 @@ void filelist::free()
 	_M_size = 0;
 	_M_used = 0;
 
+	_M_names.free();
+
 	_M_sort_criteria = SORT_BY_NAME;
 	_M_sort_order = ASCENDING;
 }
@@ -43,8 +46,15 @@ bool filelist::insert(const char* name, unsigned short namelen, unsigned short u
 
 	file* file = &(_M_files[_M_used]);
 
-	memcpy(file->name, name, namelen);
-	file->name[namelen] = 0;
+	file->name = _M_names.count();
+
+	if (!_M_names.append(name, namelen)) {
+		return false;
+	}
+
+	if (!_M_names.append((char) 0)) {
+		return false;
+	}
 
 	file->namelen = namelen;
 	file->utf8len = utf8len;
@@ -52,99 +62,151 @@ bool filelist::insert(const char* name, unsigned short namelen, unsigned short u
 	file->size = size;
 	file->mtime = mtime;
 
-	size_t position = search(name, namelen, size, mtime);
+	_M_index[_M_used] = _M_used;
+	_M_used++;
+
+	return true;
+}
+
+bool filelist::sort()
+{
+	if (_M_used < 2) {
+		return true;
+	}
+
+	// The files are sorted by merge sort over an array of compact keys
+	// (the file records are only touched when two keys are equal).
+	key* keys = (key*) malloc(2 * _M_used * sizeof(key));
+	if (!keys) {
+		return false;
+	}
+
+	key* src = keys;
+	key* dest = keys + _M_used;
+
+	for (unsigned i = 0; i < _M_used; i++) {
+		build_key(i, src[i]);
+	}
+
+	for (size_t width = 1; width < _M_used; width *= 2) {
+		for (size_t left = 0; left < _M_used; left += 2 * width) {
+			size_t middle = left + width;
+			if (middle > _M_used) {
+				middle = _M_used;
+			}
+
+			size_t right = middle + width;
+			if (right > _M_used) {
+				right = _M_used;
+			}
+
+			size_t i = left;
+			size_t j = middle;
+			size_t k = left;
+
+			while ((i < middle) && (j < right)) {
+				// Keep the insertion order of equal keys.
+				if (compare(src[j], src[i]) < 0) {
+					dest[k++] = src[j++];
+				} else {
+					dest[k++] = src[i++];
+				}
+			}
+
+			while (i < middle) {
+				dest[k++] = src[i++];
+			}
+
+			while (j < right) {
+				dest[k++] = src[j++];
+			}
+		}
+
+		key* tmp = src;
+		src = dest;
+		dest = tmp;
+	}
 
-	if (position < _M_used) {
-		memmove(&(_M_index[position + 1]), &(_M_index[position]), (_M_used - position) * sizeof(unsigned));
+	for (unsigned i = 0; i < _M_used; i++) {
+		_M_index[i] = src[i].idx;
 	}
 
-	_M_index[position] = _M_used++;
+	::free(keys);
 
 	return true;
 }
 
-size_t filelist::search(const char* name, unsigned short namelen, off_t size, time_t mtime) const
+void filelist::build_key(unsigned idx, key& key) const
 {
-	int i = 0;
-	int j = _M_used - 1;
-
-	while (i <= j) {
-		int pivot = (i + j) / 2;
-		const file* file = &(_M_files[_M_index[pivot]]);
-
-		int ret;
-
-		switch (_M_sort_criteria) {
-			case SORT_BY_NAME:
-				ret = strcmp(name, file->name);
-				break;
-			case SORT_BY_NAMELEN:
-				if (namelen < file->namelen) {
-					ret = -1;
-				} else if (namelen == file->namelen) {
-					ret = 0;
-				} else {
-					ret = 1;
-				}
+	const file* file = &(_M_files[idx]);
 
-				break;
-			case SORT_BY_SIZE:
-				if (size < file->size) {
-					ret = -1;
-				} else if (size == file->size) {
-					ret = 0;
-				} else {
-					ret = 1;
-				}
+	switch (_M_sort_criteria) {
+		case SORT_BY_NAME:
+			{
+				// First 8 bytes of the name (big endian).
+				const unsigned char* name = (const unsigned char*) _M_names.data() + file->name;
 
-				break;
-			default:
-				// SORT_BY_DATE
-				if (mtime < file->mtime) {
-					ret = -1;
-				} else if (mtime == file->mtime) {
-					ret = 0;
-				} else {
-					ret = 1;
+				key.value = 0;
+				for (unsigned i = 0; i < 8; i++) {
+					key.value <<= 8;
+
+					if (i < file->namelen) {
+						key.value |= name[i];
+					}
 				}
-		}
+			}
+
+			break;
+		case SORT_BY_NAMELEN:
+			key.value = file->namelen;
+			break;
+		case SORT_BY_SIZE:
+			key.value = file->size;
+			break;
+		default:
+			// SORT_BY_DATE
+			// Flip the sign bit, so negative times are sorted first.
+			key.value = (unsigned long long) (long long) file->mtime ^ (1ULL << 63);
+	}
 
-		ret *= (int) _M_sort_order;
+	key.idx = idx;
+}
 
-		if (ret < 0) {
-			j = pivot - 1;
-		} else if (ret == 0) {
-			return (size_t) pivot + 1;
-		} else {
-			i = pivot + 1;
-		}
+int filelist::compare(const key& k1, const key& k2) const
+{
+	int ret;
+
+	if (k1.value < k2.value) {
+		ret = -1;
+	} else if (k1.value > k2.value) {
+		ret = 1;
+	} else if ((_M_sort_criteria == SORT_BY_NAME) && (_M_files[k1.idx].namelen >= 8) && (_M_files[k2.idx].namelen >= 8)) {
+		ret = strcmp(_M_names.data() + _M_files[k1.idx].name + 8, _M_names.data() + _M_files[k2.idx].name + 8);
+	} else {
+		ret = 0;
 	}
 
-	return (size_t) i;
+	return ret * (int) _M_sort_order;
 }
 
 bool filelist::allocate()
 {
 	if (_M_used == _M_size) {
-		size_t size = _M_size + FILE_ALLOC;
-		unsigned* index = (unsigned*) malloc(size * sizeof(unsigned));
+		size_t size = (_M_size == 0) ? FILE_ALLOC : 2 * _M_size;
+
+		unsigned* index = (unsigned*) realloc(_M_index, size * sizeof(unsigned));
 		if (!index) {
 			return false;
 		}
 
+		_M_index = index;
+
 		file* files = (struct file*) realloc(_M_files, size * sizeof(struct file));
 		if (!files) {
-			::free(index);
 			return false;
 		}
 
-		if (_M_index) {
-			memcpy(index, _M_index, _M_used * sizeof(unsigned));
-			::free(_M_index);
-		}
-
 		_M_files = files;
-		_M_index = index;
 
 		_M_size = size;
 	}
@@ -2,6 +2,7 @@
 #define FILELIST_H
 
 #include <sys/types.h>
+#include "string/buffer.h"
 
 class filelist {
 	public:
@@ -18,7 +19,7 @@ class filelist {
 		};
 
 		struct file {
-			char name[256];
+			unsigned name; // Offset of the name in the names' arena.
 			unsigned short namelen;
 			unsigned short utf8len;
 			off_t size;
@@ -46,11 +47,21 @@ class filelist {
 		// Insert file.
 		bool insert(const char* name, unsigned short namelen, unsigned short utf8len, off_t size, time_t mtime);
 
+		// Sort (has to be called once all the files have been inserted).
+		bool sort();
+
+		// Get number of files.
+		size_t count() const;
+
 		// Get file.
 		const file* get_file(unsigned idx) const;
 
+		// Get name of the file.
+		const char* get_name(const file* file) const;
+
 	protected:
 		static const size_t FILE_ALLOC;
+		static const size_t NAMES_BUFFER_INCREMENT;
 
 		file* _M_files;
 		unsigned* _M_index;
@@ -58,10 +69,21 @@ class filelist {
 		size_t _M_size;
 		size_t _M_used;
 
+		buffer _M_names;
+
 		sort_criteria _M_sort_criteria;
 		sort_order _M_sort_order;
 
-		size_t search(const char* name, unsigned short namelen, off_t size, time_t mtime) const;
+		struct key {
+			unsigned long long value;
+			unsigned idx;
+		};
+
+		// Build sort key.
+		void build_key(unsigned idx, key& key) const;
+
+		// Compare keys.
+		int compare(const key& k1, const key& k2) const;
 
 		bool allocate();
 };
@@ -74,6 +96,8 @@ inline filelist::~filelist()
 inline void filelist::reset()
 {
 	_M_used = 0;
+
+	_M_names.reset();
 }
 
 inline bool filelist::set_sort_criteria(sort_criteria sort_criteria)
@@ -98,6 +122,11 @@ inline bool filelist::set_sort_order(sort_order sort_order)
 	return true;
 }
 
+inline size_t filelist::count() const
+{
+	return _M_used;
+}
+
 inline const filelist::file* filelist::get_file(unsigned idx) const
 {
 	if (idx >= _M_used) {
@@ -107,4 +136,9 @@ inline const filelist::file* filelist::get_file(unsigned idx) const
 	return &(_M_files[_M_index[idx]]);
 }
 
+inline const char* filelist::get_name(const file* file) const
+{
+	return _M_names.data() + file->name;
+}
+
 #endif // FILELIST_H
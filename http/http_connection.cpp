@@ -2,8 +2,12 @@
 #include <string.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
+#include <netdb.h>
+#include <new>
 #include "http_connection.h"
 #include "http/http_server.h"
 #include "http/range_parser.h"
@@ -32,6 +36,8 @@ const size_t http_connection::PATH_MEAN_SIZE = 128;
 const size_t http_connection::QUERY_STRING_MEAN_SIZE = 64;
 const size_t http_connection::BODY_MEAN_SIZE = 2 * 1024;
 
+const size_t http_connection::MAX_BUFFERED_BODY = 64 * 1024;
+
 const unsigned char http_connection::BEGIN_REQUEST_STATE = 0;
 const unsigned char http_connection::READING_HEADERS_STATE = 1;
 const unsigned char http_connection::PROCESSING_REQUEST_STATE = 2;
@@ -48,26 +54,328 @@ const unsigned char http_connection::SENDING_MULTIPART_FOOTER_STATE = 12;
 const unsigned char http_connection::SENDING_BACKEND_HEADERS_STATE = 13;
 const unsigned char http_connection::SENDING_BACKEND_BODY_STATE = 14;
 const unsigned char http_connection::REQUEST_COMPLETED_STATE = 15;
+const unsigned char http_connection::SENDING_CHUNKED_LISTING_STATE = 16;
+const unsigned char http_connection::WAITING_FOR_FILESYSTEM_STATE = 17;
+const unsigned char http_connection::PROCESSING_LOCAL_REQUEST_STATE = 18;
+const unsigned char http_connection::SENDING_BACKEND_STREAM_STATE = 19;
+const unsigned char http_connection::RESOLVING_STATE = 20;
+const unsigned char http_connection::QUEUED_STATE = 21;
+const unsigned char http_connection::WAITING_FOR_RESPONSE_STATE = 22;
+const unsigned char http_connection::PROCESSING_COLLAPSED_REQUEST_STATE = 23;
 
 const unsigned short http_connection::REQUEST_ID = 1;
 
+const off_t http_connection::READAHEAD_WINDOW = 2 * 1024 * 1024;
+
 url_parser http_connection::_M_url;
 struct tm http_connection::_M_last_modified;
 rulelist::rule http_connection::_M_http_rule;
 
+struct http_connection::filesystem_job : public worker_pool::job {
+	enum operation {
+		LOOKUP,       // stat() + search index file + open().
+		LOAD_LISTING, // Read directory.
+		PREFETCH      // Read ahead a window of a large file.
+	};
+
+	operation op;
+
+	http_connection* client; // NULL if the client has gone away.
+	unsigned fd;
+
+	// LOOKUP.
+	char path[PATH_MAX + 1];
+	size_t pathlen;
+
+	const index_file_finder* index_files;
+	bool open_file;
+	off_t large_file_size;
+
+	bool found;
+	struct stat buf;
+	int file;
+
+	// LOAD_LISTING.
+	const dirlisting* dir_listing;
+	dirlisting::stream* listing;
+	bool loaded;
+
+	// PREFETCH (offsets in 'in_fd').
+	int in_fd;
+	site_bundle* bundle; // Bundle 'in_fd' belongs to (if any).
+	off_t from;
+	off_t to;
+	off_t drop_from; // Drop [drop_from, drop_to) from the page cache.
+	off_t drop_to;
+
+	off_t cached; // Bytes which were already in the page cache.
+	off_t read; // Bytes which have been read from disk.
+
+	// Constructor.
+	filesystem_job(operation op, http_connection* client, unsigned fd);
+
+	// Destructor.
+	~filesystem_job();
+
+	// Run (called from a worker thread).
+	void run();
+
+	// Completed (called from the event loop).
+	void completed();
+};
+
+http_connection::filesystem_job::filesystem_job(operation op, http_connection* client, unsigned fd)
+{
+	this->op = op;
+
+	this->client = client;
+	this->fd = fd;
+
+	pathlen = 0;
+
+	index_files = NULL;
+	open_file = false;
+	large_file_size = 0;
+
+	found = false;
+	file = -1;
+
+	dir_listing = NULL;
+	listing = NULL;
+	loaded = false;
+
+	in_fd = -1;
+	bundle = NULL;
+	from = 0;
+	to = 0;
+	drop_from = 0;
+	drop_to = 0;
+
+	cached = 0;
+	read = 0;
+}
+
+http_connection::filesystem_job::~filesystem_job()
+{
+	if (file != -1) {
+		::close(file);
+	}
+
+	if (listing) {
+		delete listing;
+	}
+
+	if (bundle) {
+		bundle->release();
+	}
+}
+
+void http_connection::filesystem_job::run()
+{
+	// The logger is not thread-safe, errors are reported by completed().
+	if (op == LOOKUP) {
+		if (stat(path, &buf) < 0) {
+			return;
+		}
+
+		found = true;
+
+		// If the URI points to a directory...
+		if (S_ISDIR(buf.st_mode)) {
+			// If the directory name doesn't end with '/'...
+			if (path[pathlen - 1] != '/') {
+				return;
+			}
+
+			// Search index file.
+			if (!index_files->search(path, pathlen, &buf)) {
+				return;
+			}
+		}
+
+		if ((open_file) && ((S_ISREG(buf.st_mode)) || (S_ISLNK(buf.st_mode)))) {
+			file = file_wrapper::open_silently(path, O_RDONLY);
+
+#if HAVE_POSIX_FADVISE
+			if ((file != -1) && (large_file_size > 0) && (buf.st_size >= large_file_size)) {
+				posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+			}
+#endif
+		}
+	} else if (op == LOAD_LISTING) {
+		loaded = dir_listing->load(listing->dir.data(), listing->dir.count(), *listing);
+	} else {
+#if HAVE_POSIX_FADVISE
+		if (drop_to > drop_from) {
+			posix_fadvise(in_fd, drop_from, drop_to - drop_from, POSIX_FADV_DONTNEED);
+		}
+#endif
+
+		static const size_t page_size = sysconf(_SC_PAGESIZE);
+
+		off_t offset = from - (from % page_size);
+		size_t npages = (to - offset + page_size - 1) / page_size;
+
+		unsigned char* vec = NULL;
+
+#if HAVE_MINCORE
+		// Which pages are in the page cache already? (the mapping is never
+		// touched, so truncating the file doesn't raise SIGBUS).
+		void* addr = mmap(NULL, to - offset, PROT_READ, MAP_SHARED, in_fd, offset);
+		if (addr != MAP_FAILED) {
+			if ((vec = (unsigned char*) malloc(npages)) != NULL) {
+				if (mincore(addr, to - offset, vec) < 0) {
+					::free(vec);
+					vec = NULL;
+				}
+			}
+
+			munmap(addr, to - offset);
+		}
+#endif // HAVE_MINCORE
+
+		// Read the pages which are not in the page cache, so sendfile()
+		// doesn't block in the event loop.
+		char buf[64 * 1024];
+
+		for (size_t i = 0; i < npages; i++) {
+			off_t start = offset + (off_t) i * page_size;
+			off_t end = start + page_size;
+			if (start < from) {
+				start = from;
+			}
+
+			if (end > to) {
+				end = to;
+			}
+
+			if ((vec) && (vec[i] & 1)) {
+				cached += (end - start);
+				continue;
+			}
+
+			// Read the run of pages which are not in the page cache.
+			size_t j = i + 1;
+			while ((j < npages) && ((!vec) || (!(vec[j] & 1))) && ((j - i) * page_size < sizeof(buf))) {
+				j++;
+			}
+
+			end = offset + (off_t) j * page_size;
+			if (end > to) {
+				end = to;
+			}
+
+			ssize_t ret = pread(in_fd, buf, end - start, start);
+			if (ret <= 0) {
+				break;
+			}
+
+			read += ret;
+
+			i = j - 1;
+		}
+
+		if (vec) {
+			::free(vec);
+		}
+	}
+}
+
+void http_connection::filesystem_job::completed()
+{
+	if (client) {
+		client->filesystem_job_completed(this);
+	}
+}
+
+#if PROXY
+struct http_connection::resolve_job : public worker_pool::job {
+	http_connection* client; // NULL if the client has gone away.
+	unsigned fd;
+
+	dnscache* cache;
+
+	char host[NI_MAXHOST];
+	size_t hostlen;
+	unsigned short port;
+
+	bool success;
+	resolver::address addr;
+	time_t ttl;
+
+	// Run (called from a worker thread).
+	void run();
+
+	// Completed (called from the event loop).
+	void completed();
+};
+
+void http_connection::resolve_job::run()
+{
+	success = resolver::resolve(host, port, addr, ttl);
+}
+
+void http_connection::resolve_job::completed()
+{
+	// The address is cached even if the client has gone away.
+	if ((success) && (!cache->add(host, hostlen, addr, ttl))) {
+		success = false;
+	}
+
+	if (client) {
+		client->resolved(fd, success);
+	}
+}
+#endif // PROXY
+
 http_connection::http_connection()
  : _M_host(HOST_MEAN_SIZE),
    _M_path(PATH_MEAN_SIZE),
    _M_decoded_path(PATH_MEAN_SIZE),
    _M_query_string(QUERY_STRING_MEAN_SIZE),
+   _M_cache_key(PATH_MEAN_SIZE),
    _M_body(BODY_MEAN_SIZE)
 {
 	_M_fd = -1;
 
 	_M_tmpfile = -1;
 
+	_M_payload_memory = 0;
+
+#if HAVE_SPLICE
+	_M_pipe[0] = -1;
+	_M_pipe[1] = -1;
+	_M_piped = 0;
+#endif // HAVE_SPLICE
+
+	_M_listing = NULL;
+
+	_M_fs_job = NULL;
+
+#if PROXY
+	_M_resolve_job = NULL;
+#endif
+
+	_M_resume_state = WAITING_FOR_BACKEND_STATE;
+
+	_M_bundle = NULL;
+	_M_bundle_entry = NULL;
+	_M_file_offset = 0;
+
 	_M_vhost = NULL;
 
+	_M_attempts = 0;
+
+	_M_hedge_fd = -1;
+	_M_hedge_time = 0;
+	_M_hedge_index = 0;
+
+	_M_queue_pos = 0;
+
+	_M_cache_entry = NULL;
+	_M_fetch = NULL;
+	_M_waiter = 0;
+
 	_M_headers.set_max_line_length(HEADER_MAX_LINE_LEN);
 
 	_M_request_body_size = 0;
@@ -78,6 +386,14 @@ http_connection::http_connection()
 	_M_substate = 0;
 
 	_M_keep_alive = 0;
+
+	_M_streaming = 0;
+
+	_M_relaying_body = 0;
+
+	_M_cached = 0;
+	_M_store = 0;
+	_M_revalidating = 0;
 }
 
 void http_connection::reset()
@@ -88,19 +404,112 @@ void http_connection::reset()
 
 	_M_in_ready_list = 0;
 
+	// If there is a filesystem job running, detach it.
+	if (_M_fs_job) {
+		// The job might be reading ahead the file, it will close it.
+		if ((_M_fs_job->op == filesystem_job::PREFETCH) && (_M_fd != -1)) {
+			if (_M_bundle) {
+				_M_fs_job->bundle = _M_bundle;
+				_M_bundle = NULL;
+			} else {
+				_M_fs_job->file = _M_fd;
+			}
+
+			_M_fd = -1;
+		}
+
+		_M_fs_job->client = NULL;
+		_M_fs_job = NULL;
+	}
+
+#if PROXY
+	if (_M_resolve_job) {
+		_M_resolve_job->client = NULL;
+		_M_resolve_job = NULL;
+	}
+#endif
+
+	// The bundle's file descriptor is shared.
+	if (_M_bundle) {
+		_M_bundle->release();
+		_M_bundle = NULL;
+
+		_M_fd = -1;
+	}
+
+	_M_bundle_entry = NULL;
+	_M_file_offset = 0;
+
+	_M_large_file = 0;
+	_M_gzip = 0;
+
+#if !PROXY
+	cancel_hedge();
+
+	// The client has gone away while waiting for a backend?
+	if (_M_state == QUEUED_STATE) {
+		_M_rule->backends.cancel_queued(_M_queue_pos);
+		static_cast<http_server*>(_M_server)->_M_queued_requests--;
+	}
+#endif
+
+	_M_attempts = 0;
+
 	if (_M_fd != -1) {
-		if ((_M_state != WAITING_FOR_BACKEND_STATE) && (_M_state != SENDING_BACKEND_HEADERS_STATE) && (_M_state != SENDING_BACKEND_BODY_STATE)) {
+		if ((_M_streaming) || (relaying_body())) {
+			// The backend is still sending the response (or receiving
+			// the request body), let the connection to the backend be
+			// closed.
+			detach_backend();
+		} else if ((_M_state != WAITING_FOR_BACKEND_STATE) && (_M_state != SENDING_BACKEND_HEADERS_STATE) && (_M_state != SENDING_BACKEND_BODY_STATE)) {
 			file_wrapper::close(_M_fd);
 		}
+#if !PROXY
+		else {
+			_M_rule->backends.request_completed(_M_fd);
+		}
+#endif
 
 		_M_fd = -1;
 	}
 
+	_M_streaming = 0;
+
+	_M_relaying_body = 0;
+
+	// The client has gone away while waiting for the response to an
+	// identical request?
+	if (_M_state == WAITING_FOR_RESPONSE_STATE) {
+		static_cast<http_server*>(_M_server)->_M_cache.cancel_wait(_M_fetch, _M_waiter);
+		_M_fetch = NULL;
+	} else {
+		end_fetch();
+	}
+
+	// If the response has been sent from the cache's file, it belongs
+	// to the cache.
+	release_cache_entry();
+
+	_M_store = 0;
+
+#if HAVE_SPLICE
+	// Pipes are only kept while a response is being relayed.
+	if (_M_pipe[0] != -1) {
+		splicer::close_pipe(_M_pipe);
+		_M_piped = 0;
+	}
+#endif // HAVE_SPLICE
+
 	if (_M_tmpfile != -1) {
 		static_cast<http_server*>(_M_server)->_M_tmpfiles.close(_M_tmpfile);
 		_M_tmpfile = -1;
 	}
 
+	if (_M_payload_memory > 0) {
+		static_cast<http_server*>(_M_server)->_M_payload_memory -= _M_payload_memory;
+		_M_payload_memory = 0;
+	}
+
 	_M_vhost = NULL;
 
 	_M_headers.reset();
@@ -129,12 +538,22 @@ void http_connection::reset()
 		_M_query_string.reset();
 	}
 
+	if (_M_cache_key.size() > PATH_MEAN_SIZE) {
+		_M_cache_key.free();
+	} else {
+		_M_cache_key.reset();
+	}
+
 	if (_M_body.size() > BODY_MEAN_SIZE) {
 		_M_body.free();
 	} else {
 		_M_body.reset();
 	}
 
+	if ((_M_listing) && (_M_listing->count() >= dirlisting::STREAMING_MIN_ENTRIES)) {
+		_M_listing->free();
+	}
+
 	if (_M_ranges.count() > 2) {
 		_M_ranges.free();
 	} else {
@@ -181,7 +600,17 @@ bool http_connection::loop(unsigned fd)
 
 				break;
 			case PROCESSING_REQUEST_STATE:
-				if (!process_request(fd)) {
+			case PROCESSING_LOCAL_REQUEST_STATE:
+			case PROCESSING_COLLAPSED_REQUEST_STATE:
+				if (_M_state == PROCESSING_REQUEST_STATE) {
+					ret = process_request(fd);
+				} else if (_M_state == PROCESSING_LOCAL_REQUEST_STATE) {
+					ret = process_local_request(fd);
+				} else {
+					ret = process_collapsed_request(fd);
+				}
+
+				if (!ret) {
 					return false;
 				}
 
@@ -190,7 +619,7 @@ bool http_connection::loop(unsigned fd)
 
 					_M_state = PREPARING_ERROR_PAGE_STATE;
 				} else {
-					if ((_M_state != PREPARING_HTTP_REQUEST_STATE) && (_M_state != READING_BODY_STATE) && (_M_state != READING_CHUNKED_BODY_STATE)) {
+					if ((_M_state != PREPARING_HTTP_REQUEST_STATE) && (_M_state != READING_BODY_STATE) && (_M_state != READING_CHUNKED_BODY_STATE) && (_M_state != WAITING_FOR_FILESYSTEM_STATE) && (_M_state != PROCESSING_LOCAL_REQUEST_STATE) && (_M_state != RESOLVING_STATE) && (_M_state != QUEUED_STATE) && (_M_state != WAITING_FOR_RESPONSE_STATE)) {
 						if (!modify(fd, tcp_server::WRITE)) {
 							return false;
 						}
@@ -201,7 +630,10 @@ bool http_connection::loop(unsigned fd)
 
 				break;
 			case READING_BODY_STATE:
-				if (!_M_readable) {
+				// If the buffer is full, the backend will add us to the
+				// ready list once it has sent it (the same goes for the
+				// writes to the temporary file).
+				if ((!_M_readable) || ((_M_relaying_body) && (_M_body.count() >= MAX_BUFFERED_BODY)) || (spill_throttled(fd))) {
 					return true;
 				}
 
@@ -211,7 +643,7 @@ bool http_connection::loop(unsigned fd)
 
 				break;
 			case READING_CHUNKED_BODY_STATE:
-				if (!_M_readable) {
+				if ((!_M_readable) || ((_M_relaying_body) && (_M_body.count() >= MAX_BUFFERED_BODY)) || (spill_throttled(fd))) {
 					return true;
 				}
 
@@ -221,17 +653,34 @@ bool http_connection::loop(unsigned fd)
 
 				break;
 			case PREPARING_HTTP_REQUEST_STATE:
-				if (!prepare_http_request(fd)) {
+				// Wait for the body to be written to the temporary file.
+				if (_M_tmpfile != -1) {
+					tmpfiles_cache::write_state state = static_cast<http_server*>(_M_server)->_M_tmpfiles.flush(_M_tmpfile, fd);
+					if (state == tmpfiles_cache::WRITING) {
+						return true;
+					} else if (state == tmpfiles_cache::WRITE_FAILED) {
+						_M_error = http_error::INTERNAL_SERVER_ERROR;
+						_M_state = PREPARING_ERROR_PAGE_STATE;
+
+						break;
+					}
+				}
+
+				if ((!prepare_http_request(fd)) || (_M_error != http_error::OK)) {
 					_M_state = PREPARING_ERROR_PAGE_STATE;
-				} else {
+				} else if ((_M_state != RESOLVING_STATE) && (_M_state != QUEUED_STATE)) {
 					_M_state = WAITING_FOR_BACKEND_STATE;
 				}
 
 				break;
 			case WAITING_FOR_BACKEND_STATE:
+			case WAITING_FOR_FILESYSTEM_STATE:
+			case RESOLVING_STATE:
+			case QUEUED_STATE:
+			case WAITING_FOR_RESPONSE_STATE:
 				return true;
 			case PREPARING_ERROR_PAGE_STATE:
-				if ((!prepare_error_page()) || (!modify(fd, tcp_server::WRITE))) {
+				if ((!prepare_error_page(fd)) || (!modify(fd, tcp_server::WRITE))) {
 					return false;
 				}
 
@@ -253,6 +702,34 @@ bool http_connection::loop(unsigned fd)
 					_M_state = REQUEST_COMPLETED_STATE;
 				}
 
+				break;
+			case SENDING_CHUNKED_LISTING_STATE:
+				if (!_M_writable) {
+					return true;
+				}
+
+				io_vector[0].iov_base = _M_out.data();
+				io_vector[0].iov_len = _M_out.count();
+
+				io_vector[1].iov_base = _M_body.data();
+				io_vector[1].iov_len = _M_body.count();
+
+				if (!writev(fd, io_vector, 2, total)) {
+					return false;
+				} else if (_M_outp == (off_t) (_M_out.count() + _M_body.count())) {
+					if (_M_listing->done) {
+						_M_state = REQUEST_COMPLETED_STATE;
+					} else {
+						// The headers have been sent already.
+						_M_out.reset();
+						_M_outp = 0;
+
+						if (!build_listing_chunk()) {
+							return false;
+						}
+					}
+				}
+
 				break;
 			case SENDING_HEADERS_STATE:
 				if (!_M_writable) {
@@ -286,7 +763,18 @@ bool http_connection::loop(unsigned fd)
 					return true;
 				}
 
-				if (!sendfile(fd, _M_fd, _M_filesize, &_M_ranges, _M_nrange, total)) {
+				if (_M_large_file) {
+					if (!prefetch(fd)) {
+						return false;
+					}
+
+					// If we have to wait for the next window...
+					if (_M_outp >= _M_prefetched) {
+						return true;
+					}
+				}
+
+				if (!sendfile(fd, _M_fd, _M_filesize, &_M_ranges, _M_nrange, total, _M_large_file ? _M_prefetched : -1, _M_file_offset)) {
 					return false;
 				} else {
 					size_t nranges = _M_ranges.count();
@@ -371,7 +859,9 @@ bool http_connection::loop(unsigned fd)
 					io_vector[0].iov_base = _M_out.data();
 					io_vector[0].iov_len = _M_out.count();
 
-					if (_M_error == http_error::OK) {
+					if (_M_cached) {
+						io_vector[1].iov_base = _M_cache_entry->body;
+					} else if (_M_error == http_error::OK) {
 						io_vector[1].iov_base = _M_body.data() + _M_backend_response_header_size;
 					} else {
 						io_vector[1].iov_base = _M_bodyp->data();
@@ -392,8 +882,52 @@ bool http_connection::loop(unsigned fd)
 					} else {
 						_M_outp = 0;
 
-						_M_state = SENDING_BACKEND_BODY_STATE;
+						_M_state = _M_streaming ? SENDING_BACKEND_STREAM_STATE : SENDING_BACKEND_BODY_STATE;
+					}
+				}
+
+				break;
+			case SENDING_BACKEND_STREAM_STATE:
+				if (_M_outp < (off_t) _M_body.count()) {
+					if (!_M_writable) {
+						return true;
+					}
+
+					if (!write(fd, _M_body, total)) {
+						return false;
+					}
+#if HAVE_SPLICE
+				} else if (_M_piped > 0) {
+					if (!_M_writable) {
+						return true;
+					}
+
+					size_t count = _M_piped;
+					if (!splice_out(fd, _M_pipe[0], count, total)) {
+						return false;
+					}
+
+					if (count > 0) {
+						_M_piped -= count;
+
+						// Let the backend fill the pipe again.
+						if (_M_fd != -1) {
+							wake_backend(tcp_server::READ);
+						}
 					}
+#endif // HAVE_SPLICE
+				} else if (_M_fd == -1) {
+					// The backend has sent the whole response.
+					_M_state = REQUEST_COMPLETED_STATE;
+				} else {
+					_M_body.reset();
+					_M_outp = 0;
+
+					// If the backend has stopped reading because the buffer
+					// was full, let it go on.
+					wake_backend(tcp_server::READ);
+
+					return true;
 				}
 
 				break;
@@ -518,42 +1052,41 @@ bool http_connection::read_headers(unsigned fd, size_t& total)
 
 bool http_connection::read_body(unsigned fd, size_t& total)
 {
+	size_t buffered = _M_body.count();
+
 	io_result res;
 
 	do {
 		if ((res = read(fd, total)) == IO_ERROR) {
 			return false;
 		} else if (res == IO_NO_DATA_READ) {
-			return true;
+			break;
 		}
 
 		size_t count = MIN(_M_filesize, (off_t) _M_in.count() - _M_inp);
 
-		if (!_M_payload_in_memory) {
-			if (_M_rule->handler == rulelist::HTTP_HANDLER) {
-				if (!file_wrapper::write(_M_tmpfile, _M_in.data(), count)) {
-					_M_error = http_error::INTERNAL_SERVER_ERROR;
-
-					_M_state = PREPARING_ERROR_PAGE_STATE;
-
-					return true;
-				}
-
-				_M_tmpfilesize += count;
-			} else {
-				if (!fastcgi::stdin_stream(REQUEST_ID, _M_in.data(), count, _M_tmpfile, _M_tmpfilesize)) {
-					_M_error = http_error::INTERNAL_SERVER_ERROR;
+		if (_M_relaying_body) {
+			if (!relay_body(_M_in.data(), count)) {
+				return false;
+			}
+		} else if (!_M_payload_in_memory) {
+			// The FCGI_STDIN records are added while sending the body.
+			if (!static_cast<http_server*>(_M_server)->_M_tmpfiles.write(_M_tmpfile, _M_in.data(), count)) {
+				_M_error = http_error::INTERNAL_SERVER_ERROR;
 
-					_M_state = PREPARING_ERROR_PAGE_STATE;
+				_M_state = PREPARING_ERROR_PAGE_STATE;
 
-					return true;
-				}
+				return true;
 			}
 		}
 
 		if ((off_t) count == _M_filesize) {
 			_M_inp += count;
 
+			if (_M_relaying_body) {
+				return request_body_read();
+			}
+
 			_M_state = PREPARING_HTTP_REQUEST_STATE;
 
 			return true;
@@ -566,50 +1099,80 @@ bool http_connection::read_body(unsigned fd, size_t& total)
 		} else {
 			_M_in.reset();
 		}
-	} while (res == IO_SUCCESS);
+	} while ((res == IO_SUCCESS) && ((!_M_relaying_body) || (_M_body.count() < MAX_BUFFERED_BODY)) && (!spill_throttled(fd)));
+
+	if ((_M_relaying_body) && (_M_body.count() > buffered)) {
+		wake_backend(tcp_server::WRITE);
+	}
 
 	return true;
 }
 
 bool http_connection::read_chunked_body(unsigned fd, size_t& total)
 {
+	size_t buffered = _M_body.count();
+
+	// Are the chunks passed through?
+	bool passthrough = ((_M_relaying_body) && (_M_rule->handler == rulelist::HTTP_HANDLER));
+
 	io_result res;
 
 	do {
 		if ((res = read(fd, total)) == IO_ERROR) {
 			return false;
 		} else if (res == IO_NO_DATA_READ) {
-			return true;
+			break;
 		}
 
-		if (_M_rule->handler == rulelist::HTTP_HANDLER) {
-			size_t size;
-			switch (parse_chunk(_M_in.data(), _M_in.count(), size)) {
-				case chunked_parser::INVALID_CHUNKED_RESPONSE:
-					_M_error = http_error::BAD_REQUEST;
+		size_t size;
+		chunked_parser::parse_result parse_result = parse_chunk(_M_in.data(), _M_in.count(), size);
+		switch (parse_result) {
+			case chunked_parser::INVALID_CHUNKED_RESPONSE:
+			case chunked_parser::CALLBACK_FAILED:
+				if (_M_relaying_body) {
+					// The rest of the body won't be read.
+					detach_backend();
 
-					_M_state = PREPARING_ERROR_PAGE_STATE;
+					_M_keep_alive = 0;
+				}
 
-					return true;
-				case chunked_parser::CALLBACK_FAILED:
+				if (parse_result == chunked_parser::INVALID_CHUNKED_RESPONSE) {
+					_M_error = http_error::BAD_REQUEST;
+				} else if (_M_error != http_error::REQUEST_ENTITY_TOO_LARGE) {
 					_M_error = http_error::INTERNAL_SERVER_ERROR;
+				}
 
-					_M_state = PREPARING_ERROR_PAGE_STATE;
+				_M_state = PREPARING_ERROR_PAGE_STATE;
 
-					return true;
-				case chunked_parser::END_OF_RESPONSE:
-					_M_inp += size;
+				return true;
+			case chunked_parser::END_OF_RESPONSE:
+				if ((passthrough) && (!_M_body.append(_M_in.data(), size))) {
+					return false;
+				}
 
-					_M_state = PREPARING_HTTP_REQUEST_STATE;
+				_M_inp += size;
 
-					return true;
-				default:
-					;
-			}
+				if (_M_relaying_body) {
+					return request_body_read();
+				}
+
+				_M_state = PREPARING_HTTP_REQUEST_STATE;
+
+				return true;
+			default:
+				;
+		}
+
+		if ((passthrough) && (!_M_body.append(_M_in.data(), _M_in.count()))) {
+			return false;
 		}
 
 		_M_in.reset();
-	} while (res == IO_SUCCESS);
+	} while ((res == IO_SUCCESS) && ((!_M_relaying_body) || (_M_body.count() < MAX_BUFFERED_BODY)) && (!spill_throttled(fd)));
+
+	if ((_M_relaying_body) && (_M_body.count() > buffered)) {
+		wake_backend(tcp_server::WRITE);
+	}
 
 	return true;
 }
@@ -942,6 +1505,11 @@ bool http_connection::process_request(unsigned fd)
 
 	_M_rule = _M_vhost->rules->find(_M_method, urlpath, pathlen, extension, extensionlen);
 
+	// PURGE is handled by the rules which cache the responses.
+	if ((_M_method == http_method::PURGE) && (_M_rule->cache)) {
+		return purge();
+	}
+
 	if (_M_rule->handler != rulelist::LOCAL_HANDLER) {
 		if (_M_rule->handler == rulelist::FCGI_HANDLER) {
 			size_t len = _M_vhost->rootlen + pathlen;
@@ -967,6 +1535,11 @@ bool http_connection::process_request(unsigned fd)
 			}
 		}
 
+		// Can the response be served from the cache?
+		if ((_M_rule->cache) && (serve_from_cache(fd, true))) {
+			return true;
+		}
+
 		return process_non_local_handler(fd);
 	}
 
@@ -977,27 +1550,108 @@ bool http_connection::process_request(unsigned fd)
 		return true;
 	}
 
-	char path[PATH_MAX + 1];
+	// If the files are served from a bundle...
+	if (_M_vhost->bundle) {
+		return process_bundle_request(fd, urlpath, pathlen);
+	}
+
 	size_t len = _M_vhost->rootlen + pathlen;
-	if (len >= sizeof(path)) {
+	if (len > PATH_MAX) {
 		_M_error = http_error::REQUEST_URI_TOO_LONG;
 		return true;
 	}
 
-	memcpy(path, _M_vhost->root, _M_vhost->rootlen);
-	memcpy(path + _M_vhost->rootlen, urlpath, pathlen);
-	path[len] = 0;
+	// Look up the file in a worker thread.
+	filesystem_job* job;
+	if ((job = new (std::nothrow) filesystem_job(filesystem_job::LOOKUP, this, fd)) == NULL) {
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return true;
+	}
+
+	memcpy(job->path, _M_vhost->root, _M_vhost->rootlen);
+	memcpy(job->path + _M_vhost->rootlen, urlpath, pathlen);
+	job->pathlen = len;
+	job->path[len] = 0;
 
-	struct stat buf;
-	if (stat(path, &buf) < 0) {
+	job->index_files = &(static_cast<http_server*>(_M_server)->_M_index_file_finder);
+
+	job->open_file = (_M_method == http_method::GET);
+	job->large_file_size = static_cast<http_server*>(_M_server)->_M_large_file_size;
+
+	return submit_filesystem_job(job);
+}
+
+bool http_connection::process_bundle_request(unsigned fd, const char* urlpath, unsigned short pathlen)
+{
+	site_bundle* bundle = _M_vhost->bundle;
+
+	// Look up the file in the bundle's index (no filesystem access).
+	const site_bundle::entry* entry;
+	if ((entry = bundle->lookup(urlpath, pathlen)) == NULL) {
 		not_found();
 		return true;
 	}
 
+	if (entry->flags & site_bundle::DIRECTORY) {
+		moved_permanently();
+		return true;
+	}
+
+	_M_decoded_path.reset();
+	if (!_M_decoded_path.append_nul_terminated_string(urlpath, pathlen)) {
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return true;
+	}
+
+	memset(&_M_stat, 0, sizeof(struct stat));
+	_M_stat.st_mode = S_IFREG;
+	_M_stat.st_mtime = entry->mtime;
+
+	// Send the precompressed variant (if the client accepts it and it is
+	// not a range request)?
+	const char* value;
+	unsigned short valuelen;
+	if ((entry->gzip_size > 0) && (!_M_headers.get_value_known_header(http_headers::RANGE_HEADER, value, &valuelen)) && (accepts_gzip())) {
+		_M_stat.st_size = entry->gzip_size;
+		_M_file_offset = entry->gzip_offset;
+
+		_M_gzip = 1;
+	} else {
+		_M_stat.st_size = entry->size;
+		_M_file_offset = entry->offset;
+	}
+
+	// The bundle might be replaced while the file is being sent.
+	bundle->acquire();
+
+	_M_bundle = bundle;
+	_M_bundle_entry = entry;
+
+	if (_M_method == http_method::GET) {
+		_M_fd = bundle->get_descriptor();
+	}
+
+	_M_substate = 0;
+
+	_M_error = http_error::OK;
+
+	_M_state = PROCESSING_LOCAL_REQUEST_STATE;
+
+	return true;
+}
+
+bool http_connection::process_local_request(unsigned fd)
+{
+	// The file has been looked up by a filesystem job.
+	char* path = _M_decoded_path.data();
+	size_t len = _M_decoded_path.count() - 1; // Without the NUL terminator.
+
+	const struct stat& buf = _M_stat;
+
 	bool dirlisting;
-	bool index_file;
+	bool chunked = false;
 
-	// If the URI points to a directory...
+	// If the URI points to a directory (without index file)...
 	if (S_ISDIR(buf.st_mode)) {
 		// If the directory name doesn't end with '/'...
 		if (path[len - 1] != '/') {
@@ -1005,43 +1659,98 @@ bool http_connection::process_request(unsigned fd)
 			return true;
 		}
 
-		// Search index file.
-		if (static_cast<http_server*>(_M_server)->_M_index_file_finder.search(path, len, &buf)) {
-			// File.
-			dirlisting = false;
-			index_file = true;
-		} else {
-			// If we don't have directory listing...
-			if (!_M_vhost->have_dirlisting) {
-				not_found();
-				return true;
-			} else {
-				// Build directory listing.
-				if (!_M_vhost->dir_listing->build(urlpath, pathlen, _M_body)) {
-					logger::instance().log(logger::LOG_WARNING, "[http_connection::process_request] (fd %d) Couldn't build directory listing for (%s).", fd, path);
+		// If we don't have directory listing...
+		if (!_M_vhost->have_dirlisting) {
+			not_found();
+			return true;
+		}
+
+		const char* urlpath = path + _M_vhost->rootlen;
+		size_t pathlen = len - _M_vhost->rootlen;
+
+		// If the directory hasn't been read yet...
+		if (_M_substate == 0) {
+			// Build directory listing.
+			if (!_M_vhost->dir_listing->lookup(urlpath, pathlen, buf.st_mtime, _M_body)) {
+				if ((!_M_listing) && ((_M_listing = new (std::nothrow) dirlisting::stream) == NULL)) {
+					_M_error = http_error::INTERNAL_SERVER_ERROR;
+					return true;
+				}
+
+				_M_listing->dir.reset();
+				if (!_M_listing->dir.append(urlpath, pathlen)) {
+					_M_error = http_error::INTERNAL_SERVER_ERROR;
+					return true;
+				}
+
+				_M_listing->built = now::_M_time;
 
+				// Read the directory in a worker thread.
+				filesystem_job* job;
+				if ((job = new (std::nothrow) filesystem_job(filesystem_job::LOAD_LISTING, this, fd)) == NULL) {
 					_M_error = http_error::INTERNAL_SERVER_ERROR;
 					return true;
 				}
 
-				_M_bodyp = &_M_body;
+				job->dir_listing = _M_vhost->dir_listing;
+
+				job->listing = _M_listing;
+				_M_listing = NULL;
+
+				return submit_filesystem_job(job);
+			}
+		} else {
+			// Huge directories are sent in chunks to HTTP/1.1 clients.
+			if ((_M_listing->count() >= dirlisting::STREAMING_MIN_ENTRIES) && (_M_major_number == 1) && (_M_minor_number == 1)) {
+				chunked = true;
+			} else {
+				if (!_M_vhost->dir_listing->render(*_M_listing, _M_body)) {
+					_M_error = http_error::INTERNAL_SERVER_ERROR;
+					return true;
+				}
 
-				dirlisting = true;
-				index_file = false;
+				_M_vhost->dir_listing->store(*_M_listing, buf.st_mtime, _M_body.data(), _M_body.count());
 			}
 		}
+
+		_M_bodyp = &_M_body;
+
+		dirlisting = true;
 	} else if ((S_ISREG(buf.st_mode)) || (S_ISLNK(buf.st_mode))) {
 		// File.
 		dirlisting = false;
-		index_file = false;
 	} else {
 		not_found();
 		return true;
 	}
 
+	const char* extension = NULL;
+	size_t extensionlen = 0;
+
 	if (!dirlisting) {
 		const char* value;
 		unsigned short valuelen;
+
+		// Files in a bundle have an ETag.
+		if ((_M_bundle_entry) && (_M_headers.get_value_known_header(http_headers::IF_NONE_MATCH_HEADER, value, &valuelen))) {
+			const char* etag;
+			size_t etaglen;
+			if (_M_gzip) {
+				etag = _M_bundle->get_string(_M_bundle_entry->gzip_etag);
+				etaglen = _M_bundle_entry->gzip_etaglen;
+			} else {
+				etag = _M_bundle->get_string(_M_bundle_entry->etag);
+				etaglen = _M_bundle_entry->etaglen;
+			}
+
+			if (((valuelen == 1) && (*value == '*')) || (memmem(value, valuelen, etag, etaglen))) {
+				gmtime_r(&buf.st_mtime, &_M_last_modified);
+				not_modified();
+
+				return true;
+			}
+		}
+
 		if (_M_headers.get_value_known_header(http_headers::IF_MODIFIED_SINCE_HEADER, value, &valuelen)) {
 			time_t t;
 			if ((t = date_parser::parse(value, valuelen, &_M_last_modified)) != (time_t) -1) {
@@ -1065,12 +1774,32 @@ bool http_connection::process_request(unsigned fd)
 				}
 			}
 
-			if ((_M_fd = file_wrapper::open(path, O_RDONLY)) < 0) {
-				logger::instance().log(logger::LOG_WARNING, "[http_connection::process_request] (fd %d) Couldn't open file (%s).", fd, path);
+			// If the file couldn't be opened...
+			if (_M_fd < 0) {
+				logger::instance().log(logger::LOG_WARNING, "[http_connection::process_local_request] (fd %d) Couldn't open file (%s).", fd, path);
 
 				_M_error = http_error::INTERNAL_SERVER_ERROR;
 				return true;
 			}
+
+			// Multipart responses are sent without read-ahead.
+			off_t large_file_size = static_cast<http_server*>(_M_server)->_M_large_file_size;
+			if ((large_file_size > 0) && (buf.st_size >= large_file_size) && (_M_ranges.count() <= 1)) {
+				_M_large_file = 1;
+				_M_prefetched = 0;
+			}
+		}
+
+		const char* end = path + len;
+		const char* ptr = end;
+		while ((ptr > path) && (*(ptr - 1) != '/')) {
+			if (*(ptr - 1) == '.') {
+				extension = ptr;
+				extensionlen = end - extension;
+				break;
+			}
+
+			ptr--;
 		}
 	}
 
@@ -1103,11 +1832,18 @@ bool http_connection::process_request(unsigned fd)
 
 	// Directory listing?
 	if (dirlisting) {
-		char num[32];
-		int numlen = snprintf(num, sizeof(num), "%lu", _M_body.count());
-		if (!headers->add_known_header(http_headers::CONTENT_LENGTH_HEADER, num, numlen, false)) {
-			_M_error = http_error::INTERNAL_SERVER_ERROR;
-			return true;
+		if (chunked) {
+			if (!headers->add_known_header(http_headers::TRANSFER_ENCODING_HEADER, "chunked", 7, false)) {
+				_M_error = http_error::INTERNAL_SERVER_ERROR;
+				return true;
+			}
+		} else {
+			char num[32];
+			int numlen = snprintf(num, sizeof(num), "%lu", _M_body.count());
+			if (!headers->add_known_header(http_headers::CONTENT_LENGTH_HEADER, num, numlen, false)) {
+				_M_error = http_error::INTERNAL_SERVER_ERROR;
+				return true;
+			}
 		}
 
 		if (!headers->add_known_header(http_headers::CONTENT_TYPE_HEADER, "text/html; charset=UTF-8", 24, false)) {
@@ -1122,22 +1858,10 @@ bool http_connection::process_request(unsigned fd)
 			return true;
 		}
 
-		if (index_file) {
-			const char* end = path + len;
-			const char* ptr = end;
-			extension = NULL;
-			while ((ptr > path) && (*(ptr - 1) != '/')) {
-				if (*(ptr - 1) == '.') {
-					extension = ptr;
-					extensionlen = end - extension;
-					break;
-				}
-
-				ptr--;
-			}
-		}
-
-		if ((extension) && (extensionlen > 0)) {
+		if (_M_bundle_entry) {
+			_M_type = _M_bundle->get_string(_M_bundle_entry->type);
+			_M_typelen = _M_bundle_entry->typelen;
+		} else if ((extension) && (extensionlen > 0)) {
 			_M_type = static_cast<http_server*>(_M_server)->_M_mime_types.get_mime_type(extension, extensionlen, _M_typelen);
 		} else {
 			_M_type = mime_types::DEFAULT_MIME_TYPE;
@@ -1223,6 +1947,27 @@ bool http_connection::process_request(unsigned fd)
 		return true;
 	}
 
+	// Add the precomputed header lines of the file in the bundle.
+	if (_M_bundle_entry) {
+		const char* lines;
+		size_t lineslen;
+		if (_M_gzip) {
+			lines = _M_bundle->get_string(_M_bundle_entry->gzip_headers);
+			lineslen = _M_bundle_entry->gzip_headerslen;
+		} else {
+			lines = _M_bundle->get_string(_M_bundle_entry->headers);
+			lineslen = _M_bundle_entry->headerslen;
+		}
+
+		// Insert them before the empty line.
+		_M_out.set_count(_M_out.count() - 2);
+
+		if ((!_M_out.append(lines, lineslen)) || (!_M_out.append("\r\n", 2))) {
+			_M_error = http_error::INTERNAL_SERVER_ERROR;
+			return true;
+		}
+	}
+
 	_M_response_header_size = _M_out.count();
 
 	// If multipart...
@@ -1240,7 +1985,16 @@ bool http_connection::process_request(unsigned fd)
 
 		_M_state = SENDING_HEADERS_STATE;
 	} else {
-		if (dirlisting) {
+		if (chunked) {
+			_M_filesize = 0;
+
+			if (!build_listing_chunk()) {
+				_M_error = http_error::INTERNAL_SERVER_ERROR;
+				return true;
+			}
+
+			_M_state = SENDING_CHUNKED_LISTING_STATE;
+		} else if (dirlisting) {
 			_M_filesize = _M_body.count();
 
 			_M_state = SENDING_TWO_BUFFERS_STATE;
@@ -1254,6 +2008,147 @@ bool http_connection::process_request(unsigned fd)
 	return true;
 }
 
+bool http_connection::prefetch(unsigned fd)
+{
+	// If the previous window is still being read...
+	if (_M_fs_job) {
+		return true;
+	}
+
+	// End of the data to be sent.
+	off_t end;
+	if (_M_ranges.count() == 0) {
+		end = _M_filesize;
+	} else {
+		end = _M_ranges.get(_M_nrange)->to + 1;
+	}
+
+	off_t from = (_M_outp > _M_prefetched) ? _M_outp : _M_prefetched;
+
+	// Nothing left or the current window is still half full?
+	if ((from >= end) || (from - _M_outp >= READAHEAD_WINDOW / 2)) {
+		return true;
+	}
+
+	filesystem_job* job;
+	if ((job = new (std::nothrow) filesystem_job(filesystem_job::PREFETCH, this, fd)) == NULL) {
+		return false;
+	}
+
+	job->in_fd = _M_fd;
+	job->from = _M_file_offset + from;
+	job->to = _M_file_offset + ((end - from > READAHEAD_WINDOW) ? from + READAHEAD_WINDOW : end);
+
+	// Drop what has been sent already (keeping one window, which might
+	// still be referenced by the socket buffers).
+	if ((static_cast<http_server*>(_M_server)->_M_drop_large_files) && (_M_outp > READAHEAD_WINDOW)) {
+		job->drop_from = _M_file_offset;
+		job->drop_to = _M_file_offset + _M_outp - READAHEAD_WINDOW;
+	}
+
+	_M_fs_job = job;
+
+	if (!static_cast<http_server*>(_M_server)->_M_workers.submit(job)) {
+		_M_fs_job = NULL;
+		delete job;
+
+		return false;
+	}
+
+	return true;
+}
+
+bool http_connection::submit_filesystem_job(filesystem_job* job)
+{
+	_M_fs_job = job;
+
+	_M_error = http_error::OK;
+
+	_M_state = WAITING_FOR_FILESYSTEM_STATE;
+
+	// The job might be completed before submit() returns (if there are no
+	// worker threads).
+	if (!static_cast<http_server*>(_M_server)->_M_workers.submit(job)) {
+		_M_fs_job = NULL;
+		delete job;
+
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+	}
+
+	return true;
+}
+
+void http_connection::filesystem_job_completed(filesystem_job* job)
+{
+	_M_fs_job = NULL;
+
+	if (job->op == filesystem_job::LOOKUP) {
+		if (!job->found) {
+			not_found();
+		} else {
+			_M_decoded_path.reset();
+			if (!_M_decoded_path.append_nul_terminated_string(job->path, job->pathlen)) {
+				_M_error = http_error::INTERNAL_SERVER_ERROR;
+			} else {
+				_M_stat = job->buf;
+
+				_M_fd = job->file;
+				job->file = -1;
+
+				// The directory (if any) hasn't been read yet.
+				_M_substate = 0;
+
+				_M_state = PROCESSING_LOCAL_REQUEST_STATE;
+			}
+		}
+	} else if (job->op == filesystem_job::PREFETCH) {
+		http_server* server = static_cast<http_server*>(_M_server);
+		server->_M_page_cache_bytes += job->cached;
+		server->_M_disk_bytes += job->read;
+
+		_M_prefetched = job->to - _M_file_offset;
+
+		// If the connection is not waiting for this window...
+		if ((_M_state != SENDING_BODY_STATE) || (_M_file_offset + _M_outp < job->from)) {
+			return;
+		}
+
+		// Resume the connection.
+		if (!_M_in_ready_list) {
+			_M_in_ready_list = 1;
+
+			server->_M_ready_list[server->_M_nready++] = job->fd;
+		}
+
+		return;
+	} else {
+		_M_listing = job->listing;
+		job->listing = NULL;
+
+		if (!job->loaded) {
+			logger::instance().log(logger::LOG_WARNING, "[http_connection::filesystem_job_completed] (fd %d) Couldn't build directory listing for (%s).", job->fd, _M_decoded_path.data());
+
+			_M_error = http_error::INTERNAL_SERVER_ERROR;
+		} else {
+			_M_substate = 1;
+
+			_M_state = PROCESSING_LOCAL_REQUEST_STATE;
+		}
+	}
+
+	if (_M_error != http_error::OK) {
+		_M_state = PREPARING_ERROR_PAGE_STATE;
+	}
+
+	// Resume the connection.
+	if (!_M_in_ready_list) {
+		_M_in_ready_list = 1;
+
+		http_server* server = static_cast<http_server*>(_M_server);
+		server->_M_ready_list[server->_M_nready++] = job->fd;
+	}
+}
+
 bool http_connection::process_non_local_handler(unsigned fd)
 {
 	if ((_M_method == http_method::GET) || (_M_method == http_method::HEAD)) {
@@ -1283,6 +2178,9 @@ bool http_connection::process_non_local_handler(unsigned fd)
 		_M_request_body_size = 0;
 
 		_M_payload_in_memory = 0;
+
+		// Even if no chunk has been received yet.
+		_M_state = READING_CHUNKED_BODY_STATE;
 	} else {
 		chunked = false;
 
@@ -1297,6 +2195,11 @@ bool http_connection::process_non_local_handler(unsigned fd)
 			return true;
 		}
 
+		if ((_M_rule->max_body_size > 0) && ((off_t) _M_request_body_size > _M_rule->max_body_size)) {
+			_M_error = http_error::REQUEST_ENTITY_TOO_LARGE;
+			return true;
+		}
+
 		// If the payload is already in memory...
 		if (_M_request_header_size + _M_request_body_size <= _M_in.count()) {
 			_M_payload_in_memory = 1;
@@ -1305,7 +2208,7 @@ bool http_connection::process_non_local_handler(unsigned fd)
 
 			_M_state = PREPARING_HTTP_REQUEST_STATE;
 		} else {
-			_M_payload_in_memory = (_M_request_body_size <= static_cast<http_server*>(_M_server)->_M_max_payload_in_memory);
+			_M_payload_in_memory = keep_payload_in_memory(_M_request_body_size);
 
 			_M_inp += count;
 
@@ -1315,18 +2218,40 @@ bool http_connection::process_non_local_handler(unsigned fd)
 		}
 	}
 
+	// Is the client waiting for our go-ahead to send a body (not with
+	// "Content-Length: 0")?
+	if ((count == 0) && ((chunked) || (_M_request_body_size > 0)) && (expects_continue())) {
+#if !PROXY
+		// Reject the body before it is sent if no backend can take the
+		// request.
+		if (!_M_rule->backends.accepting()) {
+			_M_error = http_error::SERVICE_UNAVAILABLE;
+			return true;
+		}
+#endif
+
+		if (!send_continue(fd)) {
+			return false;
+		}
+	}
+
+	// Relay the payload to the backend as it arrives?
+	if ((!_M_payload_in_memory) && (static_cast<http_server*>(_M_server)->_M_stream_request_bodies)) {
+		logger::instance().log(logger::LOG_DEBUG, "[http_connection::process_non_local_handler] (fd %d) %s payload will be relayed.", fd, chunked ? "Chunked" : "Not chunked");
+
+		return start_relaying_body(fd, chunked, count);
+	}
+
 	logger::instance().log(logger::LOG_DEBUG, "[http_connection::process_non_local_handler] (fd %d) %s payload will be saved in %s.", fd, chunked ? "Chunked" : "Not chunked", _M_payload_in_memory ? "memory" : "disk");
 
 	// If the payload should be written to disk...
 	if (!_M_payload_in_memory) {
 		// Open a temporary file.
-		if ((_M_tmpfile = static_cast<http_server*>(_M_server)->_M_tmpfiles.open()) < 0) {
+		if ((_M_tmpfile = static_cast<http_server*>(_M_server)->_M_tmpfiles.open(chunked ? -1 : (off_t) _M_request_body_size)) < 0) {
 			_M_error = http_error::INTERNAL_SERVER_ERROR;
 			return true;
 		}
 
-		_M_tmpfilesize = 0;
-
 		// If there is some payload already in the input buffer...
 		if (count > 0) {
 			if (chunked) {
@@ -1336,7 +2261,11 @@ bool http_connection::process_non_local_handler(unsigned fd)
 						_M_error = http_error::BAD_REQUEST;
 						return true;
 					case chunked_parser::CALLBACK_FAILED:
-						_M_error = http_error::INTERNAL_SERVER_ERROR;
+						// Too large (add_chunked_data()) / couldn't be saved.
+						if (_M_error != http_error::REQUEST_ENTITY_TOO_LARGE) {
+							_M_error = http_error::INTERNAL_SERVER_ERROR;
+						}
+
 						return true;
 					case chunked_parser::NOT_END_OF_RESPONSE:
 						_M_state = READING_CHUNKED_BODY_STATE;
@@ -1351,16 +2280,9 @@ bool http_connection::process_non_local_handler(unsigned fd)
 						return true;
 				}
 			} else {
-				if (_M_rule->handler == rulelist::HTTP_HANDLER) {
-					if (!file_wrapper::write(_M_tmpfile, _M_in.data() + _M_request_header_size, count)) {
-						_M_error = http_error::INTERNAL_SERVER_ERROR;
-						return true;
-					}
-				} else {
-					if (!fastcgi::stdin_stream(REQUEST_ID, _M_in.data() + _M_request_header_size, count, _M_tmpfile, _M_tmpfilesize)) {
-						_M_error = http_error::INTERNAL_SERVER_ERROR;
-						return true;
-					}
+				if (!static_cast<http_server*>(_M_server)->_M_tmpfiles.write(_M_tmpfile, _M_in.data() + _M_request_header_size, count)) {
+					_M_error = http_error::INTERNAL_SERVER_ERROR;
+					return true;
 				}
 			}
 		}
@@ -1374,120 +2296,1353 @@ bool http_connection::process_non_local_handler(unsigned fd)
 	return true;
 }
 
-bool http_connection::prepare_http_request(unsigned fd)
+bool http_connection::start_relaying_body(unsigned fd, bool chunked, size_t count)
 {
-	// Connect to backend.
-	const char* host;
-	unsigned short hostlen;
+	_M_relaying_body = 1;
+
+	bool completed = false;
+
+	// If there is some payload already in the input buffer...
+	if (count > 0) {
+		const char* data = _M_in.data() + _M_request_header_size;
+
+		if (chunked) {
+			size_t size;
+			switch (parse_chunk(data, count, size)) {
+				case chunked_parser::INVALID_CHUNKED_RESPONSE:
+					_M_error = http_error::BAD_REQUEST;
+					return true;
+				case chunked_parser::CALLBACK_FAILED:
+					// Too large (add_chunked_data()) / couldn't be relayed.
+					if (_M_error != http_error::REQUEST_ENTITY_TOO_LARGE) {
+						_M_error = http_error::INTERNAL_SERVER_ERROR;
+					}
+
+					return true;
+				case chunked_parser::END_OF_RESPONSE:
+					_M_inp += size;
+
+					count = size;
+					completed = true;
+
+					break;
+				default:
+					;
+			}
+
+			// The chunks are passed through to HTTP backends.
+			if ((_M_rule->handler == rulelist::HTTP_HANDLER) && (!_M_body.append(data, count))) {
+				_M_error = http_error::INTERNAL_SERVER_ERROR;
+				return true;
+			}
+		} else if (!relay_body(data, count)) {
+			_M_error = http_error::INTERNAL_SERVER_ERROR;
+			return true;
+		}
+	}
+
+	if (!completed) {
+		_M_in.reset();
+		_M_inp = 0;
+	}
+
+	_M_error = http_error::OK;
+
+	// Connect to the backend before reading the rest of the body.
+	if (!prepare_http_request(fd)) {
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return true;
+	} else if (_M_error != http_error::OK) {
+		return true;
+	} else if ((_M_state == RESOLVING_STATE) || (_M_state == QUEUED_STATE)) {
+		// The rest of the body will be read once the name of the host
+		// has been resolved (or a backend has room).
+		if (completed) {
+			_M_resume_state = WAITING_FOR_BACKEND_STATE;
+		} else if (chunked) {
+			_M_resume_state = READING_CHUNKED_BODY_STATE;
+		} else {
+			_M_resume_state = READING_BODY_STATE;
+		}
+
+		return true;
+	}
+
+	if (completed) {
+		if (!request_body_read()) {
+			detach_backend();
+
+			_M_error = http_error::INTERNAL_SERVER_ERROR;
+		}
+	} else if (chunked) {
+		_M_state = READING_CHUNKED_BODY_STATE;
+	} else {
+		_M_state = READING_BODY_STATE;
+	}
+
+	return true;
+}
+
+bool http_connection::request_body_read()
+{
+	// End of the stdin stream.
+	if ((_M_rule->handler != rulelist::HTTP_HANDLER) && (!fastcgi::stdin_stream(REQUEST_ID, NULL, 0, _M_body))) {
+		return false;
+	}
+
+	_M_state = WAITING_FOR_BACKEND_STATE;
+
+	// The backend might be waiting for the rest of the body.
+	wake_backend(tcp_server::WRITE);
+
+	return true;
+}
+
+bool http_connection::prepare_http_request(unsigned fd)
+{
+	// Connect to backend.
+	const char* host;
+	unsigned short hostlen;
+	unsigned short port;
+
+	bool reused = false;
+
+#if !PROXY
+	// The requests which are already waiting for a backend go first.
+	if ((_M_attempts == 0) && (_M_state != QUEUED_STATE) && (_M_rule->backends.queued() > 0)) {
+		return queue_request(fd);
+	}
+
+	unsigned hash = (_M_rule->backends.get_policy() == backend_list::HASH) ? backend_hash() : 0;
+
+	while (((_M_fd = _M_rule->backends.connect(hash, host, hostlen, port, reused)) != -1) && (reused) && (!socket_wrapper::is_alive(_M_fd))) {
+		// The backend has closed the idle connection.
+		_M_rule->backends.request_completed(_M_fd);
+
+		if (_M_rule->handler == rulelist::HTTP_HANDLER) {
+			static_cast<http_server*>(_M_server)->_M_proxy_connections[_M_fd].free();
+		} else {
+			static_cast<http_server*>(_M_server)->_M_fcgi_connections[_M_fd].free();
+		}
+
+		static_cast<http_server*>(_M_server)->remove(_M_fd);
+	}
+
+	if (_M_fd < 0) {
+		// Are all the backends at their concurrency limit or busy?
+		if ((_M_attempts == 0) && (_M_rule->backends.saturated())) {
+			return queue_request(fd);
+		}
+
+		_M_error = (_M_rule->backends.busy()) ? http_error::SERVICE_UNAVAILABLE : http_error::GATEWAY_TIMEOUT;
+		return true;
+	}
+#else
+	host = _M_host.data();
+	hostlen = _M_host.count() - 1;
+
+	port = _M_port;
+
+	// The name is resolved in a worker thread unless its address is
+	// cached.
+	resolver::address addr;
+	if ((!resolver::resolve_numeric(host, port, addr)) && (!static_cast<http_server*>(_M_server)->_M_dnscache.lookup(host, hostlen, port, addr))) {
+		return resolve(fd);
+	}
+
+	if ((_M_fd = socket_wrapper::connect((const struct sockaddr*) &addr.addr, addr.addrlen)) < 0) {
+		_M_error = http_error::GATEWAY_TIMEOUT;
+		return true;
+	}
+#endif
+
+	if (reused) {
+		static_cast<http_server*>(_M_server)->_M_reused_backend_connections++;
+	} else {
+		if (!static_cast<http_server*>(_M_server)->add(_M_fd, selector::WRITE, true)) {
+			socket_wrapper::close(_M_fd);
+			_M_fd = -1;
+
+			_M_error = http_error::INTERNAL_SERVER_ERROR;
+			return true;
+		}
+
+		static_cast<http_server*>(_M_server)->_M_backend_connections++;
+	}
+
+	// Get Connection header (the first time, it is replaced for the
+	// backend).
+	if (_M_attempts++ == 0) {
+		keep_alive();
+	}
+
+	if (!prepare_backend_request(fd, _M_fd, host, hostlen, port, reused)) {
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return true;
+	}
+
+#if !PROXY
+	// Send the request to a second backend if the first one is slow to
+	// answer.
+	unsigned delay;
+	if ((_M_attempts == 1) && ((delay = _M_rule->backends.get_hedge_delay()) > 0) && (hedgeable())) {
+		static_cast<http_server*>(_M_server)->add_hedge(fd, delay);
+	}
+#endif
+
+	return true;
+}
+
+bool http_connection::prepare_backend_request(unsigned fd, unsigned sd, const char* host, unsigned short hostlen, unsigned short port, bool reused)
+{
+	if (_M_rule->handler == rulelist::HTTP_HANDLER) {
+		buffer* out = &(static_cast<http_server*>(_M_server)->_M_proxy_connections[sd]._M_out);
+
+		out->reset();
+
+		if (!out->format("%s %.*s HTTP/1.1\r\n", http_method::get_method(_M_method), _M_path.count(), _M_path.data())) {
+			return false;
+		}
+
+		bool ret;
+#if !PROXY
+		if (_M_rule->backends.keep_alive()) {
+			ret = _M_headers.add_known_header(http_headers::CONNECTION_HEADER, "keep-alive", 10, true);
+		} else {
+			ret = _M_headers.add_known_header(http_headers::CONNECTION_HEADER, "close", 5, true);
+		}
+#else
+		ret = _M_headers.add_known_header(http_headers::CONNECTION_HEADER, "close", 5, true);
+#endif
+
+		if (!ret) {
+			return false;
+		}
+
+		_M_headers.remove_known_header(http_headers::KEEP_ALIVE_HEADER);
+		_M_headers.remove_known_header(http_headers::PROXY_CONNECTION_HEADER);
+
+		// Interim responses are not relayed.
+		_M_headers.remove_known_header(http_headers::EXPECT_HEADER);
+
+		char string[512];
+		size_t len;
+
+		// A chunked body which has been saved is sent decoded.
+		if ((!_M_relaying_body) && (_M_headers.remove_known_header(http_headers::TRANSFER_ENCODING_HEADER))) {
+			len = snprintf(string, sizeof(string), "%lu", (unsigned long) _M_request_body_size);
+			if (!_M_headers.add_known_header(http_headers::CONTENT_LENGTH_HEADER, string, len, true)) {
+				return false;
+			}
+		}
+
+		if (port == url_parser::HTTP_DEFAULT_PORT) {
+			len = snprintf(string, sizeof(string), "%.*s", hostlen, host);
+		} else {
+			len = snprintf(string, sizeof(string), "%.*s:%u", hostlen, host, port);
+		}
+
+		if (!_M_headers.add_known_header(http_headers::HOST_HEADER, string, len, true)) {
+			return false;
+		}
+
+		if (!_M_headers.serialize(*out)) {
+			return false;
+		}
+
+		static_cast<http_server*>(_M_server)->_M_proxy_connections[sd]._M_fd = fd;
+		static_cast<http_server*>(_M_server)->_M_proxy_connections[sd]._M_client = this;
+
+		static_cast<http_server*>(_M_server)->_M_proxy_connections[sd]._M_timestamp = now::_M_time;
+
+		if (reused) {
+			http_server* server = static_cast<http_server*>(_M_server);
+
+			server->_M_proxy_connections[sd]._M_backends = NULL;
+			server->_M_proxy_connections[sd]._M_state = proxy_connection::CONNECTING_STATE;
+
+			// There won't be a write event for the idle connection, add
+			// it to the ready list.
+			server->_M_proxy_connections[sd]._M_writable = 1;
+			server->_M_proxy_connections[sd]._M_in_ready_list = 1;
+
+			server->_M_ready_list[server->_M_nready++] = sd;
+		}
+	} else {
+		buffer* out = &(static_cast<http_server*>(_M_server)->_M_fcgi_connections[sd]._M_out);
+
+		out->reset();
+
+#if !PROXY
+		bool keep_conn = _M_rule->backends.keep_alive();
+#else
+		bool keep_conn = false;
+#endif
+
+		if (!fastcgi::begin_request(REQUEST_ID, fastcgi::FCGI_RESPONDER, keep_conn, *out)) {
+			return false;
+		}
+
+		if (!add_fcgi_params(fd, out)) {
+			return false;
+		}
+
+		// The body (in memory or in the temporary file) is framed in
+		// FCGI_STDIN records while it is sent.
+		if (!_M_relaying_body) {
+			static_cast<http_server*>(_M_server)->_M_fcgi_connections[sd]._M_stdin.init(REQUEST_ID, _M_request_body_size);
+		}
+
+		static_cast<http_server*>(_M_server)->_M_fcgi_connections[sd]._M_fd = fd;
+		static_cast<http_server*>(_M_server)->_M_fcgi_connections[sd]._M_client = this;
+
+		static_cast<http_server*>(_M_server)->_M_fcgi_connections[sd]._M_timestamp = now::_M_time;
+
+		if (reused) {
+			http_server* server = static_cast<http_server*>(_M_server);
+
+			server->_M_fcgi_connections[sd]._M_backends = NULL;
+			server->_M_fcgi_connections[sd]._M_state = fcgi_connection::CONNECTING_STATE;
+
+			// There won't be a write event for the idle connection, add
+			// it to the ready list.
+			server->_M_fcgi_connections[sd]._M_writable = 1;
+			server->_M_fcgi_connections[sd]._M_in_ready_list = 1;
+
+			server->_M_ready_list[server->_M_nready++] = sd;
+		}
+#if !PROXY
+		else if ((keep_conn) && (_M_rule->backends.needs_probe(sd))) {
+			// Ask the application how many connections it accepts (on a
+			// separate connection, some applications close the connection
+			// after having answered).
+			probe_fcgi_backend();
+		}
+#endif
+	}
+
+	static_cast<http_server*>(_M_server)->_M_connection_handlers[sd] = _M_rule->handler;
+
+	return true;
+}
+
+void http_connection::resume_backend_request(unsigned fd)
+{
+	if ((!prepare_http_request(fd)) || (_M_error != http_error::OK)) {
+		_M_state = PREPARING_ERROR_PAGE_STATE;
+	} else if (_M_fd == -1) {
+		// Queued (resolving) again.
+		return;
+	} else if (!_M_relaying_body) {
+		_M_state = WAITING_FOR_BACKEND_STATE;
+		return;
+	} else if (_M_resume_state != WAITING_FOR_BACKEND_STATE) {
+		// Read the rest of the body.
+		_M_state = _M_resume_state;
+	} else if (request_body_read()) {
+		return;
+	} else {
+		detach_backend();
+
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+		_M_state = PREPARING_ERROR_PAGE_STATE;
+	}
+
+	if (!_M_in_ready_list) {
+		http_server* server = static_cast<http_server*>(_M_server);
+
+		_M_in_ready_list = 1;
+		server->_M_ready_list[server->_M_nready++] = fd;
+	}
+}
+
+#if PROXY
+bool http_connection::resolve(unsigned fd)
+{
+	if (_M_host.count() > NI_MAXHOST) {
+		_M_error = http_error::GATEWAY_TIMEOUT;
+		return true;
+	}
+
+	resolve_job* job;
+	if ((job = new (std::nothrow) resolve_job()) == NULL) {
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return true;
+	}
+
+	job->client = this;
+	job->fd = fd;
+
+	job->cache = &(static_cast<http_server*>(_M_server)->_M_dnscache);
+
+	memcpy(job->host, _M_host.data(), _M_host.count());
+	job->hostlen = _M_host.count() - 1;
+	job->port = _M_port;
+
+	_M_resolve_job = job;
+
+	_M_state = RESOLVING_STATE;
+
+	// The job might be completed before submit() returns (if there are no
+	// worker threads).
+	if (!static_cast<http_server*>(_M_server)->_M_workers.submit(job)) {
+		_M_resolve_job = NULL;
+		delete job;
+
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+	}
+
+	return true;
+}
+
+void http_connection::resolved(unsigned fd, bool success)
+{
+	_M_resolve_job = NULL;
+
+	if (success) {
+		resume_backend_request(fd);
+		return;
+	}
+
+	logger::instance().log(logger::LOG_WARNING, "Couldn't resolve %s.", _M_host.data());
+
+	_M_error = http_error::GATEWAY_TIMEOUT;
+	_M_state = PREPARING_ERROR_PAGE_STATE;
+
+	if (!_M_in_ready_list) {
+		http_server* server = static_cast<http_server*>(_M_server);
+
+		_M_in_ready_list = 1;
+		server->_M_ready_list[server->_M_nready++] = fd;
+	}
+}
+#endif // PROXY
+
+void http_connection::wake_backend(int events)
+{
+	http_server* server = static_cast<http_server*>(_M_server);
+
+	tcp_connection* backend;
+	if (_M_rule->handler == rulelist::HTTP_HANDLER) {
+		backend = &server->_M_proxy_connections[_M_fd];
+	} else {
+		backend = &server->_M_fcgi_connections[_M_fd];
+	}
+
+	if (backend->_M_in_ready_list) {
+		return;
+	}
+
+	// Otherwise, the backend will receive an event.
+	if ((((events & tcp_server::READ) != 0) && (backend->_M_readable)) || \
+	    (((events & tcp_server::WRITE) != 0) && (backend->_M_writable))) {
+		backend->_M_in_ready_list = 1;
+		server->_M_ready_list[server->_M_nready++] = _M_fd;
+	}
+}
+
+void http_connection::detach_backend()
+{
+	http_server* server = static_cast<http_server*>(_M_server);
+
+#if !PROXY
+	cancel_hedge();
+#endif
+
+	tcp_connection* backend;
+	if (_M_rule->handler == rulelist::HTTP_HANDLER) {
+		server->_M_proxy_connections[_M_fd]._M_client = NULL;
+		backend = &server->_M_proxy_connections[_M_fd];
+	} else {
+		server->_M_fcgi_connections[_M_fd]._M_client = NULL;
+		backend = &server->_M_fcgi_connections[_M_fd];
+	}
+
+	// The backend will see it has no client anymore.
+	if (!backend->_M_in_ready_list) {
+		backend->_M_in_ready_list = 1;
+		server->_M_ready_list[server->_M_nready++] = _M_fd;
+	}
+
+#if !PROXY
+	_M_rule->backends.request_completed(_M_fd);
+#endif
+
+	_M_fd = -1;
+}
+
+void http_connection::resume_body(unsigned fd)
+{
+	// Otherwise, we will receive an event.
+	if ((_M_readable) && (!_M_in_ready_list)) {
+		http_server* server = static_cast<http_server*>(_M_server);
+
+		_M_in_ready_list = 1;
+		server->_M_ready_list[server->_M_nready++] = fd;
+	}
+}
+
+#if !PROXY
+void http_connection::probe_fcgi_backend()
+{
+	int sd;
+	if ((sd = _M_rule->backends.connect(_M_fd)) < 0) {
+		return;
+	}
+
+	http_server* server = static_cast<http_server*>(_M_server);
+
+	if (!server->add(sd, selector::WRITE, true)) {
+		socket_wrapper::close(sd);
+		return;
+	}
+
+	fcgi_connection* conn = &server->_M_fcgi_connections[sd];
+
+	conn->_M_out.reset();
+
+	if (!fastcgi::get_values(conn->_M_out)) {
+		server->remove(sd);
+		return;
+	}
+
+	conn->_M_backends = &_M_rule->backends;
+	conn->_M_timestamp = now::_M_time;
+
+	conn->_M_state = fcgi_connection::SENDING_GET_VALUES_STATE;
+
+	server->_M_connection_handlers[sd] = rulelist::FCGI_HANDLER;
+}
+
+unsigned http_connection::backend_hash()
+{
+	const char* cookie;
+	size_t cookielen;
+	switch (_M_rule->backends.get_hash_key(cookie, cookielen)) {
+		case backend_list::URL_KEY:
+			return backend_list::hash(_M_path.data(), _M_path.count());
+		case backend_list::COOKIE_KEY:
+			{
+				// There might be several Cookie headers.
+				unsigned char header;
+				const char* name;
+				unsigned short namelen;
+				const char* value;
+				unsigned short valuelen;
+				for (unsigned i = 0; _M_headers.get_header(i, header, name, namelen, value, valuelen); i++) {
+					if (header != http_headers::COOKIE_HEADER) {
+						continue;
+					}
+
+					// Search "name=value" in "name1=value1; name2=value2...".
+					const char* end = value + valuelen;
+					const char* ptr = value;
+					while (ptr < end) {
+						while ((ptr < end) && ((*ptr == ' ') || (*ptr == ';'))) {
+							ptr++;
+						}
+
+						const char* next = (const char*) memchr(ptr, ';', end - ptr);
+						if (!next) {
+							next = end;
+						}
+
+						if (((size_t) (next - ptr) > cookielen) && (ptr[cookielen] == '=') && (strncmp(ptr, cookie, cookielen) == 0)) {
+							return backend_list::hash(ptr + cookielen + 1, next - (ptr + cookielen + 1));
+						}
+
+						ptr = next;
+					}
+				}
+			}
+
+			// Without the cookie, the client's IP address is used.
+		default:
+			return backend_list::hash((const char*) &(((const struct sockaddr_in*) &_M_addr)->sin_addr), sizeof(struct in_addr));
+	}
+}
+
+bool http_connection::hedgeable() const
+{
+	// Only requests without body, the backend of which doesn't depend
+	// on the request.
+	return ((_M_rule->handler == rulelist::HTTP_HANDLER) && \
+	        (_M_rule->backends.get_policy() != backend_list::HASH) && \
+	        ((_M_method == http_method::GET) || (_M_method == http_method::HEAD)) && \
+	        (_M_request_body_size == 0) && \
+	        (!_M_relaying_body));
+}
+
+bool http_connection::send_hedge(unsigned fd)
+{
+	http_server* server = static_cast<http_server*>(_M_server);
+
+	const char* host;
+	unsigned short hostlen;
 	unsigned short port;
+	bool reused;
+
+	int sd;
+	if ((sd = _M_rule->backends.connect_hedge(_M_fd, host, hostlen, port, reused)) < 0) {
+		return false;
+	}
+
+	if (reused) {
+		server->_M_reused_backend_connections++;
+	} else {
+		if (!server->add(sd, selector::WRITE, true)) {
+			_M_rule->backends.request_cancelled(sd);
+			socket_wrapper::close(sd);
+
+			return false;
+		}
+
+		server->_M_backend_connections++;
+	}
+
+	if (!prepare_backend_request(fd, sd, host, hostlen, port, reused)) {
+		_M_rule->backends.request_cancelled(sd);
+
+		server->_M_proxy_connections[sd].free();
+		server->remove(sd);
+
+		return false;
+	}
+
+	logger::instance().log(logger::LOG_DEBUG, "[http_connection::send_hedge] (fd %d) Request sent to a second backend (fd %d).", fd, sd);
+
+	// The hedge doesn't use up a retry.
+	_M_hedge_fd = sd;
+
+	return true;
+}
+
+void http_connection::cancel_hedge()
+{
+	http_server* server = static_cast<http_server*>(_M_server);
+
+	if (_M_hedge_time != 0) {
+		server->remove_hedge(this);
+	}
+
+	if (_M_hedge_fd != -1) {
+		proxy_connection* hedge = &server->_M_proxy_connections[_M_hedge_fd];
+
+		// The backend will see it has no client anymore.
+		hedge->_M_client = NULL;
+
+		if (!hedge->_M_in_ready_list) {
+			hedge->_M_in_ready_list = 1;
+			server->_M_ready_list[server->_M_nready++] = _M_hedge_fd;
+		}
+
+		_M_rule->backends.request_cancelled(_M_hedge_fd);
+
+		_M_hedge_fd = -1;
+	}
+}
+
+void http_connection::backend_responding(unsigned sd)
+{
+	if (_M_hedge_time != 0) {
+		static_cast<http_server*>(_M_server)->remove_hedge(this);
+	}
+
+	if (_M_hedge_fd == -1) {
+		return;
+	}
+
+	// The first backend to answer wins.
+	if ((int) sd == _M_hedge_fd) {
+		_M_hedge_fd = _M_fd;
+		_M_fd = sd;
+	}
+
+	cancel_hedge();
+}
+
+bool http_connection::backend_failed(unsigned fd, unsigned sd, bool sent)
+{
+	// Has the second backend failed?
+	if ((int) sd == _M_hedge_fd) {
+		_M_rule->backends.request_completed(sd, true);
+		_M_hedge_fd = -1;
+
+		return true;
+	}
+
+	// Let the second backend answer.
+	if (_M_hedge_fd != -1) {
+		_M_rule->backends.request_completed(sd, true);
+
+		_M_fd = _M_hedge_fd;
+		_M_hedge_fd = -1;
+
+		return true;
+	}
+
+	if (_M_attempts > _M_rule->backends.get_retries()) {
+		cancel_hedge();
+		return false;
+	}
+
+	// Once sent, only the idempotent requests whose body is still
+	// available can be sent again.
+	if ((sent) && \
+	    ((!http_method::is_idempotent(_M_method)) || \
+	     (_M_relaying_body) || \
+	     ((!_M_payload_in_memory) && (_M_tmpfile == -1)))) {
+		cancel_hedge();
+		return false;
+	}
+
+	unsigned short error = _M_error;
+	_M_error = http_error::OK;
+
+	if ((!prepare_http_request(fd)) || (_M_error != http_error::OK)) {
+		// Has the request been built for another backend?
+		if ((_M_fd != -1) && (_M_fd != (int) sd)) {
+			http_server* server = static_cast<http_server*>(_M_server);
+
+			_M_rule->backends.request_completed(_M_fd);
+
+			if (_M_rule->handler == rulelist::HTTP_HANDLER) {
+				server->_M_proxy_connections[_M_fd].free();
+			} else {
+				server->_M_fcgi_connections[_M_fd].free();
+			}
+
+			server->remove(_M_fd);
+		}
+
+		_M_fd = sd;
+		_M_error = error;
+
+		cancel_hedge();
+
+		return false;
+	}
+
+	logger::instance().log(logger::LOG_INFO, "(fd %d) Request sent again to another backend (attempt %u).", fd, _M_attempts);
+
+	_M_rule->backends.request_completed(sd, true);
+
+	return true;
+}
+
+void http_connection::backend_timed_out(unsigned sd)
+{
+	_M_rule->backends.request_completed(sd, true);
+
+	if ((int) sd == _M_hedge_fd) {
+		_M_hedge_fd = -1;
+	} else if (_M_hedge_fd != -1) {
+		// Let the second backend answer.
+		_M_fd = _M_hedge_fd;
+		_M_hedge_fd = -1;
+	} else if (_M_hedge_time != 0) {
+		static_cast<http_server*>(_M_server)->remove_hedge(this);
+	}
+}
+
+bool http_connection::queue_request(unsigned fd)
+{
+	int pos;
+	if ((pos = _M_rule->backends.enqueue(fd)) < 0) {
+		// The queue is full.
+		_M_error = http_error::SERVICE_UNAVAILABLE;
+		return true;
+	}
+
+	_M_queue_pos = pos;
+	_M_state = QUEUED_STATE;
+
+	static_cast<http_server*>(_M_server)->_M_queued_requests++;
+
+	return true;
+}
+
+void http_connection::dequeued(unsigned fd)
+{
+	resume_backend_request(fd);
+}
+
+void http_connection::queue_timed_out(unsigned fd)
+{
+	_M_error = http_error::SERVICE_UNAVAILABLE;
+	_M_state = PREPARING_ERROR_PAGE_STATE;
+
+	if (!_M_in_ready_list) {
+		http_server* server = static_cast<http_server*>(_M_server);
+
+		_M_in_ready_list = 1;
+		server->_M_ready_list[server->_M_nready++] = fd;
+	}
+}
+#endif
+
+bool http_connection::serve_from_cache(unsigned fd, bool collapse)
+{
+	if ((_M_method != http_method::GET) && (_M_method != http_method::HEAD)) {
+		return false;
+	}
+
+	const char* value;
+	unsigned short valuelen;
+
+	// Requests with credentials are neither served from the cache nor
+	// stored.
+	if (_M_headers.get_value_known_header(http_headers::AUTHORIZATION_HEADER, value, &valuelen)) {
+		return false;
+	}
+
+	if (!build_cache_key()) {
+		return false;
+	}
+
+	response_cache* cache = &static_cast<http_server*>(_M_server)->_M_cache;
+
+	// Responses to HEAD requests have no body.
+	_M_store = (_M_method == http_method::GET);
+
+	// Does the client ask for a response from the backend?
+	if (((_M_headers.get_value_known_header(http_headers::CACHE_CONTROL_HEADER, value, &valuelen)) && (memcasemem(value, valuelen, "no-cache", 8))) || \
+	    ((_M_headers.get_value_known_header(http_headers::PRAGMA_HEADER, value, &valuelen)) && (memcasemem(value, valuelen, "no-cache", 8)))) {
+		cache->miss();
+		return false;
+	}
+
+	if ((_M_cache_entry = cache->lookup(_M_vhost->name, _M_vhost->namelen, _M_cache_key.data(), _M_cache_key.count(), _M_in.data(), _M_request_header_size)) == NULL) {
+		if ((collapse) && (collapse_request(fd))) {
+			return true;
+		}
+
+		cache->miss();
+		return false;
+	}
+
+	if (response_cache::fresh(_M_cache_entry)) {
+		cache->hit();
+	} else if ((_M_cache_entry->revalidating) && (response_cache::stale_while_revalidate(_M_cache_entry))) {
+		// Another request is refreshing the response.
+		cache->stale_hit();
+	} else {
+		// Refresh the response, the stale one is kept in case the
+		// backend fails.
+		if (response_cache::stale_while_revalidate(_M_cache_entry)) {
+			_M_cache_entry->revalidating = true;
+			_M_revalidating = 1;
+		} else {
+			if (!response_cache::stale_if_error(_M_cache_entry)) {
+				release_cache_entry();
+			}
+
+			if ((collapse) && (collapse_request(fd))) {
+				return true;
+			}
+		}
+
+		cache->miss();
+		return false;
+	}
+
+	// The response is not stored again.
+	_M_store = 0;
+
+	keep_alive();
+
+	if (!send_cached_response(fd)) {
+		release_cache_entry();
+
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+	}
+
+	return true;
+}
+
+bool http_connection::build_cache_key(bool cookies)
+{
+	_M_cache_key.reset();
+
+	if (_M_rule->microcache_ttl == 0) {
+		if (!_M_cache_key.append(_M_path.data(), _M_path.count())) {
+			return false;
+		}
+	} else {
+		const char* path = _M_path.data();
+		const char* end = path + _M_path.count();
+
+		const char* query = (const char*) memchr(path, '?', end - path);
+		if (!query) {
+			query = end;
+		}
+
+		if (!_M_cache_key.append(path, query - path)) {
+			return false;
+		}
+
+		// Skip the ignored query parameters.
+		const char* fragment = (const char*) memchr(query, '#', end - query);
+		if (fragment) {
+			end = fragment;
+		}
+
+		char separator = '?';
+		const char* ptr = query + 1;
+		while (ptr < end) {
+			const char* next = (const char*) memchr(ptr, '&', end - ptr);
+			if (!next) {
+				next = end;
+			}
+
+			if (next > ptr) {
+				const char* equal = (const char*) memchr(ptr, '=', next - ptr);
+				if (!equal) {
+					equal = next;
+				}
+
+				if (!_M_rule->microcache_ignore_query.exists(ptr, equal - ptr)) {
+					if ((!_M_cache_key.append(separator)) || (!_M_cache_key.append(ptr, next - ptr))) {
+						return false;
+					}
+
+					separator = '&';
+				}
+			}
+
+			ptr = next + 1;
+		}
+
+		// The cookies which are not ignored are part of the key (there
+		// might be several Cookie headers).
+		unsigned char header;
+		const char* name;
+		unsigned short namelen;
+		const char* value;
+		unsigned short valuelen;
+		for (unsigned i = 0; (cookies) && (_M_headers.get_header(i, header, name, namelen, value, valuelen)); i++) {
+			if (header != http_headers::COOKIE_HEADER) {
+				continue;
+			}
+
+			// "name1=value1; name2=value2...".
+			end = value + valuelen;
+			ptr = value;
+			while (ptr < end) {
+				while ((ptr < end) && ((*ptr == ' ') || (*ptr == ';'))) {
+					ptr++;
+				}
+
+				const char* next = (const char*) memchr(ptr, ';', end - ptr);
+				if (!next) {
+					next = end;
+				}
+
+				if (next > ptr) {
+					const char* equal = (const char*) memchr(ptr, '=', next - ptr);
+					if (!equal) {
+						equal = next;
+					}
+
+					if (!_M_rule->microcache_ignore_cookies.exists(ptr, equal - ptr)) {
+						if ((!_M_cache_key.append('\n')) || (!_M_cache_key.append(ptr, next - ptr))) {
+							return false;
+						}
+					}
+				}
+
+				ptr = next;
+			}
+		}
+	}
+
+	// Too long to be cached?
+	return (_M_cache_key.count() <= (size_t) (0xffff - _M_vhost->namelen));
+}
+
+bool http_connection::collapse_request(unsigned fd)
+{
+	response_cache* cache = &static_cast<http_server*>(_M_server)->_M_cache;
+
+	if ((!_M_store) || (!cache->collapsing())) {
+		return false;
+	}
+
+	response_cache::fetch* fetch;
+	if ((fetch = cache->get_fetch(_M_vhost->name, _M_vhost->namelen, _M_cache_key.data(), _M_cache_key.count())) == NULL) {
+		// The identical requests will wait for the response to this one.
+		_M_fetch = cache->start_fetch(_M_vhost->name, _M_vhost->namelen, _M_cache_key.data(), _M_cache_key.count());
+		return false;
+	}
+
+	if (!cache->wait(fetch, fd)) {
+		return false;
+	}
+
+	_M_fetch = fetch;
+	_M_waiter = fd;
+
+	_M_error = http_error::OK;
+
+	_M_state = WAITING_FOR_RESPONSE_STATE;
+
+	return true;
+}
+
+void http_connection::response_ready(unsigned fd)
+{
+	_M_fetch = NULL;
+
+	// The request has not timed out while waiting.
+	_M_timestamp = now::_M_time;
+
+	_M_state = PROCESSING_COLLAPSED_REQUEST_STATE;
+
+	if (!_M_in_ready_list) {
+		http_server* server = static_cast<http_server*>(_M_server);
+
+		_M_in_ready_list = 1;
+		server->_M_ready_list[server->_M_nready++] = fd;
+	}
+}
+
+bool http_connection::process_collapsed_request(unsigned fd)
+{
+	// The stale response might have been replaced.
+	release_cache_entry();
+
+	if (serve_from_cache(fd, false)) {
+		return true;
+	}
+
+	return process_non_local_handler(fd);
+}
+
+void http_connection::end_fetch()
+{
+	if (!_M_fetch) {
+		return;
+	}
+
+	http_server* server = static_cast<http_server*>(_M_server);
+
+	int fd;
+	while ((fd = server->_M_cache.next_waiter(_M_fetch)) != -1) {
+		server->_M_http_connections[fd].response_ready(fd);
+	}
+
+	server->_M_cache.end_fetch(_M_fetch);
+	_M_fetch = NULL;
+}
+
+bool http_connection::send_cached_response(unsigned fd)
+{
+	const response_cache::entry* entry = _M_cache_entry;
+
+	_M_out.reset();
+
+	if ((!_M_out.append(entry->headers, entry->headerslen)) || \
+	    (!_M_out.format("Age: %ld\r\n", (long) MAX(now::_M_time - entry->date, 0)))) {
+		return false;
+	}
+
+	if (_M_keep_alive) {
+		if (!_M_out.append("Connection: Keep-Alive\r\n", 24)) {
+			return false;
+		}
+	} else {
+		if (!_M_out.append("Connection: close\r\n", 19)) {
+			return false;
+		}
+	}
+
+	if (!_M_out.format("Content-Length: %lld\r\n\r\n", entry->size)) {
+		return false;
+	}
+
+	_M_response_header_size = _M_out.count();
+
+	_M_filesize = entry->size;
+
+	if ((entry->fd == -1) || (_M_method == http_method::HEAD)) {
+		_M_payload_in_memory = 1;
+	} else {
+		_M_payload_in_memory = 0;
 
-#if !PROXY
-	if ((_M_fd = _M_rule->backends.connect(host, hostlen, port)) < 0) {
-		_M_error = http_error::GATEWAY_TIMEOUT;
-		return true;
+		// The body is sent from the cache's file.
+		_M_tmpfile = entry->fd;
+
+		socket_wrapper::cork(fd);
 	}
-#else
-	host = _M_host.data();
-	hostlen = _M_host.count() - 1;
 
-	port = _M_port;
+	_M_cached = 1;
 
-	if ((_M_fd = socket_wrapper::connect(_M_host.data(), port)) < 0) {
-		_M_error = http_error::GATEWAY_TIMEOUT;
-		return true;
+	_M_error = http_error::OK;
+
+	_M_state = SENDING_BACKEND_HEADERS_STATE;
+
+	return true;
+}
+
+bool http_connection::serve_stale(unsigned fd)
+{
+	if ((!_M_cache_entry) || (_M_cached) || (!response_cache::stale_if_error(_M_cache_entry))) {
+		return false;
 	}
-#endif
 
-	if (!static_cast<http_server*>(_M_server)->add(_M_fd, selector::WRITE, true)) {
-		socket_wrapper::close(_M_fd);
-		_M_fd = -1;
+	end_fetch();
 
-		_M_error = http_error::INTERNAL_SERVER_ERROR;
-		return true;
+	// The rest of the request body won't be read.
+	if (relaying_body()) {
+		_M_keep_alive = 0;
 	}
 
-	// Get Connection header.
-	keep_alive();
+	if (!send_cached_response(fd)) {
+		return false;
+	}
 
-	if (_M_rule->handler == rulelist::HTTP_HANDLER) {
-		buffer* out = &(static_cast<http_server*>(_M_server)->_M_proxy_connections[_M_fd]._M_out);
+	static_cast<http_server*>(_M_server)->_M_cache.stale_hit();
 
-		out->reset();
+	return true;
+}
 
-		if (!out->format("%s %.*s HTTP/1.1\r\n", http_method::get_method(_M_method), _M_path.count(), _M_path.data())) {
-			_M_error = http_error::INTERNAL_SERVER_ERROR;
-			return true;
-		}
+bool http_connection::cacheable(unsigned short status_code, off_t size) const
+{
+	return ((_M_store) && (static_cast<http_server*>(_M_server)->_M_cache.storable(status_code, _M_headers, size, _M_rule->microcache_ttl)));
+}
 
-		if (!_M_headers.add_known_header(http_headers::CONNECTION_HEADER, "close", 5, true)) {
-			_M_error = http_error::INTERNAL_SERVER_ERROR;
-			return true;
-		}
+void http_connection::cache_response(unsigned short status_code)
+{
+	// The stale response is not needed anymore.
+	release_cache_entry();
 
-		_M_headers.remove_known_header(http_headers::KEEP_ALIVE_HEADER);
-		_M_headers.remove_known_header(http_headers::PROXY_CONNECTION_HEADER);
+	if (!_M_store) {
+		return;
+	}
 
-		char string[512];
-		size_t len;
-		if (port == url_parser::HTTP_DEFAULT_PORT) {
-			len = snprintf(string, sizeof(string), "%.*s", hostlen, host);
-		} else {
-			len = snprintf(string, sizeof(string), "%.*s:%u", hostlen, host, port);
-		}
+	// Once the response has been stored, the requests waiting for it
+	// are served from the cache.
+	store_response(status_code);
 
-		if (!_M_headers.add_known_header(http_headers::HOST_HEADER, string, len, true)) {
-			_M_error = http_error::INTERNAL_SERVER_ERROR;
-			return true;
+	end_fetch();
+}
+
+bool http_connection::add_chunked_data(const char* buf, size_t len)
+{
+	if ((_M_rule->max_body_size > 0) && ((off_t) (_M_request_body_size + len) > _M_rule->max_body_size)) {
+		_M_error = http_error::REQUEST_ENTITY_TOO_LARGE;
+		return false;
+	}
+
+	if (_M_relaying_body) {
+		// The chunks are passed through to HTTP backends.
+		if ((_M_rule->handler != rulelist::HTTP_HANDLER) && (!fastcgi::stdin_stream(REQUEST_ID, buf, len, _M_body))) {
+			return false;
+		}
+	} else {
+		// The FCGI_STDIN records are added while sending the body.
+		if (!static_cast<http_server*>(_M_server)->_M_tmpfiles.write(_M_tmpfile, buf, len)) {
+			return false;
 		}
+	}
 
-		if (!_M_headers.serialize(*out)) {
-			_M_error = http_error::INTERNAL_SERVER_ERROR;
+	_M_request_body_size += len;
+
+	return true;
+}
+
+bool http_connection::expects_continue() const
+{
+	// 100 (Continue) is not sent to HTTP/1.0 clients.
+	if ((_M_major_number != 1) || (_M_minor_number == 0)) {
+		return false;
+	}
+
+	const char* value;
+	unsigned short valuelen;
+	return ((_M_headers.get_value_known_header(http_headers::EXPECT_HEADER, value, &valuelen)) && (memcasemem(value, valuelen, "100-continue", 12)));
+}
+
+bool http_connection::send_continue(unsigned fd)
+{
+	logger::instance().log(logger::LOG_DEBUG, "[http_connection::send_continue] (fd %d) Sending 100 Continue.", fd);
+
+	// The interim response is sent before the body is read, the socket
+	// buffer has room for it.
+	return (socket_wrapper::write(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25) == 25);
+}
+
+bool http_connection::spill_throttled(unsigned fd)
+{
+	return ((_M_tmpfile != -1) && (static_cast<http_server*>(_M_server)->_M_tmpfiles.throttled(_M_tmpfile, fd)));
+}
+
+bool http_connection::keep_payload_in_memory(off_t size)
+{
+	http_server* server = static_cast<http_server*>(_M_server);
+
+	if ((size > (off_t) server->_M_max_payload_in_memory) || (server->_M_payload_memory + size > server->_M_max_payload_memory)) {
+		return false;
+	}
+
+	server->_M_payload_memory += size;
+	_M_payload_memory += size;
+
+	return true;
+}
+
+void http_connection::store_response(unsigned short status_code)
+{
+	http_server* server = static_cast<http_server*>(_M_server);
+
+	// The response headers begin with the status line.
+	const char* status_line = _M_out.data();
+	const char* eol = (const char*) memchr(status_line, '\n', _M_out.count());
+	if (!eol) {
+		return;
+	}
+
+	const char* body;
+	int file;
+	if (_M_payload_in_memory) {
+		body = _M_body.data() + _M_backend_response_header_size;
+		file = -1;
+	} else {
+		body = NULL;
+		file = _M_tmpfile;
+	}
+
+	response_cache::entry* entry = server->_M_cache.add(_M_vhost->name, _M_vhost->namelen, _M_cache_key.data(), _M_cache_key.count(), _M_in.data(), _M_request_header_size, status_code, status_line, (eol + 1) - status_line, _M_headers, body, file, _M_filesize, _M_rule->microcache_ttl);
+	if (!entry) {
+		return;
+	}
+
+	if ((file != -1) && (entry->fd == file)) {
+		// The cache has kept the file, the response is sent from it.
+		server->_M_tmpfiles.detach(file);
+
+		_M_cache_entry = entry;
+		_M_cached = 1;
+	} else {
+		server->_M_cache.release(entry);
+	}
+}
+
+void http_connection::release_cache_entry()
+{
+	if (!_M_cache_entry) {
+		return;
+	}
+
+	if (_M_revalidating) {
+		_M_cache_entry->revalidating = false;
+		_M_revalidating = 0;
+	}
+
+	// The file belongs to the cache.
+	if (_M_tmpfile == _M_cache_entry->fd) {
+		_M_tmpfile = -1;
+	}
+
+	static_cast<http_server*>(_M_server)->_M_cache.release(_M_cache_entry);
+	_M_cache_entry = NULL;
+
+	_M_cached = 0;
+}
+
+bool http_connection::purge()
+{
+	if (!static_cast<http_server*>(_M_server)->purge_allowed(&_M_addr)) {
+		_M_error = http_error::FORBIDDEN;
+		return true;
+	}
+
+	const char* path = _M_path.data();
+	unsigned short pathlen = _M_path.count();
+	bool any_cookies = false;
+
+	// The microcached responses are stored without the ignored query
+	// parameters and with the cookies of the request which fetched them.
+	if ((_M_rule->microcache_ttl > 0) && ((pathlen == 0) || (path[pathlen - 1] != '*'))) {
+		if (!build_cache_key(false)) {
+			// Too long to have been cached.
+			not_found();
 			return true;
 		}
 
-		static_cast<http_server*>(_M_server)->_M_proxy_connections[_M_fd]._M_fd = fd;
-		static_cast<http_server*>(_M_server)->_M_proxy_connections[_M_fd]._M_client = this;
+		path = _M_cache_key.data();
+		pathlen = _M_cache_key.count();
+		any_cookies = true;
+	}
 
-		static_cast<http_server*>(_M_server)->_M_proxy_connections[_M_fd]._M_timestamp = now::_M_time;
-	} else {
-		buffer* out = &(static_cast<http_server*>(_M_server)->_M_fcgi_connections[_M_fd]._M_out);
+	unsigned count = static_cast<http_server*>(_M_server)->_M_cache.purge(_M_vhost->name, _M_vhost->namelen, path, pathlen, any_cookies);
 
-		out->reset();
+	logger::instance().log(logger::LOG_INFO, "Purged %u response(s) of %s%.*s from the cache.", count, _M_vhost->name, _M_path.count(), _M_path.data());
+
+	if (count == 0) {
+		not_found();
+		return true;
+	}
+
+	keep_alive();
+
+	_M_body.reset();
+	if (!_M_body.format("%u response(s) purged.\n", count)) {
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return true;
+	}
+
+	http_headers* headers = &(static_cast<http_server*>(_M_server)->_M_headers);
+	headers->reset();
 
-		if (!fastcgi::begin_request(REQUEST_ID, fastcgi::FCGI_RESPONDER, false, *out)) {
+	if (!headers->add_known_header(http_headers::DATE_HEADER, &now::_M_tm)) {
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return true;
+	}
+
+	if (_M_keep_alive) {
+		if (!headers->add_known_header(http_headers::CONNECTION_HEADER, "Keep-Alive", 10, false)) {
 			_M_error = http_error::INTERNAL_SERVER_ERROR;
 			return true;
 		}
-
-		if (!add_fcgi_params(fd, out)) {
+	} else {
+		if (!headers->add_known_header(http_headers::CONNECTION_HEADER, "close", 5, false)) {
 			_M_error = http_error::INTERNAL_SERVER_ERROR;
 			return true;
 		}
+	}
 
-		if (_M_payload_in_memory) {
-			if (!fastcgi::stdin_stream(REQUEST_ID, _M_in.data() + _M_request_header_size, _M_request_body_size, *out)) {
-				_M_error = http_error::INTERNAL_SERVER_ERROR;
-				return true;
-			}
+	if (!headers->add_known_header(http_headers::SERVER_HEADER, WEBSERVER_NAME, sizeof(WEBSERVER_NAME) - 1, false)) {
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return true;
+	}
 
-			if (!fastcgi::stdin_stream(REQUEST_ID, NULL, 0, *out)) {
-				_M_error = http_error::INTERNAL_SERVER_ERROR;
-				return true;
-			}
-		} else {
-			if (!fastcgi::stdin_stream(REQUEST_ID, NULL, 0, _M_tmpfile, _M_tmpfilesize)) {
-				_M_error = http_error::INTERNAL_SERVER_ERROR;
-				return true;
-			}
-		}
+	char num[32];
+	int numlen = snprintf(num, sizeof(num), "%lu", (unsigned long) _M_body.count());
+	if (!headers->add_known_header(http_headers::CONTENT_LENGTH_HEADER, num, numlen, false)) {
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return true;
+	}
 
-		static_cast<http_server*>(_M_server)->_M_fcgi_connections[_M_fd]._M_fd = fd;
-		static_cast<http_server*>(_M_server)->_M_fcgi_connections[_M_fd]._M_client = this;
+	if (!headers->add_known_header(http_headers::CONTENT_TYPE_HEADER, "text/plain", 10, false)) {
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return true;
+	}
 
-		static_cast<http_server*>(_M_server)->_M_fcgi_connections[_M_fd]._M_timestamp = now::_M_time;
+	_M_out.reset();
+	if ((!_M_out.append("HTTP/1.1 200 OK\r\n", 17)) || (!headers->serialize(_M_out))) {
+		_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return true;
 	}
 
-	static_cast<http_server*>(_M_server)->_M_connection_handlers[_M_fd] = _M_rule->handler;
+	_M_response_header_size = _M_out.count();
+
+	_M_bodyp = &_M_body;
+	_M_filesize = _M_body.count();
+
+	_M_error = http_error::OK;
+
+	_M_state = SENDING_TWO_BUFFERS_STATE;
 
 	return true;
 }
@@ -1500,13 +3655,9 @@ bool http_connection::add_fcgi_params(unsigned fd, buffer* out)
 		return false;
 	}
 
-	if (!params.add("SERVER_NAME", 11, _M_vhost->name, _M_vhost->namelen, false, false)) {
-		return false;
-	}
-
-	char port[32];
-	unsigned short valuelen = snprintf(port, sizeof(port), "%u", static_cast<http_server*>(_M_server)->_M_port);
-	if (!params.add("SERVER_PORT", 11, port, valuelen, false, false)) {
+	// SERVER_SOFTWARE, SERVER_NAME, SERVER_PORT, DOCUMENT_ROOT,
+	// SERVER_PROTOCOL and GATEWAY_INTERFACE.
+	if (!params.add(_M_rule->fcgi_params.data(), _M_rule->fcgi_params.count())) {
 		return false;
 	}
 
@@ -1517,29 +3668,29 @@ bool http_connection::add_fcgi_params(unsigned fd, buffer* out)
 
 	const unsigned char* ip = (const unsigned char*) &(((struct sockaddr_in*) &_M_addr)->sin_addr);
 	char addr[32];
-	valuelen = snprintf(addr, sizeof(addr), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+	unsigned short valuelen = snprintf(addr, sizeof(addr), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
 	if (!params.add("REMOTE_ADDR", 11, addr, valuelen, false, false)) {
 		return false;
 	}
 
+	char port[32];
 	valuelen = snprintf(port, sizeof(port), "%u", ntohs(((struct sockaddr_in*) &_M_addr)->sin_port));
 	if (!params.add("REMOTE_PORT", 11, port, valuelen, false, false)) {
 		return false;
 	}
 
-	if (!params.add("DOCUMENT_ROOT", 13, _M_vhost->root, _M_vhost->rootlen, false, false)) {
-		return false;
-	}
-
 	if (!params.add("REQUEST_URI", 11, _M_path.data(), _M_path.count(), false, false)) {
 		return false;
 	}
 
-	char path[PATH_MAX + 1];
-	memcpy(path, _M_vhost->root, _M_vhost->rootlen);
-	memcpy(path + _M_vhost->rootlen, _M_decoded_path.data(), _M_decoded_path.count());
+	// Document root + decoded path.
+	file_wrapper::io_vector path[2];
+	path[0].iov_base = (void*) _M_vhost->root;
+	path[0].iov_len = _M_vhost->rootlen;
+	path[1].iov_base = _M_decoded_path.data();
+	path[1].iov_len = _M_decoded_path.count();
 
-	if (!params.add("SCRIPT_FILENAME", 15, path, _M_vhost->rootlen + _M_decoded_path.count(), false, false)) {
+	if (!params.add("SCRIPT_FILENAME", 15, path, 2)) {
 		return false;
 	}
 
@@ -1551,26 +3702,28 @@ bool http_connection::add_fcgi_params(unsigned fd, buffer* out)
 		return false;
 	}
 
-	if (!params.add("SERVER_PROTOCOL", 15, "HTTP/1.1", 8, false, false)) {
-		return false;
-	}
-
-	if (!params.add("GATEWAY_INTERFACE", 17, "CGI/1.1", 7, false, false)) {
-		return false;
-	}
-
 	unsigned char header;
 	const char* name;
 	unsigned short namelen;
 
 	for (unsigned i = 0; _M_headers.get_header(i, header, name, namelen, value, valuelen); i++) {
-		if (!params.add(name, namelen, value, valuelen, true, true)) {
+		if (header == http_headers::UNKNOWN_HEADER) {
+			if (!params.add(name, namelen, value, valuelen, true, true)) {
+				return false;
+			}
+
+			continue;
+		}
+
+		// The names of the known headers are already transformed.
+		name = http_headers::get_cgi_name(header, namelen);
+		if (!params.add(name, namelen, value, valuelen, false, false)) {
 			return false;
 		}
 
-		// Content-Type or Content-Length?
+		// Content-Type or Content-Length (without "HTTP_")?
 		if ((header == http_headers::CONTENT_TYPE_HEADER) || (header == http_headers::CONTENT_LENGTH_HEADER)) {
-			if (!params.add(name, namelen, value, valuelen, false, true)) {
+			if (!params.add(name + 5, namelen - 5, value, valuelen, false, false)) {
 				return false;
 			}
 		}
@@ -1602,6 +3755,68 @@ bool http_connection::keep_alive()
 	}
 }
 
+bool http_connection::accepts_gzip() const
+{
+	const char* value;
+	unsigned short valuelen;
+	if (!_M_headers.get_value_known_header(http_headers::ACCEPT_ENCODING_HEADER, value, &valuelen)) {
+		return false;
+	}
+
+	// Accept-Encoding: gzip;q=1.0, identity; q=0.5, *;q=0
+	int gzip = -1;
+	int any = -1;
+
+	const char* end = value + valuelen;
+	const char* ptr = value;
+
+	while (ptr < end) {
+		// Skip separators.
+		while ((ptr < end) && ((*ptr == ',') || (*ptr == ' ') || (*ptr == '\t'))) {
+			ptr++;
+		}
+
+		// Coding.
+		const char* coding = ptr;
+		while ((ptr < end) && (*ptr != ',') && (*ptr != ';') && (*ptr != ' ') && (*ptr != '\t')) {
+			ptr++;
+		}
+
+		size_t len = ptr - coding;
+		if (len == 0) {
+			continue;
+		}
+
+		// Parameters (only the quality value is relevant).
+		int accepted = 1;
+		while ((ptr < end) && (*ptr != ',')) {
+			if (((*ptr == 'q') || (*ptr == 'Q')) && (ptr + 1 < end) && (ptr[1] == '=') && ((ptr[-1] == ';') || (ptr[-1] == ' ') || (ptr[-1] == '\t'))) {
+				ptr += 2;
+
+				// A quality value of 0 means "not acceptable".
+				accepted = 0;
+				while ((ptr < end) && ((*ptr == '0') || (*ptr == '.'))) {
+					ptr++;
+				}
+
+				if ((ptr < end) && (*ptr >= '1') && (*ptr <= '9')) {
+					accepted = 1;
+				}
+			} else {
+				ptr++;
+			}
+		}
+
+		if (((len == 4) && (strncasecmp(coding, "gzip", 4) == 0)) || ((len == 6) && (strncasecmp(coding, "x-gzip", 6) == 0))) {
+			gzip = accepted;
+		} else if ((len == 1) && (*coding == '*')) {
+			any = accepted;
+		}
+	}
+
+	return (gzip != -1) ? (gzip == 1) : (any == 1);
+}
+
 off_t http_connection::compute_content_length(off_t filesize) const
 {
 	size_t nranges = _M_ranges.count();
@@ -1631,8 +3846,48 @@ off_t http_connection::compute_content_length(off_t filesize) const
 	return content_length;
 }
 
-bool http_connection::prepare_error_page()
+bool http_connection::build_listing_chunk()
+{
+	_M_body.reset();
+
+	// Reserve space for the chunk size.
+	if (!_M_body.append("00000000\r\n", 10)) {
+		return false;
+	}
+
+	if (!_M_vhost->dir_listing->render(*_M_listing, _M_body, dirlisting::ENTRIES_PER_PAGE)) {
+		return false;
+	}
+
+	size_t len = _M_body.count() - 10;
+
+	char size[9];
+	snprintf(size, sizeof(size), "%08x", (unsigned) len);
+	memcpy(_M_body.data(), size, 8);
+
+	if (!_M_body.append("\r\n", 2)) {
+		return false;
+	}
+
+	// Last chunk?
+	if (_M_listing->done) {
+		if (!_M_body.append("0\r\n\r\n", 5)) {
+			return false;
+		}
+	}
+
+	_M_filesize += len;
+
+	return true;
+}
+
+bool http_connection::prepare_error_page(unsigned fd)
 {
+	// Has a backend failed?
+	if ((_M_error >= http_error::INTERNAL_SERVER_ERROR) && (serve_stale(fd))) {
+		return true;
+	}
+
 	if (!http_error::build_page(this)) {
 		return false;
 	}
@@ -1687,6 +3942,22 @@ const char* http_connection::state_to_string(unsigned state)
 			return "SENDING_BACKEND_BODY_STATE";
 		case REQUEST_COMPLETED_STATE:
 			return "REQUEST_COMPLETED_STATE";
+		case SENDING_CHUNKED_LISTING_STATE:
+			return "SENDING_CHUNKED_LISTING_STATE";
+		case WAITING_FOR_FILESYSTEM_STATE:
+			return "WAITING_FOR_FILESYSTEM_STATE";
+		case PROCESSING_LOCAL_REQUEST_STATE:
+			return "PROCESSING_LOCAL_REQUEST_STATE";
+		case SENDING_BACKEND_STREAM_STATE:
+			return "SENDING_BACKEND_STREAM_STATE";
+		case RESOLVING_STATE:
+			return "RESOLVING_STATE";
+		case QUEUED_STATE:
+			return "QUEUED_STATE";
+		case WAITING_FOR_RESPONSE_STATE:
+			return "WAITING_FOR_RESPONSE_STATE";
+		case PROCESSING_COLLAPSED_REQUEST_STATE:
+			return "PROCESSING_COLLAPSED_REQUEST_STATE";
 		default:
 			return "(unknown)";
 	}
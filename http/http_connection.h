@@ -2,8 +2,10 @@
 #define HTTP_CONNECTION_H
 
 #include <unistd.h>
+#include <sys/stat.h>
 #include "net/tcp_connection.h"
 #include "net/url_parser.h"
+#include "net/splicer.h"
 #include "http/chunked_parser.h"
 #include "http/virtual_hosts.h"
 #include "http/rulelist.h"
@@ -11,6 +13,7 @@
 #include "http/fastcgi.h"
 #include "http/http_method.h"
 #include "http/http_error.h"
+#include "http/response_cache.h"
 #include "file/file_wrapper.h"
 
 struct http_connection : public tcp_connection,
@@ -24,6 +27,10 @@ struct http_connection : public tcp_connection,
 	static const size_t QUERY_STRING_MEAN_SIZE;
 	static const size_t BODY_MEAN_SIZE;
 
+	// The request body is not read while this many bytes of it are
+	// waiting to be sent to the backend.
+	static const size_t MAX_BUFFERED_BODY;
+
 	// HTTP states.
 	static const unsigned char BEGIN_REQUEST_STATE;
 	static const unsigned char READING_HEADERS_STATE;
@@ -41,9 +48,19 @@ struct http_connection : public tcp_connection,
 	static const unsigned char SENDING_BACKEND_HEADERS_STATE;
 	static const unsigned char SENDING_BACKEND_BODY_STATE;
 	static const unsigned char REQUEST_COMPLETED_STATE;
+	static const unsigned char SENDING_CHUNKED_LISTING_STATE;
+	static const unsigned char WAITING_FOR_FILESYSTEM_STATE;
+	static const unsigned char PROCESSING_LOCAL_REQUEST_STATE;
+	static const unsigned char SENDING_BACKEND_STREAM_STATE;
+	static const unsigned char RESOLVING_STATE;
+	static const unsigned char QUEUED_STATE;
+	static const unsigned char WAITING_FOR_RESPONSE_STATE;
+	static const unsigned char PROCESSING_COLLAPSED_REQUEST_STATE;
 
 	static const unsigned short REQUEST_ID;
 
+	static const off_t READAHEAD_WINDOW;
+
 	static url_parser _M_url;
 
 	static struct tm _M_last_modified;
@@ -52,12 +69,50 @@ struct http_connection : public tcp_connection,
 
 	int _M_tmpfile;
 
+	// Payloads in memory accounted in the server's budget [bytes].
+	size_t _M_payload_memory;
+
+#if HAVE_SPLICE
+	// Pipe through which the backend's response is relayed.
+	int _M_pipe[2];
+	size_t _M_piped; // Number of bytes in the pipe.
+#endif // HAVE_SPLICE
+
 	virtual_hosts::vhost* _M_vhost;
 
 	rulelist::rule* _M_rule;
 
 	static rulelist::rule _M_http_rule;
 
+	// Number of times the request has been sent (the hedge, if any, is
+	// not counted).
+	unsigned _M_attempts;
+
+	// Second backend the request has been sent to (hedged request, -1:
+	// none).
+	int _M_hedge_fd;
+
+	// When the request is due to be sent to a second backend [us] (0:
+	// not planned).
+	unsigned long long _M_hedge_time;
+	unsigned _M_hedge_index; // In the server's list of planned hedges.
+
+	// Position in the queue of the rule (QUEUED_STATE).
+	unsigned _M_queue_pos;
+
+	// Response of the cache being sent, or stale response kept in case
+	// the backend fails (NULL: none).
+	response_cache::entry* _M_cache_entry;
+
+	// Request to the backend whose response is awaited by the identical
+	// requests (sent by this request, or by another one in
+	// WAITING_FOR_RESPONSE_STATE) (NULL: none).
+	response_cache::fetch* _M_fetch;
+
+	// Descriptor under which the request waits for the response to an
+	// identical request (WAITING_FOR_RESPONSE_STATE).
+	unsigned _M_waiter;
+
 	http_headers _M_headers;
 
 	buffer _M_host;
@@ -65,16 +120,47 @@ struct http_connection : public tcp_connection,
 	buffer _M_decoded_path;
 	buffer _M_query_string;
 
+	// Path (with query string) under which the response is cached.
+	buffer _M_cache_key;
+
 	buffer _M_body;
 	buffer* _M_bodyp;
 
+	dirlisting::stream* _M_listing;
+
+	// Filesystem operation running in a worker thread.
+	struct filesystem_job;
+	filesystem_job* _M_fs_job;
+
+#if PROXY
+	// Name of the host being resolved in a worker thread.
+	struct resolve_job;
+	resolve_job* _M_resolve_job;
+#endif
+
+	// State once the request can be sent (request body being relayed).
+	unsigned char _M_resume_state;
+
+	// Result of looking up the requested file.
+	struct stat _M_stat;
+
+	// Large files are read ahead of the send offset by the worker threads.
+	off_t _M_prefetched;
+
+	// Bundle the file is served from (referenced until the request is
+	// completed).
+	site_bundle* _M_bundle;
+	const site_bundle::entry* _M_bundle_entry;
+
+	// Offset of the file's data in _M_fd.
+	off_t _M_file_offset;
+
 	size_t _M_request_header_size;
 	size_t _M_request_body_size;
 	size_t _M_response_header_size;
 	size_t _M_backend_response_header_size;
 
 	off_t _M_filesize;
-	off_t _M_tmpfilesize;
 
 	range_list _M_ranges;
 	size_t _M_nrange;
@@ -105,6 +191,18 @@ struct http_connection : public tcp_connection,
 
 	unsigned _M_payload_in_memory:1;
 
+	unsigned _M_streaming:1; // Relaying the backend's response as it arrives.
+
+	unsigned _M_relaying_body:1; // Relaying the request body to the backend as it arrives.
+
+	unsigned _M_large_file:1;
+
+	unsigned _M_gzip:1; // Sending the precompressed variant.
+
+	unsigned _M_cached:1; // Sending the response of _M_cache_entry.
+	unsigned _M_store:1; // Store the backend's response in the cache.
+	unsigned _M_revalidating:1; // Refreshing the stale response of _M_cache_entry.
+
 	// Constructor.
 	http_connection();
 
@@ -147,12 +245,166 @@ struct http_connection : public tcp_connection,
 	// Process request.
 	virtual bool process_request(unsigned fd);
 
+	// Process request for a file in a bundle.
+	bool process_bundle_request(unsigned fd, const char* urlpath, unsigned short pathlen);
+
+	// Process request for local handler (once the file has been looked up).
+	bool process_local_request(unsigned fd);
+
+	// Read ahead the next window of a large file.
+	bool prefetch(unsigned fd);
+
+	// Submit filesystem job.
+	bool submit_filesystem_job(filesystem_job* job);
+
+	// Filesystem job has been completed.
+	void filesystem_job_completed(filesystem_job* job);
+
 	// Process request for non-local handler.
 	virtual bool process_non_local_handler(unsigned fd);
 
+	// Connect to the backend and relay the request body as it arrives.
+	bool start_relaying_body(unsigned fd, bool chunked, size_t count);
+
 	// Prepare HTTP request.
 	bool prepare_http_request(unsigned fd);
 
+	// Send the request which couldn't be sent right away (it was queued
+	// or the name of the host was being resolved).
+	void resume_backend_request(unsigned fd);
+
+#if PROXY
+	// Resolve the name of the host in a worker thread.
+	bool resolve(unsigned fd);
+
+	// The name of the host has been resolved.
+	void resolved(unsigned fd, bool success);
+#endif
+
+	// Build the request for the backend sd.
+	bool prepare_backend_request(unsigned fd, unsigned sd, const char* host, unsigned short hostlen, unsigned short port, bool reused);
+
+	// Add the backend to the ready list if it is waiting for us and
+	// it can read / write ('events').
+	void wake_backend(int events);
+
+	// Detach the backend (it will be closed).
+	void detach_backend();
+
+	// Add to the ready list to read more of the request body (if the
+	// buffer was full).
+	void resume_body(unsigned fd);
+
+	// Is the request body being relayed to the backend?
+	bool relaying_body() const;
+
+	// Relay part of the request body to the backend.
+	bool relay_body(const char* buf, size_t len);
+
+	// The request body has been read.
+	bool request_body_read();
+
+#if !PROXY
+	// Query the limits of the FastCGI application.
+	void probe_fcgi_backend();
+
+	// Hash the key of the request (consistent hashing of the backends).
+	unsigned backend_hash();
+
+	// Can the request be sent to a second backend if the first one is
+	// slow to answer?
+	bool hedgeable() const;
+
+	// Send the request to a second backend.
+	bool send_hedge(unsigned fd);
+
+	// Don't send the request to a second backend (and cancel it if it
+	// has been sent already).
+	void cancel_hedge();
+
+	// The backend sd is answering (if the request has been sent to two
+	// backends, cancel it on the other one).
+	void backend_responding(unsigned sd);
+
+	// The backend sd has failed before answering ('sent': the request
+	// has been sent, at least partly). Returns true if another backend
+	// will answer (the connection to sd has to be closed).
+	bool backend_failed(unsigned fd, unsigned sd, bool sent);
+
+	// The connection to the backend sd has timed out.
+	void backend_timed_out(unsigned sd);
+
+	// Wait until a backend has room for the request.
+	bool queue_request(unsigned fd);
+
+	// A backend has room for the queued request.
+	void dequeued(unsigned fd);
+
+	// The request has waited too long in the queue.
+	void queue_timed_out(unsigned fd);
+#endif
+
+	// Serve the response from the cache ('collapse': wait for the
+	// response to an identical request being sent to the backend).
+	// Returns false if the request has to be sent to the backend.
+	bool serve_from_cache(unsigned fd, bool collapse);
+
+	// Build _M_cache_key (microcaching: without the ignored query
+	// parameters, followed by the cookies not ignored if 'cookies').
+	bool build_cache_key(bool cookies = true);
+
+	// Wait for the response to an identical request being sent to the
+	// backend (false: the request has to be sent to the backend).
+	bool collapse_request(unsigned fd);
+
+	// The response to the identical request has been received (or the
+	// request has waited too long).
+	void response_ready(unsigned fd);
+
+	// Serve the response from the cache or send the request to the
+	// backend after waiting.
+	bool process_collapsed_request(unsigned fd);
+
+	// Let the requests waiting for the response go on.
+	void end_fetch();
+
+	// Send the response of _M_cache_entry.
+	bool send_cached_response(unsigned fd);
+
+	// The backend has failed, send the stale response (if allowed).
+	bool serve_stale(unsigned fd);
+
+	// Will the backend's response be stored in the cache ('size' -1:
+	// unknown)?
+	bool cacheable(unsigned short status_code, off_t size) const;
+
+	// Can a payload of 'size' bytes be kept in memory (per request and
+	// global limits)? It is accounted until the connection is reset.
+	bool keep_payload_in_memory(off_t size);
+
+	// Are too many bytes waiting to be written to the temporary file?
+	// If so, the connection 'fd' is resumed once they have progressed.
+	bool spill_throttled(unsigned fd);
+
+	// Does the client wait for 100 (Continue) before sending the body?
+	bool expects_continue() const;
+
+	// Send 100 (Continue).
+	bool send_continue(unsigned fd);
+
+	// Store the backend's response in the cache and let the requests
+	// waiting for it go on.
+	void cache_response(unsigned short status_code);
+
+	// Store the backend's response in the cache.
+	void store_response(unsigned short status_code);
+
+	// Release _M_cache_entry.
+	void release_cache_entry();
+
+	// Remove responses from the cache (PURGE request).
+	bool purge();
+
 	// Add FastCGI parameters.
 	bool add_fcgi_params(unsigned fd, buffer* out);
 
@@ -162,14 +414,20 @@ struct http_connection : public tcp_connection,
 	// Keep-Alive?
 	bool keep_alive();
 
+	// Does the client accept gzip (Accept-Encoding, honoring q=0)?
+	bool accepts_gzip() const;
+
 	// Compute Content-Length.
 	off_t compute_content_length(off_t filesize) const;
 
 	// Build part header.
 	bool build_part_header();
 
+	// Render next page of the directory listing as a chunk.
+	bool build_listing_chunk();
+
 	// Prepare error page.
-	bool prepare_error_page();
+	bool prepare_error_page(unsigned fd);
 
 	// Moved permanently.
 	void moved_permanently();
@@ -189,9 +447,19 @@ struct http_connection : public tcp_connection,
 
 inline http_connection::~http_connection()
 {
-	if (_M_fd != -1) {
+	if (_M_bundle) {
+		_M_bundle->release();
+	} else if (_M_fd != -1) {
 		close(_M_fd);
 	}
+
+#if HAVE_SPLICE
+	splicer::close_pipe(_M_pipe);
+#endif // HAVE_SPLICE
+
+	if (_M_listing) {
+		delete _M_listing;
+	}
 }
 
 inline void http_connection::free()
@@ -210,23 +478,18 @@ inline void http_connection::free()
 	_M_writable = 0;
 }
 
-inline bool http_connection::add_chunked_data(const char* buf, size_t len)
+inline bool http_connection::relaying_body() const
 {
-	if (_M_rule->handler == rulelist::HTTP_HANDLER) {
-		if (!file_wrapper::write(_M_tmpfile, buf, len)) {
-			return false;
-		}
+	return ((_M_relaying_body) && ((_M_state == READING_BODY_STATE) || (_M_state == READING_CHUNKED_BODY_STATE)));
+}
 
-		_M_tmpfilesize += len;
+inline bool http_connection::relay_body(const char* buf, size_t len)
+{
+	if (_M_rule->handler == rulelist::HTTP_HANDLER) {
+		return _M_body.append(buf, len);
 	} else {
-		if (!fastcgi::stdin_stream(REQUEST_ID, buf, len, _M_tmpfile, _M_tmpfilesize)) {
-			return false;
-		}
+		return fastcgi::stdin_stream(REQUEST_ID, buf, len, _M_body);
 	}
-
-	_M_request_body_size += len;
-
-	return true;
 }
 
 inline bool http_connection::build_part_header()
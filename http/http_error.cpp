@@ -106,6 +106,17 @@ bool http_error::build_page(http_connection* conn)
 		}
 	}
 
+#if !PROXY
+	// All the backends are busy.
+	if (conn->_M_error == SERVICE_UNAVAILABLE) {
+		char seconds[32];
+		len = snprintf(seconds, sizeof(seconds), "%d", (int) conn->_M_rule->backends.get_retry_after());
+		if (!_M_headers->add_known_header(http_headers::RETRY_AFTER_HEADER, seconds, len, false)) {
+			return false;
+		}
+	}
+#endif
+
 	if (!_M_headers->add_known_header(http_headers::SERVER_HEADER, WEBSERVER_NAME, sizeof(WEBSERVER_NAME) - 1, false)) {
 		return false;
 	}
@@ -72,58 +72,58 @@ const size_t http_headers::DATA_ALLOC = 1024;
 const unsigned short http_headers::MAX_LINE_LEN = 76;
 
 const http_headers::known_http_header http_headers::_M_known_http_headers[] = {
-	{"Accept",               6, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"Accept-Charset",      14, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"Accept-Encoding",     15, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"Accept-Language",     15, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"Accept-Ranges",       13, RESPONSE_HEADER_FIELD, 1, 0, 0},
-	{"Age",                  3, RESPONSE_HEADER_FIELD, 0, 1, 0},
-	{"Allow",                5, ENTITY_HEADER_FIELD,   1, 0, 0},
-	{"Authorization",       13, REQUEST_HEADER_FIELD,  0, 0, 0},
-	{"Cache-Control",       13, GENERAL_HEADER_FIELD,  1, 0, 0},
-	{"Connection",          10, GENERAL_HEADER_FIELD,  1, 0, 0},
-	{"Content-Encoding",    16, ENTITY_HEADER_FIELD,   1, 0, 0},
-	{"Content-Language",    16, ENTITY_HEADER_FIELD,   1, 0, 0},
-	{"Content-Length",      14, ENTITY_HEADER_FIELD,   0, 1, 0},
-	{"Content-Location",    16, ENTITY_HEADER_FIELD,   0, 1, 0},
-	{"Content-MD5",         11, ENTITY_HEADER_FIELD,   0, 1, 0},
-	{"Content-Range",       13, ENTITY_HEADER_FIELD,   0, 0, 0},
-	{"Content-Type",        12, ENTITY_HEADER_FIELD,   0, 0, 0},
-	{"Cookie",               6, REQUEST_HEADER_FIELD,  1, 0, 1},
-	{"Date",                 4, GENERAL_HEADER_FIELD,  1, 0, 0},
-	{"ETag",                 4, RESPONSE_HEADER_FIELD, 0, 1, 0},
-	{"Expect",               6, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"Expires",              7, ENTITY_HEADER_FIELD,   1, 0, 0},
-	{"From",                 4, REQUEST_HEADER_FIELD,  0, 1, 0},
-	{"Host",                 4, REQUEST_HEADER_FIELD,  0, 1, 0},
-	{"If-Match",             8, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"If-Modified-Since",   17, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"If-None-Match",       13, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"If-Range",             8, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"If-Unmodified-Since", 19, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"Keep-Alive",          10, GENERAL_HEADER_FIELD,  1, 0, 0},
-	{"Last-Modified",       13, ENTITY_HEADER_FIELD,   1, 0, 0},
-	{"Location",             8, RESPONSE_HEADER_FIELD, 0, 1, 0},
-	{"Max-Forwards",        12, REQUEST_HEADER_FIELD,  0, 1, 0},
-	{"Pragma",               6, GENERAL_HEADER_FIELD,  1, 0, 0},
-	{"Proxy-Authenticate",  18, RESPONSE_HEADER_FIELD, 1, 0, 0},
-	{"Proxy-Authorization", 19, REQUEST_HEADER_FIELD,  0, 0, 0},
-	{"Proxy-Connection",    16, GENERAL_HEADER_FIELD,  1, 0, 0},
-	{"Range",                5, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"Referer",              7, REQUEST_HEADER_FIELD,  0, 1, 0},
-	{"Retry-After",         11, RESPONSE_HEADER_FIELD, 1, 0, 0},
-	{"Server",               6, RESPONSE_HEADER_FIELD, 1, 0, 0},
-	{"Set-Cookie",          10, RESPONSE_HEADER_FIELD, 1, 0, 1},
-	{"Status",               6, RESPONSE_HEADER_FIELD, 1, 0, 0},
-	{"TE",                   2, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"Trailer",              7, GENERAL_HEADER_FIELD,  1, 0, 0},
-	{"Transfer-Encoding",   17, GENERAL_HEADER_FIELD,  1, 0, 0},
-	{"Upgrade",              7, GENERAL_HEADER_FIELD,  1, 0, 0},
-	{"User-Agent",          10, REQUEST_HEADER_FIELD,  1, 0, 0},
-	{"Vary",                 4, RESPONSE_HEADER_FIELD, 1, 0, 0},
-	{"Via",                  3, GENERAL_HEADER_FIELD,  1, 0, 0},
-	{"Warning",              7, GENERAL_HEADER_FIELD,  1, 0, 0},
-	{"WWW-Authenticate",    16, RESPONSE_HEADER_FIELD, 1, 0, 0}
+	{"Accept",               6, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_ACCEPT"},
+	{"Accept-Charset",      14, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_ACCEPT_CHARSET"},
+	{"Accept-Encoding",     15, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_ACCEPT_ENCODING"},
+	{"Accept-Language",     15, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_ACCEPT_LANGUAGE"},
+	{"Accept-Ranges",       13, RESPONSE_HEADER_FIELD, 1, 0, 0, "HTTP_ACCEPT_RANGES"},
+	{"Age",                  3, RESPONSE_HEADER_FIELD, 0, 1, 0, "HTTP_AGE"},
+	{"Allow",                5, ENTITY_HEADER_FIELD,   1, 0, 0, "HTTP_ALLOW"},
+	{"Authorization",       13, REQUEST_HEADER_FIELD,  0, 0, 0, "HTTP_AUTHORIZATION"},
+	{"Cache-Control",       13, GENERAL_HEADER_FIELD,  1, 0, 0, "HTTP_CACHE_CONTROL"},
+	{"Connection",          10, GENERAL_HEADER_FIELD,  1, 0, 0, "HTTP_CONNECTION"},
+	{"Content-Encoding",    16, ENTITY_HEADER_FIELD,   1, 0, 0, "HTTP_CONTENT_ENCODING"},
+	{"Content-Language",    16, ENTITY_HEADER_FIELD,   1, 0, 0, "HTTP_CONTENT_LANGUAGE"},
+	{"Content-Length",      14, ENTITY_HEADER_FIELD,   0, 1, 0, "HTTP_CONTENT_LENGTH"},
+	{"Content-Location",    16, ENTITY_HEADER_FIELD,   0, 1, 0, "HTTP_CONTENT_LOCATION"},
+	{"Content-MD5",         11, ENTITY_HEADER_FIELD,   0, 1, 0, "HTTP_CONTENT_MD5"},
+	{"Content-Range",       13, ENTITY_HEADER_FIELD,   0, 0, 0, "HTTP_CONTENT_RANGE"},
+	{"Content-Type",        12, ENTITY_HEADER_FIELD,   0, 0, 0, "HTTP_CONTENT_TYPE"},
+	{"Cookie",               6, REQUEST_HEADER_FIELD,  1, 0, 1, "HTTP_COOKIE"},
+	{"Date",                 4, GENERAL_HEADER_FIELD,  1, 0, 0, "HTTP_DATE"},
+	{"ETag",                 4, RESPONSE_HEADER_FIELD, 0, 1, 0, "HTTP_ETAG"},
+	{"Expect",               6, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_EXPECT"},
+	{"Expires",              7, ENTITY_HEADER_FIELD,   1, 0, 0, "HTTP_EXPIRES"},
+	{"From",                 4, REQUEST_HEADER_FIELD,  0, 1, 0, "HTTP_FROM"},
+	{"Host",                 4, REQUEST_HEADER_FIELD,  0, 1, 0, "HTTP_HOST"},
+	{"If-Match",             8, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_IF_MATCH"},
+	{"If-Modified-Since",   17, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_IF_MODIFIED_SINCE"},
+	{"If-None-Match",       13, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_IF_NONE_MATCH"},
+	{"If-Range",             8, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_IF_RANGE"},
+	{"If-Unmodified-Since", 19, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_IF_UNMODIFIED_SINCE"},
+	{"Keep-Alive",          10, GENERAL_HEADER_FIELD,  1, 0, 0, "HTTP_KEEP_ALIVE"},
+	{"Last-Modified",       13, ENTITY_HEADER_FIELD,   1, 0, 0, "HTTP_LAST_MODIFIED"},
+	{"Location",             8, RESPONSE_HEADER_FIELD, 0, 1, 0, "HTTP_LOCATION"},
+	{"Max-Forwards",        12, REQUEST_HEADER_FIELD,  0, 1, 0, "HTTP_MAX_FORWARDS"},
+	{"Pragma",               6, GENERAL_HEADER_FIELD,  1, 0, 0, "HTTP_PRAGMA"},
+	{"Proxy-Authenticate",  18, RESPONSE_HEADER_FIELD, 1, 0, 0, "HTTP_PROXY_AUTHENTICATE"},
+	{"Proxy-Authorization", 19, REQUEST_HEADER_FIELD,  0, 0, 0, "HTTP_PROXY_AUTHORIZATION"},
+	{"Proxy-Connection",    16, GENERAL_HEADER_FIELD,  1, 0, 0, "HTTP_PROXY_CONNECTION"},
+	{"Range",                5, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_RANGE"},
+	{"Referer",              7, REQUEST_HEADER_FIELD,  0, 1, 0, "HTTP_REFERER"},
+	{"Retry-After",         11, RESPONSE_HEADER_FIELD, 1, 0, 0, "HTTP_RETRY_AFTER"},
+	{"Server",               6, RESPONSE_HEADER_FIELD, 1, 0, 0, "HTTP_SERVER"},
+	{"Set-Cookie",          10, RESPONSE_HEADER_FIELD, 1, 0, 1, "HTTP_SET_COOKIE"},
+	{"Status",               6, RESPONSE_HEADER_FIELD, 1, 0, 0, "HTTP_STATUS"},
+	{"TE",                   2, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_TE"},
+	{"Trailer",              7, GENERAL_HEADER_FIELD,  1, 0, 0, "HTTP_TRAILER"},
+	{"Transfer-Encoding",   17, GENERAL_HEADER_FIELD,  1, 0, 0, "HTTP_TRANSFER_ENCODING"},
+	{"Upgrade",              7, GENERAL_HEADER_FIELD,  1, 0, 0, "HTTP_UPGRADE"},
+	{"User-Agent",          10, REQUEST_HEADER_FIELD,  1, 0, 0, "HTTP_USER_AGENT"},
+	{"Vary",                 4, RESPONSE_HEADER_FIELD, 1, 0, 0, "HTTP_VARY"},
+	{"Via",                  3, GENERAL_HEADER_FIELD,  1, 0, 0, "HTTP_VIA"},
+	{"Warning",              7, GENERAL_HEADER_FIELD,  1, 0, 0, "HTTP_WARNING"},
+	{"WWW-Authenticate",    16, RESPONSE_HEADER_FIELD, 1, 0, 0, "HTTP_WWW_AUTHENTICATE"}
 };
 
 http_headers::http_headers()
@@ -116,6 +116,9 @@ class http_headers {
 		// Get header.
 		bool get_header(unsigned idx, unsigned char& header, const char*& name, unsigned short& namelen, const char*& value, unsigned short& valuelen);
 
+		// Get name of the CGI variable of known header.
+		static const char* get_cgi_name(unsigned char header, unsigned short& len);
+
 		// Get value of header.
 		bool get_value(const char* name, unsigned short namelen, const char*& value, unsigned short* valuelen = NULL) const;
 
@@ -154,6 +157,10 @@ class http_headers {
 			unsigned char might_have_commas;
 			unsigned char single_token;
 			unsigned char force_multiple_header_fields;
+
+			// Name of the CGI variable ("HTTP_" + uppercase name, '-'
+			// replaced by '_', 5 + len bytes).
+			const char* cgi_name;
 		};
 
 		static const known_http_header _M_known_http_headers[];
@@ -264,6 +271,12 @@ inline bool http_headers::get_header(unsigned idx, unsigned char& header, const
 	return true;
 }
 
+inline const char* http_headers::get_cgi_name(unsigned char header, unsigned short& len)
+{
+	len = 5 + _M_known_http_headers[(unsigned) header].len;
+	return _M_known_http_headers[(unsigned) header].cgi_name;
+}
+
 inline http_headers::http_header* http_headers::search(unsigned char header, unsigned short& pos) const
 {
 	const known_http_header* known_http_header = &(_M_known_http_headers[header]);
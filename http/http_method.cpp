@@ -15,9 +15,10 @@ const unsigned char http_method::OPTIONS = 8;
 const unsigned char http_method::POST = 9;
 const unsigned char http_method::PROPFIND = 10;
 const unsigned char http_method::PROPPATCH = 11;
-const unsigned char http_method::PUT = 12;
-const unsigned char http_method::TRACE = 13;
-const unsigned char http_method::UNLOCK = 14;
+const unsigned char http_method::PURGE = 12;
+const unsigned char http_method::PUT = 13;
+const unsigned char http_method::TRACE = 14;
+const unsigned char http_method::UNLOCK = 15;
 const unsigned char http_method::UNKNOWN = 63;
 
 const http_method::string http_method::_M_methods[] = {
@@ -33,6 +34,7 @@ const http_method::string http_method::_M_methods[] = {
 	{"POST", 4},
 	{"PROPFIND", 8},
 	{"PROPPATCH", 9},
+	{"PURGE", 5},
 	{"PUT", 3},
 	{"TRACE", 5},
 	{"UNLOCK", 6}
@@ -63,3 +65,8 @@ unsigned char http_method::get_method(const char* string, size_t len)
 
 	return UNKNOWN;
 }
+
+bool http_method::is_idempotent(unsigned char method)
+{
+	return ((method == GET) || (method == HEAD) || (method == OPTIONS) || (method == TRACE) || (method == PUT) || (method == DELETE) || (method == PROPFIND));
+}
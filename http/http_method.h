@@ -15,6 +15,7 @@ class http_method {
 		static const unsigned char POST;
 		static const unsigned char PROPFIND;
 		static const unsigned char PROPPATCH;
+		static const unsigned char PURGE;
 		static const unsigned char PUT;
 		static const unsigned char TRACE;
 		static const unsigned char UNLOCK;
@@ -25,6 +26,9 @@ class http_method {
 
 		static unsigned char get_method(const char* string, size_t len);
 
+		// Can a request with this method be sent again?
+		static bool is_idempotent(unsigned char method);
+
 	private:
 		struct string {
 			const char* name;
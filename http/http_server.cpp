@@ -2,10 +2,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <arpa/inet.h>
 #include <new>
 #include "http_server.h"
 #include "http/http_error.h"
 #include "net/url_parser.h"
+#include "net/resolver.h"
 #include "util/number.h"
 
 #ifndef HAVE_MEMRCHR
@@ -27,6 +29,27 @@ http_server::http_server() : tcp_server(true)
 	_M_boundary = 0;
 
 	_M_sync_count = 0;
+
+	_M_statistics_count = 0;
+
+	_M_bundle_check_count = 0;
+
+	_M_page_cache_bytes = 0;
+	_M_disk_bytes = 0;
+
+	_M_backend_connections = 0;
+	_M_reused_backend_connections = 0;
+
+	_M_hedges = NULL;
+	_M_nhedges = 0;
+
+	_M_queued_requests = 0;
+
+	_M_payload_memory = 0;
+
+	_M_health_checks = false;
+
+	_M_npurge_networks = 0;
 }
 
 bool http_server::create(const char* config_file, const char* mime_types_file)
@@ -70,16 +93,66 @@ bool http_server::create(const char* config_file, const char* mime_types_file)
 		return false;
 	}
 
+	// Create pool of worker threads.
+	if (!_M_workers.create(general_conf.worker_threads)) {
+		logger::instance().log(logger::LOG_ERROR, "Couldn't create pool of worker threads.");
+		return false;
+	}
+
+	if (_M_workers.get_descriptor() != -1) {
+		if (!add(_M_workers.get_descriptor(), selector::READ, false)) {
+			logger::instance().log(logger::LOG_ERROR, "Couldn't add pool of worker threads to the selector.");
+			return false;
+		}
+	}
+
+	// Create pool of threads for the health checks of the backends.
+	if (_M_health_checks) {
+		if (!_M_health_checkers.create(general_conf.health_check_threads)) {
+			logger::instance().log(logger::LOG_ERROR, "Couldn't create pool of health check threads.");
+			return false;
+		}
+
+		if (!add(_M_health_checkers.get_descriptor(), selector::READ, false)) {
+			logger::instance().log(logger::LOG_ERROR, "Couldn't add pool of health check threads to the selector.");
+			return false;
+		}
+	}
+
 	// Create cache of temporary files.
 	if (general_conf.max_spare_files > _M_size) {
 		general_conf.max_spare_files = _M_size;
 	}
 
-	if (!_M_tmpfiles.create(general_conf.payload_directory, _M_size, general_conf.max_spare_files)) {
+	if (!_M_tmpfiles.create(general_conf.payload_directory, _M_size, general_conf.max_spare_files, (off_t) general_conf.max_payload_in_memory_files * 1024 * 1024)) {
 		logger::instance().log(logger::LOG_ERROR, "Couldn't create cache of temporary files.");
 		return false;
 	}
 
+	// Write the temporary files in the worker threads.
+	if ((_M_workers.get_descriptor() != -1) && (general_conf.max_pending_payload_writes > 0)) {
+		_M_tmpfiles.set_writer(&_M_workers, (size_t) general_conf.max_pending_payload_writes * 1024 * 1024, resume_connection, this);
+	}
+
+	// Create response cache (the disk tier uses up to a quarter of the
+	// file descriptors).
+	if (!_M_cache.create((size_t) general_conf.cache_max_memory * 1024 * 1024, (size_t) general_conf.cache_max_object_size * 1024, (off_t) general_conf.cache_max_disk_size * 1024 * 1024, (off_t) general_conf.cache_max_disk_object_size * 1024 * 1024, _M_size / 4)) {
+		logger::instance().log(logger::LOG_ERROR, "Couldn't create response cache.");
+		return false;
+	}
+
+	if (!_M_cache.set_collapsing(general_conf.cache_collapse_timeout, _M_size)) {
+		logger::instance().log(logger::LOG_ERROR, "Couldn't create response cache.");
+		return false;
+	}
+
+#if PROXY
+	if (!_M_dnscache.create(general_conf.min_dns_ttl, general_conf.max_dns_ttl)) {
+		logger::instance().log(logger::LOG_ERROR, "Couldn't create DNS cache.");
+		return false;
+	}
+#endif
+
 	// Create backends.
 	virtual_hosts::vhost* vhost;
 	for (size_t i = 0; (vhost = _M_vhosts.get_host(i)) != NULL; i++) {
@@ -92,6 +165,15 @@ bool http_server::create(const char* config_file, const char* mime_types_file)
 		}
 	}
 
+#if PROXY
+	// The requests sent through the proxy don't go to configured
+	// backends, but they are accounted in the rule's list.
+	if (!http_connection::_M_http_rule.backends.create(_M_size)) {
+		logger::instance().log(logger::LOG_ERROR, "Couldn't create backends.");
+		return false;
+	}
+#endif
+
 	http_error::set_port(general_conf.port);
 
 	logger::instance().log(logger::LOG_INFO, "Server started.");
@@ -117,6 +199,10 @@ bool http_server::create_connections()
 		return false;
 	}
 
+	if ((_M_hedges = (unsigned*) malloc(_M_size * sizeof(unsigned))) == NULL) {
+		return false;
+	}
+
 	for (size_t i = 0; i < _M_size; i++) {
 		_M_connections[i] = &(_M_http_connections[i]);
 	}
@@ -145,6 +231,15 @@ void http_server::delete_connections()
 		delete [] _M_fcgi_connections;
 		_M_fcgi_connections = NULL;
 	}
+
+	if (_M_hedges) {
+		free(_M_hedges);
+		_M_hedges = NULL;
+	}
+
+	_M_nhedges = 0;
+
+	_M_queued_requests = 0;
 }
 
 bool http_server::on_event(unsigned fd, int events)
@@ -155,6 +250,10 @@ bool http_server::on_event(unsigned fd, int events)
 		if ((client = on_new_connection()) != -1) {
 			_M_connection_handlers[client] = rulelist::LOCAL_HANDLER;
 		}
+	} else if ((int) fd == _M_workers.get_descriptor()) {
+		_M_workers.process_completed();
+	} else if ((int) fd == _M_health_checkers.get_descriptor()) {
+		_M_health_checkers.process_completed();
 	} else {
 		if (!process_connection(fd, events)) {
 			return false;
@@ -171,6 +270,26 @@ bool http_server::on_event(unsigned fd, int events)
 	return true;
 }
 
+void http_server::on_event_error(unsigned fd)
+{
+	// Idle connection to a backend?
+	backend_list* backends;
+	if ((backends = get_idle_pool(fd)) != NULL) {
+		backends->remove_idle_connection(fd);
+
+		if (_M_connection_handlers[fd] == rulelist::HTTP_HANDLER) {
+			_M_proxy_connections[fd].free();
+		} else {
+			_M_fcgi_connections[fd].free();
+		}
+	} else if ((_M_connection_handlers[fd] == rulelist::FCGI_HANDLER) && (!_M_fcgi_connections[fd]._M_client)) {
+		// Query of the limits of a FastCGI application.
+		_M_fcgi_connections[fd].free();
+	} else {
+		tcp_server::on_event_error(fd);
+	}
+}
+
 bool http_server::load_general(const xmlconf& conf, general_conf& general_conf)
 {
 	const char* value;
@@ -237,6 +356,36 @@ bool http_server::load_general(const xmlconf& conf, general_conf& general_conf)
 		}
 	}
 
+	if (!conf.get_value(i, "config", "general", "max_total_payload_in_memory", NULL)) {
+		_M_max_payload_memory = 64 * 1024 * 1024;
+	} else {
+		if (i > 64 * 1024) {
+			_M_max_payload_memory = 64 * 1024 * 1024;
+
+			logger::instance().log(logger::LOG_INFO, "Invalid maximum total payload in memory, set to %u MB.", (unsigned) (_M_max_payload_memory / (1024 * 1024)));
+		} else {
+			_M_max_payload_memory = (size_t) i * 1024 * 1024;
+		}
+	}
+
+	if (!conf.get_value(b, "config", "general", "stream_backend_responses", NULL)) {
+		_M_stream_backend_responses = true;
+	} else {
+		_M_stream_backend_responses = b;
+	}
+
+	if (!conf.get_value(b, "config", "general", "splice_backend_responses", NULL)) {
+		_M_splice_backend_responses = true;
+	} else {
+		_M_splice_backend_responses = b;
+	}
+
+	if (!conf.get_value(b, "config", "general", "stream_request_bodies", NULL)) {
+		_M_stream_request_bodies = true;
+	} else {
+		_M_stream_request_bodies = b;
+	}
+
 	if (!conf.get_value(general_conf.payload_directory, len, "config", "general", "payload_directory", NULL)) {
 		general_conf.payload_directory = "/tmp";
 	}
@@ -245,6 +394,96 @@ bool http_server::load_general(const xmlconf& conf, general_conf& general_conf)
 		general_conf.max_spare_files = 32;
 	}
 
+	if (!conf.get_value(i, "config", "general", "max_payload_in_memory_files", NULL)) {
+		general_conf.max_payload_in_memory_files = tmpfiles_cache::DEFAULT_MAX_MEMORY / (1024 * 1024);
+	} else {
+		if (i > 64 * 1024) {
+			general_conf.max_payload_in_memory_files = tmpfiles_cache::DEFAULT_MAX_MEMORY / (1024 * 1024);
+
+			logger::instance().log(logger::LOG_INFO, "Invalid maximum size of the payloads in memory files, set to %u MB.", general_conf.max_payload_in_memory_files);
+		} else {
+			general_conf.max_payload_in_memory_files = i;
+		}
+	}
+
+	if (!conf.get_value(general_conf.max_request_body_size, "config", "general", "max_request_body_size", NULL)) {
+		general_conf.max_request_body_size = 0;
+	}
+
+	// Proxy (no rules): the limit applies to all the requests.
+	http_connection::_M_http_rule.max_body_size = (off_t) general_conf.max_request_body_size * 1024;
+
+	if (!conf.get_value(i, "config", "general", "max_pending_payload_writes", NULL)) {
+		general_conf.max_pending_payload_writes = tmpfiles_cache::DEFAULT_MAX_PENDING_WRITES / (1024 * 1024);
+	} else {
+		if (i > 1024) {
+			general_conf.max_pending_payload_writes = tmpfiles_cache::DEFAULT_MAX_PENDING_WRITES / (1024 * 1024);
+
+			logger::instance().log(logger::LOG_INFO, "Invalid maximum size of the pending payload writes, set to %u MB.", general_conf.max_pending_payload_writes);
+		} else {
+			general_conf.max_pending_payload_writes = i;
+		}
+	}
+
+	if (!conf.get_value(i, "config", "general", "response_cache", "max_memory", NULL)) {
+		general_conf.cache_max_memory = response_cache::DEFAULT_MAX_MEMORY / (1024 * 1024);
+	} else {
+		if (i > 64 * 1024) {
+			general_conf.cache_max_memory = response_cache::DEFAULT_MAX_MEMORY / (1024 * 1024);
+
+			logger::instance().log(logger::LOG_INFO, "Invalid maximum memory of the response cache, set to %u MB.", general_conf.cache_max_memory);
+		} else {
+			general_conf.cache_max_memory = i;
+		}
+	}
+
+	if (!conf.get_value(i, "config", "general", "response_cache", "max_object_size", NULL)) {
+		general_conf.cache_max_object_size = response_cache::DEFAULT_MAX_OBJECT_SIZE / 1024;
+	} else {
+		if ((i == 0) || (i > 1024 * 1024)) {
+			general_conf.cache_max_object_size = response_cache::DEFAULT_MAX_OBJECT_SIZE / 1024;
+
+			logger::instance().log(logger::LOG_INFO, "Invalid maximum object size of the response cache, set to %u KB.", general_conf.cache_max_object_size);
+		} else {
+			general_conf.cache_max_object_size = i;
+		}
+	}
+
+	if (!conf.get_value(i, "config", "general", "response_cache", "max_disk_size", NULL)) {
+		general_conf.cache_max_disk_size = 0;
+	} else {
+		general_conf.cache_max_disk_size = i;
+	}
+
+	if (!conf.get_value(i, "config", "general", "response_cache", "max_disk_object_size", NULL)) {
+		general_conf.cache_max_disk_object_size = response_cache::DEFAULT_MAX_DISK_OBJECT_SIZE / (1024 * 1024);
+	} else {
+		if (i == 0) {
+			general_conf.cache_max_disk_object_size = response_cache::DEFAULT_MAX_DISK_OBJECT_SIZE / (1024 * 1024);
+
+			logger::instance().log(logger::LOG_INFO, "Invalid maximum disk object size of the response cache, set to %u MB.", general_conf.cache_max_disk_object_size);
+		} else {
+			general_conf.cache_max_disk_object_size = i;
+		}
+	}
+
+	if (!conf.get_value(i, "config", "general", "response_cache", "collapse_timeout", NULL)) {
+		general_conf.cache_collapse_timeout = response_cache::DEFAULT_COLLAPSE_TIMEOUT;
+	} else {
+		if (i > 3600) {
+			general_conf.cache_collapse_timeout = response_cache::DEFAULT_COLLAPSE_TIMEOUT;
+
+			logger::instance().log(logger::LOG_INFO, "Invalid collapse timeout of the response cache, set to %u seconds.", general_conf.cache_collapse_timeout);
+		} else {
+			general_conf.cache_collapse_timeout = i;
+		}
+	}
+
+	if (!load_purge_networks(conf)) {
+		logger::instance().log(logger::LOG_ERROR, "Invalid networks from which PURGE requests are accepted.");
+		return false;
+	}
+
 	if (!conf.get_value(i, "config", "general", "backend_retry_interval", NULL)) {
 		general_conf.backend_retry_interval = 300;
 	} else {
@@ -257,6 +496,54 @@ bool http_server::load_general(const xmlconf& conf, general_conf& general_conf)
 		}
 	}
 
+	if (!conf.get_value(i, "config", "general", "max_idle_backend_connections", NULL)) {
+		general_conf.max_idle_backend_connections = backend_list::DEFAULT_MAX_IDLE_CONNECTIONS;
+	} else {
+		if (i > 1024) {
+			general_conf.max_idle_backend_connections = backend_list::DEFAULT_MAX_IDLE_CONNECTIONS;
+
+			logger::instance().log(logger::LOG_INFO, "Invalid maximum number of idle backend connections, set to %u.", general_conf.max_idle_backend_connections);
+		} else {
+			general_conf.max_idle_backend_connections = i;
+		}
+	}
+
+	if (!conf.get_value(i, "config", "general", "backend_idle_timeout", NULL)) {
+		general_conf.backend_idle_timeout = backend_list::DEFAULT_IDLE_TIMEOUT;
+	} else {
+		if ((i == 0) || (i > 3600)) {
+			general_conf.backend_idle_timeout = backend_list::DEFAULT_IDLE_TIMEOUT;
+
+			logger::instance().log(logger::LOG_INFO, "Invalid backend idle timeout, set to %u seconds.", general_conf.backend_idle_timeout);
+		} else {
+			general_conf.backend_idle_timeout = i;
+		}
+	}
+
+	if (!conf.get_value(i, "config", "general", "min_dns_ttl", NULL)) {
+		general_conf.min_dns_ttl = backend_list::DEFAULT_MIN_DNS_TTL;
+	} else {
+		if ((i == 0) || (i > 86400)) {
+			general_conf.min_dns_ttl = backend_list::DEFAULT_MIN_DNS_TTL;
+
+			logger::instance().log(logger::LOG_INFO, "Invalid minimum DNS TTL, set to %u seconds.", general_conf.min_dns_ttl);
+		} else {
+			general_conf.min_dns_ttl = i;
+		}
+	}
+
+	if (!conf.get_value(i, "config", "general", "max_dns_ttl", NULL)) {
+		general_conf.max_dns_ttl = backend_list::DEFAULT_MAX_DNS_TTL;
+	} else {
+		if ((i < general_conf.min_dns_ttl) || (i > 86400)) {
+			general_conf.max_dns_ttl = (general_conf.min_dns_ttl > backend_list::DEFAULT_MAX_DNS_TTL) ? general_conf.min_dns_ttl : backend_list::DEFAULT_MAX_DNS_TTL;
+
+			logger::instance().log(logger::LOG_INFO, "Invalid maximum DNS TTL, set to %u seconds.", general_conf.max_dns_ttl);
+		} else {
+			general_conf.max_dns_ttl = i;
+		}
+	}
+
 	if (!conf.get_value(value, len, "config", "general", "log_level", NULL)) {
 		general_conf.level = logger::LOG_ERROR;
 	} else {
@@ -368,6 +655,60 @@ bool http_server::load_general(const xmlconf& conf, general_conf& general_conf)
 		general_conf.footer_file = value;
 	}
 
+	if (!conf.get_value(i, "config", "general", "statistics_interval", NULL)) {
+		_M_statistics_interval = 60;
+	} else {
+		_M_statistics_interval = i;
+	}
+
+	if (!conf.get_value(i, "config", "general", "bundle_check_interval", NULL)) {
+		_M_bundle_check_interval = 5;
+	} else {
+		_M_bundle_check_interval = i;
+	}
+
+	if (!conf.get_value(i, "config", "general", "directory_listing_cache_size", NULL)) {
+		general_conf.dirlisting_cache_size = dirlisting::DEFAULT_MAX_CACHED_LISTINGS;
+	} else {
+		general_conf.dirlisting_cache_size = i;
+	}
+
+	if (!conf.get_value(i, "config", "general", "large_file_size", NULL)) {
+		_M_large_file_size = 4 * 1024 * 1024;
+	} else {
+		_M_large_file_size = (off_t) i * 1024;
+	}
+
+	if (!conf.get_value(b, "config", "general", "drop_large_files_from_cache", NULL)) {
+		_M_drop_large_files = false;
+	} else {
+		_M_drop_large_files = b;
+	}
+
+	if (!conf.get_value(i, "config", "general", "worker_threads", NULL)) {
+		general_conf.worker_threads = worker_pool::DEFAULT_THREADS;
+	} else {
+		if (i > worker_pool::MAX_THREADS) {
+			general_conf.worker_threads = worker_pool::MAX_THREADS;
+
+			logger::instance().log(logger::LOG_INFO, "Too many worker threads, set to %u.", general_conf.worker_threads);
+		} else {
+			general_conf.worker_threads = i;
+		}
+	}
+
+	if (!conf.get_value(i, "config", "general", "health_check_threads", NULL)) {
+		general_conf.health_check_threads = worker_pool::DEFAULT_THREADS;
+	} else {
+		if (i > worker_pool::MAX_THREADS) {
+			general_conf.health_check_threads = worker_pool::MAX_THREADS;
+
+			logger::instance().log(logger::LOG_INFO, "Too many health check threads, set to %u.", general_conf.health_check_threads);
+		} else {
+			general_conf.health_check_threads = i;
+		}
+	}
+
 	for (unsigned i = 0; conf.get_child(i, value, len, "config", "general", "index_files", NULL); i++) {
 		// If the filename contains a '/'...
 		if (memchr(value, '/', len)) {
@@ -383,6 +724,73 @@ bool http_server::load_general(const xmlconf& conf, general_conf& general_conf)
 	return true;
 }
 
+bool http_server::load_purge_networks(const xmlconf& conf)
+{
+	const char* value;
+	size_t len;
+	for (unsigned i = 0; conf.get_child(i, value, len, "config", "general", "response_cache", "purge_from", NULL); i++) {
+		if (_M_npurge_networks == sizeof(_M_purge_networks) / sizeof(network)) {
+			return false;
+		}
+
+		// Address with optional prefix length (a.b.c.d/n).
+		unsigned prefix = 32;
+		const char* slash = (const char*) memchr(value, '/', len);
+		if (slash) {
+			if (number::parse_unsigned(slash + 1, (value + len) - (slash + 1), prefix, 0, 32) != number::PARSE_SUCCEEDED) {
+				return false;
+			}
+
+			len = slash - value;
+		}
+
+		char address[16];
+		if (len >= sizeof(address)) {
+			return false;
+		}
+
+		memcpy(address, value, len);
+		address[len] = 0;
+
+		struct in_addr in;
+		if (inet_pton(AF_INET, address, &in) != 1) {
+			return false;
+		}
+
+		network* net = &_M_purge_networks[_M_npurge_networks++];
+		net->mask = (prefix == 0) ? 0 : 0xffffffffu << (32 - prefix);
+		net->addr = ntohl(in.s_addr) & net->mask;
+	}
+
+	// Only the local host by default.
+	if (_M_npurge_networks == 0) {
+		_M_purge_networks[0].addr = 0x7f000000u;
+		_M_purge_networks[0].mask = 0xff000000u;
+
+		_M_npurge_networks = 1;
+	}
+
+	return true;
+}
+
+bool http_server::purge_allowed(const struct sockaddr* addr) const
+{
+	// The server only listens on IPv4.
+	if (addr->sa_family != AF_INET) {
+		return false;
+	}
+
+	in_addr_t a = ntohl(((const struct sockaddr_in*) addr)->sin_addr.s_addr);
+
+	for (unsigned i = 0; i < _M_npurge_networks; i++) {
+		if ((a & _M_purge_networks[i].mask) == _M_purge_networks[i].addr) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 bool http_server::load_hosts(const xmlconf& conf, const general_conf& general_conf)
 {
 	const char* host;
@@ -397,11 +805,23 @@ bool http_server::load_hosts(const xmlconf& conf, const general_conf& general_co
 			def = false;
 		}
 
+		const char* bundle_file;
+		size_t bundle_file_len;
+		if (!conf.get_value(bundle_file, bundle_file_len, "config", "hosts", host, "bundle", NULL)) {
+			bundle_file = NULL;
+		}
+
 		const char* document_root;
 		size_t document_root_len;
 		if (!conf.get_value(document_root, document_root_len, "config", "hosts", host, "document_root", NULL)) {
-			logger::instance().log(logger::LOG_ERROR, "Empty document root for host %s.", host);
-			return false;
+			// The document root is optional if the files are served from a bundle.
+			if (!bundle_file) {
+				logger::instance().log(logger::LOG_ERROR, "Empty document root for host %s.", host);
+				return false;
+			}
+
+			document_root = "";
+			document_root_len = 0;
 		} else {
 			if (document_root[document_root_len - 1] == '/') {
 				document_root_len--;
@@ -476,6 +896,13 @@ bool http_server::load_hosts(const xmlconf& conf, const general_conf& general_co
 			return false;
 		}
 
+		if (bundle_file) {
+			if ((vhost->bundle = site_bundle::open(bundle_file)) == NULL) {
+				logger::instance().log(logger::LOG_ERROR, "Couldn't load bundle %s for host %s.", bundle_file, host);
+				return false;
+			}
+		}
+
 		if (log_requests) {
 			if (!vhost->log->create(dir, filename, log_format, bufsize * 1024, access_log_max_file_size * 1024L)) {
 				logger::instance().log(logger::LOG_ERROR, "Couldn't create access log for host %s.", host);
@@ -495,6 +922,11 @@ bool http_server::load_hosts(const xmlconf& conf, const general_conf& general_co
 					return false;
 				}
 			}
+
+			if (!vhost->dir_listing->create_cache(general_conf.dirlisting_cache_size, &_M_workers)) {
+				logger::instance().log(logger::LOG_ERROR, "Couldn't create cache of directory listings for host %s.", host);
+				return false;
+			}
 		}
 
 		for (unsigned j = 0; conf.get_child(j, value, len, "config", "hosts", host, "aliases", NULL); j++) {
@@ -503,7 +935,7 @@ bool http_server::load_hosts(const xmlconf& conf, const general_conf& general_co
 			}
 		}
 
-		if (!load_rules(conf, general_conf, host, vhost->rules)) {
+		if (!load_rules(conf, general_conf, host, hostlen, document_root, document_root_len, vhost->rules)) {
 			return false;
 		}
 	}
@@ -511,7 +943,7 @@ bool http_server::load_hosts(const xmlconf& conf, const general_conf& general_co
 	return (_M_vhosts.count() > 0);
 }
 
-bool http_server::load_rules(const xmlconf& conf, const general_conf& general_conf, const char* host, rulelist* rules)
+bool http_server::load_rules(const xmlconf& conf, const general_conf& general_conf, const char* host, size_t hostlen, const char* document_root, size_t document_root_len, rulelist* rules)
 {
 	for (unsigned i = 0; ; i++) {
 		char name[64];
@@ -615,12 +1047,52 @@ bool http_server::load_rules(const xmlconf& conf, const general_conf& general_co
 
 		rule->backends.set_retry_interval(general_conf.backend_retry_interval);
 
+		rule->backends.set_idle_connections(general_conf.max_idle_backend_connections, general_conf.backend_idle_timeout);
+
+		rule->backends.set_dns_ttl(general_conf.min_dns_ttl, general_conf.max_dns_ttl);
+
 		if (handler != rulelist::LOCAL_HANDLER) {
+			if (!load_balancing(conf, host, name, rule->backends)) {
+				delete rule;
+				return false;
+			}
+
+			if (!load_health_checks(conf, general_conf, host, name, handler, rule->backends)) {
+				delete rule;
+				return false;
+			}
+
+			if (!load_retries(conf, host, name, rule->backends)) {
+				delete rule;
+				return false;
+			}
+
+			if (!load_concurrency_limit(conf, host, name, rule->backends)) {
+				delete rule;
+				return false;
+			}
+
 			for (j = 0; conf.get_child(j, value, len, "config", "hosts", host, "request_handling", name, "backends", NULL); j++) {
+				// Weight ("host:port*weight", "unix:/path*weight")?
+				unsigned weight = backend_list::DEFAULT_WEIGHT;
+
+				const char* asterisk = (const char*) memrchr(value, '*', len);
+				if (asterisk) {
+					if (number::parse_unsigned(asterisk + 1, (value + len) - (asterisk + 1), weight, 1, backend_list::MAX_WEIGHT) != number::PARSE_SUCCEEDED) {
+						delete rule;
+						return false;
+					}
+
+					len = asterisk - value;
+				}
+
 				unsigned port;
 
-				const char* semicolon = (const char*) memrchr(value, ':', len);
-				if (semicolon) {
+				const char* semicolon;
+				if (resolver::is_unix(value, len)) {
+					// Unix domain socket.
+					port = 0;
+				} else if ((semicolon = (const char*) memrchr(value, ':', len)) != NULL) {
 					if (number::parse_unsigned(semicolon + 1, (value + len) - (semicolon + 1), port, 1, 65535) != number::PARSE_SUCCEEDED) {
 						delete rule;
 						return false;
@@ -641,7 +1113,7 @@ bool http_server::load_rules(const xmlconf& conf, const general_conf& general_co
 					return false;
 				}
 
-				if (!rule->backends.add(value, len, port)) {
+				if (!rule->backends.add(value, len, port, weight)) {
 					delete rule;
 					return false;
 				}
@@ -653,16 +1125,237 @@ bool http_server::load_rules(const xmlconf& conf, const general_conf& general_co
 			}
 		}
 
-		rule->handler = handler;
-		rule->criterion = criterion;
+		if (handler != rulelist::LOCAL_HANDLER) {
+			bool b;
+			if (conf.get_value(b, "config", "hosts", host, "request_handling", name, "cache", NULL)) {
+				rule->cache = b;
+			}
 
-		if (!rules->add(rule)) {
-			delete rule;
-			return false;
-		}
-	}
+			if (!load_microcache(conf, host, name, rule)) {
+				delete rule;
+				return false;
+			}
 
-	return true;
+			// Maximum size of the request bodies [KB].
+			unsigned max_body_size;
+			if (!conf.get_value(max_body_size, "config", "hosts", host, "request_handling", name, "max_body_size", NULL)) {
+				max_body_size = general_conf.max_request_body_size;
+			}
+
+			rule->max_body_size = (off_t) max_body_size * 1024;
+		}
+
+		if (handler == rulelist::FCGI_HANDLER) {
+			if (!rule->set_fcgi_params(host, hostlen, general_conf.port, document_root, document_root_len)) {
+				delete rule;
+				return false;
+			}
+		}
+
+		rule->handler = handler;
+		rule->criterion = criterion;
+
+		if (!rules->add(rule)) {
+			delete rule;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool http_server::load_balancing(const xmlconf& conf, const char* host, const char* rule, backend_list& backends)
+{
+	const char* value;
+	size_t len;
+	if (!conf.get_value(value, len, "config", "hosts", host, "request_handling", rule, "load_balancing", NULL)) {
+		backends.set_policy(backend_list::ROUND_ROBIN);
+		return true;
+	}
+
+	if ((len == 11) && (strncasecmp(value, "round_robin", 11) == 0)) {
+		backends.set_policy(backend_list::ROUND_ROBIN);
+	} else if ((len == 14) && (strncasecmp(value, "least_requests", 14) == 0)) {
+		backends.set_policy(backend_list::LEAST_REQUESTS);
+	} else if ((len == 7) && (strncasecmp(value, "latency", 7) == 0)) {
+		backends.set_policy(backend_list::LATENCY);
+	} else if ((len == 4) && (strncasecmp(value, "hash", 4) == 0)) {
+		backends.set_policy(backend_list::HASH);
+
+		if (!conf.get_value(value, len, "config", "hosts", host, "request_handling", rule, "hash_key", NULL)) {
+			return backends.set_hash_key(backend_list::CLIENT_IP_KEY);
+		}
+
+		if ((len == 9) && (strncasecmp(value, "client_ip", 9) == 0)) {
+			return backends.set_hash_key(backend_list::CLIENT_IP_KEY);
+		} else if ((len == 3) && (strncasecmp(value, "url", 3) == 0)) {
+			return backends.set_hash_key(backend_list::URL_KEY);
+		} else if ((len > 7) && (strncasecmp(value, "cookie:", 7) == 0)) {
+			return backends.set_hash_key(backend_list::COOKIE_KEY, value + 7, len - 7);
+		} else {
+			return false;
+		}
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+bool http_server::load_health_checks(const xmlconf& conf, const general_conf& general_conf, const char* host, const char* rule, unsigned char handler, backend_list& backends)
+{
+	unsigned interval;
+	if ((conf.get_value(interval, "config", "hosts", host, "request_handling", rule, "health_check", "interval", NULL)) && (interval > 0)) {
+		unsigned timeout;
+		if (!conf.get_value(timeout, "config", "hosts", host, "request_handling", rule, "health_check", "timeout", NULL)) {
+			timeout = backend_list::DEFAULT_HEALTH_CHECK_TIMEOUT;
+		} else if (timeout == 0) {
+			return false;
+		}
+
+		// The HTTP backends can be checked with a request, the others
+		// only by connecting.
+		const char* path;
+		size_t pathlen;
+		if (handler != rulelist::HTTP_HANDLER) {
+			path = NULL;
+			pathlen = 0;
+		} else if (!conf.get_value(path, pathlen, "config", "hosts", host, "request_handling", rule, "health_check", "path", NULL)) {
+			path = NULL;
+			pathlen = 0;
+		}
+
+		unsigned status;
+		if (!conf.get_value(status, "config", "hosts", host, "request_handling", rule, "health_check", "status", NULL)) {
+			status = 200;
+		} else if ((status < 100) || (status > 599)) {
+			return false;
+		}
+
+		unsigned healthy_threshold;
+		if (!conf.get_value(healthy_threshold, "config", "hosts", host, "request_handling", rule, "health_check", "healthy_threshold", NULL)) {
+			healthy_threshold = backend_list::DEFAULT_HEALTHY_THRESHOLD;
+		} else if (healthy_threshold == 0) {
+			return false;
+		}
+
+		unsigned unhealthy_threshold;
+		if (!conf.get_value(unhealthy_threshold, "config", "hosts", host, "request_handling", rule, "health_check", "unhealthy_threshold", NULL)) {
+			unhealthy_threshold = backend_list::DEFAULT_UNHEALTHY_THRESHOLD;
+		} else if (unhealthy_threshold == 0) {
+			return false;
+		}
+
+		if (general_conf.health_check_threads == 0) {
+			// The checks would block the server.
+			logger::instance().log(logger::LOG_WARNING, "No health check threads, health checks of the backends of rule %s disabled.", rule);
+		} else if (!backends.set_health_check(interval, timeout, path, pathlen, status, healthy_threshold, unhealthy_threshold)) {
+			return false;
+		} else {
+			_M_health_checks = true;
+		}
+	}
+
+	unsigned max_errors;
+	if (!conf.get_value(max_errors, "config", "hosts", host, "request_handling", rule, "outlier_detection", "consecutive_errors", NULL)) {
+		max_errors = 0;
+	}
+
+	unsigned max_latency;
+	if (!conf.get_value(max_latency, "config", "hosts", host, "request_handling", rule, "outlier_detection", "max_latency", NULL)) {
+		max_latency = 0;
+	}
+
+	unsigned ejection_time;
+	if (!conf.get_value(ejection_time, "config", "hosts", host, "request_handling", rule, "outlier_detection", "ejection_time", NULL)) {
+		ejection_time = backend_list::DEFAULT_EJECTION_TIME;
+	}
+
+	backends.set_outlier_detection(max_errors, max_latency, ejection_time);
+
+	unsigned slow_start;
+	if (!conf.get_value(slow_start, "config", "hosts", host, "request_handling", rule, "slow_start", NULL)) {
+		slow_start = 0;
+	}
+
+	backends.set_slow_start(slow_start);
+
+	return true;
+}
+
+bool http_server::load_retries(const xmlconf& conf, const char* host, const char* rule, backend_list& backends)
+{
+	unsigned retries;
+	if (!conf.get_value(retries, "config", "hosts", host, "request_handling", rule, "retries", NULL)) {
+		retries = backend_list::DEFAULT_RETRIES;
+	}
+
+	backends.set_retries(retries);
+
+	unsigned percentile;
+	if (!conf.get_value(percentile, "config", "hosts", host, "request_handling", rule, "hedge_percentile", NULL)) {
+		percentile = 0;
+	} else if (percentile > 99) {
+		return false;
+	}
+
+	backends.set_hedging(percentile);
+
+	return true;
+}
+
+bool http_server::load_concurrency_limit(const xmlconf& conf, const char* host, const char* rule, backend_list& backends)
+{
+	unsigned max;
+	if ((!conf.get_value(max, "config", "hosts", host, "request_handling", rule, "concurrency_limit", "max", NULL)) || (max == 0)) {
+		return true;
+	}
+
+	unsigned initial;
+	if (!conf.get_value(initial, "config", "hosts", host, "request_handling", rule, "concurrency_limit", "initial", NULL)) {
+		initial = max;
+	}
+
+	unsigned queue_size;
+	if (!conf.get_value(queue_size, "config", "hosts", host, "request_handling", rule, "concurrency_limit", "queue_size", NULL)) {
+		queue_size = backend_list::DEFAULT_QUEUE_SIZE;
+	}
+
+	unsigned queue_timeout;
+	if (!conf.get_value(queue_timeout, "config", "hosts", host, "request_handling", rule, "concurrency_limit", "queue_timeout", NULL)) {
+		queue_timeout = backend_list::DEFAULT_QUEUE_TIMEOUT;
+	} else if (queue_timeout == 0) {
+		return false;
+	}
+
+	return backends.set_concurrency_limit(initial, max, queue_size, queue_timeout);
+}
+
+bool http_server::load_microcache(const xmlconf& conf, const char* host, const char* name, rulelist::rule* rule)
+{
+	unsigned ttl;
+	if ((!conf.get_value(ttl, "config", "hosts", host, "request_handling", name, "microcache", "ttl", NULL)) || (ttl == 0)) {
+		return true;
+	}
+
+	rule->microcache_ttl = ttl;
+	rule->cache = true;
+
+	const char* value;
+	size_t len;
+	for (unsigned i = 0; conf.get_child(i, value, len, "config", "hosts", host, "request_handling", name, "microcache", "ignore_query_parameters", NULL); i++) {
+		if (!rule->microcache_ignore_query.add(value, len)) {
+			return false;
+		}
+	}
+
+	for (unsigned i = 0; conf.get_child(i, value, len, "config", "hosts", host, "request_handling", name, "microcache", "ignore_cookies", NULL); i++) {
+		if (!rule->microcache_ignore_cookies.add(value, len)) {
+			return false;
+		}
+	}
+
+	return true;
 }
 
 bool http_server::get_dirname_basename(const char* path, size_t pathlen, char* dir, const char*& base)
@@ -694,6 +1387,10 @@ bool http_server::get_dirname_basename(const char* path, size_t pathlen, char* d
 
 void http_server::process_ready_list()
 {
+	if (_M_nhedges > 0) {
+		send_hedges();
+	}
+
 	logger::instance().log(logger::LOG_DEBUG, "[http_server::process_ready_list] Processing %d connection(s) from the ready list.", _M_nready);
 
 	unsigned nready = _M_nready;
@@ -708,6 +1405,34 @@ void http_server::process_ready_list()
 	}
 
 	_M_nready -= nready;
+
+	// Some backends might have room now.
+	if (_M_queued_requests > 0) {
+		dequeue_requests();
+	}
+}
+
+void http_server::resume(unsigned fd)
+{
+	tcp_connection* conn = _M_connections[fd];
+
+	if (_M_connection_handlers[fd] == rulelist::LOCAL_HANDLER) {
+		conn = &_M_http_connections[fd];
+	} else if (_M_connection_handlers[fd] == rulelist::HTTP_HANDLER) {
+		conn = &_M_proxy_connections[fd];
+	} else if (_M_connection_handlers[fd] == rulelist::FCGI_HANDLER) {
+		conn = &_M_fcgi_connections[fd];
+	}
+
+	if (!conn->_M_in_ready_list) {
+		conn->_M_in_ready_list = 1;
+		_M_ready_list[_M_nready++] = fd;
+	}
+}
+
+void http_server::resume_connection(unsigned fd, void* arg)
+{
+	static_cast<http_server*>(arg)->resume(fd);
 }
 
 bool http_server::process_connection(unsigned fd, int events)
@@ -738,18 +1463,94 @@ bool http_server::process_connection(unsigned fd, int events)
 
 	if (!conn->loop(fd)) {
 		if (_M_connection_handlers[fd] != rulelist::LOCAL_HANDLER) {
+			backend_list* backends;
+
+			// Has the backend closed an idle connection?
+			if ((backends = get_idle_pool(fd)) != NULL) {
+				backends->remove_idle_connection(fd);
+
+				conn->free();
+
+				return false;
+			}
+
 			int sock;
+			bool streaming = false;
 			if (_M_connection_handlers[fd] == rulelist::HTTP_HANDLER) {
-				sock = static_cast<proxy_connection*>(conn)->_M_fd;
+				proxy_connection* proxy = static_cast<proxy_connection*>(conn);
+
+				// Has the client gone away while the response was being
+				// relayed?
+				if (!proxy->_M_client) {
+					conn->free();
+
+					return false;
+				}
+
+				sock = proxy->_M_fd;
+
+				streaming = proxy->streaming();
+
+				// Can the connection be reused?
+				if (((proxy->_M_state == proxy_connection::RESPONSE_COMPLETED_STATE) || (proxy->_M_state == proxy_connection::RESPONSE_STREAMED_STATE)) && (proxy->_M_reusable)) {
+					backends = &(_M_http_connections[sock]._M_rule->backends);
+				}
 			} else {
-				sock = static_cast<fcgi_connection*>(conn)->_M_fd;
+				fcgi_connection* fcgi = static_cast<fcgi_connection*>(conn);
+
+				// Query of the limits of the application (or has the client
+				// gone away)?
+				if (!fcgi->_M_client) {
+					conn->free();
+
+					return false;
+				}
+
+				sock = fcgi->_M_fd;
+
+				streaming = fcgi->streaming();
+
+				// Can the connection be reused?
+				if (((fcgi->_M_state == fcgi_connection::RESPONSE_COMPLETED_STATE) || (fcgi->_M_state == fcgi_connection::RESPONSE_STREAMED_STATE)) && (fcgi->_M_reusable)) {
+					backends = &(_M_http_connections[sock]._M_rule->backends);
+				}
 			}
 
 			http_connection* client = static_cast<http_connection*>(&_M_http_connections[sock]);
 
+			client->_M_rule->backends.request_completed(fd, true);
+
 			client->_M_fd = -1;
 
-			if (client->_M_in_ready_list) {
+			// Add the connection to the pool before the client sends its
+			// next request.
+			if ((backends) && (backends->add_idle_connection(fd))) {
+				conn->free();
+
+				if (_M_connection_handlers[fd] == rulelist::HTTP_HANDLER) {
+					proxy_connection* proxy = static_cast<proxy_connection*>(conn);
+
+					proxy->_M_backends = backends;
+					proxy->_M_state = proxy_connection::IDLE_STATE;
+				} else {
+					fcgi_connection* fcgi = static_cast<fcgi_connection*>(conn);
+
+					fcgi->_M_backends = backends;
+					fcgi->_M_state = fcgi_connection::IDLE_STATE;
+				}
+
+				conn->_M_timestamp = now::_M_time;
+			} else {
+				backends = NULL;
+			}
+
+			if (streaming) {
+				// Let the client send what is left in its buffer.
+				if (!client->_M_in_ready_list) {
+					client->_M_in_ready_list = 1;
+					_M_ready_list[_M_nready++] = sock;
+				}
+			} else if (client->_M_in_ready_list) {
 				client->_M_in_ready_list = 0;
 
 				if (!client->loop(sock)) {
@@ -757,6 +1558,10 @@ bool http_server::process_connection(unsigned fd, int events)
 					remove(sock);
 				}
 			}
+
+			if (backends) {
+				return true;
+			}
 		}
 
 		conn->free();
@@ -776,6 +1581,12 @@ void http_server::handle_alarm()
 	while (i < _M_used) {
 		unsigned fd = _M_index[i];
 
+		// Pool of worker threads?
+		if (((int) fd == _M_workers.get_descriptor()) || ((int) fd == _M_health_checkers.get_descriptor())) {
+			i++;
+			continue;
+		}
+
 		tcp_connection* conn;
 
 		if (_M_connection_handlers[fd] == rulelist::LOCAL_HANDLER) {
@@ -786,8 +1597,52 @@ void http_server::handle_alarm()
 			conn = &_M_fcgi_connections[fd];
 		}
 
-		if (conn->_M_timestamp + (time_t) _M_max_idle_time < now::_M_time) {
-			logger::instance().log(logger::LOG_INFO, "Connection fd %d timed out.", fd);
+		// The connection to a backend whose response is being relayed
+		// (or to which the request body is being relayed) is closed with
+		// the client connection.
+		if (_M_connection_handlers[fd] == rulelist::HTTP_HANDLER) {
+			proxy_connection* proxy = static_cast<proxy_connection*>(conn);
+
+			if ((proxy->streaming()) || ((proxy->_M_client) && (proxy->_M_client->relaying_body()))) {
+				i++;
+				continue;
+			}
+		} else if (_M_connection_handlers[fd] == rulelist::FCGI_HANDLER) {
+			fcgi_connection* fcgi = static_cast<fcgi_connection*>(conn);
+
+			if ((fcgi->streaming()) || ((fcgi->_M_client) && (fcgi->_M_client->relaying_body()))) {
+				i++;
+				continue;
+			}
+		}
+
+		// Idle connection to a backend?
+		backend_list* backends = get_idle_pool(fd);
+
+		time_t max_idle_time = backends ? backends->get_idle_timeout() : (time_t) _M_max_idle_time;
+
+		if (conn->_M_timestamp + max_idle_time < now::_M_time) {
+			if (backends) {
+				logger::instance().log(logger::LOG_DEBUG, "[http_server::handle_alarm] Closing idle connection to backend fd %d.", fd);
+
+				backends->remove_idle_connection(fd);
+			} else {
+				logger::instance().log(logger::LOG_INFO, "Connection fd %d timed out.", fd);
+
+#if !PROXY
+				// Request to a backend?
+				http_connection* client = NULL;
+				if (_M_connection_handlers[fd] == rulelist::HTTP_HANDLER) {
+					client = static_cast<proxy_connection*>(conn)->_M_client;
+				} else if (_M_connection_handlers[fd] == rulelist::FCGI_HANDLER) {
+					client = static_cast<fcgi_connection*>(conn)->_M_client;
+				}
+
+				if (client) {
+					client->backend_timed_out(fd);
+				}
+#endif
+			}
 
 			remove(fd);
 			conn->free();
@@ -810,8 +1665,195 @@ void http_server::handle_alarm()
 		}
 	}
 
+	// Resolve again the names of the backends whose addresses have
+	// expired and check the health of the backends.
+	virtual_hosts::vhost* vhost;
+	for (i = 0; (vhost = _M_vhosts.get_host(i)) != NULL; i++) {
+		rulelist::rule* rules;
+		for (size_t j = 0; (rules = vhost->rules->get(j)) != NULL; j++) {
+			if (!rules->backends.refresh(_M_workers)) {
+				logger::instance().log(logger::LOG_WARNING, "Couldn't resolve the names of the backends.");
+			}
+
+			if (!rules->backends.check_health(_M_health_checkers)) {
+				logger::instance().log(logger::LOG_WARNING, "Couldn't check the health of the backends.");
+			}
+
+#if !PROXY
+			// Requests which have waited too long for a backend.
+			int fd;
+			while ((fd = rules->backends.expire()) != -1) {
+				_M_queued_requests--;
+
+				_M_http_connections[fd].queue_timed_out(fd);
+			}
+#endif
+		}
+	}
+
+	// Requests which have waited too long for the response to an
+	// identical request are sent to the backend.
+	int fd;
+	while ((fd = _M_cache.expire()) != -1) {
+		_M_http_connections[fd].response_ready(fd);
+	}
+
 	if (++_M_sync_count == _M_sync_interval) {
 		_M_vhosts.sync();
 		_M_sync_count = 0;
 	}
+
+	if ((_M_statistics_interval > 0) && (++_M_statistics_count == _M_statistics_interval)) {
+		log_statistics();
+		_M_statistics_count = 0;
+	}
+
+	if ((_M_bundle_check_interval > 0) && (++_M_bundle_check_count == _M_bundle_check_interval)) {
+		reload_bundles();
+		_M_bundle_check_count = 0;
+	}
+}
+
+void http_server::send_hedges()
+{
+#if !PROXY
+	unsigned long long now = backend_list::microseconds();
+
+	unsigned i = 0;
+	while (i < _M_nhedges) {
+		unsigned fd = _M_hedges[i];
+		http_connection* client = &_M_http_connections[fd];
+
+		if (client->_M_hedge_time > now) {
+			i++;
+			continue;
+		}
+
+		remove_hedge(client);
+
+		if (!client->send_hedge(fd)) {
+			logger::instance().log(logger::LOG_DEBUG, "[http_server::send_hedges] (fd %d) Couldn't send the request to a second backend.", fd);
+		}
+	}
+#endif
+}
+
+int http_server::get_wait_timeout()
+{
+	if (_M_nhedges == 0) {
+		return -1;
+	}
+
+	unsigned long long next = _M_http_connections[_M_hedges[0]]._M_hedge_time;
+	for (unsigned i = 1; i < _M_nhedges; i++) {
+		if (_M_http_connections[_M_hedges[i]]._M_hedge_time < next) {
+			next = _M_http_connections[_M_hedges[i]]._M_hedge_time;
+		}
+	}
+
+	unsigned long long now = backend_list::microseconds();
+
+	return (next > now) ? (int) ((next - now + 999) / 1000) : 0;
+}
+
+void http_server::dequeue_requests()
+{
+#if !PROXY
+	virtual_hosts::vhost* vhost;
+	for (size_t i = 0; (vhost = _M_vhosts.get_host(i)) != NULL; i++) {
+		rulelist::rule* rules;
+		for (size_t j = 0; (rules = vhost->rules->get(j)) != NULL; j++) {
+			int fd;
+			while ((fd = rules->backends.dequeue()) != -1) {
+				_M_queued_requests--;
+
+				_M_http_connections[fd].dequeued(fd);
+			}
+
+			if (_M_queued_requests == 0) {
+				return;
+			}
+		}
+	}
+#endif
+}
+
+void http_server::reload_bundles()
+{
+	for (size_t i = 0; i < _M_vhosts.count(); i++) {
+		virtual_hosts::vhost* vhost = _M_vhosts.get_host(i);
+
+		// If the bundle hasn't been replaced...
+		if ((!vhost->bundle) || (!vhost->bundle->changed())) {
+			continue;
+		}
+
+		// The connections which are sending files from the old bundle
+		// keep a reference to it.
+		site_bundle* bundle;
+		if ((bundle = site_bundle::open(vhost->bundle->get_filename())) == NULL) {
+			logger::instance().log(logger::LOG_WARNING, "Couldn't reload bundle %s, keeping the current one.", vhost->bundle->get_filename());
+			continue;
+		}
+
+		vhost->bundle->release();
+		vhost->bundle = bundle;
+
+		logger::instance().log(logger::LOG_INFO, "Bundle %s has been reloaded.", bundle->get_filename());
+	}
+}
+
+void http_server::log_statistics()
+{
+	worker_pool::statistics stats;
+	_M_workers.get_statistics(stats);
+
+	logger::instance().log(logger::LOG_INFO, "[Statistics] Worker pool: %u job(s) queued (max: %u), %llu job(s) completed, latency avg: %llu us, max: %u us.", stats.queued, stats.max_queued, stats.completed, (stats.completed > 0) ? stats.total_latency / stats.completed : 0ULL, stats.max_latency);
+
+	if (_M_large_file_size > 0) {
+		logger::instance().log(logger::LOG_INFO, "[Statistics] Large files: %llu byte(s) from the page cache, %llu byte(s) from disk.", _M_page_cache_bytes, _M_disk_bytes);
+
+		_M_page_cache_bytes = 0;
+		_M_disk_bytes = 0;
+	}
+
+	if (_M_backend_connections + _M_reused_backend_connections > 0) {
+		logger::instance().log(logger::LOG_INFO, "[Statistics] Backend connections: %llu established, %llu reused.", _M_backend_connections, _M_reused_backend_connections);
+
+		_M_backend_connections = 0;
+		_M_reused_backend_connections = 0;
+	}
+
+	const tmpfiles_cache::statistics& tmpfiles_stats = _M_tmpfiles.get_statistics();
+	if ((_M_payload_memory > 0) || (tmpfiles_stats.files[tmpfiles_cache::MEMORY_TIER] + tmpfiles_stats.files[tmpfiles_cache::DISK_TIER] > 0)) {
+		logger::instance().log(logger::LOG_INFO, "[Statistics] Payloads: %lu byte(s) in memory, %lu file(s) in memory (%lld byte(s)), %lu file(s) on disk.", (unsigned long) _M_payload_memory, (unsigned long) tmpfiles_stats.files[tmpfiles_cache::MEMORY_TIER], (long long) tmpfiles_stats.size[tmpfiles_cache::MEMORY_TIER], (unsigned long) tmpfiles_stats.files[tmpfiles_cache::DISK_TIER]);
+	}
+
+	const response_cache::statistics& cache_stats = _M_cache.get_statistics();
+	if (cache_stats.hits + cache_stats.stale_hits + cache_stats.misses > 0) {
+		logger::instance().log(logger::LOG_INFO, "[Statistics] Response cache: %llu hit(s), %llu stale hit(s), %llu miss(es), %llu collapsed (%llu timed out), %llu response(s) stored, %lu entries, %lu byte(s) in memory, %lld byte(s) on disk.", cache_stats.hits, cache_stats.stale_hits, cache_stats.misses, cache_stats.collapsed, cache_stats.collapse_timeouts, cache_stats.stores, (unsigned long) cache_stats.entries, (unsigned long) cache_stats.memory, (long long) cache_stats.disk);
+	}
+
+	// Load of the backends.
+	virtual_hosts::vhost* vhost;
+	for (size_t i = 0; (vhost = _M_vhosts.get_host(i)) != NULL; i++) {
+		rulelist::rule* rules;
+		for (size_t j = 0; (rules = vhost->rules->get(j)) != NULL; j++) {
+			backend_list::statistics backend_stats;
+			for (size_t k = 0; rules->backends.get_statistics(k, backend_stats); k++) {
+				if ((backend_stats.requests > 0) || (backend_stats.outstanding > 0)) {
+					if (backend_stats.limit > 0) {
+						logger::instance().log(logger::LOG_INFO, "[Statistics] Backend %s (host %.*s, rule %u, weight %u): %llu request(s), %u in flight (limit: %u), latency (EWMA): %u us%s.", backend_stats.name, vhost->namelen, vhost->name, j, backend_stats.weight, backend_stats.requests, backend_stats.outstanding, backend_stats.limit, backend_stats.latency, backend_stats.available ? "" : ", unavailable");
+					} else {
+						logger::instance().log(logger::LOG_INFO, "[Statistics] Backend %s (host %.*s, rule %u, weight %u): %llu request(s), %u in flight, latency (EWMA): %u us%s.", backend_stats.name, vhost->namelen, vhost->name, j, backend_stats.weight, backend_stats.requests, backend_stats.outstanding, backend_stats.latency, backend_stats.available ? "" : ", unavailable");
+					}
+				}
+			}
+
+			backend_list::queue_statistics queue_stats;
+			if ((rules->backends.get_queue_statistics(queue_stats)) && (queue_stats.max_queued + queue_stats.rejected > 0)) {
+				logger::instance().log(logger::LOG_INFO, "[Statistics] Queue (host %.*s, rule %u): %u request(s) queued (max: %u), %llu dequeued, wait avg: %llu us, max: %u us, %llu rejected, %llu timed out.", vhost->namelen, vhost->name, j, queue_stats.queued, queue_stats.max_queued, queue_stats.dequeued, (queue_stats.dequeued > 0) ? queue_stats.total_wait / queue_stats.dequeued : 0ULL, queue_stats.max_wait, queue_stats.rejected, queue_stats.timed_out);
+			}
+		}
+	}
 }
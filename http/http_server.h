@@ -2,6 +2,7 @@
 #define HTTP_SERVER_H
 
 #include <limits.h>
+#include <netinet/in.h>
 #include "net/tcp_server.h"
 #include "http/http_connection.h"
 #include "http/proxy_connection.h"
@@ -9,9 +10,12 @@
 #include "http/virtual_hosts.h"
 #include "http/index_file_finder.h"
 #include "http/http_headers.h"
+#include "http/response_cache.h"
 #include "xmlconf/xmlconf.h"
 #include "mime/mime_types.h"
 #include "file/tmpfiles_cache.h"
+#include "net/dnscache.h"
+#include "util/worker_pool.h"
 #include "logger/logger.h"
 
 class http_server : public tcp_server {
@@ -46,15 +50,85 @@ class http_server : public tcp_server {
 
 		tmpfiles_cache _M_tmpfiles;
 
+		response_cache _M_cache;
+
+		// IPv4 networks from which PURGE requests are accepted (host
+		// byte order).
+		struct network {
+			in_addr_t addr;
+			in_addr_t mask;
+		};
+
+		network _M_purge_networks[16];
+		unsigned _M_npurge_networks;
+
+#if PROXY
+		// Addresses of the hosts requested through the proxy.
+		dnscache _M_dnscache;
+#endif
+
+		// Has to be destroyed before the virtual hosts (the jobs might
+		// reference them).
+		worker_pool _M_workers;
+
+		// The health checks block until they time out, they have their
+		// own threads so they don't delay the other jobs.
+		worker_pool _M_health_checkers;
+		bool _M_health_checks;
+
 		unsigned _M_max_idle_time_unknown_size_body;
 
+		// Connections to the backends established / reused.
+		unsigned long long _M_backend_connections;
+		unsigned long long _M_reused_backend_connections;
+
 		size_t _M_max_payload_in_memory;
 
+		// Payloads kept in memory by all the connections (and limit)
+		// [bytes].
+		size_t _M_payload_memory;
+		size_t _M_max_payload_memory;
+
+		// Relay the large responses of the HTTP backends as they arrive
+		// (instead of saving them to disk first)?
+		bool _M_stream_backend_responses;
+
+		// Move the relayed bodies from socket to socket through a pipe
+		// (instead of copying them to user space)?
+		bool _M_splice_backend_responses;
+
+		// Relay the large request bodies to the backends as they arrive
+		// (instead of saving them to disk first)?
+		bool _M_stream_request_bodies;
+
 		unsigned _M_boundary;
 
+		// Clients whose request is due to be sent to a second backend.
+		unsigned* _M_hedges;
+		unsigned _M_nhedges;
+
+		// Requests waiting for a backend to have room (all the rules).
+		unsigned _M_queued_requests;
+
 		unsigned _M_sync_interval;
 		unsigned _M_sync_count;
 
+		unsigned _M_statistics_interval;
+		unsigned _M_statistics_count;
+
+		// Interval for checking whether the bundles have been replaced.
+		unsigned _M_bundle_check_interval;
+		unsigned _M_bundle_check_count;
+
+		// Files of at least _M_large_file_size bytes are read ahead
+		// by the worker threads (0: disabled).
+		off_t _M_large_file_size;
+		bool _M_drop_large_files;
+
+		// Bytes of large files found in the page cache / read from disk.
+		unsigned long long _M_page_cache_bytes;
+		unsigned long long _M_disk_bytes;
+
 		// Create connections.
 		virtual bool create_connections();
 
@@ -64,6 +138,9 @@ class http_server : public tcp_server {
 		// On event.
 		virtual bool on_event(unsigned fd, int events);
 
+		// On event error.
+		virtual void on_event_error(unsigned fd);
+
 		enum tribool {
 			TRIBOOL_UNDEFINED,
 			TRIBOOL_TRUE,
@@ -76,9 +153,25 @@ class http_server : public tcp_server {
 
 			const char* payload_directory;
 			unsigned max_spare_files;
+			unsigned max_payload_in_memory_files; // [MB]
+			unsigned max_pending_payload_writes; // [MB]
+
+			unsigned max_request_body_size; // [KB] (0: no limit)
+
+			unsigned cache_max_memory; // [MB]
+			unsigned cache_max_object_size; // [KB]
+			unsigned cache_max_disk_size; // [MB]
+			unsigned cache_max_disk_object_size; // [MB]
+			unsigned cache_collapse_timeout; // [s]
 
 			unsigned backend_retry_interval;
 
+			unsigned max_idle_backend_connections;
+			unsigned backend_idle_timeout;
+
+			unsigned min_dns_ttl;
+			unsigned max_dns_ttl;
+
 			tribool log_requests;
 			const char* log_format;
 			size_t log_buffer_size; // [KB]
@@ -87,6 +180,10 @@ class http_server : public tcp_server {
 			tribool have_dirlisting;
 
 			const char* footer_file;
+			size_t dirlisting_cache_size;
+
+			unsigned worker_threads;
+			unsigned health_check_threads;
 
 			logger::level level;
 
@@ -98,11 +195,33 @@ class http_server : public tcp_server {
 		// Load general.
 		bool load_general(const xmlconf& conf, general_conf& general_conf);
 
+		// Load the networks from which PURGE requests are accepted.
+		bool load_purge_networks(const xmlconf& conf);
+
+		// May the client send PURGE requests?
+		bool purge_allowed(const struct sockaddr* addr) const;
+
 		// Load hosts.
 		bool load_hosts(const xmlconf& conf, const general_conf& general_conf);
 
-		// Load rules.
-		bool load_rules(const xmlconf& conf, const general_conf& general_conf, const char* host, rulelist* rules);
+		// Load rules ('host' and 'document_root': to encode the
+		// FastCGI parameters which don't depend on the request).
+		bool load_rules(const xmlconf& conf, const general_conf& general_conf, const char* host, size_t hostlen, const char* document_root, size_t document_root_len, rulelist* rules);
+
+		// Load load-balancing policy of rule.
+		bool load_balancing(const xmlconf& conf, const char* host, const char* rule, backend_list& backends);
+
+		// Load health checks, outlier detection and slow start of rule.
+		bool load_health_checks(const xmlconf& conf, const general_conf& general_conf, const char* host, const char* rule, unsigned char handler, backend_list& backends);
+
+		// Load retries and hedging of rule.
+		bool load_retries(const xmlconf& conf, const char* host, const char* rule, backend_list& backends);
+
+		// Load concurrency limit and queue of rule.
+		bool load_concurrency_limit(const xmlconf& conf, const char* host, const char* rule, backend_list& backends);
+
+		// Load microcaching of rule.
+		bool load_microcache(const xmlconf& conf, const char* host, const char* name, rulelist::rule* rule);
 
 		// Get directory and file name.
 		bool get_dirname_basename(const char* path, size_t pathlen, char* dir, const char*& base);
@@ -113,8 +232,39 @@ class http_server : public tcp_server {
 		// Process connection.
 		bool process_connection(unsigned fd, int events);
 
+		// Add connection to the ready list (the writes to its temporary
+		// file have progressed).
+		void resume(unsigned fd);
+		static void resume_connection(unsigned fd, void* arg);
+
+		// Get the pool of the idle connection to a backend (NULL if the
+		// connection is not idle).
+		backend_list* get_idle_pool(unsigned fd);
+
 		// Handle alarm.
 		virtual void handle_alarm();
+
+		// Send the request of fd to a second backend if the response
+		// hasn't been received after 'delay' microseconds.
+		void add_hedge(unsigned fd, unsigned delay);
+
+		// Don't send the request of the client to a second backend.
+		void remove_hedge(http_connection* client);
+
+		// Send the requests whose delay has expired to a second backend.
+		void send_hedges();
+
+		// Wake up in time to send the requests to a second backend.
+		virtual int get_wait_timeout();
+
+		// Send the queued requests for which a backend has room.
+		void dequeue_requests();
+
+		// Log statistics.
+		void log_statistics();
+
+		// Reload the bundles which have been replaced.
+		void reload_bundles();
 };
 
 inline http_server::~http_server()
@@ -122,4 +272,39 @@ inline http_server::~http_server()
 	delete_connections();
 }
 
+inline void http_server::add_hedge(unsigned fd, unsigned delay)
+{
+	http_connection* client = &_M_http_connections[fd];
+
+	client->_M_hedge_time = backend_list::microseconds() + delay;
+	client->_M_hedge_index = _M_nhedges;
+
+	_M_hedges[_M_nhedges++] = fd;
+}
+
+inline void http_server::remove_hedge(http_connection* client)
+{
+	unsigned fd = _M_hedges[--_M_nhedges];
+
+	_M_hedges[client->_M_hedge_index] = fd;
+	_M_http_connections[fd]._M_hedge_index = client->_M_hedge_index;
+
+	client->_M_hedge_time = 0;
+}
+
+inline backend_list* http_server::get_idle_pool(unsigned fd)
+{
+	if (_M_connection_handlers[fd] == rulelist::HTTP_HANDLER) {
+		if (_M_proxy_connections[fd]._M_state == proxy_connection::IDLE_STATE) {
+			return _M_proxy_connections[fd]._M_backends;
+		}
+	} else if (_M_connection_handlers[fd] == rulelist::FCGI_HANDLER) {
+		if (_M_fcgi_connections[fd]._M_state == fcgi_connection::IDLE_STATE) {
+			return _M_fcgi_connections[fd]._M_backends;
+		}
+	}
+
+	return NULL;
+}
+
 #endif // HTTP_SERVER_H
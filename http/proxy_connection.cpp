@@ -4,6 +4,7 @@
 #include "http/http_server.h"
 #include "http/version.h"
 #include "net/socket_wrapper.h"
+#include "net/splicer.h"
 #include "net/tcp_connection.inl"
 #include "util/number.h"
 #include "util/now.h"
@@ -13,6 +14,8 @@
 
 const unsigned short proxy_connection::STATUS_LINE_MAX_LEN = 1024;
 
+const size_t proxy_connection::STREAM_BUFFER_SIZE = 64 * 1024;
+
 const unsigned char proxy_connection::CONNECTING_STATE = 0;
 const unsigned char proxy_connection::SENDING_HEADERS_STATE = 1;
 const unsigned char proxy_connection::SENDING_BODY_STATE = 2;
@@ -24,6 +27,12 @@ const unsigned char proxy_connection::READING_CHUNKED_BODY_STATE = 7;
 const unsigned char proxy_connection::READING_UNKNOWN_SIZE_BODY_STATE = 8;
 const unsigned char proxy_connection::PREPARING_ERROR_PAGE_STATE = 9;
 const unsigned char proxy_connection::RESPONSE_COMPLETED_STATE = 10;
+const unsigned char proxy_connection::IDLE_STATE = 11;
+const unsigned char proxy_connection::STREAMING_BODY_STATE = 12;
+const unsigned char proxy_connection::STREAMING_CHUNKED_BODY_STATE = 13;
+const unsigned char proxy_connection::STREAMING_UNKNOWN_SIZE_BODY_STATE = 14;
+const unsigned char proxy_connection::RESPONSE_STREAMED_STATE = 15;
+const unsigned char proxy_connection::RELAYING_BODY_STATE = 16;
 
 proxy_connection::proxy_connection()
 {
@@ -33,12 +42,16 @@ proxy_connection::proxy_connection()
 
 	_M_client = NULL;
 
+	_M_backends = NULL;
+
 	_M_status_code = 0;
 
 	_M_reason_phrase_len = 0;
 
 	_M_state = CONNECTING_STATE;
 	_M_substate = 0;
+
+	_M_reusable = 0;
 }
 
 void proxy_connection::reset()
@@ -55,12 +68,16 @@ void proxy_connection::reset()
 
 	_M_client = NULL;
 
+	_M_backends = NULL;
+
 	_M_status_code = 0;
 
 	_M_reason_phrase_len = 0;
 
 	_M_state = CONNECTING_STATE;
 	_M_substate = 0;
+
+	_M_reusable = 0;
 }
 
 bool proxy_connection::loop(unsigned fd)
@@ -84,6 +101,12 @@ bool proxy_connection::loop(unsigned fd)
 
 #if !PROXY
 					_M_client->_M_rule->backends.connection_failed(fd);
+
+					// Try another backend.
+					if (_M_client->backend_failed(_M_fd, fd, false)) {
+						_M_client = NULL;
+						return false;
+					}
 #endif
 
 					_M_client->_M_error = http_error::GATEWAY_TIMEOUT;
@@ -98,6 +121,11 @@ bool proxy_connection::loop(unsigned fd)
 
 				break;
 			case SENDING_HEADERS_STATE:
+				// Has the client gone away while sending the body?
+				if (!_M_client) {
+					return false;
+				}
+
 				if (!_M_writable) {
 					return true;
 				}
@@ -121,6 +149,13 @@ bool proxy_connection::loop(unsigned fd)
 				}
 
 				if (!ret) {
+#if !PROXY
+					if (_M_client->backend_failed(_M_fd, fd, true)) {
+						_M_client = NULL;
+						return false;
+					}
+#endif
+
 					_M_client->_M_error = http_error::GATEWAY_TIMEOUT;
 					_M_state = PREPARING_ERROR_PAGE_STATE;
 				} else {
@@ -139,7 +174,7 @@ bool proxy_connection::loop(unsigned fd)
 						} else {
 							_M_outp = 0;
 
-							_M_state = SENDING_BODY_STATE;
+							_M_state = (_M_client->_M_relaying_body) ? RELAYING_BODY_STATE : SENDING_BODY_STATE;
 						}
 					}
 				}
@@ -151,6 +186,13 @@ bool proxy_connection::loop(unsigned fd)
 				}
 
 				if (!sendfile(fd, _M_client->_M_tmpfile, _M_client->_M_request_body_size, total)) {
+#if !PROXY
+					if (_M_client->backend_failed(_M_fd, fd, true)) {
+						_M_client = NULL;
+						return false;
+					}
+#endif
+
 					_M_client->_M_error = http_error::GATEWAY_TIMEOUT;
 					_M_state = PREPARING_ERROR_PAGE_STATE;
 				} else {
@@ -174,13 +216,67 @@ bool proxy_connection::loop(unsigned fd)
 					}
 				}
 
+				break;
+			case RELAYING_BODY_STATE:
+				// Has the client gone away while sending the body?
+				if (!_M_client) {
+					return false;
+				}
+
+				if (_M_outp < (off_t) _M_client->_M_body.count()) {
+					if (!_M_writable) {
+						return true;
+					}
+
+					if (!write(fd, _M_client->_M_body, total)) {
+						_M_client->_M_error = http_error::GATEWAY_TIMEOUT;
+						_M_state = PREPARING_ERROR_PAGE_STATE;
+					} else {
+						_M_client->_M_timestamp = now::_M_time;
+					}
+				} else if (!_M_client->relaying_body()) {
+					// The whole body has been sent.
+					socket_wrapper::uncork(fd);
+
+					if (!modify(fd, tcp_server::READ)) {
+						_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
+						_M_state = PREPARING_ERROR_PAGE_STATE;
+					} else {
+						_M_client->_M_body.reset();
+
+						_M_state = READING_STATUS_LINE_STATE;
+					}
+				} else {
+					_M_client->_M_body.reset();
+					_M_outp = 0;
+
+					// If the client has stopped reading because the buffer
+					// was full, let it go on.
+					_M_client->resume_body(_M_fd);
+
+					return true;
+				}
+
 				break;
 			case READING_STATUS_LINE_STATE:
+				// Has another backend answered first?
+				if (!_M_client) {
+					return false;
+				}
+
 				if (!_M_readable) {
 					return true;
 				}
 
 				if (!read_status_line(fd, total)) {
+#if !PROXY
+					// Nothing received?
+					if ((_M_client->_M_error == http_error::GATEWAY_TIMEOUT) && (_M_client->_M_body.count() == 0) && (_M_client->backend_failed(_M_fd, fd, true))) {
+						_M_client = NULL;
+						return false;
+					}
+#endif
+
 					_M_state = PREPARING_ERROR_PAGE_STATE;
 				}
 
@@ -202,7 +298,10 @@ bool proxy_connection::loop(unsigned fd)
 
 				break;
 			case READING_BODY_STATE:
-				if (!_M_readable) {
+				// If too much data is waiting to be written to the
+				// temporary file, we will be added to the ready list once
+				// it has progressed.
+				if ((!_M_readable) || (spill_throttled(fd))) {
 					return true;
 				}
 
@@ -212,7 +311,7 @@ bool proxy_connection::loop(unsigned fd)
 
 				break;
 			case READING_CHUNKED_BODY_STATE:
-				if (!_M_readable) {
+				if ((!_M_readable) || (spill_throttled(fd))) {
 					return true;
 				}
 
@@ -222,7 +321,7 @@ bool proxy_connection::loop(unsigned fd)
 
 				break;
 			case READING_UNKNOWN_SIZE_BODY_STATE:
-				if (!_M_readable) {
+				if ((!_M_readable) || (spill_throttled(fd))) {
 					return true;
 				}
 
@@ -231,7 +330,63 @@ bool proxy_connection::loop(unsigned fd)
 				}
 
 				break;
+			case STREAMING_BODY_STATE:
+			case STREAMING_CHUNKED_BODY_STATE:
+			case STREAMING_UNKNOWN_SIZE_BODY_STATE:
+				// Has the client gone away?
+				if (!_M_client) {
+					return false;
+				}
+
+				// If the client has to send what has been read already
+				// first, it will add us to the ready list.
+				if ((!_M_readable) || (_M_client->_M_body.count() >= STREAM_BUFFER_SIZE)) {
+					return true;
+				}
+
+#if HAVE_SPLICE
+				if (_M_client->_M_pipe[1] != -1) {
+					if (!splice_body(fd, total)) {
+						_M_reusable = 0;
+						_M_client->_M_keep_alive = 0;
+
+						return false;
+					}
+
+					// Wait for more data or for the client to empty the
+					// pipe.
+					if (_M_state != RESPONSE_STREAMED_STATE) {
+						return true;
+					}
+
+					break;
+				}
+#endif // HAVE_SPLICE
+
+				if (!stream_body(fd, total)) {
+					// The headers have been sent already, the client
+					// connection will be closed.
+					_M_reusable = 0;
+					_M_client->_M_keep_alive = 0;
+
+					return false;
+				}
+
+				break;
+			case RESPONSE_STREAMED_STATE:
+				return false;
 			case PREPARING_ERROR_PAGE_STATE:
+				// Serve the stale response instead?
+				if ((_M_client->_M_error >= http_error::INTERNAL_SERVER_ERROR) && (_M_client->serve_stale(_M_fd))) {
+					_M_client->_M_in_ready_list = 1;
+					return false;
+				}
+
+				// The rest of the request body won't be read.
+				if (_M_client->relaying_body()) {
+					_M_client->_M_keep_alive = 0;
+				}
+
 				if (!http_error::build_page(_M_client)) {
 					return false;
 				}
@@ -251,7 +406,34 @@ bool proxy_connection::loop(unsigned fd)
 				_M_client->_M_state = http_connection::SENDING_BACKEND_HEADERS_STATE;
 
 				return false;
+			case IDLE_STATE:
+				// Has the backend closed the connection (or sent
+				// unexpected data)?
+				if (_M_readable) {
+					return false;
+				}
+
+				return true;
 			case RESPONSE_COMPLETED_STATE:
+				// Serve the stale response instead?
+				if ((_M_status_code >= 500) && (_M_client->serve_stale(_M_fd))) {
+					_M_client->_M_in_ready_list = 1;
+					return false;
+				}
+
+				// Wait for the body to be written to the temporary file.
+				if (_M_tmpfile != -1) {
+					tmpfiles_cache::write_state state = static_cast<http_server*>(_M_server)->_M_tmpfiles.flush(_M_tmpfile, fd);
+					if (state == tmpfiles_cache::WRITING) {
+						return true;
+					} else if (state == tmpfiles_cache::WRITE_FAILED) {
+						_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
+						_M_state = PREPARING_ERROR_PAGE_STATE;
+
+						break;
+					}
+				}
+
 				if (!prepare_http_response(fd)) {
 					_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
 					_M_state = PREPARING_ERROR_PAGE_STATE;
@@ -261,6 +443,8 @@ bool proxy_connection::loop(unsigned fd)
 					_M_client->_M_tmpfile = _M_tmpfile;
 					_M_tmpfile = -1;
 
+					_M_client->cache_response(_M_status_code);
+
 					_M_client->_M_state = http_connection::SENDING_BACKEND_HEADERS_STATE;
 
 					if (!_M_client->_M_payload_in_memory) {
@@ -290,6 +474,11 @@ bool proxy_connection::read_status_line(unsigned fd, size_t& total)
 			return true;
 		}
 
+#if !PROXY
+		// If the request has been sent to two backends, this one answers.
+		_M_client->backend_responding(fd);
+#endif
+
 		_M_client->_M_timestamp = now::_M_time;
 
 		parse_result parse_result = parse_status_line(fd);
@@ -360,10 +549,11 @@ bool proxy_connection::read_body(unsigned fd, size_t& total)
 
 		_M_client->_M_timestamp = now::_M_time;
 
-		size_t count = MIN(_M_left, (off_t) _M_client->_M_body.count() - _M_inp);
+		size_t available = _M_client->_M_body.count() - _M_inp;
+		size_t count = MIN(_M_left, (off_t) available);
 
 		if (!_M_client->_M_payload_in_memory) {
-			if (!file_wrapper::write(_M_tmpfile, _M_client->_M_body.data(), count)) {
+			if (!static_cast<http_server*>(_M_server)->_M_tmpfiles.write(_M_tmpfile, _M_client->_M_body.data(), count)) {
 				_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
 				return false;
 			}
@@ -374,12 +564,18 @@ bool proxy_connection::read_body(unsigned fd, size_t& total)
 		}
 
 		if ((off_t) count == _M_left) {
+			// Don't reuse the connection if the backend has sent more
+			// data than expected.
+			if (available > count) {
+				_M_reusable = 0;
+			}
+
 			_M_state = RESPONSE_COMPLETED_STATE;
 			return true;
 		}
 
 		_M_left -= count;
-	} while (res == IO_SUCCESS);
+	} while ((res == IO_SUCCESS) && (!spill_throttled(fd)));
 
 	return true;
 }
@@ -398,7 +594,8 @@ bool proxy_connection::read_chunked_body(unsigned fd, size_t& total)
 
 		_M_client->_M_timestamp = now::_M_time;
 
-		switch (parse_chunk(_M_client->_M_body.data(), _M_client->_M_body.count())) {
+		size_t size;
+		switch (parse_chunk(_M_client->_M_body.data(), _M_client->_M_body.count(), size)) {
 			case chunked_parser::INVALID_CHUNKED_RESPONSE:
 				_M_client->_M_error = http_error::BAD_GATEWAY;
 				return false;
@@ -409,10 +606,16 @@ bool proxy_connection::read_chunked_body(unsigned fd, size_t& total)
 				_M_client->_M_body.reset();
 				break;
 			default:
+				// Don't reuse the connection if the backend has sent more
+				// data than expected.
+				if (size < _M_client->_M_body.count()) {
+					_M_reusable = 0;
+				}
+
 				_M_state = RESPONSE_COMPLETED_STATE;
 				return true;
 		}
-	} while (res == IO_SUCCESS);
+	} while ((res == IO_SUCCESS) && (!spill_throttled(fd)));
 
 	return true;
 }
@@ -433,7 +636,7 @@ bool proxy_connection::read_unknown_size_body(unsigned fd, size_t& total)
 
 		size_t count = _M_client->_M_body.count();
 
-		if (!file_wrapper::write(_M_tmpfile, _M_client->_M_body.data(), count)) {
+		if (!static_cast<http_server*>(_M_server)->_M_tmpfiles.write(_M_tmpfile, _M_client->_M_body.data(), count)) {
 			_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
 			return false;
 		}
@@ -441,10 +644,159 @@ bool proxy_connection::read_unknown_size_body(unsigned fd, size_t& total)
 		_M_client->_M_body.reset();
 
 		_M_client->_M_filesize += count;
-	} while (res == IO_SUCCESS);
+	} while ((res == IO_SUCCESS) && (!spill_throttled(fd)));
+
+	return true;
+}
+
+bool proxy_connection::add_chunked_data(const char* buf, size_t len)
+{
+	// The chunks are passed through, only count the data.
+	if (_M_state == STREAMING_CHUNKED_BODY_STATE) {
+		_M_client->_M_filesize += len;
+		return true;
+	}
+
+	if (!static_cast<http_server*>(_M_server)->_M_tmpfiles.write(_M_tmpfile, buf, len)) {
+		return false;
+	}
+
+	_M_client->_M_filesize += len;
+
+	return true;
+}
+
+bool proxy_connection::spill_throttled(unsigned fd)
+{
+	return ((_M_tmpfile != -1) && (static_cast<http_server*>(_M_server)->_M_tmpfiles.throttled(_M_tmpfile, fd)));
+}
+
+bool proxy_connection::stream_body(unsigned fd, size_t& total)
+{
+	buffer* body = &_M_client->_M_body;
+	size_t count = body->count();
+
+	io_result res;
+
+	do {
+		size_t offset = body->count();
+
+		if ((res = read(fd, *body, total)) == IO_ERROR) {
+			if (_M_state != STREAMING_UNKNOWN_SIZE_BODY_STATE) {
+				return false;
+			}
+
+			// The end of the body is signaled by closing the connection.
+			_M_state = RESPONSE_STREAMED_STATE;
+			break;
+		} else if (res == IO_NO_DATA_READ) {
+			break;
+		}
+
+		_M_client->_M_timestamp = now::_M_time;
+
+		size_t len = body->count() - offset;
+
+		if (_M_state == STREAMING_BODY_STATE) {
+			if ((off_t) len >= _M_left) {
+				// Don't reuse the connection (nor relay the data) if the
+				// backend has sent more data than expected.
+				if ((off_t) len > _M_left) {
+					_M_reusable = 0;
+					body->set_count(offset + _M_left);
+				}
+
+				_M_state = RESPONSE_STREAMED_STATE;
+				break;
+			}
+
+			_M_left -= len;
+		} else if (_M_state == STREAMING_CHUNKED_BODY_STATE) {
+			size_t size;
+			chunked_parser::parse_result parse_result = parse_chunk(body->data() + offset, len, size);
+			if (parse_result == chunked_parser::INVALID_CHUNKED_RESPONSE) {
+				return false;
+			} else if (parse_result == chunked_parser::END_OF_RESPONSE) {
+				if (size < len) {
+					_M_reusable = 0;
+					body->set_count(offset + size);
+				}
+
+				_M_state = RESPONSE_STREAMED_STATE;
+				break;
+			}
+		} else {
+			_M_client->_M_filesize += len;
+
+			// The backend might have closed the connection after
+			// having sent the data (no more events would be received).
+			if (res == IO_WOULD_BLOCK) {
+				_M_readable = 1;
+				res = IO_SUCCESS;
+			}
+		}
+	} while ((res == IO_SUCCESS) && (body->count() < STREAM_BUFFER_SIZE));
+
+	if (body->count() > count) {
+		wake_client();
+	}
+
+	return true;
+}
+
+#if HAVE_SPLICE
+bool proxy_connection::splice_body(unsigned fd, size_t& total)
+{
+	size_t piped = _M_client->_M_piped;
+
+	io_result res;
+
+	do {
+		size_t count;
+		if (_M_state == STREAMING_BODY_STATE) {
+			if (_M_left == 0) {
+				_M_state = RESPONSE_STREAMED_STATE;
+				break;
+			}
+
+			// Don't read beyond the end of the body.
+			count = MIN((off_t) STREAM_BUFFER_SIZE, _M_left);
+		} else {
+			count = STREAM_BUFFER_SIZE;
+		}
+
+		if ((res = splice_in(fd, _M_client->_M_pipe[1], count, total)) == IO_ERROR) {
+			if (_M_state != STREAMING_UNKNOWN_SIZE_BODY_STATE) {
+				return false;
+			}
+
+			// The end of the body is signaled by closing the connection.
+			_M_state = RESPONSE_STREAMED_STATE;
+			break;
+		} else if (res == IO_NO_DATA_READ) {
+			break;
+		}
+
+		_M_client->_M_piped += count;
+
+		if (_M_state == STREAMING_BODY_STATE) {
+			if ((_M_left -= count) == 0) {
+				_M_state = RESPONSE_STREAMED_STATE;
+			}
+		} else {
+			_M_client->_M_filesize += count;
+		}
+	} while (_M_state != RESPONSE_STREAMED_STATE);
+
+	if (_M_client->_M_piped > piped) {
+		_M_client->_M_timestamp = now::_M_time;
+
+		wake_client();
+	}
 
 	return true;
 }
+#endif // HAVE_SPLICE
 
 proxy_connection::parse_result proxy_connection::parse_status_line(unsigned fd)
 {
@@ -667,6 +1019,12 @@ bool proxy_connection::process_response(unsigned fd)
 	const char* value;
 	unsigned short valuelen;
 
+#if !PROXY
+	_M_reusable = backend_keep_alive();
+
+	_M_client->_M_rule->backends.response_received(fd, _M_status_code);
+#endif
+
 	if (_M_client->_M_method == http_method::HEAD) {
 		_M_client->_M_payload_in_memory = 1;
 
@@ -681,6 +1039,11 @@ bool proxy_connection::process_response(unsigned fd)
 			}
 		}
 
+		// Don't reuse the connection if the backend has sent a body.
+		if (_M_client->_M_body.count() > _M_body_offset) {
+			_M_reusable = 0;
+		}
+
 		_M_state = RESPONSE_COMPLETED_STATE;
 	} else {
 		size_t count = _M_client->_M_body.count() - _M_body_offset;
@@ -703,6 +1066,10 @@ bool proxy_connection::process_response(unsigned fd)
 			// Get Content-Length.
 			if (!_M_client->_M_headers.get_value_known_header(http_headers::CONTENT_LENGTH_HEADER, value, &valuelen)) {
 				if ((_M_status_code < 200) || (_M_status_code == 204) || (_M_status_code == 302) || (_M_status_code == 304)) {
+					if (count > 0) {
+						_M_reusable = 0;
+					}
+
 					_M_client->_M_filesize = 0;
 
 					_M_client->_M_payload_in_memory = 1;
@@ -729,6 +1096,9 @@ bool proxy_connection::process_response(unsigned fd)
 
 					logger::instance().log(logger::LOG_DEBUG, "[proxy_connection::process_response] (fd %d) Unknown body size.", fd);
 
+					// The end of the body is signaled by closing the connection.
+					_M_reusable = 0;
+
 					_M_client->_M_filesize = count;
 
 					_M_client->_M_payload_in_memory = 0;
@@ -747,11 +1117,17 @@ bool proxy_connection::process_response(unsigned fd)
 
 				// If we have received the whole body already...
 				if ((off_t) count >= _M_client->_M_filesize) {
+					// Don't reuse the connection if the backend has sent more
+					// data than expected.
+					if ((off_t) count > _M_client->_M_filesize) {
+						_M_reusable = 0;
+					}
+
 					_M_client->_M_payload_in_memory = 1;
 
 					_M_state = RESPONSE_COMPLETED_STATE;
 				} else {
-					_M_client->_M_payload_in_memory = (_M_client->_M_filesize <= (off_t) static_cast<http_server*>(_M_server)->_M_max_payload_in_memory);
+					_M_client->_M_payload_in_memory = _M_client->keep_payload_in_memory(_M_client->_M_filesize);
 
 					_M_left = _M_client->_M_filesize - count;
 
@@ -760,23 +1136,38 @@ bool proxy_connection::process_response(unsigned fd)
 			}
 		}
 
+		// Relay the response as it arrives? (HTTP/1.0 clients don't
+		// understand chunked responses).
+		// Responses to be cached are saved first.
+		if ((!_M_client->_M_payload_in_memory) && \
+		    (static_cast<http_server*>(_M_server)->_M_stream_backend_responses) && \
+		    ((!chunked) || ((_M_client->_M_major_number == 1) && (_M_client->_M_minor_number == 1))) && \
+		    (!_M_client->cacheable(_M_status_code, (_M_state == READING_BODY_STATE) ? _M_client->_M_filesize : -1))) {
+			logger::instance().log(logger::LOG_DEBUG, "[proxy_connection::process_response] (fd %d) Payload will be relayed.", fd);
+
+			return start_streaming(fd, count);
+		}
+
 		logger::instance().log(logger::LOG_DEBUG, "[proxy_connection::process_response] (fd %d) Payload will be saved %s.", fd, _M_client->_M_payload_in_memory ? "in memory" : "to disk");
 
 		if (!_M_client->_M_payload_in_memory) {
-			// Open a temporary file.
-			if ((_M_tmpfile = static_cast<http_server*>(_M_server)->_M_tmpfiles.open()) < 0) {
+			// Open a temporary file (the responses to be cached are
+			// kept on disk).
+			off_t size = ((_M_state == READING_BODY_STATE) && (!_M_client->_M_store)) ? _M_client->_M_filesize : -1;
+			if ((_M_tmpfile = static_cast<http_server*>(_M_server)->_M_tmpfiles.open(size)) < 0) {
 				_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
 				return false;
 			}
 
 			if (count > 0) {
 				if (!chunked) {
-					if (!file_wrapper::write(_M_tmpfile, _M_client->_M_body.data() + _M_body_offset, count)) {
+					if (!static_cast<http_server*>(_M_server)->_M_tmpfiles.write(_M_tmpfile, _M_client->_M_body.data() + _M_body_offset, count)) {
 						_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
 						return false;
 					}
 				} else {
-					switch (parse_chunk(_M_client->_M_body.data() + _M_body_offset, count)) {
+					size_t size;
+					switch (parse_chunk(_M_client->_M_body.data() + _M_body_offset, count, size)) {
 						case chunked_parser::INVALID_CHUNKED_RESPONSE:
 							_M_client->_M_error = http_error::BAD_GATEWAY;
 							return false;
@@ -784,6 +1175,10 @@ bool proxy_connection::process_response(unsigned fd)
 							_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
 							return false;
 						case chunked_parser::END_OF_RESPONSE:
+							if (size < count) {
+								_M_reusable = 0;
+							}
+
 							_M_state = RESPONSE_COMPLETED_STATE;
 							break;
 						default: // NOT_END_OF_RESPONSE.
@@ -809,6 +1204,116 @@ bool proxy_connection::process_response(unsigned fd)
 	return true;
 }
 
+bool proxy_connection::start_streaming(unsigned fd, size_t count)
+{
+	if (_M_state == READING_BODY_STATE) {
+		_M_state = STREAMING_BODY_STATE;
+	} else if (_M_state == READING_CHUNKED_BODY_STATE) {
+		_M_state = STREAMING_CHUNKED_BODY_STATE;
+	} else {
+		_M_state = STREAMING_UNKNOWN_SIZE_BODY_STATE;
+
+		// The end of the body will be signaled by closing the
+		// connection.
+		_M_client->_M_keep_alive = 0;
+	}
+
+	// If there is reason phrase...
+	if (_M_reason_phrase_len > 0) {
+		_M_out.reset();
+		if (!_M_out.append(_M_client->_M_body.data() + _M_reason_phrase, _M_reason_phrase_len)) {
+			_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
+			return false;
+		}
+	}
+
+	if (!prepare_http_response(fd)) {
+		_M_client->_M_error = http_error::INTERNAL_SERVER_ERROR;
+		return false;
+	}
+
+	// The client will send the body from its buffer.
+	buffer* body = &_M_client->_M_body;
+	if (count > 0) {
+		memmove(body->data(), body->data() + _M_body_offset, count);
+	}
+
+	body->set_count(count);
+	_M_inp = 0;
+
+	if ((count > 0) && (_M_state == STREAMING_CHUNKED_BODY_STATE)) {
+		size_t size;
+		chunked_parser::parse_result parse_result = parse_chunk(body->data(), count, size);
+		if (parse_result == chunked_parser::INVALID_CHUNKED_RESPONSE) {
+			_M_client->_M_error = http_error::BAD_GATEWAY;
+			return false;
+		} else if (parse_result == chunked_parser::END_OF_RESPONSE) {
+			if (size < count) {
+				_M_reusable = 0;
+				body->set_count(size);
+			}
+
+			_M_state = RESPONSE_STREAMED_STATE;
+		}
+	}
+
+#if HAVE_SPLICE
+	// Move the rest of the body from socket to socket through a pipe if
+	// it doesn't have to be decoded.
+	if ((_M_state != STREAMING_CHUNKED_BODY_STATE) && \
+	    (_M_state != RESPONSE_STREAMED_STATE) && \
+	    (static_cast<http_server*>(_M_server)->_M_splice_backend_responses)) {
+		if (splicer::create_pipe(_M_client->_M_pipe)) {
+			_M_client->_M_piped = 0;
+		}
+	}
+#endif // HAVE_SPLICE
+
+	// The response won't be stored, the requests waiting for it are
+	// sent to the backend.
+	_M_client->end_fetch();
+
+	_M_client->_M_streaming = 1;
+
+	_M_client->_M_state = http_connection::SENDING_BACKEND_HEADERS_STATE;
+
+	wake_client();
+
+	return true;
+}
+
+void proxy_connection::wake_client()
+{
+	// If the client cannot write, it will receive an event.
+	if ((!_M_client->_M_in_ready_list) && (_M_client->_M_writable)) {
+		http_server* server = static_cast<http_server*>(_M_server);
+
+		_M_client->_M_in_ready_list = 1;
+		server->_M_ready_list[server->_M_nready++] = _M_fd;
+	}
+}
+
+bool proxy_connection::backend_keep_alive() const
+{
+	// An interim response is followed by the final one.
+	if (_M_status_code < 200) {
+		return false;
+	}
+
+	const char* value;
+	unsigned short valuelen;
+	if (_M_client->_M_headers.get_value_known_header(http_headers::CONNECTION_HEADER, value, &valuelen)) {
+		if (memcasemem(value, valuelen, "close", 5)) {
+			return false;
+		} else if (memcasemem(value, valuelen, "Keep-Alive", 10)) {
+			return true;
+		}
+	}
+
+	// HTTP/1.1 connections are persistent by default.
+	return ((_M_major_number == 1) && (_M_minor_number == 1));
+}
+
 bool proxy_connection::prepare_http_response(unsigned fd)
 {
 	buffer* out = &_M_client->_M_out;
@@ -839,16 +1344,24 @@ bool proxy_connection::prepare_http_response(unsigned fd)
 		}
 	}
 
-	headers->remove_known_header(http_headers::TRANSFER_ENCODING_HEADER);
+	// Are the chunks passed through?
+	if (_M_state == STREAMING_CHUNKED_BODY_STATE) {
+		headers->remove_known_header(http_headers::CONTENT_LENGTH_HEADER);
+	} else {
+		headers->remove_known_header(http_headers::TRANSFER_ENCODING_HEADER);
+	}
 
 	if (!headers->add_known_header(http_headers::SERVER_HEADER, WEBSERVER_NAME, sizeof(WEBSERVER_NAME) - 1, true)) {
 		return false;
 	}
 
-	char num[32];
-	int numlen = snprintf(num, sizeof(num), "%lld", _M_client->_M_filesize);
-	if (!headers->add_known_header(http_headers::CONTENT_LENGTH_HEADER, num, numlen, true)) {
-		return false;
+	// Is the body size known?
+	if ((_M_state != STREAMING_CHUNKED_BODY_STATE) && (_M_state != STREAMING_UNKNOWN_SIZE_BODY_STATE)) {
+		char num[32];
+		int numlen = snprintf(num, sizeof(num), "%lld", _M_client->_M_filesize);
+		if (!headers->add_known_header(http_headers::CONTENT_LENGTH_HEADER, num, numlen, true)) {
+			return false;
+		}
 	}
 
 	if (!headers->serialize(*out)) {
@@ -889,6 +1402,18 @@ const char* proxy_connection::state_to_string(unsigned state)
 			return "PREPARING_ERROR_PAGE_STATE";
 		case RESPONSE_COMPLETED_STATE:
 			return "RESPONSE_COMPLETED_STATE";
+		case IDLE_STATE:
+			return "IDLE_STATE";
+		case STREAMING_BODY_STATE:
+			return "STREAMING_BODY_STATE";
+		case STREAMING_CHUNKED_BODY_STATE:
+			return "STREAMING_CHUNKED_BODY_STATE";
+		case STREAMING_UNKNOWN_SIZE_BODY_STATE:
+			return "STREAMING_UNKNOWN_SIZE_BODY_STATE";
+		case RESPONSE_STREAMED_STATE:
+			return "RESPONSE_STREAMED_STATE";
+		case RELAYING_BODY_STATE:
+			return "RELAYING_BODY_STATE";
 		default:
 			return "(unknown)";
 	}
@@ -12,6 +12,10 @@ struct proxy_connection : public tcp_connection,
                           public chunked_parser {
 	static const unsigned short STATUS_LINE_MAX_LEN;
 
+	// The backend is not read while the client has this many bytes
+	// of the response left to send.
+	static const size_t STREAM_BUFFER_SIZE;
+
 	// FastCGI states.
 	static const unsigned char CONNECTING_STATE;
 	static const unsigned char SENDING_HEADERS_STATE;
@@ -24,6 +28,12 @@ struct proxy_connection : public tcp_connection,
 	static const unsigned char READING_UNKNOWN_SIZE_BODY_STATE;
 	static const unsigned char PREPARING_ERROR_PAGE_STATE;
 	static const unsigned char RESPONSE_COMPLETED_STATE;
+	static const unsigned char IDLE_STATE;
+	static const unsigned char STREAMING_BODY_STATE;
+	static const unsigned char STREAMING_CHUNKED_BODY_STATE;
+	static const unsigned char STREAMING_UNKNOWN_SIZE_BODY_STATE;
+	static const unsigned char RESPONSE_STREAMED_STATE;
+	static const unsigned char RELAYING_BODY_STATE;
 
 	int _M_fd;
 
@@ -31,6 +41,9 @@ struct proxy_connection : public tcp_connection,
 
 	http_connection* _M_client;
 
+	// Pool the connection belongs to while it is idle.
+	backend_list* _M_backends;
+
 	off_t _M_left;
 
 	unsigned short _M_status_code;
@@ -40,12 +53,14 @@ struct proxy_connection : public tcp_connection,
 
 	size_t _M_body_offset;
 
-	unsigned _M_state:4;
+	unsigned _M_state:5;
 	unsigned _M_substate:4;
 
 	unsigned _M_major_number:4;
 	unsigned _M_minor_number:4;
 
+	unsigned _M_reusable:1; // Can the connection be reused once the response has been read?
+
 	// Constructor.
 	proxy_connection();
 
@@ -76,6 +91,17 @@ struct proxy_connection : public tcp_connection,
 	// Read unknown size body.
 	bool read_unknown_size_body(unsigned fd, size_t& total);
 
+	// Relay body to the client.
+	bool stream_body(unsigned fd, size_t& total);
+
+#if HAVE_SPLICE
+	// Relay body to the client through the client's pipe.
+	bool splice_body(unsigned fd, size_t& total);
+#endif // HAVE_SPLICE
+
+	// Is the response being relayed to the client?
+	bool streaming() const;
+
 	enum parse_result {
 		PARSE_ERROR,
 		PARSING_NOT_COMPLETED,
@@ -91,12 +117,24 @@ struct proxy_connection : public tcp_connection,
 	// Process response.
 	virtual bool process_response(unsigned fd);
 
+	// Start relaying the response to the client.
+	bool start_streaming(unsigned fd, size_t count);
+
+	// Add client to the ready list.
+	void wake_client();
+
+	// Will the backend keep the connection open?
+	bool backend_keep_alive() const;
+
 	// Prepare HTTP response.
 	bool prepare_http_response(unsigned fd);
 
 	// Add chunked data.
 	bool add_chunked_data(const char* buf, size_t len);
 
+	// Are too many bytes waiting to be written to the temporary file?
+	bool spill_throttled(unsigned fd);
+
 	// State to string.
 	static const char* state_to_string(unsigned state);
 };
@@ -110,15 +148,9 @@ inline void proxy_connection::free()
 	tcp_connection::free();
 }
 
-inline bool proxy_connection::add_chunked_data(const char* buf, size_t len)
+inline bool proxy_connection::streaming() const
 {
-	if (!file_wrapper::write(_M_tmpfile, buf, len)) {
-		return false;
-	}
-
-	_M_client->_M_filesize += len;
-
-	return true;
+	return ((_M_state >= STREAMING_BODY_STATE) && (_M_state <= RESPONSE_STREAMED_STATE));
 }
 
 #endif // PROXY_CONNECTION_H
@@ -0,0 +1,815 @@
+#include <stdlib.h>
+#include <string.h>
+#include "response_cache.h"
+#include "file/file_wrapper.h"
+#include "util/date_parser.h"
+#include "util/number.h"
+#include "util/fnv.h"
+
+const size_t response_cache::DEFAULT_MAX_MEMORY = 64 * 1024 * 1024;
+const size_t response_cache::DEFAULT_MAX_OBJECT_SIZE = 1024 * 1024;
+const off_t response_cache::DEFAULT_MAX_DISK_OBJECT_SIZE = 64 * 1024 * 1024;
+const unsigned response_cache::DEFAULT_COLLAPSE_TIMEOUT = 5;
+
+const size_t response_cache::HASH_SIZE = 4096;
+
+const unsigned response_cache::MEMORY_TIER = 0;
+const unsigned response_cache::DISK_TIER = 1;
+
+response_cache::response_cache()
+{
+	_M_buckets = NULL;
+
+	for (size_t i = 0; i < 2; i++) {
+		_M_lru[i].head = NULL;
+		_M_lru[i].tail = NULL;
+	}
+
+	_M_max_memory = 0;
+	_M_max_object_size = 0;
+
+	_M_max_disk = 0;
+	_M_max_disk_object_size = 0;
+
+	_M_max_files = 0;
+	_M_nfiles = 0;
+
+	_M_fetches = NULL;
+	_M_next_waiter = NULL;
+
+	_M_collapse_timeout = 0;
+	_M_waiting = 0;
+
+	memset(&_M_stats, 0, sizeof(statistics));
+}
+
+response_cache::~response_cache()
+{
+	if (_M_buckets) {
+		for (size_t i = 0; i < HASH_SIZE; i++) {
+			entry* e = _M_buckets[i];
+			while (e) {
+				entry* next = e->next;
+				free(e);
+				e = next;
+			}
+		}
+
+		::free(_M_buckets);
+	}
+
+	if (_M_fetches) {
+		for (size_t i = 0; i < HASH_SIZE; i++) {
+			fetch* f = _M_fetches[i];
+			while (f) {
+				fetch* next = f->next;
+				::free(f);
+				f = next;
+			}
+		}
+
+		::free(_M_fetches);
+	}
+
+	if (_M_next_waiter) {
+		::free(_M_next_waiter);
+	}
+}
+
+bool response_cache::create(size_t max_memory, size_t max_object_size, off_t max_disk, off_t max_disk_object_size, size_t max_files)
+{
+	if ((_M_buckets = (entry**) calloc(HASH_SIZE, sizeof(entry*))) == NULL) {
+		return false;
+	}
+
+	_M_max_memory = max_memory;
+	_M_max_object_size = max_object_size;
+
+	_M_max_disk = max_disk;
+	_M_max_disk_object_size = max_disk_object_size;
+
+	_M_max_files = max_files;
+
+	return true;
+}
+
+bool response_cache::set_collapsing(unsigned timeout, size_t max_connections)
+{
+	if (timeout > 0) {
+		if ((_M_fetches = (fetch**) calloc(HASH_SIZE, sizeof(fetch*))) == NULL) {
+			return false;
+		}
+
+		if ((_M_next_waiter = (int*) malloc(max_connections * sizeof(int))) == NULL) {
+			return false;
+		}
+	}
+
+	_M_collapse_timeout = timeout;
+
+	return true;
+}
+
+bool response_cache::storable(unsigned short status_code, const http_headers& headers, off_t size, unsigned ttl) const
+{
+	freshness freshness;
+	if (!get_freshness(status_code, headers, ttl, freshness)) {
+		return false;
+	}
+
+	// The size of chunked bodies is only known once received.
+	if ((size < 0) || (size <= (off_t) _M_max_object_size)) {
+		return true;
+	}
+
+	// Microcached responses are only kept in memory.
+	return ((ttl == 0) && (_M_max_disk > 0) && (size <= _M_max_disk_object_size));
+}
+
+response_cache::entry* response_cache::lookup(const char* host, unsigned short hostlen, const char* path, unsigned short pathlen, const char* request, size_t requestlen)
+{
+	unsigned h = hash(host, hostlen, path, pathlen);
+
+	for (entry* e = _M_buckets[h & (HASH_SIZE - 1)]; e; e = e->next) {
+		if ((e->hash == h) && \
+		    (e->hostlen == hostlen) && \
+		    (e->keylen == hostlen + pathlen) && \
+		    (memcmp(e->key, host, hostlen) == 0) && \
+		    (memcmp(e->key + hostlen, path, pathlen) == 0) && \
+		    (match(e, request, requestlen))) {
+			e->refcount++;
+
+			// Most recently used.
+			unlink_lru(e);
+			link_lru(e);
+
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+response_cache::entry* response_cache::add(const char* host, unsigned short hostlen, const char* path, unsigned short pathlen, const char* request, size_t requestlen, unsigned short status_code, const char* status_line, size_t status_line_len, http_headers& headers, const char* body, int fd, off_t size, unsigned ttl)
+{
+	freshness freshness;
+	if (!get_freshness(status_code, headers, ttl, freshness)) {
+		return NULL;
+	}
+
+	// Keep the body in memory or the file on disk?
+	bool in_memory;
+	if (size <= (off_t) _M_max_object_size) {
+		in_memory = true;
+	} else if ((fd != -1) && (ttl == 0) && (_M_max_disk > 0) && (size <= _M_max_disk_object_size)) {
+		in_memory = false;
+	} else {
+		return NULL;
+	}
+
+	// Save the values of the request headers the response varies on.
+	_M_vary.reset();
+
+	const char* value;
+	unsigned short valuelen;
+	if (headers.get_value_known_header(http_headers::VARY_HEADER, value, &valuelen)) {
+		const char* end = value + valuelen;
+		const char* ptr = value;
+		while (ptr < end) {
+			while ((ptr < end) && ((*ptr == ',') || (IS_WHITE_SPACE(*ptr)))) {
+				ptr++;
+			}
+
+			const char* name = ptr;
+			while ((ptr < end) && (*ptr != ',') && (!IS_WHITE_SPACE(*ptr))) {
+				ptr++;
+			}
+
+			if (ptr == name) {
+				break;
+			}
+
+			const char* reqvalue;
+			size_t reqvaluelen;
+			if (!get_request_header(request, requestlen, name, ptr - name, reqvalue, reqvaluelen)) {
+				reqvaluelen = 0;
+			}
+
+			if ((!_M_vary.append(name, ptr - name)) || \
+			    (!_M_vary.append('\0')) || \
+			    (!_M_vary.append(reqvalue, reqvaluelen)) || \
+			    (!_M_vary.append('\0'))) {
+				return NULL;
+			}
+		}
+	}
+
+	// Save the headers without the ones which are set for each client.
+	_M_headers.reset();
+
+	if (!_M_headers.append(status_line, status_line_len)) {
+		return NULL;
+	}
+
+	unsigned char header;
+	const char* name;
+	unsigned short namelen;
+	for (unsigned i = 0; headers.get_header(i, header, name, namelen, value, valuelen); i++) {
+		if ((header == http_headers::CONNECTION_HEADER) || \
+		    (header == http_headers::KEEP_ALIVE_HEADER) || \
+		    (header == http_headers::TRANSFER_ENCODING_HEADER) || \
+		    (header == http_headers::CONTENT_LENGTH_HEADER) || \
+		    (header == http_headers::AGE_HEADER)) {
+			continue;
+		}
+
+		if ((!_M_headers.append(name, namelen)) || \
+		    (!_M_headers.append(": ", 2)) || \
+		    (!_M_headers.append(value, valuelen)) || \
+		    (!_M_headers.append("\r\n", 2))) {
+			return NULL;
+		}
+	}
+
+	unsigned h = hash(host, hostlen, path, pathlen);
+
+	// Replace the previous response to the same request.
+	for (entry* e = _M_buckets[h & (HASH_SIZE - 1)]; e; e = e->next) {
+		if ((e->hash == h) && \
+		    (e->hostlen == hostlen) && \
+		    (e->keylen == hostlen + pathlen) && \
+		    (memcmp(e->key, host, hostlen) == 0) && \
+		    (memcmp(e->key + hostlen, path, pathlen) == 0) && \
+		    (e->varylen == _M_vary.count()) && \
+		    (memcmp(e->vary, _M_vary.data(), e->varylen) == 0)) {
+			remove(e);
+			break;
+		}
+	}
+
+	// The entry, key, Vary values, headers and body are allocated at
+	// once.
+	size_t len = sizeof(entry) + hostlen + pathlen + _M_vary.count() + _M_headers.count();
+	if (in_memory) {
+		len += size;
+	}
+
+	if (!make_room(len, in_memory ? 0 : size)) {
+		return NULL;
+	}
+
+	entry* e;
+	if ((e = (entry*) malloc(len)) == NULL) {
+		return NULL;
+	}
+
+	e->key = (char*) (e + 1);
+	memcpy(e->key, host, hostlen);
+	memcpy(e->key + hostlen, path, pathlen);
+	e->hostlen = hostlen;
+	e->keylen = hostlen + pathlen;
+
+	e->vary = e->key + e->keylen;
+	memcpy(e->vary, _M_vary.data(), _M_vary.count());
+	e->varylen = _M_vary.count();
+
+	e->headers = e->vary + e->varylen;
+	memcpy(e->headers, _M_headers.data(), _M_headers.count());
+	e->headerslen = _M_headers.count();
+
+	if (in_memory) {
+		e->body = e->headers + e->headerslen;
+		e->fd = -1;
+
+		if (body) {
+			memcpy(e->body, body, size);
+		} else if ((size > 0) && (file_wrapper::pread(fd, e->body, size, 0) != (ssize_t) size)) {
+			::free(e);
+			return NULL;
+		}
+	} else {
+		// The cache takes over the file (the data of a reused temporary
+		// file might be longer than the body).
+		e->body = NULL;
+		e->fd = fd;
+
+		file_wrapper::truncate(fd, size);
+
+		_M_stats.disk += size;
+		_M_nfiles++;
+	}
+
+	e->size = size;
+
+	e->hash = h;
+
+	e->date = freshness.date;
+	e->expires = freshness.expires;
+
+	e->stale_while_revalidate = freshness.stale_while_revalidate;
+	e->stale_if_error = freshness.stale_if_error;
+
+	e->refcount = 1;
+
+	e->revalidating = false;
+	e->removed = false;
+
+	entry** bucket = &_M_buckets[h & (HASH_SIZE - 1)];
+	e->next = *bucket;
+	*bucket = e;
+
+	link_lru(e);
+
+	_M_stats.memory += len;
+	_M_stats.entries++;
+	_M_stats.stores++;
+
+	return e;
+}
+
+void response_cache::release(entry* e)
+{
+	if ((--e->refcount == 0) && (e->removed)) {
+		free(e);
+	}
+}
+
+unsigned response_cache::purge(const char* host, unsigned short hostlen, const char* path, unsigned short pathlen, bool any_cookies)
+{
+	unsigned count = 0;
+
+	bool prefix = ((pathlen > 0) && (path[pathlen - 1] == '*'));
+
+	// The keys with cookies are in other buckets.
+	if ((prefix) || (any_cookies)) {
+		if (prefix) {
+			pathlen--;
+		}
+
+		for (size_t i = 0; i < HASH_SIZE; i++) {
+			entry* e = _M_buckets[i];
+			while (e) {
+				entry* next = e->next;
+
+				if ((e->hostlen == hostlen) && \
+				    (e->keylen >= hostlen + pathlen) && \
+				    (memcmp(e->key, host, hostlen) == 0) && \
+				    (memcmp(e->key + hostlen, path, pathlen) == 0) && \
+				    ((prefix) || (e->keylen == hostlen + pathlen) || (e->key[hostlen + pathlen] == '\n'))) {
+					remove(e);
+					count++;
+				}
+
+				e = next;
+			}
+		}
+	} else {
+		unsigned h = hash(host, hostlen, path, pathlen);
+
+		entry* e = _M_buckets[h & (HASH_SIZE - 1)];
+		while (e) {
+			entry* next = e->next;
+
+			if ((e->hash == h) && \
+			    (e->hostlen == hostlen) && \
+			    (e->keylen == hostlen + pathlen) && \
+			    (memcmp(e->key, host, hostlen) == 0) && \
+			    (memcmp(e->key + hostlen, path, pathlen) == 0)) {
+				remove(e);
+				count++;
+			}
+
+			e = next;
+		}
+	}
+
+	return count;
+}
+
+response_cache::fetch* response_cache::get_fetch(const char* host, unsigned short hostlen, const char* path, unsigned short pathlen)
+{
+	unsigned h = hash(host, hostlen, path, pathlen);
+
+	for (fetch* f = _M_fetches[h & (HASH_SIZE - 1)]; f; f = f->next) {
+		if ((f->hash == h) && \
+		    (f->hostlen == hostlen) && \
+		    (f->keylen == hostlen + pathlen) && \
+		    (memcmp(f->key, host, hostlen) == 0) && \
+		    (memcmp(f->key + hostlen, path, pathlen) == 0)) {
+			return f;
+		}
+	}
+
+	return NULL;
+}
+
+response_cache::fetch* response_cache::start_fetch(const char* host, unsigned short hostlen, const char* path, unsigned short pathlen)
+{
+	fetch* f;
+	if ((f = (fetch*) malloc(sizeof(fetch) + hostlen + pathlen)) == NULL) {
+		return NULL;
+	}
+
+	f->hash = hash(host, hostlen, path, pathlen);
+
+	f->key = (char*) (f + 1);
+	memcpy(f->key, host, hostlen);
+	memcpy(f->key + hostlen, path, pathlen);
+	f->hostlen = hostlen;
+	f->keylen = hostlen + pathlen;
+
+	f->deadline = now::_M_time + _M_collapse_timeout;
+
+	f->head = -1;
+	f->tail = -1;
+
+	fetch** bucket = &_M_fetches[f->hash & (HASH_SIZE - 1)];
+	f->next = *bucket;
+	*bucket = f;
+
+	return f;
+}
+
+bool response_cache::wait(fetch* f, unsigned fd)
+{
+	if (now::_M_time >= f->deadline) {
+		return false;
+	}
+
+	_M_next_waiter[fd] = -1;
+
+	if (f->tail == -1) {
+		f->head = fd;
+	} else {
+		_M_next_waiter[f->tail] = fd;
+	}
+
+	f->tail = fd;
+
+	_M_waiting++;
+	_M_stats.collapsed++;
+
+	return true;
+}
+
+void response_cache::cancel_wait(fetch* f, unsigned fd)
+{
+	int prev = -1;
+	for (int i = f->head; i != -1; prev = i, i = _M_next_waiter[i]) {
+		if (i == (int) fd) {
+			if (prev == -1) {
+				f->head = _M_next_waiter[i];
+			} else {
+				_M_next_waiter[prev] = _M_next_waiter[i];
+			}
+
+			if (f->tail == i) {
+				f->tail = prev;
+			}
+
+			_M_waiting--;
+
+			return;
+		}
+	}
+}
+
+int response_cache::next_waiter(fetch* f)
+{
+	int fd;
+	if ((fd = f->head) != -1) {
+		if ((f->head = _M_next_waiter[fd]) == -1) {
+			f->tail = -1;
+		}
+
+		_M_waiting--;
+	}
+
+	return fd;
+}
+
+void response_cache::end_fetch(fetch* f)
+{
+	fetch** prev = &_M_fetches[f->hash & (HASH_SIZE - 1)];
+	while (*prev != f) {
+		prev = &(*prev)->next;
+	}
+
+	*prev = f->next;
+
+	::free(f);
+}
+
+int response_cache::expire()
+{
+	if (_M_waiting == 0) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < HASH_SIZE; i++) {
+		for (fetch* f = _M_fetches[i]; f; f = f->next) {
+			if ((f->head != -1) && (now::_M_time >= f->deadline)) {
+				_M_stats.collapse_timeouts++;
+
+				return next_waiter(f);
+			}
+		}
+	}
+
+	return -1;
+}
+
+bool response_cache::get_request_header(const char* request, size_t requestlen, const char* name, size_t namelen, const char*& value, size_t& valuelen)
+{
+	const char* end = request + requestlen;
+
+	// Skip the request line.
+	const char* ptr = (const char*) memchr(request, '\n', requestlen);
+	while (ptr) {
+		ptr++;
+
+		const char* eol = (const char*) memchr(ptr, '\n', end - ptr);
+		if (!eol) {
+			return false;
+		}
+
+		if (((size_t) (eol - ptr) > namelen) && (ptr[namelen] == ':') && (strncasecmp(ptr, name, namelen) == 0)) {
+			value = ptr + namelen + 1;
+			while ((value < eol) && (IS_WHITE_SPACE(*value))) {
+				value++;
+			}
+
+			const char* last = eol;
+			while ((last > value) && ((*(last - 1) == '\r') || (IS_WHITE_SPACE(*(last - 1))))) {
+				last--;
+			}
+
+			valuelen = last - value;
+
+			return true;
+		}
+
+		ptr = eol;
+	}
+
+	return false;
+}
+
+bool response_cache::get_freshness(unsigned short status_code, const http_headers& headers, unsigned ttl, freshness& freshness) const
+{
+	// Status codes which can be cached by default (microcaching: only
+	// successful responses).
+	if ((ttl > 0) && (status_code != 200)) {
+		return false;
+	}
+
+	switch (status_code) {
+		case 200:
+		case 203:
+		case 300:
+		case 301:
+		case 404:
+		case 410:
+			break;
+		default:
+			return false;
+	}
+
+	const char* value;
+	unsigned short valuelen;
+
+	// Responses setting cookies are not shared.
+	if (headers.get_value_known_header(http_headers::SET_COOKIE_HEADER, value, &valuelen)) {
+		return false;
+	}
+
+	// "Vary: *" never matches.
+	if ((headers.get_value_known_header(http_headers::VARY_HEADER, value, &valuelen)) && (memchr(value, '*', valuelen))) {
+		return false;
+	}
+
+	freshness.stale_while_revalidate = 0;
+	freshness.stale_if_error = 0;
+
+	time_t lifetime = -1;
+
+	if (headers.get_value_known_header(http_headers::CACHE_CONTROL_HEADER, value, &valuelen)) {
+		const char* arg;
+		size_t arglen;
+
+		// Revalidation with the backend is not implemented, responses
+		// which require it are not stored.
+		if ((get_directive(value, valuelen, "no-store", 8, arg, arglen)) || \
+		    (get_directive(value, valuelen, "private", 7, arg, arglen)) || \
+		    (get_directive(value, valuelen, "no-cache", 8, arg, arglen))) {
+			return false;
+		}
+
+		// s-maxage overrides max-age (unless it is invalid).
+		unsigned n;
+		if ((get_directive(value, valuelen, "s-maxage", 8, arg, arglen)) && \
+		    (number::parse_unsigned(arg, arglen, n) == number::PARSE_SUCCEEDED)) {
+			lifetime = n;
+		} else if ((get_directive(value, valuelen, "max-age", 7, arg, arglen)) && \
+		           (number::parse_unsigned(arg, arglen, n) == number::PARSE_SUCCEEDED)) {
+			lifetime = n;
+		}
+
+		if ((get_directive(value, valuelen, "stale-while-revalidate", 22, arg, arglen)) && \
+		    (number::parse_unsigned(arg, arglen, n) == number::PARSE_SUCCEEDED)) {
+			freshness.stale_while_revalidate = n;
+		}
+
+		if ((get_directive(value, valuelen, "stale-if-error", 14, arg, arglen)) && \
+		    (number::parse_unsigned(arg, arglen, n) == number::PARSE_SUCCEEDED)) {
+			freshness.stale_if_error = n;
+		}
+	}
+
+	// Microcached responses are kept 'ttl' seconds, whatever the
+	// backend says.
+	if (ttl > 0) {
+		freshness.date = now::_M_time;
+		freshness.expires = now::_M_time + ttl;
+		return true;
+	}
+
+	// How long has the response been in other caches?
+	unsigned age;
+	if ((!headers.get_value_known_header(http_headers::AGE_HEADER, value, &valuelen)) || \
+	    (number::parse_unsigned(value, valuelen, age) != number::PARSE_SUCCEEDED)) {
+		age = 0;
+	}
+
+	freshness.date = now::_M_time - age;
+
+	if (lifetime < 0) {
+		// Without explicit lifetime, the response is not stored.
+		if (!headers.get_value_known_header(http_headers::EXPIRES_HEADER, value, &valuelen)) {
+			return false;
+		}
+
+		struct tm tm;
+		time_t expires;
+		if ((expires = date_parser::parse(value, valuelen, &tm)) == (time_t) -1) {
+			return false;
+		}
+
+		// Relative to the backend's clock.
+		time_t date;
+		if ((headers.get_value_known_header(http_headers::DATE_HEADER, value, &valuelen)) && \
+		    ((date = date_parser::parse(value, valuelen, &tm)) != (time_t) -1)) {
+			lifetime = expires - date;
+		} else {
+			lifetime = expires - now::_M_time;
+		}
+
+		if (lifetime < 0) {
+			lifetime = 0;
+		}
+	}
+
+	freshness.expires = freshness.date + lifetime;
+
+	// Could it still be served?
+	return (freshness.expires + (time_t) MAX(freshness.stale_while_revalidate, freshness.stale_if_error) > now::_M_time);
+}
+
+bool response_cache::match(const entry* e, const char* request, size_t requestlen)
+{
+	const char* ptr = e->vary;
+	const char* end = ptr + e->varylen;
+
+	while (ptr < end) {
+		size_t namelen = strlen(ptr);
+
+		const char* stored = ptr + namelen + 1;
+		size_t storedlen = strlen(stored);
+
+		const char* value;
+		size_t valuelen;
+		if (!get_request_header(request, requestlen, ptr, namelen, value, valuelen)) {
+			valuelen = 0;
+		}
+
+		if ((valuelen != storedlen) || (memcmp(value, stored, valuelen) != 0)) {
+			return false;
+		}
+
+		ptr = stored + storedlen + 1;
+	}
+
+	return true;
+}
+
+void response_cache::remove(entry* e)
+{
+	entry** prev = &_M_buckets[e->hash & (HASH_SIZE - 1)];
+	while (*prev != e) {
+		prev = &(*prev)->next;
+	}
+
+	*prev = e->next;
+
+	unlink_lru(e);
+
+	size_t len = sizeof(entry) + e->keylen + e->varylen + e->headerslen;
+	if (e->fd == -1) {
+		len += e->size;
+	} else {
+		_M_stats.disk -= e->size;
+		_M_nfiles--;
+	}
+
+	_M_stats.memory -= len;
+	_M_stats.entries--;
+
+	e->removed = true;
+
+	// Is the response being sent?
+	if (e->refcount == 0) {
+		free(e);
+	}
+}
+
+void response_cache::free(entry* e)
+{
+	if (e->fd != -1) {
+		file_wrapper::close(e->fd);
+	}
+
+	::free(e);
+}
+
+bool response_cache::make_room(size_t memory, off_t disk)
+{
+	if ((memory > _M_max_memory) || (disk > _M_max_disk)) {
+		return false;
+	}
+
+	while (_M_stats.memory + memory > _M_max_memory) {
+		entry* e = _M_lru[MEMORY_TIER].tail;
+		if ((!e) && ((e = _M_lru[DISK_TIER].tail) == NULL)) {
+			return false;
+		}
+
+		remove(e);
+	}
+
+	if (disk > 0) {
+		while ((_M_stats.disk + disk > _M_max_disk) || (_M_nfiles >= _M_max_files)) {
+			entry* e;
+			if ((e = _M_lru[DISK_TIER].tail) == NULL) {
+				return false;
+			}
+
+			remove(e);
+		}
+	}
+
+	return true;
+}
+
+unsigned response_cache::hash(const char* host, unsigned short hostlen, const char* path, unsigned short pathlen)
+{
+	return fnv::hash(path, pathlen, fnv::hash(host, hostlen));
+}
+
+bool response_cache::get_directive(const char* value, unsigned short valuelen, const char* name, size_t namelen, const char*& arg, size_t& arglen)
+{
+	const char* end = value + valuelen;
+	const char* ptr = value;
+
+	while (ptr < end) {
+		while ((ptr < end) && ((*ptr == ',') || (IS_WHITE_SPACE(*ptr)))) {
+			ptr++;
+		}
+
+		const char* next = (const char*) memchr(ptr, ',', end - ptr);
+		if (!next) {
+			next = end;
+		}
+
+		if (((size_t) (next - ptr) >= namelen) && \
+		    (strncasecmp(ptr, name, namelen) == 0) && \
+		    ((ptr + namelen == next) || (ptr[namelen] == '=') || (IS_WHITE_SPACE(ptr[namelen])))) {
+			arg = ptr + namelen;
+			while ((arg < next) && ((*arg == '=') || (*arg == '"') || (IS_WHITE_SPACE(*arg)))) {
+				arg++;
+			}
+
+			const char* last = next;
+			while ((last > arg) && ((*(last - 1) == '"') || (IS_WHITE_SPACE(*(last - 1))))) {
+				last--;
+			}
+
+			arglen = last - arg;
+
+			return true;
+		}
+
+		ptr = next;
+	}
+
+	return false;
+}
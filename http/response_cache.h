@@ -0,0 +1,344 @@
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <sys/types.h>
+#include <time.h>
+#include "http/http_headers.h"
+#include "string/buffer.h"
+#include "util/now.h"
+#include "macros/macros.h"
+
+class response_cache {
+	public:
+		static const size_t DEFAULT_MAX_MEMORY;
+		static const size_t DEFAULT_MAX_OBJECT_SIZE;
+		static const off_t DEFAULT_MAX_DISK_OBJECT_SIZE;
+		static const unsigned DEFAULT_COLLAPSE_TIMEOUT;
+
+		struct entry {
+			entry* next; // In the bucket.
+
+			// Least recently used list of the tier.
+			entry* prev_lru;
+			entry* next_lru;
+
+			unsigned hash;
+
+			// Host and path (including the query string).
+			char* key;
+			unsigned short hostlen;
+			unsigned short keylen;
+
+			// Request headers listed in the Vary header and their values
+			// ("name\0value\0...").
+			char* vary;
+			size_t varylen;
+
+			// Status line and headers (without Connection, Keep-Alive,
+			// Transfer-Encoding, Content-Length and Age).
+			char* headers;
+			size_t headerslen;
+
+			// Body (memory tier) or file (disk tier, -1: none).
+			char* body;
+			int fd;
+			off_t size;
+
+			// When the response was generated and until when it is fresh.
+			time_t date;
+			time_t expires;
+
+			// How long after expiring it can be served while it is being
+			// revalidated / if the backend fails [s].
+			unsigned stale_while_revalidate;
+			unsigned stale_if_error;
+
+			// Number of clients sending / holding the response.
+			unsigned refcount;
+
+			bool revalidating; // A request has been sent to the backend to refresh it.
+			bool removed; // No longer in the cache (freed once released).
+		};
+
+		// Request sent to the backend on a miss, the identical requests
+		// wait for its response instead of being sent too.
+		struct fetch {
+			fetch* next; // In the bucket.
+
+			unsigned hash;
+
+			// Host and path (including the query string).
+			char* key;
+			unsigned short hostlen;
+			unsigned short keylen;
+
+			// Until when requests can wait for the response.
+			time_t deadline;
+
+			// Waiting requests (file descriptors of the clients, -1: none).
+			int head;
+			int tail;
+		};
+
+		struct statistics {
+			unsigned long long hits;
+			unsigned long long stale_hits;
+			unsigned long long misses;
+			unsigned long long stores;
+
+			// Requests which have waited for the response to an identical
+			// request / which have been sent to the backend after waiting
+			// too long.
+			unsigned long long collapsed;
+			unsigned long long collapse_timeouts;
+
+			size_t entries;
+			size_t memory;
+			off_t disk;
+		};
+
+		// Constructor.
+		response_cache();
+
+		// Destructor.
+		virtual ~response_cache();
+
+		// Create ('max_disk' 0: the responses are only kept in memory;
+		// 'max_files': maximum number of files of the disk tier).
+		bool create(size_t max_memory, size_t max_object_size, off_t max_disk, off_t max_disk_object_size, size_t max_files);
+
+		// Let the identical requests wait for the response to the first
+		// one during at most 'timeout' seconds (0: disabled).
+		bool set_collapsing(unsigned timeout, size_t max_connections);
+
+		// Is request collapsing enabled?
+		bool collapsing() const;
+
+		// Can the response be stored ('size' -1: unknown; 'ttl' > 0:
+		// microcaching, successful responses are kept 'ttl' seconds in
+		// memory even without Cache-Control)?
+		bool storable(unsigned short status_code, const http_headers& headers, off_t size, unsigned ttl) const;
+
+		// Look up the response to the request ('request': request line
+		// and headers). The entry is referenced until it is released.
+		entry* lookup(const char* host, unsigned short hostlen, const char* path, unsigned short pathlen, const char* request, size_t requestlen);
+
+		// Store the response (replacing the previous one). 'status_line'
+		// has to end with CRLF. The body is either in memory or in the
+		// file 'fd', which is kept (disk tier) if the returned entry
+		// refers to it ('ttl': see storable()). The entry is referenced
+		// until it is released.
+		entry* add(const char* host, unsigned short hostlen, const char* path, unsigned short pathlen, const char* request, size_t requestlen, unsigned short status_code, const char* status_line, size_t status_line_len, http_headers& headers, const char* body, int fd, off_t size, unsigned ttl);
+
+		// Release entry.
+		void release(entry* e);
+
+		// Remove the responses to the URL (all the variants). A path
+		// ending in '*' removes all the URLs starting with it;
+		// 'any_cookies': also the keys of the URL followed by cookies
+		// (microcaching). Returns the number of responses removed.
+		unsigned purge(const char* host, unsigned short hostlen, const char* path, unsigned short pathlen, bool any_cookies = false);
+
+		// Get the request being sent to the backend for the URL (NULL: none).
+		fetch* get_fetch(const char* host, unsigned short hostlen, const char* path, unsigned short pathlen);
+
+		// The request is being sent to the backend.
+		fetch* start_fetch(const char* host, unsigned short hostlen, const char* path, unsigned short pathlen);
+
+		// Wait for the response (false: too late, the request has to be
+		// sent to the backend).
+		bool wait(fetch* f, unsigned fd);
+
+		// Stop waiting (the client has gone away).
+		void cancel_wait(fetch* f, unsigned fd);
+
+		// Get the next waiting request (-1: none).
+		int next_waiter(fetch* f);
+
+		// The response has been received (there must be no waiting
+		// requests left).
+		void end_fetch(fetch* f);
+
+		// Get a request which has waited too long (-1: none).
+		int expire();
+
+		// Number of waiting requests.
+		unsigned waiting() const;
+
+		// Count a request served from the cache (fresh / stale response).
+		void hit();
+		void stale_hit();
+
+		// Count a request sent to the backend.
+		void miss();
+
+		// Get statistics.
+		const statistics& get_statistics() const;
+
+		// Is the response fresh?
+		static bool fresh(const entry* e);
+
+		// Can the stale response be served while it is being
+		// revalidated?
+		static bool stale_while_revalidate(const entry* e);
+
+		// Can the stale response be served if the backend fails?
+		static bool stale_if_error(const entry* e);
+
+		// Get the value of the request header 'name' ('request': request
+		// line and headers).
+		static bool get_request_header(const char* request, size_t requestlen, const char* name, size_t namelen, const char*& value, size_t& valuelen);
+
+	protected:
+		static const size_t HASH_SIZE;
+
+		static const unsigned MEMORY_TIER;
+		static const unsigned DISK_TIER;
+
+		struct freshness {
+			time_t date;
+			time_t expires;
+
+			unsigned stale_while_revalidate;
+			unsigned stale_if_error;
+		};
+
+		entry** _M_buckets;
+
+		fetch** _M_fetches;
+
+		// Next waiting request of each client (-1: last).
+		int* _M_next_waiter;
+
+		unsigned _M_collapse_timeout;
+		unsigned _M_waiting;
+
+		struct lru {
+			entry* head;
+			entry* tail;
+		};
+
+		lru _M_lru[2];
+
+		size_t _M_max_memory;
+		size_t _M_max_object_size;
+
+		off_t _M_max_disk;
+		off_t _M_max_disk_object_size;
+
+		size_t _M_max_files;
+		size_t _M_nfiles;
+
+		statistics _M_stats;
+
+		// Vary values / headers of the response being stored.
+		buffer _M_vary;
+		buffer _M_headers;
+
+		// Compute the freshness of the response ('ttl': see storable()).
+		bool get_freshness(unsigned short status_code, const http_headers& headers, unsigned ttl, freshness& freshness) const;
+
+		// Does the entry match the request's values of the Vary headers?
+		static bool match(const entry* e, const char* request, size_t requestlen);
+
+		// Remove entry from the cache (it is freed once released).
+		void remove(entry* e);
+
+		// Free entry.
+		void free(entry* e);
+
+		// Evict the least recently used responses to make room.
+		bool make_room(size_t memory, off_t disk);
+
+		// Add entry to the head of the LRU list of its tier.
+		void link_lru(entry* e);
+
+		// Remove entry from the LRU list of its tier.
+		void unlink_lru(entry* e);
+
+		// Hash key.
+		static unsigned hash(const char* host, unsigned short hostlen, const char* path, unsigned short pathlen);
+
+		// Get the value of directive 'name' of the Cache-Control header.
+		static bool get_directive(const char* value, unsigned short valuelen, const char* name, size_t namelen, const char*& arg, size_t& arglen);
+};
+
+inline void response_cache::hit()
+{
+	_M_stats.hits++;
+}
+
+inline void response_cache::stale_hit()
+{
+	_M_stats.stale_hits++;
+}
+
+inline void response_cache::miss()
+{
+	_M_stats.misses++;
+}
+
+inline bool response_cache::collapsing() const
+{
+	return (_M_collapse_timeout > 0);
+}
+
+inline unsigned response_cache::waiting() const
+{
+	return _M_waiting;
+}
+
+inline const response_cache::statistics& response_cache::get_statistics() const
+{
+	return _M_stats;
+}
+
+inline bool response_cache::fresh(const entry* e)
+{
+	return (now::_M_time < e->expires);
+}
+
+inline bool response_cache::stale_while_revalidate(const entry* e)
+{
+	return (now::_M_time < e->expires + (time_t) e->stale_while_revalidate);
+}
+
+inline bool response_cache::stale_if_error(const entry* e)
+{
+	return (now::_M_time < e->expires + (time_t) MAX(e->stale_while_revalidate, e->stale_if_error));
+}
+
+inline void response_cache::link_lru(entry* e)
+{
+	lru* l = &_M_lru[(e->fd == -1) ? MEMORY_TIER : DISK_TIER];
+
+	e->prev_lru = NULL;
+	e->next_lru = l->head;
+
+	if (l->head) {
+		l->head->prev_lru = e;
+	} else {
+		l->tail = e;
+	}
+
+	l->head = e;
+}
+
+inline void response_cache::unlink_lru(entry* e)
+{
+	lru* l = &_M_lru[(e->fd == -1) ? MEMORY_TIER : DISK_TIER];
+
+	if (e->prev_lru) {
+		e->prev_lru->next_lru = e->next_lru;
+	} else {
+		l->head = e->next_lru;
+	}
+
+	if (e->next_lru) {
+		e->next_lru->prev_lru = e->prev_lru;
+	} else {
+		l->tail = e->prev_lru;
+	}
+}
+
+#endif // RESPONSE_CACHE_H
@@ -1,5 +1,8 @@
 #include <stdlib.h>
+#include <stdio.h>
 #include "rulelist.h"
+#include "http/fastcgi.h"
+#include "http/version.h"
 
 const unsigned char rulelist::HTTP_HANDLER = 0;
 const unsigned char rulelist::FCGI_HANDLER = 1;
@@ -11,6 +14,37 @@ const unsigned char rulelist::BY_METHOD = 2;
 
 const size_t rulelist::RULE_ALLOC = 4;
 
+bool rulelist::rule::set_fcgi_params(const char* server_name, unsigned short server_namelen, unsigned short port, const char* document_root, unsigned short document_rootlen)
+{
+	fcgi_params.reset();
+
+	fastcgi::name_value_pairs params(fcgi_params);
+
+	if (!params.add("SERVER_SOFTWARE", 15, WEBSERVER_NAME, sizeof(WEBSERVER_NAME) - 1, false, false)) {
+		return false;
+	}
+
+	if (!params.add("SERVER_NAME", 11, server_name, server_namelen, false, false)) {
+		return false;
+	}
+
+	char value[32];
+	unsigned short valuelen = snprintf(value, sizeof(value), "%u", port);
+	if (!params.add("SERVER_PORT", 11, value, valuelen, false, false)) {
+		return false;
+	}
+
+	if (!params.add("DOCUMENT_ROOT", 13, document_root, document_rootlen, false, false)) {
+		return false;
+	}
+
+	if (!params.add("SERVER_PROTOCOL", 15, "HTTP/1.1", 8, false, false)) {
+		return false;
+	}
+
+	return params.add("GATEWAY_INTERFACE", 17, "CGI/1.1", 7, false, false);
+}
+
 bool rulelist::rule::match(unsigned char method, const char* path, unsigned short pathlen, const char* extension, unsigned short extensionlen) const
 {
 	switch (criterion) {
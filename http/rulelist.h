@@ -5,6 +5,7 @@
 #include "util/string_list.h"
 #include "http/http_method.h"
 #include "http/backend_list.h"
+#include "string/buffer.h"
 
 class rulelist {
 	public:
@@ -26,6 +27,24 @@ class rulelist {
 
 			backend_list backends;
 
+			// Store the backends' responses in the response cache?
+			bool cache;
+
+			// Microcaching: successful responses are cached during
+			// 'microcache_ttl' seconds even without Cache-Control (0:
+			// disabled). The query parameters and cookies listed are not
+			// part of the cache key.
+			unsigned microcache_ttl;
+			string_list microcache_ignore_query;
+			string_list microcache_ignore_cookies;
+
+			// Maximum size of the request bodies [bytes] (0: no limit).
+			off_t max_body_size;
+
+			// FastCGI parameters which don't depend on the request
+			// (encoded name-value pairs).
+			buffer fcgi_params;
+
 			// Constructor.
 			rule();
 
@@ -35,6 +54,10 @@ class rulelist {
 			// Add method.
 			void add(unsigned char method);
 
+			// Encode the FastCGI parameters which don't depend on the
+			// request.
+			bool set_fcgi_params(const char* server_name, unsigned short server_namelen, unsigned short port, const char* document_root, unsigned short document_rootlen);
+
 			// Match.
 			bool match(unsigned char method, const char* path, unsigned short pathlen, const char* extension, unsigned short extensionlen) const;
 		};
@@ -67,6 +90,12 @@ class rulelist {
 inline rulelist::rule::rule()
 {
 	methods = 0;
+
+	cache = false;
+
+	microcache_ttl = 0;
+
+	max_body_size = 0;
 }
 
 inline rulelist::rule::~rule()
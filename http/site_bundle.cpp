@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <new>
+#include "site_bundle.h"
+#include "logger/logger.h"
+
+const char site_bundle::MAGIC[8] = {'G', 'W', 'E', 'B', 'P', 'A', 'C', 'K'};
+const unsigned site_bundle::VERSION = 1;
+
+const unsigned site_bundle::DIRECTORY = 1;
+
+site_bundle::site_bundle()
+{
+	*_M_filename = 0;
+
+	_M_fd = -1;
+
+	_M_index = (char*) MAP_FAILED;
+	_M_indexlen = 0;
+
+	_M_buckets = NULL;
+	_M_entries = NULL;
+	_M_strings = NULL;
+
+	_M_nbuckets = 0;
+
+	_M_references = 1;
+}
+
+site_bundle::~site_bundle()
+{
+	if (_M_index != MAP_FAILED) {
+		munmap(_M_index, _M_indexlen);
+	}
+
+	if (_M_fd != -1) {
+		::close(_M_fd);
+	}
+}
+
+site_bundle* site_bundle::open(const char* filename)
+{
+	site_bundle* bundle;
+	if ((bundle = new (std::nothrow) site_bundle()) == NULL) {
+		return NULL;
+	}
+
+	if (!bundle->load(filename)) {
+		bundle->release();
+		return NULL;
+	}
+
+	return bundle;
+}
+
+bool site_bundle::changed() const
+{
+	struct stat buf;
+	if (stat(_M_filename, &buf) < 0) {
+		// Keep serving the current bundle.
+		return false;
+	}
+
+	return ((buf.st_dev != _M_dev) || (buf.st_ino != _M_ino) || (buf.st_mtime != _M_mtime) || (buf.st_size != _M_size));
+}
+
+const site_bundle::entry* site_bundle::lookup(const char* path, size_t pathlen) const
+{
+	unsigned h = hash(path, pathlen);
+	unsigned mask = _M_nbuckets - 1;
+
+	for (unsigned i = 0, idx = h & mask; i < _M_nbuckets; i++, idx = (idx + 1) & mask) {
+		unsigned bucket = _M_buckets[idx];
+		if (bucket == 0) {
+			return NULL;
+		}
+
+		const entry* entry = &(_M_entries[bucket - 1]);
+		if ((entry->hash == h) && (entry->pathlen == pathlen) && (memcmp(_M_strings + entry->path, path, pathlen) == 0)) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+bool site_bundle::load(const char* filename)
+{
+	size_t len = strlen(filename);
+	if (len >= sizeof(_M_filename)) {
+		logger::instance().log(logger::LOG_ERROR, "Bundle file name too long (%s).", filename);
+		return false;
+	}
+
+	memcpy(_M_filename, filename, len + 1);
+
+	if ((_M_fd = ::open(filename, O_RDONLY)) < 0) {
+		logger::instance().log(logger::LOG_ERROR, "Couldn't open bundle (%s).", filename);
+		return false;
+	}
+
+	struct stat buf;
+	if (fstat(_M_fd, &buf) < 0) {
+		logger::instance().perror("fstat");
+		return false;
+	}
+
+	_M_dev = buf.st_dev;
+	_M_ino = buf.st_ino;
+	_M_mtime = buf.st_mtime;
+	_M_size = buf.st_size;
+
+	header hdr;
+	if ((_M_size < (off_t) sizeof(hdr)) || (pread(_M_fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr))) {
+		logger::instance().log(logger::LOG_ERROR, "Couldn't read bundle header (%s).", filename);
+		return false;
+	}
+
+	if ((memcmp(hdr.magic, MAGIC, sizeof(MAGIC)) != 0) || (hdr.version != VERSION)) {
+		logger::instance().log(logger::LOG_ERROR, "Invalid bundle (%s).", filename);
+		return false;
+	}
+
+	// Check the layout.
+	unsigned long long entries = sizeof(hdr) + (unsigned long long) hdr.nbuckets * sizeof(unsigned);
+	unsigned long long strings = entries + (unsigned long long) hdr.nentries * sizeof(entry);
+
+	if ((hdr.nbuckets == 0) || ((hdr.nbuckets & (hdr.nbuckets - 1)) != 0) || (hdr.nentries > hdr.nbuckets) || (hdr.strings != strings) || (hdr.data < hdr.strings) || (hdr.data > (unsigned long long) _M_size)) {
+		logger::instance().log(logger::LOG_ERROR, "Invalid bundle (%s).", filename);
+		return false;
+	}
+
+	_M_indexlen = hdr.data;
+
+	if ((_M_index = (char*) mmap(NULL, _M_indexlen, PROT_READ, MAP_SHARED, _M_fd, 0)) == MAP_FAILED) {
+		logger::instance().perror("mmap");
+		return false;
+	}
+
+	_M_buckets = (const unsigned*) (_M_index + sizeof(hdr));
+	_M_entries = (const entry*) (_M_index + entries);
+	_M_strings = _M_index + strings;
+
+	_M_nbuckets = hdr.nbuckets;
+
+	unsigned long long stringslen = hdr.data - hdr.strings;
+
+	for (unsigned i = 0; i < hdr.nbuckets; i++) {
+		if (_M_buckets[i] > hdr.nentries) {
+			logger::instance().log(logger::LOG_ERROR, "Invalid bundle (%s).", filename);
+			return false;
+		}
+	}
+
+	for (unsigned i = 0; i < hdr.nentries; i++) {
+		const entry* entry = &(_M_entries[i]);
+
+		// Are the strings and the data inside the bundle?
+		bool valid = ((unsigned long long) entry->path + entry->pathlen <= stringslen);
+		valid = valid && ((unsigned long long) entry->type + entry->typelen <= stringslen);
+		valid = valid && ((unsigned long long) entry->etag + entry->etaglen <= stringslen);
+		valid = valid && ((unsigned long long) entry->headers + entry->headerslen <= stringslen);
+		valid = valid && ((unsigned long long) entry->gzip_etag + entry->gzip_etaglen <= stringslen);
+		valid = valid && ((unsigned long long) entry->gzip_headers + entry->gzip_headerslen <= stringslen);
+		valid = valid && (entry->offset <= (unsigned long long) _M_size) && (entry->size <= (unsigned long long) _M_size - entry->offset);
+		valid = valid && (entry->gzip_offset <= (unsigned long long) _M_size) && (entry->gzip_size <= (unsigned long long) _M_size - entry->gzip_offset);
+
+		if (!valid) {
+			logger::instance().log(logger::LOG_ERROR, "Invalid bundle entry %u (%s).", i, filename);
+			return false;
+		}
+	}
+
+	return true;
+}
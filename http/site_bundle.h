@@ -0,0 +1,157 @@
+#ifndef SITE_BUNDLE_H
+#define SITE_BUNDLE_H
+
+#include <sys/types.h>
+#include <limits.h>
+#include "util/fnv.h"
+
+// Document root packed in a single file by gweb-pack.
+//
+// Layout:
+//   header
+//   buckets[nbuckets] (entry index + 1, 0: empty bucket)
+//   entries[nentries]
+//   strings (paths, MIME types, ETags and header lines)
+//   data (page aligned)
+class site_bundle {
+	public:
+		static const char MAGIC[8];
+		static const unsigned VERSION;
+
+		static const unsigned DIRECTORY; // Directory without trailing '/'.
+
+		struct header {
+			char magic[8];
+			unsigned version;
+			unsigned nentries;
+			unsigned nbuckets; // Power of 2.
+			unsigned unused;
+			unsigned long long strings;
+			unsigned long long data;
+		};
+
+		struct entry {
+			unsigned hash;
+			unsigned flags;
+
+			unsigned path;
+			unsigned pathlen;
+
+			unsigned type;
+			unsigned typelen;
+
+			unsigned etag;
+			unsigned etaglen;
+
+			unsigned headers; // Header lines ("ETag", "Vary").
+			unsigned headerslen;
+
+			unsigned gzip_etag;
+			unsigned gzip_etaglen;
+
+			unsigned gzip_headers; // Header lines ("ETag", "Vary", "Content-Encoding").
+			unsigned gzip_headerslen;
+
+			long long mtime;
+
+			unsigned long long offset;
+			unsigned long long size;
+
+			// Precompressed variant (if gzip_size > 0).
+			unsigned long long gzip_offset;
+			unsigned long long gzip_size;
+		};
+
+		// Open bundle (the reference count is set to 1).
+		static site_bundle* open(const char* filename);
+
+		// Acquire reference.
+		void acquire();
+
+		// Release reference (the bundle is deleted when there are no
+		// references left).
+		void release();
+
+		// Has the file been replaced or modified?
+		bool changed() const;
+
+		// Get file name.
+		const char* get_filename() const;
+
+		// Get file descriptor.
+		int get_descriptor() const;
+
+		// Look up path.
+		const entry* lookup(const char* path, size_t pathlen) const;
+
+		// Get string.
+		const char* get_string(unsigned offset) const;
+
+		// Hash function.
+		static unsigned hash(const char* path, size_t pathlen);
+
+	protected:
+		char _M_filename[PATH_MAX + 1];
+
+		int _M_fd;
+
+		// Mapping of the index (header, buckets, entries and strings).
+		char* _M_index;
+		size_t _M_indexlen;
+
+		const unsigned* _M_buckets;
+		const entry* _M_entries;
+		const char* _M_strings;
+
+		unsigned _M_nbuckets;
+
+		dev_t _M_dev;
+		ino_t _M_ino;
+		time_t _M_mtime;
+		off_t _M_size;
+
+		unsigned _M_references;
+
+		// Constructor.
+		site_bundle();
+
+		// Destructor.
+		virtual ~site_bundle();
+
+		// Load bundle.
+		bool load(const char* filename);
+};
+
+inline void site_bundle::acquire()
+{
+	_M_references++;
+}
+
+inline void site_bundle::release()
+{
+	if (--_M_references == 0) {
+		delete this;
+	}
+}
+
+inline const char* site_bundle::get_filename() const
+{
+	return _M_filename;
+}
+
+inline int site_bundle::get_descriptor() const
+{
+	return _M_fd;
+}
+
+inline const char* site_bundle::get_string(unsigned offset) const
+{
+	return _M_strings + offset;
+}
+
+inline unsigned site_bundle::hash(const char* path, size_t pathlen)
+{
+	return fnv::hash(path, pathlen);
+}
+
+#endif // SITE_BUNDLE_H
@@ -33,6 +33,10 @@ void virtual_hosts::free()
 			}
 
 			delete _M_vhosts[i].rules;
+
+			if (_M_vhosts[i].bundle) {
+				_M_vhosts[i].bundle->release();
+			}
 		}
 
 		::free(_M_vhosts);
@@ -145,6 +149,8 @@ virtual_hosts::vhost* virtual_hosts::add(const char* name, unsigned short namele
 
 	vhost->rules = rules;
 
+	vhost->bundle = NULL;
+
 	vhost->_M_name = index->name;
 	vhost->_M_root = root_offset;
 
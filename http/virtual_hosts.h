@@ -4,6 +4,7 @@
 #include "http/dirlisting.h"
 #include "http/access_log.h"
 #include "http/rulelist.h"
+#include "http/site_bundle.h"
 #include "string/buffer.h"
 
 class virtual_hosts {
@@ -26,6 +27,9 @@ class virtual_hosts {
 
 				rulelist* rules;
 
+				// If not NULL, the files are served from the bundle.
+				site_bundle* bundle;
+
 			private:
 				size_t _M_name;
 				size_t _M_root;
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dnscache.h"
+#include "util/fnv.h"
+#include "util/now.h"
+
+const size_t dnscache::DEFAULT_SIZE = 1024;
+
+dnscache::dnscache()
+{
+	_M_entries = NULL;
+	_M_size = 0;
+
+	_M_min_ttl = 0;
+	_M_max_ttl = 0;
+}
+
+dnscache::~dnscache()
+{
+	if (_M_entries) {
+		for (size_t i = 0; i < _M_size; i++) {
+			if (_M_entries[i].name) {
+				free(_M_entries[i].name);
+			}
+		}
+
+		free(_M_entries);
+	}
+}
+
+bool dnscache::create(time_t min_ttl, time_t max_ttl, size_t size)
+{
+	size_t s = 1;
+	while (s < size) {
+		s <<= 1;
+	}
+
+	if ((_M_entries = (entry*) calloc(s, sizeof(entry))) == NULL) {
+		return false;
+	}
+
+	_M_size = s;
+
+	_M_min_ttl = min_ttl;
+	_M_max_ttl = max_ttl;
+
+	return true;
+}
+
+bool dnscache::lookup(const char* host, size_t hostlen, unsigned short port, resolver::address& addr) const
+{
+	const entry* e = &_M_entries[fnv::hash(host, hostlen) & (_M_size - 1)];
+
+	if ((!e->name) || (e->namelen != hostlen) || (memcmp(e->name, host, hostlen) != 0) || (e->expires < now::_M_time)) {
+		return false;
+	}
+
+	addr = e->addr;
+
+	if (addr.addr.ss_family == AF_INET) {
+		((struct sockaddr_in*) &addr.addr)->sin_port = htons(port);
+	} else {
+		((struct sockaddr_in6*) &addr.addr)->sin6_port = htons(port);
+	}
+
+	return true;
+}
+
+bool dnscache::add(const char* host, size_t hostlen, const resolver::address& addr, time_t ttl)
+{
+	entry* e = &_M_entries[fnv::hash(host, hostlen) & (_M_size - 1)];
+
+	if ((!e->name) || (e->namelen != hostlen) || (memcmp(e->name, host, hostlen) != 0)) {
+		char* name;
+		if ((name = (char*) malloc(hostlen)) == NULL) {
+			return false;
+		}
+
+		memcpy(name, host, hostlen);
+
+		if (e->name) {
+			free(e->name);
+		}
+
+		e->name = name;
+		e->namelen = hostlen;
+	}
+
+	e->addr = addr;
+
+	if ((ttl < 0) || (ttl > _M_max_ttl)) {
+		ttl = _M_max_ttl;
+	} else if (ttl < _M_min_ttl) {
+		ttl = _M_min_ttl;
+	}
+
+	e->expires = now::_M_time + ttl;
+
+	return true;
+}
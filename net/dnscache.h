@@ -0,0 +1,44 @@
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+#include "net/resolver.h"
+
+// Addresses of the names resolved by the worker threads. An entry is
+// replaced by the next name with the same hash.
+class dnscache {
+	public:
+		static const size_t DEFAULT_SIZE;
+
+		// Constructor.
+		dnscache();
+
+		// Destructor.
+		virtual ~dnscache();
+
+		// Create ('size' is rounded up to a power of two).
+		bool create(time_t min_ttl, time_t max_ttl, size_t size = DEFAULT_SIZE);
+
+		// Look up the address of host (with 'port').
+		bool lookup(const char* host, size_t hostlen, unsigned short port, resolver::address& addr) const;
+
+		// Add the address of host ('ttl': -1 for numeric addresses).
+		bool add(const char* host, size_t hostlen, const resolver::address& addr, time_t ttl);
+
+	protected:
+		struct entry {
+			char* name;
+			size_t namelen;
+
+			resolver::address addr;
+
+			time_t expires;
+		};
+
+		entry* _M_entries;
+		size_t _M_size;
+
+		time_t _M_min_ttl;
+		time_t _M_max_ttl;
+};
+
+#endif // DNSCACHE_H
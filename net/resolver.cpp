@@ -1,35 +1,253 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <netdb.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#if HAVE_RES_NQUERY
+	#include <arpa/nameser.h>
+	#include <resolv.h>
+#endif
 #include "resolver.h"
-#include "logger/logger.h"
 
-bool resolver::resolve(const char* host, struct sockaddr* addr)
+const time_t resolver::DEFAULT_TTL = 60;
+
+const char* resolver::UNIX_PREFIX = "unix:";
+const size_t resolver::UNIX_PREFIX_LEN = 5;
+
+bool resolver::resolve(const char* host, unsigned short port, address& addr, time_t& ttl)
 {
-#if defined(__linux__) || defined(__sun__)
-	struct hostent ret;
-	char buf[2048];
+	if (resolve_numeric(host, port, addr)) {
+		ttl = -1;
+		return true;
+	}
+
+#if HAVE_RES_NQUERY
+	if (query(host, port, addr, ttl)) {
+		return true;
+	}
 #endif
 
-	struct hostent* result;
+	// Not in the DNS (/etc/hosts, ...). The logger is not thread-safe,
+	// errors are reported by the caller.
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
 
-#if defined(__linux__)
-	int error;
-	if (gethostbyname_r(host, &ret, buf, sizeof(buf), &result, &error) != 0) {
-#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
-	if ((result = gethostbyname(host)) == NULL) {
-#elif defined(__sun__)
-	int error;
-	if ((result = gethostbyname_r(host, &ret, buf, sizeof(buf), &error)) == NULL) {
-#endif
-		logger::instance().log(logger::LOG_WARNING, "Couldn't resolve [%s].", host);
+	struct addrinfo* result;
+	if (getaddrinfo(host, NULL, &hints, &result) != 0) {
 		return false;
 	}
 
-	struct sockaddr_in* sin = (struct sockaddr_in*) addr;
+	// Prefer IPv4.
+	const struct addrinfo* ai = result;
+	for (const struct addrinfo* res = result; res; res = res->ai_next) {
+		if (res->ai_family == AF_INET) {
+			ai = res;
+			break;
+		}
+	}
+
+	memcpy(&addr.addr, ai->ai_addr, ai->ai_addrlen);
+	addr.addrlen = ai->ai_addrlen;
+
+	freeaddrinfo(result);
+
+	if (addr.addr.ss_family == AF_INET) {
+		((struct sockaddr_in*) &addr.addr)->sin_port = htons(port);
+	} else {
+		((struct sockaddr_in6*) &addr.addr)->sin6_port = htons(port);
+	}
 
-	sin->sin_family = result->h_addrtype;
-	memcpy(&sin->sin_addr, result->h_addr_list[0], result->h_length);
-	memset(&sin->sin_zero, 0, sizeof(sin->sin_zero));
+	ttl = DEFAULT_TTL;
 
 	return true;
 }
+
+bool resolver::resolve_numeric(const char* host, unsigned short port, address& addr)
+{
+	// IPv6 address between brackets?
+	char name[NI_MAXHOST];
+	size_t len = strlen(host);
+	if ((len > 2) && (host[0] == '[') && (host[len - 1] == ']')) {
+		if (len - 2 >= sizeof(name)) {
+			return false;
+		}
+
+		memcpy(name, host + 1, len - 2);
+		name[len - 2] = 0;
+
+		host = name;
+	}
+
+	return parse_numeric(host, port, addr);
+}
+
+bool resolver::equal(const address& addr1, const address& addr2)
+{
+	return ((addr1.addrlen == addr2.addrlen) && (memcmp(&addr1.addr, &addr2.addr, addr1.addrlen) == 0));
+}
+
+const char* resolver::to_string(const address& addr, char* buf, size_t size)
+{
+	if (addr.addr.ss_family == AF_UNIX) {
+		snprintf(buf, size, "%s%s", UNIX_PREFIX, ((const struct sockaddr_un*) &addr.addr)->sun_path);
+		return buf;
+	}
+
+	const void* src;
+	if (addr.addr.ss_family == AF_INET) {
+		src = &((const struct sockaddr_in*) &addr.addr)->sin_addr;
+	} else {
+		src = &((const struct sockaddr_in6*) &addr.addr)->sin6_addr;
+	}
+
+	if (!inet_ntop(addr.addr.ss_family, src, buf, size)) {
+		snprintf(buf, size, "?");
+	}
+
+	return buf;
+}
+
+bool resolver::parse_unix(const char* path, address& addr)
+{
+	struct sockaddr_un* un = (struct sockaddr_un*) &addr.addr;
+
+	size_t len = strlen(path);
+	if (len >= sizeof(un->sun_path)) {
+		return false;
+	}
+
+	memset(&addr.addr, 0, sizeof(struct sockaddr_storage));
+
+	un->sun_family = AF_UNIX;
+	memcpy(un->sun_path, path, len + 1);
+
+	addr.addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+
+	return true;
+}
+
+bool resolver::parse_numeric(const char* host, unsigned short port, address& addr)
+{
+	memset(&addr.addr, 0, sizeof(struct sockaddr_storage));
+
+	struct sockaddr_in* sin = (struct sockaddr_in*) &addr.addr;
+	if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+
+		addr.addrlen = sizeof(struct sockaddr_in);
+
+		return true;
+	}
+
+	struct sockaddr_in6* sin6 = (struct sockaddr_in6*) &addr.addr;
+	if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+
+		addr.addrlen = sizeof(struct sockaddr_in6);
+
+		return true;
+	}
+
+	return false;
+}
+
+#if HAVE_RES_NQUERY
+bool resolver::query(const char* host, unsigned short port, address& addr, time_t& ttl)
+{
+	// The resolver state is not shared between threads.
+	struct __res_state state;
+	memset(&state, 0, sizeof(struct __res_state));
+
+	if (res_ninit(&state) != 0) {
+		return false;
+	}
+
+	unsigned char answer[NS_PACKETSZ];
+
+	static const int types[] = {ns_t_a, ns_t_aaaa};
+
+	bool found = false;
+
+	for (size_t i = 0; (i < sizeof(types) / sizeof(int)) && (!found); i++) {
+		int len;
+		if ((len = res_nsearch(&state, host, ns_c_in, types[i], answer, sizeof(answer))) > 0) {
+			if ((size_t) len <= sizeof(answer)) {
+				found = parse_answer(answer, len, types[i], port, addr, ttl);
+			} else {
+				// The answer didn't fit, retry with a buffer large
+				// enough for any message.
+				unsigned char* buf;
+				if ((buf = (unsigned char*) malloc(NS_MAXMSG)) != NULL) {
+					if ((len = res_nsearch(&state, host, ns_c_in, types[i], buf, NS_MAXMSG)) > 0) {
+						found = parse_answer(buf, (len <= NS_MAXMSG) ? len : NS_MAXMSG, types[i], port, addr, ttl);
+					}
+
+					free(buf);
+				}
+			}
+		}
+	}
+
+	res_nclose(&state);
+
+	return found;
+}
+
+bool resolver::parse_answer(const unsigned char* answer, int len, int type, unsigned short port, address& addr, time_t& ttl)
+{
+	ns_msg msg;
+	if (ns_initparse(answer, len, &msg) < 0) {
+		return false;
+	}
+
+	bool found = false;
+
+	int count = ns_msg_count(msg, ns_s_an);
+	for (int i = 0; i < count; i++) {
+		ns_rr rr;
+		if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) {
+			return false;
+		}
+
+		// The address can be kept as long as all the records of the
+		// chain (CNAMEs, ...).
+		if ((i == 0) || ((time_t) ns_rr_ttl(rr) < ttl)) {
+			ttl = ns_rr_ttl(rr);
+		}
+
+		if ((found) || (ns_rr_type(rr) != type)) {
+			continue;
+		}
+
+		memset(&addr.addr, 0, sizeof(struct sockaddr_storage));
+
+		if ((type == ns_t_a) && (ns_rr_rdlen(rr) == sizeof(struct in_addr))) {
+			struct sockaddr_in* sin = (struct sockaddr_in*) &addr.addr;
+			sin->sin_family = AF_INET;
+			sin->sin_port = htons(port);
+			memcpy(&sin->sin_addr, ns_rr_rdata(rr), sizeof(struct in_addr));
+
+			addr.addrlen = sizeof(struct sockaddr_in);
+
+			found = true;
+		} else if ((type == ns_t_aaaa) && (ns_rr_rdlen(rr) == sizeof(struct in6_addr))) {
+			struct sockaddr_in6* sin6 = (struct sockaddr_in6*) &addr.addr;
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_port = htons(port);
+			memcpy(&sin6->sin6_addr, ns_rr_rdata(rr), sizeof(struct in6_addr));
+
+			addr.addrlen = sizeof(struct sockaddr_in6);
+
+			found = true;
+		}
+	}
+
+	return found;
+}
+#endif // HAVE_RES_NQUERY
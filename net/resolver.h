@@ -1,12 +1,63 @@
 #ifndef RESOLVER_H
 #define RESOLVER_H
 
+#include <string.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
 class resolver {
 	public:
-		static bool resolve(const char* host, struct sockaddr* addr);
+		// How long the address of a name which hasn't been resolved
+		// through the DNS (/etc/hosts, ...) is kept.
+		static const time_t DEFAULT_TTL;
+
+		// Prefix of the Unix domain socket addresses ("unix:/path").
+		static const char* UNIX_PREFIX;
+		static const size_t UNIX_PREFIX_LEN;
+
+		struct address {
+			struct sockaddr_storage addr;
+			socklen_t addrlen;
+		};
+
+		// Resolve host (IPv4 addresses are preferred). 'ttl' is set to
+		// how long the address can be kept (-1: numeric address). Blocks,
+		// has to be called from a worker thread once the server runs.
+		static bool resolve(const char* host, unsigned short port, address& addr, time_t& ttl);
+
+		// Parse numeric address (IPv6 addresses might be between
+		// brackets). Doesn't block.
+		static bool resolve_numeric(const char* host, unsigned short port, address& addr);
+
+		// Same address?
+		static bool equal(const address& addr1, const address& addr2);
+
+		// Unix domain socket address?
+		static bool is_unix(const char* host, size_t len);
+
+		// Build Unix domain socket address ('path': without the prefix).
+		static bool parse_unix(const char* path, address& addr);
+
+		// Address to string.
+		static const char* to_string(const address& addr, char* buf, size_t size);
+
+	private:
+		// Parse numeric address.
+		static bool parse_numeric(const char* host, unsigned short port, address& addr);
+
+#if HAVE_RES_NQUERY
+		// Query the DNS servers.
+		static bool query(const char* host, unsigned short port, address& addr, time_t& ttl);
+
+		// Search A / AAAA record in the answer.
+		static bool parse_answer(const unsigned char* answer, int len, int type, unsigned short port, address& addr, time_t& ttl);
+#endif // HAVE_RES_NQUERY
 };
 
+inline bool resolver::is_unix(const char* host, size_t len)
+{
+	return ((len > UNIX_PREFIX_LEN) && (memcmp(host, UNIX_PREFIX, UNIX_PREFIX_LEN) == 0));
+}
+
 #endif // RESOLVER_H
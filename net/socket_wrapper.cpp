@@ -14,9 +14,9 @@
 const char* socket_wrapper::ANY_ADDRESS = "0.0.0.0";
 const unsigned socket_wrapper::BACKLOG = 128;
 
-int socket_wrapper::create()
+int socket_wrapper::create(int domain)
 {
-	int sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	int sd = socket(domain, SOCK_STREAM, (domain == AF_UNIX) ? 0 : IPPROTO_TCP);
 	if (sd < 0) {
 		logger::instance().perror("socket");
 		return -1;
@@ -111,27 +111,32 @@ bool socket_wrapper::shutdown(int sd, int how)
 
 int socket_wrapper::connect(const char* host, unsigned short port)
 {
-	struct sockaddr addr;
-	if (!resolver::resolve(host, &addr)) {
+	resolver::address addr;
+	time_t ttl;
+	if (!resolver::resolve(host, port, addr, ttl)) {
+		logger::instance().log(logger::LOG_WARNING, "Couldn't resolve %s.", host);
 		return -1;
 	}
 
-	((struct sockaddr_in*) &addr)->sin_port = htons(port);
-
-	return connect(&addr);
+	return connect((const struct sockaddr*) &addr.addr, addr.addrlen);
 }
 
-int socket_wrapper::connect(const struct sockaddr* addr)
+int socket_wrapper::connect(const struct sockaddr* addr, socklen_t addrlen)
 {
-	int sd = create();
+	int sd = create(addr->sa_family);
 	if (sd < 0) {
 		return -1;
 	}
 
-	if ((::connect(sd, addr, sizeof(struct sockaddr)) < 0) && (errno != EINPROGRESS)) {
+	if ((::connect(sd, addr, addrlen) < 0) && (errno != EINPROGRESS)) {
+		// The caller might check errno.
+		int error = errno;
+
 		logger::instance().perror("connect");
 
 		close(sd);
+
+		errno = error;
 		return -1;
 	}
 
@@ -149,6 +154,22 @@ bool socket_wrapper::get_socket_error(int sd, int& error)
 	return true;
 }
 
+bool socket_wrapper::is_alive(int sd)
+{
+	char c;
+	if (recv(sd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0) {
+		return ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+	}
+
+	return false;
+}
+
+bool socket_wrapper::has_data(int sd)
+{
+	char c;
+	return (recv(sd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0);
+}
+
 ssize_t socket_wrapper::read(int sd, void* buf, size_t len)
 {
 	ssize_t ret;
@@ -245,12 +266,22 @@ bool socket_wrapper::cork(int sd)
 #if HAVE_TCP_CORK
 	int optval = 1;
 	if (setsockopt(sd, IPPROTO_TCP, TCP_CORK, &optval, sizeof(int)) < 0) {
+		// Unix domain socket?
+		if (errno == EOPNOTSUPP) {
+			return true;
+		}
+
 		logger::instance().perror("setsockopt");
 		return false;
 	}
 #elif HAVE_TCP_NOPUSH
 	int optval = 1;
 	if (setsockopt(sd, IPPROTO_TCP, TCP_NOPUSH, &optval, sizeof(int)) < 0) {
+		// Unix domain socket?
+		if (errno == EOPNOTSUPP) {
+			return true;
+		}
+
 		logger::instance().perror("setsockopt");
 		return false;
 	}
@@ -264,12 +295,22 @@ bool socket_wrapper::uncork(int sd)
 #if HAVE_TCP_CORK
 	int optval = 0;
 	if (setsockopt(sd, IPPROTO_TCP, TCP_CORK, &optval, sizeof(int)) < 0) {
+		// Unix domain socket?
+		if (errno == EOPNOTSUPP) {
+			return true;
+		}
+
 		logger::instance().perror("setsockopt");
 		return false;
 	}
 #elif HAVE_TCP_NOPUSH
 	int optval = 0;
 	if (setsockopt(sd, IPPROTO_TCP, TCP_NOPUSH, &optval, sizeof(int)) < 0) {
+		// Unix domain socket?
+		if (errno == EOPNOTSUPP) {
+			return true;
+		}
+
 		logger::instance().perror("setsockopt");
 		return false;
 	}
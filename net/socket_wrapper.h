@@ -14,7 +14,7 @@ class socket_wrapper {
 		};
 
 		// Create socket.
-		static int create();
+		static int create(int domain = AF_INET);
 
 		// Create listener socket.
 		static int create_listener(unsigned short port);
@@ -31,11 +31,18 @@ class socket_wrapper {
 
 		// Connect.
 		static int connect(const char* host, unsigned short port);
-		static int connect(const struct sockaddr* addr);
+		static int connect(const struct sockaddr* addr, socklen_t addrlen);
 
 		// Get socket error.
 		static bool get_socket_error(int sd, int& error);
 
+		// Is the idle connection still usable (not closed by the peer and
+		// without unexpected data)?
+		static bool is_alive(int sd);
+
+		// Are there data waiting to be read?
+		static bool has_data(int sd);
+
 		// Read.
 		static ssize_t read(int sd, void* buf, size_t len);
 
@@ -0,0 +1,49 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "splicer.h"
+#include "logger/logger.h"
+
+#if HAVE_SPLICE
+bool splicer::create_pipe(int fds[2])
+{
+	if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+		logger::instance().perror("pipe2");
+
+		fds[0] = -1;
+		fds[1] = -1;
+
+		return false;
+	}
+
+	return true;
+}
+
+void splicer::close_pipe(int fds[2])
+{
+	if (fds[0] != -1) {
+		close(fds[0]);
+		fds[0] = -1;
+	}
+
+	if (fds[1] != -1) {
+		close(fds[1]);
+		fds[1] = -1;
+	}
+}
+
+ssize_t splicer::splice(int in_fd, int out_fd, size_t count)
+{
+	ssize_t ret;
+
+	if ((ret = ::splice(in_fd, NULL, out_fd, NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) < 0) {
+		if (errno != EAGAIN) {
+			logger::instance().perror(logger::LOG_INFO, "splice");
+		}
+
+		return -1;
+	}
+
+	return ret;
+}
+#endif // HAVE_SPLICE
@@ -0,0 +1,21 @@
+#ifndef SPLICER_H
+#define SPLICER_H
+
+#include <sys/types.h>
+
+// Moves data between a socket and a pipe without copying it to user
+// space (available if HAVE_SPLICE is defined).
+class splicer {
+	public:
+		// Create pipe.
+		static bool create_pipe(int fds[2]);
+
+		// Close pipe.
+		static void close_pipe(int fds[2]);
+
+		// Move up to 'count' bytes from 'in_fd' to 'out_fd' (one of
+		// them must be a pipe).
+		static ssize_t splice(int in_fd, int out_fd, size_t count);
+};
+
+#endif // SPLICER_H
@@ -3,6 +3,7 @@
 #include "tcp_connection.h"
 #include "net/tcp_server.h"
 #include "net/filesender.h"
+#include "net/splicer.h"
 #include "logger/logger.h"
 #include "util/now.h"
 #include "macros/macros.h"
@@ -206,7 +207,7 @@ bool tcp_connection::writev(unsigned fd, const socket_wrapper::io_vector* io_vec
 	return true;
 }
 
-bool tcp_connection::sendfile(unsigned fd, unsigned in_fd, off_t filesize, const range_list* ranges, size_t nrange, size_t& total)
+bool tcp_connection::sendfile(unsigned fd, unsigned in_fd, off_t filesize, const range_list* ranges, size_t nrange, size_t& total, off_t limit, off_t offset)
 {
 	// Get the number of bytes to send.
 	off_t count;
@@ -219,6 +220,11 @@ bool tcp_connection::sendfile(unsigned fd, unsigned in_fd, off_t filesize, const
 		count = range->to - _M_outp + 1;
 	}
 
+	// Don't send beyond 'limit' (if set).
+	if ((limit >= 0) && (limit - _M_outp < count)) {
+		count = limit - _M_outp;
+	}
+
 	if (_M_max_write > 0) {
 		count = MIN(count, (off_t) (_M_max_write - total));
 
@@ -234,7 +240,14 @@ bool tcp_connection::sendfile(unsigned fd, unsigned in_fd, off_t filesize, const
 	off_t outp = _M_outp;
 
 	// Send.
-	ssize_t ret = filesender::sendfile(fd, in_fd, &_M_outp, count, filesize);
+	ssize_t ret;
+	if (offset == 0) {
+		ret = filesender::sendfile(fd, in_fd, &_M_outp, count, filesize);
+	} else {
+		off_t off = offset + _M_outp;
+		ret = filesender::sendfile(fd, in_fd, &off, count, offset + filesize);
+		_M_outp = off - offset;
+	}
 	if (ret < 0) {
 		if (errno == EAGAIN) {
 			logger::instance().log(logger::LOG_DEBUG, "[tcp_connection::sendfile] (fd %d) EAGAIN.", fd);
@@ -278,3 +291,102 @@ bool tcp_connection::sendfile(unsigned fd, unsigned in_fd, off_t filesize, const
 
 	return true;
 }
+
+#if HAVE_SPLICE
+tcp_connection::io_result tcp_connection::splice_in(unsigned fd, int pipe, size_t& count, size_t& total)
+{
+	if (_M_max_read > 0) {
+		count = MIN(count, _M_max_read - total);
+
+		// If we have received too much already...
+		if (count == 0) {
+			logger::instance().log(logger::LOG_DEBUG, "[tcp_connection::splice_in] (fd %d) Received too much data.", fd);
+
+			_M_in_ready_list = 1;
+			return IO_NO_DATA_READ;
+		}
+	}
+
+	ssize_t ret = splicer::splice(fd, pipe, count);
+	if (ret < 0) {
+		count = 0;
+
+		if (errno == EAGAIN) {
+			logger::instance().log(logger::LOG_DEBUG, "[tcp_connection::splice_in] (fd %d) EAGAIN.", fd);
+
+			// Either there is no data to read or the pipe is full (the
+			// socket stays readable then).
+			if (!socket_wrapper::has_data(fd)) {
+				_M_readable = 0;
+			}
+
+			return IO_NO_DATA_READ;
+		} else if (errno == EINTR) {
+			logger::instance().log(logger::LOG_DEBUG, "[tcp_connection::splice_in] (fd %d) EINTR.", fd);
+
+			_M_in_ready_list = 1;
+			return IO_NO_DATA_READ;
+		} else {
+			logger::instance().log(logger::LOG_DEBUG, "[tcp_connection::splice_in] (fd %d) errno = %d.", fd, errno);
+			return IO_ERROR;
+		}
+	} else if (ret == 0) {
+		// The peer has performed an orderly shutdown.
+		logger::instance().log(logger::LOG_DEBUG, "[tcp_connection::splice_in] (fd %d) Connection closed by peer.", fd);
+
+		count = 0;
+		return IO_ERROR;
+	} else {
+		logger::instance().log(logger::LOG_DEBUG, "[tcp_connection::splice_in] (fd %d) Received %d bytes.", fd, ret);
+
+		_M_timestamp = now::_M_time;
+
+		count = ret;
+		total += ret;
+
+		return IO_SUCCESS;
+	}
+}
+
+bool tcp_connection::splice_out(unsigned fd, int pipe, size_t& count, size_t& total)
+{
+	if (_M_max_write > 0) {
+		count = MIN(count, _M_max_write - total);
+
+		// If we have sent too much already...
+		if (count == 0) {
+			logger::instance().log(logger::LOG_DEBUG, "[tcp_connection::splice_out] (fd %d) Sent too much data.", fd);
+
+			_M_in_ready_list = 1;
+			return true;
+		}
+	}
+
+	ssize_t ret = splicer::splice(pipe, fd, count);
+	if (ret < 0) {
+		count = 0;
+
+		if (errno == EAGAIN) {
+			logger::instance().log(logger::LOG_DEBUG, "[tcp_connection::splice_out] (fd %d) EAGAIN.", fd);
+
+			_M_writable = 0;
+		} else if (errno == EINTR) {
+			logger::instance().log(logger::LOG_DEBUG, "[tcp_connection::splice_out] (fd %d) EINTR.", fd);
+
+			_M_in_ready_list = 1;
+		} else {
+			logger::instance().log(logger::LOG_DEBUG, "[tcp_connection::splice_out] (fd %d) errno = %d.", fd, errno);
+			return false;
+		}
+	} else {
+		logger::instance().log(logger::LOG_DEBUG, "[tcp_connection::splice_out] (fd %d) Sent %d bytes.", fd, ret);
+
+		_M_timestamp = now::_M_time;
+
+		count = ret;
+		total += ret;
+	}
+
+	return true;
+}
+#endif // HAVE_SPLICE
@@ -68,9 +68,19 @@ struct tcp_connection {
 	bool writev(unsigned fd, const buffer** bufs, unsigned nbufs, size_t& total);
 	bool writev(unsigned fd, const socket_wrapper::io_vector* io_vector, unsigned iovcnt, size_t& total);
 
-	// Send file.
+	// Send file (offset: offset of the file's data in 'in_fd').
 	bool sendfile(unsigned fd, unsigned in_fd, off_t filesize, size_t& total);
-	bool sendfile(unsigned fd, unsigned in_fd, off_t filesize, const range_list* ranges, size_t nrange, size_t& total);
+	bool sendfile(unsigned fd, unsigned in_fd, off_t filesize, const range_list* ranges, size_t nrange, size_t& total, off_t limit = -1, off_t offset = 0);
+
+#if HAVE_SPLICE
+	// Move up to 'count' bytes from the socket to a pipe ('count' is
+	// set to the number of bytes moved).
+	io_result splice_in(unsigned fd, int pipe, size_t& count, size_t& total);
+
+	// Move up to 'count' bytes from a pipe to the socket ('count' is
+	// set to the number of bytes moved).
+	bool splice_out(unsigned fd, int pipe, size_t& count, size_t& total);
+#endif // HAVE_SPLICE
 
 	// Loop.
 	virtual bool loop(unsigned fd) = 0;
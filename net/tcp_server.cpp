@@ -96,7 +96,15 @@ void tcp_server::start()
 
 		process_ready_list();
 
-		wait_for_event();
+		// Don't block if connections have been added to the ready list.
+		int timeout;
+		if (_M_nready > 0) {
+			wait_for_event(0);
+		} else if ((timeout = get_wait_timeout()) >= 0) {
+			wait_for_event(timeout);
+		} else {
+			wait_for_event();
+		}
 	} while (!_M_must_stop);
 
 	logger::instance().log(logger::LOG_INFO, "Server stopped.");
@@ -91,6 +91,10 @@ class tcp_server : protected selector {
 
 		// Handle alarm.
 		virtual void handle_alarm();
+
+		// How long to wait for events at most [milliseconds] (-1: no
+		// limit).
+		virtual int get_wait_timeout();
 };
 
 inline void tcp_server::stop()
@@ -103,6 +107,11 @@ inline void tcp_server::on_alarm()
 	_M_handle_alarm = true;
 }
 
+inline int tcp_server::get_wait_timeout()
+{
+	return -1;
+}
+
 inline unsigned short tcp_server::get_port() const
 {
 	return _M_port;
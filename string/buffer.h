@@ -56,6 +56,9 @@ class buffer {
 		bool format(const char* format, ...);
 		bool vformat(const char* format, va_list ap);
 
+		// Swap contents with another buffer.
+		void swap(buffer& other);
+
 	protected:
 		char* _M_data;
 		size_t _M_size;
@@ -194,4 +197,19 @@ inline bool buffer::format(const char* format, ...)
 	return ret;
 }
 
+inline void buffer::swap(buffer& other)
+{
+	char* data = _M_data;
+	_M_data = other._M_data;
+	other._M_data = data;
+
+	size_t size = _M_size;
+	_M_size = other._M_size;
+	other._M_size = size;
+
+	size_t used = _M_used;
+	_M_used = other._M_used;
+	other._M_used = used;
+}
+
 #endif // BUFFER_H
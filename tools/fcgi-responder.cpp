@@ -0,0 +1,360 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Minimal FastCGI responder (one thread per connection), used to
+// benchmark the FastCGI handler without a real application.
+
+static const unsigned char FCGI_VERSION_1 = 1;
+
+static const unsigned char FCGI_BEGIN_REQUEST = 1;
+static const unsigned char FCGI_END_REQUEST = 3;
+static const unsigned char FCGI_PARAMS = 4;
+static const unsigned char FCGI_STDIN = 5;
+static const unsigned char FCGI_STDOUT = 6;
+static const unsigned char FCGI_GET_VALUES = 9;
+static const unsigned char FCGI_GET_VALUES_RESULT = 10;
+
+static const unsigned char FCGI_KEEP_CONN = 1;
+
+static const size_t FCGI_HEADER_LEN = 8;
+static const size_t MAX_CONTENT_LENGTH = 65535;
+
+static const unsigned short DEFAULT_PORT = 9000;
+static const size_t DEFAULT_RESPONSE_SIZE = 1024;
+static const unsigned DEFAULT_MAX_CONNS = 8;
+
+static char* response = NULL;
+static size_t response_size = DEFAULT_RESPONSE_SIZE;
+
+static unsigned max_conns = DEFAULT_MAX_CONNS;
+static unsigned nconns = 0;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static void print_usage(const char* program);
+static bool parse_number(const char* s, unsigned long& n);
+static void* serve(void* arg);
+static bool read_all(int fd, void* buf, size_t count);
+static bool write_all(int fd, const void* buf, size_t count);
+static bool write_record(int fd, unsigned char type, unsigned short requestId, const void* buf, size_t len);
+static bool get_values_result(int fd);
+static bool respond(int fd, unsigned short requestId);
+
+int main(int argc, char** argv)
+{
+	unsigned short port = DEFAULT_PORT;
+
+	int i = 1;
+	while (i < argc) {
+		unsigned long n;
+
+		if ((i + 1 == argc) || (!parse_number(argv[i + 1], n))) {
+			print_usage(argv[0]);
+			return -1;
+		}
+
+		if (strcasecmp(argv[i], "--port") == 0) {
+			if ((n == 0) || (n > 65535)) {
+				print_usage(argv[0]);
+				return -1;
+			}
+
+			port = (unsigned short) n;
+		} else if (strcasecmp(argv[i], "--size") == 0) {
+			response_size = n;
+		} else if (strcasecmp(argv[i], "--max-conns") == 0) {
+			if ((n == 0) || (n > 65535)) {
+				print_usage(argv[0]);
+				return -1;
+			}
+
+			max_conns = (unsigned) n;
+		} else {
+			print_usage(argv[0]);
+			return -1;
+		}
+
+		i += 2;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	static const char content_type[] = "Content-Type: text/plain\r\n\r\n";
+
+	if ((response = (char*) malloc(sizeof(content_type) - 1 + response_size)) == NULL) {
+		fprintf(stderr, "Couldn't allocate memory.\n");
+		return -1;
+	}
+
+	memcpy(response, content_type, sizeof(content_type) - 1);
+	memset(response + sizeof(content_type) - 1, 'x', response_size);
+	response_size += sizeof(content_type) - 1;
+
+	int sd;
+	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	int optval = 1;
+	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	if ((bind(sd, (const struct sockaddr*) &addr, sizeof(struct sockaddr_in)) < 0) || (listen(sd, SOMAXCONN) < 0)) {
+		perror("bind/listen");
+		close(sd);
+		return -1;
+	}
+
+	printf("Listening on 127.0.0.1:%u (response size: %lu, max. connections: %u).\n", port, (unsigned long) response_size, max_conns);
+	fflush(stdout);
+
+	do {
+		// Like a pool of application processes, let the connections
+		// wait in the backlog when all the workers are busy.
+		pthread_mutex_lock(&mutex);
+
+		while (nconns == max_conns) {
+			pthread_cond_wait(&cond, &mutex);
+		}
+
+		pthread_mutex_unlock(&mutex);
+
+		int fd;
+		if ((fd = accept(sd, NULL, NULL)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			perror("accept");
+			break;
+		}
+
+		optval = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(int));
+
+		pthread_mutex_lock(&mutex);
+		nconns++;
+		pthread_mutex_unlock(&mutex);
+
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+		if (pthread_create(&thread, &attr, serve, (void*) (long) fd) != 0) {
+			close(fd);
+
+			pthread_mutex_lock(&mutex);
+			nconns--;
+			pthread_mutex_unlock(&mutex);
+		}
+
+		pthread_attr_destroy(&attr);
+	} while (true);
+
+	close(sd);
+
+	free(response);
+
+	return 0;
+}
+
+void print_usage(const char* program)
+{
+	fprintf(stderr, "%s [--port <port>] [--size <response_size>] [--max-conns <max_connections>]\n", program);
+}
+
+bool parse_number(const char* s, unsigned long& n)
+{
+	char* end;
+	errno = 0;
+	n = strtoul(s, &end, 10);
+
+	return ((*s >= '0') && (*s <= '9') && (*end == 0) && (errno == 0));
+}
+
+void* serve(void* arg)
+{
+	int fd = (int) (long) arg;
+
+	unsigned char buf[FCGI_HEADER_LEN + MAX_CONTENT_LENGTH + 255];
+
+	unsigned short requestId = 0;
+	bool keep_conn = false;
+	bool active = false;
+
+	unsigned nrequests = 0;
+
+	do {
+		if (!read_all(fd, buf, FCGI_HEADER_LEN)) {
+			break;
+		}
+
+		if (buf[0] != FCGI_VERSION_1) {
+			fprintf(stderr, "Invalid version %u.\n", buf[0]);
+			break;
+		}
+
+		unsigned char type = buf[1];
+		unsigned short id = (buf[2] << 8) | buf[3];
+		size_t len = ((buf[4] << 8) | buf[5]) + buf[6];
+
+		if (!read_all(fd, buf + FCGI_HEADER_LEN, len)) {
+			break;
+		}
+
+		if (type == FCGI_GET_VALUES) {
+			if (!get_values_result(fd)) {
+				break;
+			}
+		} else if (type == FCGI_BEGIN_REQUEST) {
+			requestId = id;
+			keep_conn = ((len >= 3) && ((buf[FCGI_HEADER_LEN + 2] & FCGI_KEEP_CONN) != 0));
+			active = true;
+		} else if (type == FCGI_STDIN) {
+			// End of the stdin stream?
+			if ((active) && (id == requestId) && (len == buf[6])) {
+				if (!respond(fd, requestId)) {
+					break;
+				}
+
+				active = false;
+				nrequests++;
+
+				if (!keep_conn) {
+					break;
+				}
+			}
+		} else if (type != FCGI_PARAMS) {
+			fprintf(stderr, "Ignoring record of type %u.\n", type);
+		}
+	} while (true);
+
+	close(fd);
+
+	pthread_mutex_lock(&mutex);
+
+	printf("Connection closed after %u request(s) (%u connection(s) open).\n", nrequests, nconns - 1);
+	fflush(stdout);
+
+	if (nconns-- == max_conns) {
+		pthread_cond_signal(&cond);
+	}
+
+	pthread_mutex_unlock(&mutex);
+
+	return NULL;
+}
+
+bool read_all(int fd, void* buf, size_t count)
+{
+	size_t n = 0;
+	while (n < count) {
+		ssize_t ret = read(fd, (char*) buf + n, count - n);
+		if (ret <= 0) {
+			if ((ret < 0) && (errno == EINTR)) {
+				continue;
+			}
+
+			return false;
+		}
+
+		n += ret;
+	}
+
+	return true;
+}
+
+bool write_all(int fd, const void* buf, size_t count)
+{
+	size_t n = 0;
+	while (n < count) {
+		ssize_t ret = write(fd, (const char*) buf + n, count - n);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return false;
+		}
+
+		n += ret;
+	}
+
+	return true;
+}
+
+bool write_record(int fd, unsigned char type, unsigned short requestId, const void* buf, size_t len)
+{
+	unsigned char header[FCGI_HEADER_LEN];
+	header[0] = FCGI_VERSION_1;
+	header[1] = type;
+	header[2] = (requestId >> 8) & 0xff;
+	header[3] = requestId & 0xff;
+	header[4] = (len >> 8) & 0xff;
+	header[5] = len & 0xff;
+	header[6] = 0;
+	header[7] = 0;
+
+	return ((write_all(fd, header, sizeof(header))) && (write_all(fd, buf, len)));
+}
+
+bool get_values_result(int fd)
+{
+	char values[128];
+	char num[16];
+	size_t len = 0;
+
+	const char* names[] = {"FCGI_MAX_CONNS", "FCGI_MAX_REQS", "FCGI_MPXS_CONNS"};
+	for (size_t i = 0; i < sizeof(names) / sizeof(const char*); i++) {
+		size_t namelen = strlen(names[i]);
+		size_t valuelen = (i < 2) ? snprintf(num, sizeof(num), "%u", max_conns) : snprintf(num, sizeof(num), "0");
+
+		values[len++] = (char) namelen;
+		values[len++] = (char) valuelen;
+
+		memcpy(values + len, names[i], namelen);
+		len += namelen;
+
+		memcpy(values + len, num, valuelen);
+		len += valuelen;
+	}
+
+	return write_record(fd, FCGI_GET_VALUES_RESULT, 0, values, len);
+}
+
+bool respond(int fd, unsigned short requestId)
+{
+	for (size_t offset = 0; offset < response_size; offset += MAX_CONTENT_LENGTH) {
+		size_t len = response_size - offset;
+		if (len > MAX_CONTENT_LENGTH) {
+			len = MAX_CONTENT_LENGTH;
+		}
+
+		if (!write_record(fd, FCGI_STDOUT, requestId, response + offset, len)) {
+			return false;
+		}
+	}
+
+	// End of the stdout stream and FCGI_REQUEST_COMPLETE.
+	static const unsigned char end[] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+	return ((write_record(fd, FCGI_STDOUT, requestId, NULL, 0)) && (write_record(fd, FCGI_END_REQUEST, requestId, end, sizeof(end))));
+}
@@ -0,0 +1,644 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "http/site_bundle.h"
+#include "mime/mime_types.h"
+#include "string/buffer.h"
+
+#define MIME_TYPES_FILE "mime.types"
+#define INDEX_FILE "index.html"
+
+static const size_t RECORD_ALLOC = 256;
+static const size_t PAGE_SIZE = 4096;
+
+enum record_type {
+	FILE_RECORD,
+	DIRECTORY_RECORD,
+	INDEX_RECORD // Directory with trailing '/' (points to the index file).
+};
+
+struct record {
+	record_type type;
+
+	size_t path; // Offset in 'paths'.
+	unsigned pathlen;
+
+	off_t size;
+	time_t mtime;
+
+	int target; // Index file (INDEX_RECORD).
+	int gzip; // Precompressed variant (-1: none).
+
+	unsigned long long offset;
+};
+
+static record* records = NULL;
+static size_t nrecords = 0;
+static size_t nallocated = 0;
+
+// Hash table of the files (record index + 1, 0: empty bucket).
+static unsigned* files = NULL;
+static unsigned nfiles_buckets = 0;
+
+static buffer paths;
+
+static mime_types types;
+
+static const char* index_files[32];
+static size_t nindex_files = 0;
+
+static void print_usage(const char* program);
+static bool add_record(record_type type, const char* path, size_t pathlen, off_t size, time_t mtime);
+static bool walk(char* path, size_t rootlen, size_t pathlen);
+static bool build_file_index();
+static int find_file(const char* path, size_t pathlen);
+static void resolve();
+static bool write_bundle(const char* root, size_t rootlen, const char* filename);
+static bool copy_file(int out, const char* filename, off_t size);
+static bool write_all(int fd, const void* buf, size_t count);
+
+int main(int argc, char** argv)
+{
+	const char* mime_types_file = NULL;
+
+	int i = 1;
+	while (i < argc - 2) {
+		if (strcasecmp(argv[i], "--mime") == 0) {
+			if (mime_types_file) {
+				print_usage(argv[0]);
+				return -1;
+			}
+
+			mime_types_file = argv[i + 1];
+
+			i += 2;
+		} else if (strcasecmp(argv[i], "--index") == 0) {
+			if (nindex_files == sizeof(index_files) / sizeof(const char*)) {
+				print_usage(argv[0]);
+				return -1;
+			}
+
+			index_files[nindex_files++] = argv[i + 1];
+
+			i += 2;
+		} else {
+			print_usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (i != argc - 2) {
+		print_usage(argv[0]);
+		return -1;
+	}
+
+	if (nindex_files == 0) {
+		index_files[nindex_files++] = INDEX_FILE;
+	}
+
+	if (!types.load(mime_types_file ? mime_types_file : MIME_TYPES_FILE)) {
+		fprintf(stderr, "Couldn't load MIME types.\n");
+		return -1;
+	}
+
+	const char* root = argv[i];
+	size_t rootlen = strlen(root);
+	while ((rootlen > 1) && (root[rootlen - 1] == '/')) {
+		rootlen--;
+	}
+
+	char path[PATH_MAX + 1];
+	if (rootlen >= sizeof(path)) {
+		fprintf(stderr, "Path too long (%s).\n", root);
+		return -1;
+	}
+
+	memcpy(path, root, rootlen);
+	path[rootlen] = 0;
+
+	if ((!add_record(INDEX_RECORD, "/", 1, 0, 0)) || (!walk(path, rootlen, rootlen)) || (!build_file_index())) {
+		return -1;
+	}
+
+	resolve();
+
+	if (!write_bundle(root, rootlen, argv[i + 1])) {
+		return -1;
+	}
+
+	size_t nfiles = 0;
+	for (size_t j = 0; j < nrecords; j++) {
+		if (records[j].type == FILE_RECORD) {
+			nfiles++;
+		}
+	}
+
+	printf("%lu files written to %s.\n", nfiles, argv[i + 1]);
+
+	free(files);
+	free(records);
+
+	return 0;
+}
+
+void print_usage(const char* program)
+{
+	fprintf(stderr, "%s [--mime <mime_types_file>] [--index <index_file>]... <document_root> <bundle>\n", program);
+}
+
+bool add_record(record_type type, const char* path, size_t pathlen, off_t filesize, time_t mtime)
+{
+	if (nrecords == nallocated) {
+		size_t n = (nallocated == 0) ? RECORD_ALLOC : 2 * nallocated;
+		record* r = (record*) realloc(records, n * sizeof(record));
+		if (!r) {
+			fprintf(stderr, "Couldn't allocate memory.\n");
+			return false;
+		}
+
+		records = r;
+		nallocated = n;
+	}
+
+	record* record = &(records[nrecords]);
+
+	record->type = type;
+
+	record->path = paths.count();
+	record->pathlen = pathlen;
+
+	if (!paths.append(path, pathlen)) {
+		fprintf(stderr, "Couldn't allocate memory.\n");
+		return false;
+	}
+
+	record->size = filesize;
+	record->mtime = mtime;
+
+	record->target = -1;
+	record->gzip = -1;
+
+	record->offset = 0;
+
+	nrecords++;
+
+	return true;
+}
+
+bool walk(char* path, size_t rootlen, size_t pathlen)
+{
+	DIR* d = opendir(path);
+	if (!d) {
+		fprintf(stderr, "Couldn't open directory (%s).\n", path);
+		return false;
+	}
+
+	struct dirent* entry;
+	while ((entry = readdir(d)) != NULL) {
+		// Skip hidden files.
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		size_t namelen = strlen(entry->d_name);
+		if (pathlen + 1 + namelen + 1 > PATH_MAX) {
+			fprintf(stderr, "Path too long (%.*s/%s).\n", (int) pathlen, path, entry->d_name);
+			closedir(d);
+
+			return false;
+		}
+
+		path[pathlen] = '/';
+		memcpy(path + pathlen + 1, entry->d_name, namelen + 1);
+
+		size_t len = pathlen + 1 + namelen;
+
+		struct stat buf;
+		if (stat(path, &buf) < 0) {
+			fprintf(stderr, "Couldn't stat (%s).\n", path);
+			closedir(d);
+
+			return false;
+		}
+
+		const char* urlpath = path + rootlen;
+		size_t urlpathlen = len - rootlen;
+
+		if (S_ISDIR(buf.st_mode)) {
+			if (!add_record(DIRECTORY_RECORD, urlpath, urlpathlen, 0, buf.st_mtime)) {
+				closedir(d);
+				return false;
+			}
+
+			path[len] = '/';
+			path[len + 1] = 0;
+
+			if ((!add_record(INDEX_RECORD, urlpath, urlpathlen + 1, 0, 0)) || (!walk(path, rootlen, len))) {
+				closedir(d);
+				return false;
+			}
+		} else if (S_ISREG(buf.st_mode)) {
+			if (!add_record(FILE_RECORD, urlpath, urlpathlen, buf.st_size, buf.st_mtime)) {
+				closedir(d);
+				return false;
+			}
+		}
+
+		path[pathlen] = 0;
+	}
+
+	closedir(d);
+
+	path[pathlen] = 0;
+
+	return true;
+}
+
+bool build_file_index()
+{
+	nfiles_buckets = 16;
+	while (nfiles_buckets < 2 * nrecords) {
+		nfiles_buckets *= 2;
+	}
+
+	if ((files = (unsigned*) calloc(nfiles_buckets, sizeof(unsigned))) == NULL) {
+		fprintf(stderr, "Couldn't allocate memory.\n");
+		return false;
+	}
+
+	for (size_t i = 0; i < nrecords; i++) {
+		if (records[i].type == FILE_RECORD) {
+			unsigned idx = site_bundle::hash(paths.data() + records[i].path, records[i].pathlen) & (nfiles_buckets - 1);
+			while (files[idx] != 0) {
+				idx = (idx + 1) & (nfiles_buckets - 1);
+			}
+
+			files[idx] = i + 1;
+		}
+	}
+
+	return true;
+}
+
+int find_file(const char* path, size_t pathlen)
+{
+	unsigned idx = site_bundle::hash(path, pathlen) & (nfiles_buckets - 1);
+
+	while (files[idx] != 0) {
+		const record* record = &(records[files[idx] - 1]);
+		if ((record->pathlen == pathlen) && (memcmp(paths.data() + record->path, path, pathlen) == 0)) {
+			return files[idx] - 1;
+		}
+
+		idx = (idx + 1) & (nfiles_buckets - 1);
+	}
+
+	return -1;
+}
+
+void resolve()
+{
+	char path[PATH_MAX + 4];
+
+	for (size_t i = 0; i < nrecords; i++) {
+		record* record = &(records[i]);
+		const char* recordpath = paths.data() + record->path;
+
+		if (record->type == INDEX_RECORD) {
+			// Look for the index file.
+			for (size_t j = 0; j < nindex_files; j++) {
+				size_t len = strlen(index_files[j]);
+				if (record->pathlen + len >= sizeof(path)) {
+					continue;
+				}
+
+				memcpy(path, recordpath, record->pathlen);
+				memcpy(path + record->pathlen, index_files[j], len);
+
+				if ((record->target = find_file(path, record->pathlen + len)) != -1) {
+					break;
+				}
+			}
+		} else if (record->type == FILE_RECORD) {
+			// Look for the precompressed variant.
+			if (record->pathlen + 3 < sizeof(path)) {
+				memcpy(path, recordpath, record->pathlen);
+				memcpy(path + record->pathlen, ".gz", 3);
+
+				record->gzip = find_file(path, record->pathlen + 3);
+			}
+		}
+	}
+}
+
+bool write_bundle(const char* root, size_t rootlen, const char* filename)
+{
+	// Directories without index file are not found.
+	size_t nentries = 0;
+	for (size_t i = 0; i < nrecords; i++) {
+		if ((records[i].type != INDEX_RECORD) || (records[i].target != -1)) {
+			nentries++;
+		}
+	}
+
+	unsigned nbuckets = 16;
+	while (nbuckets < 2 * nentries) {
+		nbuckets *= 2;
+	}
+
+	// Build entries and strings.
+	site_bundle::entry* entries = (site_bundle::entry*) calloc(nentries, sizeof(site_bundle::entry));
+	unsigned* buckets = (unsigned*) calloc(nbuckets, sizeof(unsigned));
+	if ((!entries) || (!buckets)) {
+		fprintf(stderr, "Couldn't allocate memory.\n");
+		return false;
+	}
+
+	buffer strings(64 * 1024);
+
+	unsigned long long strings_offset = sizeof(site_bundle::header) + (unsigned long long) nbuckets * sizeof(unsigned) + (unsigned long long) nentries * sizeof(site_bundle::entry);
+
+	// First compute the size of the strings, so we know where the data
+	// begins.
+	for (int pass = 0; pass < 2; pass++) {
+		unsigned long long data = strings_offset + strings.count();
+		data = (data + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+
+		strings.reset();
+
+		for (size_t i = 0; i < nrecords; i++) {
+			if (records[i].type == FILE_RECORD) {
+				records[i].offset = data;
+				data += records[i].size;
+			}
+		}
+
+		size_t n = 0;
+		for (size_t i = 0; i < nrecords; i++) {
+			record* record = &(records[i]);
+			const char* path = paths.data() + record->path;
+
+			if ((record->type == INDEX_RECORD) && (record->target == -1)) {
+				continue;
+			}
+
+			site_bundle::entry* entry = &(entries[n++]);
+			memset(entry, 0, sizeof(site_bundle::entry));
+
+			entry->hash = site_bundle::hash(path, record->pathlen);
+
+			entry->path = strings.count();
+			entry->pathlen = record->pathlen;
+
+			if (!strings.append(path, record->pathlen)) {
+				fprintf(stderr, "Couldn't allocate memory.\n");
+				return false;
+			}
+
+			if (record->type == DIRECTORY_RECORD) {
+				entry->flags = site_bundle::DIRECTORY;
+				entry->mtime = record->mtime;
+
+				continue;
+			}
+
+			// The index file of a directory is served by the directory.
+			const struct record* file = (record->type == INDEX_RECORD) ? &(records[record->target]) : record;
+			const char* filepath = paths.data() + file->path;
+
+			entry->mtime = file->mtime;
+			entry->offset = file->offset;
+			entry->size = file->size;
+
+			if (file->gzip != -1) {
+				entry->gzip_offset = records[file->gzip].offset;
+				entry->gzip_size = records[file->gzip].size;
+			}
+
+			// MIME type.
+			const char* extension = NULL;
+			unsigned short extensionlen = 0;
+
+			const char* end = filepath + file->pathlen;
+			const char* ptr = end;
+			while ((ptr > filepath) && (*(ptr - 1) != '/')) {
+				if (*(ptr - 1) == '.') {
+					extension = ptr;
+					extensionlen = end - extension;
+					break;
+				}
+
+				ptr--;
+			}
+
+			const char* type;
+			unsigned short typelen;
+			if ((extension) && (extensionlen > 0)) {
+				type = types.get_mime_type(extension, extensionlen, typelen);
+			} else {
+				type = mime_types::DEFAULT_MIME_TYPE;
+				typelen = mime_types::DEFAULT_MIME_TYPE_LEN;
+			}
+
+			entry->type = strings.count();
+			entry->typelen = typelen;
+
+			if (!strings.append(type, typelen)) {
+				fprintf(stderr, "Couldn't allocate memory.\n");
+				return false;
+			}
+
+			// ETag.
+			char etag[64];
+			int etaglen = snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long) file->mtime, (unsigned long long) file->size);
+
+			entry->etag = strings.count();
+			entry->etaglen = etaglen;
+
+			if (!strings.append(etag, etaglen)) {
+				fprintf(stderr, "Couldn't allocate memory.\n");
+				return false;
+			}
+
+			// Header lines.
+			entry->headers = strings.count();
+
+			if ((!strings.append("ETag: ", 6)) || (!strings.append(etag, etaglen)) || (!strings.append("\r\n", 2))) {
+				fprintf(stderr, "Couldn't allocate memory.\n");
+				return false;
+			}
+
+			if (file->gzip != -1) {
+				if (!strings.append("Vary: Accept-Encoding\r\n", 23)) {
+					fprintf(stderr, "Couldn't allocate memory.\n");
+					return false;
+				}
+			}
+
+			entry->headerslen = strings.count() - entry->headers;
+
+			if (file->gzip != -1) {
+				const struct record* gzip = &(records[file->gzip]);
+
+				etaglen = snprintf(etag, sizeof(etag), "\"%llx-%llx-gz\"", (unsigned long long) gzip->mtime, (unsigned long long) gzip->size);
+
+				entry->gzip_etag = strings.count();
+				entry->gzip_etaglen = etaglen;
+
+				if (!strings.append(etag, etaglen)) {
+					fprintf(stderr, "Couldn't allocate memory.\n");
+					return false;
+				}
+
+				entry->gzip_headers = strings.count();
+
+				if ((!strings.append("ETag: ", 6)) || (!strings.append(etag, etaglen)) || (!strings.append("\r\nVary: Accept-Encoding\r\nContent-Encoding: gzip\r\n", 49))) {
+					fprintf(stderr, "Couldn't allocate memory.\n");
+					return false;
+				}
+
+				entry->gzip_headerslen = strings.count() - entry->gzip_headers;
+			}
+		}
+	}
+
+	// Build hash table.
+	for (size_t i = 0; i < nentries; i++) {
+		unsigned idx = entries[i].hash & (nbuckets - 1);
+		while (buckets[idx] != 0) {
+			idx = (idx + 1) & (nbuckets - 1);
+		}
+
+		buckets[idx] = i + 1;
+	}
+
+	site_bundle::header header;
+	memset(&header, 0, sizeof(header));
+
+	memcpy(header.magic, site_bundle::MAGIC, sizeof(header.magic));
+	header.version = site_bundle::VERSION;
+	header.nentries = nentries;
+	header.nbuckets = nbuckets;
+	header.strings = strings_offset;
+	header.data = (strings_offset + strings.count() + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+
+	// Write to a temporary file which replaces the bundle atomically.
+	char tmpfile[PATH_MAX + 1];
+	if (snprintf(tmpfile, sizeof(tmpfile), "%s.XXXXXX", filename) >= (int) sizeof(tmpfile)) {
+		fprintf(stderr, "Path too long (%s).\n", filename);
+		return false;
+	}
+
+	int fd = mkstemp(tmpfile);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't create file (%s).\n", tmpfile);
+		return false;
+	}
+
+	bool ret = write_all(fd, &header, sizeof(header));
+	ret = ret && write_all(fd, buckets, nbuckets * sizeof(unsigned));
+	ret = ret && write_all(fd, entries, nentries * sizeof(site_bundle::entry));
+	ret = ret && write_all(fd, strings.data(), strings.count());
+
+	if (ret) {
+		// Padding.
+		static const char zeros[PAGE_SIZE] = {0};
+		ret = write_all(fd, zeros, header.data - strings_offset - strings.count());
+	}
+
+	char path[PATH_MAX + 1];
+
+	for (size_t i = 0; (ret) && (i < nrecords); i++) {
+		if (records[i].type != FILE_RECORD) {
+			continue;
+		}
+
+		if (rootlen + records[i].pathlen >= sizeof(path)) {
+			ret = false;
+			break;
+		}
+
+		memcpy(path, root, rootlen);
+		memcpy(path + rootlen, paths.data() + records[i].path, records[i].pathlen);
+		path[rootlen + records[i].pathlen] = 0;
+
+		ret = copy_file(fd, path, records[i].size);
+	}
+
+	free(entries);
+	free(buckets);
+
+	if ((!ret) || (fchmod(fd, 0644) < 0) || (fsync(fd) < 0)) {
+		fprintf(stderr, "Couldn't write bundle (%s).\n", tmpfile);
+
+		close(fd);
+		unlink(tmpfile);
+
+		return false;
+	}
+
+	close(fd);
+
+	if (rename(tmpfile, filename) < 0) {
+		fprintf(stderr, "Couldn't rename %s to %s.\n", tmpfile, filename);
+		unlink(tmpfile);
+
+		return false;
+	}
+
+	return true;
+}
+
+bool copy_file(int out, const char* filename, off_t size)
+{
+	int in = open(filename, O_RDONLY);
+	if (in < 0) {
+		fprintf(stderr, "Couldn't open file (%s).\n", filename);
+		return false;
+	}
+
+	char buf[64 * 1024];
+	off_t total = 0;
+
+	ssize_t ret;
+	while ((total < size) && ((ret = read(in, buf, (size - total < (off_t) sizeof(buf)) ? size - total : sizeof(buf))) > 0)) {
+		if (!write_all(out, buf, ret)) {
+			close(in);
+			return false;
+		}
+
+		total += ret;
+	}
+
+	close(in);
+
+	// Has the file been truncated while packing?
+	if (total != size) {
+		fprintf(stderr, "File %s has been modified.\n", filename);
+		return false;
+	}
+
+	return true;
+}
+
+bool write_all(int fd, const void* buf, size_t count)
+{
+	const char* ptr = (const char*) buf;
+
+	while (count > 0) {
+		ssize_t ret = write(fd, ptr, count);
+		if (ret <= 0) {
+			return false;
+		}
+
+		ptr += ret;
+		count -= ret;
+	}
+
+	return true;
+}
@@ -0,0 +1,24 @@
+#ifndef FNV_H
+#define FNV_H
+
+#include <stddef.h>
+
+struct fnv {
+	// FNV-1a hash ('h': hash of the preceding data, to hash several
+	// pieces as one).
+	static unsigned hash(const void* data, size_t len, unsigned h = 2166136261u);
+};
+
+inline unsigned fnv::hash(const void* data, size_t len, unsigned h)
+{
+	const unsigned char* p = (const unsigned char*) data;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+#endif // FNV_H
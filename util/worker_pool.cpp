@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include "worker_pool.h"
+#include "logger/logger.h"
+
+const unsigned worker_pool::DEFAULT_THREADS = 2;
+const unsigned worker_pool::MAX_THREADS = 64;
+
+worker_pool::worker_pool()
+{
+	_M_threads = NULL;
+	_M_nthreads = 0;
+
+	pthread_mutex_init(&_M_mutex, NULL);
+	pthread_cond_init(&_M_cond, NULL);
+
+	_M_pending = NULL;
+	_M_last_pending = NULL;
+
+	_M_completed = NULL;
+	_M_last_completed = NULL;
+
+	memset(&_M_stats, 0, sizeof(statistics));
+
+	_M_pipe[0] = -1;
+	_M_pipe[1] = -1;
+
+	_M_stop = false;
+}
+
+worker_pool::~worker_pool()
+{
+	if (_M_threads) {
+		pthread_mutex_lock(&_M_mutex);
+		_M_stop = true;
+		pthread_cond_broadcast(&_M_cond);
+		pthread_mutex_unlock(&_M_mutex);
+
+		for (unsigned i = 0; i < _M_nthreads; i++) {
+			pthread_join(_M_threads[i], NULL);
+		}
+
+		free(_M_threads);
+	}
+
+	delete_jobs(_M_pending);
+	delete_jobs(_M_completed);
+
+	if (_M_pipe[0] != -1) {
+		close(_M_pipe[0]);
+		close(_M_pipe[1]);
+	}
+
+	pthread_cond_destroy(&_M_cond);
+	pthread_mutex_destroy(&_M_mutex);
+}
+
+bool worker_pool::create(unsigned nthreads)
+{
+	// Run jobs synchronously?
+	if (nthreads == 0) {
+		return true;
+	}
+
+	if (nthreads > MAX_THREADS) {
+		nthreads = MAX_THREADS;
+	}
+
+	if (pipe(_M_pipe) < 0) {
+		logger::instance().perror("pipe");
+
+		_M_pipe[0] = -1;
+		_M_pipe[1] = -1;
+
+		return false;
+	}
+
+	for (unsigned i = 0; i < 2; i++) {
+		int flags = fcntl(_M_pipe[i], F_GETFL);
+		if (fcntl(_M_pipe[i], F_SETFL, flags | O_NONBLOCK) < 0) {
+			logger::instance().perror("fcntl");
+			return false;
+		}
+	}
+
+	if ((_M_threads = (pthread_t*) malloc(nthreads * sizeof(pthread_t))) == NULL) {
+		return false;
+	}
+
+	// The worker threads inherit the signal mask, signals have to be
+	// handled by the event loop.
+	sigset_t set, oldset;
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oldset);
+
+	for (; _M_nthreads < nthreads; _M_nthreads++) {
+		if (pthread_create(&_M_threads[_M_nthreads], NULL, thread_main, this) != 0) {
+			pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+			logger::instance().log(logger::LOG_ERROR, "Couldn't create worker thread.");
+			return false;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	return true;
+}
+
+bool worker_pool::submit(job* job)
+{
+	job->next = NULL;
+
+	gettimeofday(&job->submitted, NULL);
+
+	// If the jobs have to be run synchronously...
+	if (_M_nthreads == 0) {
+		job->run();
+
+		update_statistics(job);
+
+		job->completed();
+
+		delete job;
+
+		return true;
+	}
+
+	pthread_mutex_lock(&_M_mutex);
+
+	if (_M_last_pending) {
+		_M_last_pending->next = job;
+	} else {
+		_M_pending = job;
+	}
+
+	_M_last_pending = job;
+
+	if (++_M_stats.queued > _M_stats.max_queued) {
+		_M_stats.max_queued = _M_stats.queued;
+	}
+
+	pthread_cond_signal(&_M_cond);
+	pthread_mutex_unlock(&_M_mutex);
+
+	return true;
+}
+
+void worker_pool::process_completed()
+{
+	// Drain the pipe.
+	char buf[256];
+	while (read(_M_pipe[0], buf, sizeof(buf)) > 0);
+
+	pthread_mutex_lock(&_M_mutex);
+
+	job* job = _M_completed;
+
+	_M_completed = NULL;
+	_M_last_completed = NULL;
+
+	pthread_mutex_unlock(&_M_mutex);
+
+	while (job) {
+		worker_pool::job* next = job->next;
+
+		job->completed();
+
+		delete job;
+
+		job = next;
+	}
+}
+
+void* worker_pool::thread_main(void* arg)
+{
+	worker_pool* pool = (worker_pool*) arg;
+
+	pthread_mutex_lock(&pool->_M_mutex);
+
+	do {
+		while ((!pool->_M_pending) && (!pool->_M_stop)) {
+			pthread_cond_wait(&pool->_M_cond, &pool->_M_mutex);
+		}
+
+		if (pool->_M_stop) {
+			break;
+		}
+
+		job* job = pool->_M_pending;
+		if ((pool->_M_pending = job->next) == NULL) {
+			pool->_M_last_pending = NULL;
+		}
+
+		pool->_M_stats.queued--;
+
+		pthread_mutex_unlock(&pool->_M_mutex);
+
+		job->run();
+
+		job->next = NULL;
+
+		pthread_mutex_lock(&pool->_M_mutex);
+
+		pool->update_statistics(job);
+
+		bool notify = (pool->_M_completed == NULL);
+
+		if (pool->_M_last_completed) {
+			pool->_M_last_completed->next = job;
+		} else {
+			pool->_M_completed = job;
+		}
+
+		pool->_M_last_completed = job;
+
+		// Wake up the event loop (the pipe is non-blocking, if it is full
+		// there is a notification pending already).
+		if (notify) {
+			ssize_t ret;
+			do {
+				ret = write(pool->_M_pipe[1], "", 1);
+			} while ((ret < 0) && (errno == EINTR));
+		}
+	} while (true);
+
+	pthread_mutex_unlock(&pool->_M_mutex);
+
+	return NULL;
+}
+
+void worker_pool::get_statistics(statistics& stats)
+{
+	pthread_mutex_lock(&_M_mutex);
+
+	stats = _M_stats;
+
+	_M_stats.max_queued = _M_stats.queued;
+	_M_stats.completed = 0;
+	_M_stats.total_latency = 0;
+	_M_stats.max_latency = 0;
+
+	pthread_mutex_unlock(&_M_mutex);
+}
+
+void worker_pool::update_statistics(const job* job)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	unsigned latency = (now.tv_sec - job->submitted.tv_sec) * 1000000 + (now.tv_usec - job->submitted.tv_usec);
+
+	_M_stats.completed++;
+
+	_M_stats.total_latency += latency;
+	if (latency > _M_stats.max_latency) {
+		_M_stats.max_latency = latency;
+	}
+}
+
+void worker_pool::delete_jobs(job* job)
+{
+	while (job) {
+		worker_pool::job* next = job->next;
+		delete job;
+		job = next;
+	}
+}
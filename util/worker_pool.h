@@ -0,0 +1,97 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <sys/time.h>
+#include <pthread.h>
+
+class worker_pool {
+	public:
+		static const unsigned DEFAULT_THREADS;
+		static const unsigned MAX_THREADS;
+
+		struct job {
+			job* next;
+
+			struct timeval submitted;
+
+			// Destructor.
+			virtual ~job();
+
+			// Run (called from a worker thread).
+			virtual void run() = 0;
+
+			// Completed (called from the event loop once run() has finished).
+			virtual void completed() = 0;
+		};
+
+		// Constructor.
+		worker_pool();
+
+		// Destructor.
+		virtual ~worker_pool();
+
+		// Create.
+		bool create(unsigned nthreads = DEFAULT_THREADS);
+
+		// Get descriptor which becomes readable when there are completed jobs
+		// (-1 if the jobs are run synchronously).
+		int get_descriptor() const;
+
+		// Submit job (the pool takes ownership of the job).
+		bool submit(job* job);
+
+		// Process completed jobs.
+		void process_completed();
+
+		struct statistics {
+			unsigned queued; // Jobs waiting for a thread.
+			unsigned max_queued;
+
+			unsigned long long completed;
+
+			unsigned long long total_latency; // [us] From submission to completion.
+			unsigned max_latency; // [us]
+		};
+
+		// Get statistics (and reset the counters).
+		void get_statistics(statistics& stats);
+
+	protected:
+		pthread_t* _M_threads;
+		unsigned _M_nthreads;
+
+		pthread_mutex_t _M_mutex;
+		pthread_cond_t _M_cond;
+
+		job* _M_pending;
+		job* _M_last_pending;
+
+		job* _M_completed;
+		job* _M_last_completed;
+
+		statistics _M_stats;
+
+		int _M_pipe[2];
+
+		bool _M_stop;
+
+		// Thread's main function.
+		static void* thread_main(void* arg);
+
+		// Update statistics (called with the mutex locked).
+		void update_statistics(const job* job);
+
+		// Delete list of jobs.
+		static void delete_jobs(job* job);
+};
+
+inline worker_pool::job::~job()
+{
+}
+
+inline int worker_pool::get_descriptor() const
+{
+	return _M_pipe[0];
+}
+
+#endif // WORKER_POOL_H